@@ -125,40 +125,11 @@ void VoxelTool::_set_voxel_f(Vector3i pos, float v) {
 	ERR_PRINT("Not implemented");
 }
 
-// TODO May be worth using VoxelBuffer::read_write_action() in the future with a lambda,
-// so we avoid the burden of going through get/set, validation and rehash access to blocks.
-// Would work well by avoiding virtual as well using a specialized implementation.
-
-namespace {
-inline float sdf_blend(float src_value, float dst_value, VoxelTool::Mode mode) {
-	float res;
-	switch (mode) {
-
-		case VoxelTool::MODE_ADD:
-			// Union
-			res = min(src_value, dst_value);
-			break;
-
-		case VoxelTool::MODE_REMOVE:
-			// Relative complement (or difference)
-			res = max(1.f - src_value, dst_value);
-			break;
-
-		case VoxelTool::MODE_SET:
-			res = src_value;
-			break;
-
-		default:
-			res = 0;
-			break;
-	}
-	return res;
-}
-} // namespace
-
+// Generic implementation going through _get_voxel/_set_voxel.
+// Implementations having direct access to voxel buffers should use read_write_action() with the same operations.
 void VoxelTool::do_sphere(Vector3 center, float radius) {
 
-	Rect3i box(Vector3i(center) - Vector3i(Math::floor(radius)), Vector3i(Math::ceil(radius) * 2));
+	Rect3i box = get_sphere_box(center, radius);
 
 	if (!is_area_editable(box)) {
 		print_line("Area not editable");
@@ -167,9 +138,9 @@ void VoxelTool::do_sphere(Vector3 center, float radius) {
 
 	if (_channel == VoxelBuffer::CHANNEL_SDF) {
 
-		box.for_each_cell([this, center, radius](Vector3i pos) {
-			float d = pos.to_vec3().distance_to(center) - radius;
-			_set_voxel_f(pos, sdf_blend(d, get_voxel_f(pos), _mode));
+		SdfSphereOp op = { center, radius, _mode };
+		box.for_each_cell([this, &op](Vector3i pos) {
+			_set_voxel_f(pos, op(pos, _get_voxel_f(pos)));
 		});
 
 	} else {
@@ -75,6 +75,92 @@ protected:
 	virtual void _set_voxel_f(Vector3i pos, float v);
 	virtual void _post_edit(const Rect3i &box);
 
+	static inline float sdf_blend(float src_value, float dst_value, Mode mode) {
+		float res;
+		switch (mode) {
+
+			case MODE_ADD:
+				// Union
+				res = min(src_value, dst_value);
+				break;
+
+			case MODE_REMOVE:
+				// Relative complement (or difference)
+				res = max(1.f - src_value, dst_value);
+				break;
+
+			case MODE_SET:
+				res = src_value;
+				break;
+
+			default:
+				res = 0;
+				break;
+		}
+		return res;
+	}
+
+	static inline Rect3i get_sphere_box(Vector3 center, float radius) {
+		return Rect3i(Vector3i(center) - Vector3i(Math::floor(radius)), Vector3i(Math::ceil(radius) * 2));
+	}
+
+	// Per-voxel operations of edits. They can be given to VoxelBuffer::read_write_action() and its variants,
+	// so implementations can run them in bulk instead of going through _get_voxel/_set_voxel.
+	// They also tell which voxels they can't change, so blocks can be skipped without being touched:
+	// `intersects()` takes a box in the same space as positions given to the operation,
+	// and `is_unchanged()` tells if voxels having a given value are left as they are anywhere.
+
+	struct SdfSphereOp {
+		Vector3 center;
+		float radius;
+		Mode mode;
+
+		inline real_t operator()(Vector3i pos, real_t v) const {
+			return sdf_blend(pos.to_vec3().distance_to(center) - radius, v, mode);
+		}
+
+		// Distances are blended in the whole box of the edit, not only inside the sphere
+		inline bool intersects(const Rect3i &box) const {
+			return true;
+		}
+
+		inline bool is_unchanged(real_t v) const {
+			// Distances to the sphere are at least -radius
+			switch (mode) {
+				case MODE_ADD:
+					return v <= -radius;
+				case MODE_REMOVE:
+					return v >= 1.f + radius;
+				default:
+					return false;
+			}
+		}
+	};
+
+	struct ValueSphereOp {
+		Vector3 center;
+		float radius;
+		uint64_t value;
+
+		inline uint64_t operator()(Vector3i pos, uint64_t v) const {
+			return pos.to_vec3().distance_to(center) <= radius ? value : v;
+		}
+
+		inline bool intersects(const Rect3i &box) const {
+			// Closest point of the box to the center
+			const Vector3i max_pos = box.pos + box.size - Vector3i(1);
+			const Vector3 closest(
+					CLAMP(center.x, box.pos.x, max_pos.x),
+					CLAMP(center.y, box.pos.y, max_pos.y),
+					CLAMP(center.z, box.pos.z, max_pos.z));
+			return closest.distance_to(center) <= radius;
+		}
+
+		inline bool is_unchanged(uint64_t v) const {
+			return v == value;
+		}
+	};
+
 private:
 	// Bindings to convert to more specialized C++ types and handle virtuality cuz I don't know if it works by binding straight
 	int _b_get_voxel(Vector3 pos) { return get_voxel(Vector3i(pos)); }
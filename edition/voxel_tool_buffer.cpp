@@ -11,6 +11,33 @@ bool VoxelToolBuffer::is_area_editable(const Rect3i &box) const {
 	return Rect3i(Vector3i(), _buffer->get_size()).encloses(box);
 }
 
+void VoxelToolBuffer::do_sphere(Vector3 center, float radius) {
+	ERR_FAIL_COND(_buffer.is_null());
+
+	Rect3i box = get_sphere_box(center, radius);
+
+	if (!is_area_editable(box)) {
+		print_line("Area not editable");
+		return;
+	}
+
+	const bool uniform = _buffer->get_channel_compression(_channel) == VoxelBuffer::COMPRESSION_UNIFORM;
+
+	if (_channel == VoxelBuffer::CHANNEL_SDF) {
+		SdfSphereOp op = { center, radius, _mode };
+		if (!uniform || !op.is_unchanged(_buffer->get_voxel_f(0, 0, 0, _channel))) {
+			_buffer->read_write_action_f(box, Vector3i(), _channel, op);
+		}
+	} else {
+		ValueSphereOp op = { center, radius, static_cast<uint64_t>(_mode == MODE_REMOVE ? _eraser_value : _value) };
+		if (!uniform || !op.is_unchanged(_buffer->get_voxel(0, 0, 0, _channel))) {
+			_buffer->read_write_action(box, Vector3i(), _channel, op);
+		}
+	}
+
+	_post_edit(box);
+}
+
 int VoxelToolBuffer::_get_voxel(Vector3i pos) {
 	ERR_FAIL_COND_V(_buffer.is_null(), 0);
 	return _buffer->get_voxel(pos, _channel);
@@ -11,6 +11,7 @@ public:
 	VoxelToolBuffer(Ref<VoxelBuffer> vb);
 
 	bool is_area_editable(const Rect3i &box) const override;
+	void do_sphere(Vector3 center, float radius) override;
 
 protected:
 	int _get_voxel(Vector3i pos) override;
@@ -14,6 +14,27 @@ bool VoxelToolLodTerrain::is_area_editable(const Rect3i &box) const {
 	return _map->is_area_fully_loaded(box.padded(1));
 }
 
+void VoxelToolLodTerrain::do_sphere(Vector3 center, float radius) {
+	ERR_FAIL_COND(_terrain == nullptr);
+
+	Rect3i box = get_sphere_box(center, radius);
+
+	if (!is_area_editable(box)) {
+		print_line("Area not editable");
+		return;
+	}
+
+	if (_channel == VoxelBuffer::CHANNEL_SDF) {
+		SdfSphereOp op = { center, radius, _mode };
+		_map->write_box_f(box, _channel, op);
+	} else {
+		ValueSphereOp op = { center, radius, static_cast<uint64_t>(_mode == MODE_REMOVE ? _eraser_value : _value) };
+		_map->write_box(box, _channel, op);
+	}
+
+	_post_edit(box);
+}
+
 int VoxelToolLodTerrain::_get_voxel(Vector3i pos) {
 	ERR_FAIL_COND_V(_terrain == nullptr, 0);
 	return _map->get_voxel(pos, _channel);
@@ -12,6 +12,7 @@ public:
 	VoxelToolLodTerrain(VoxelLodTerrain *terrain, Ref<VoxelMap> map);
 
 	bool is_area_editable(const Rect3i &box) const override;
+	void do_sphere(Vector3 center, float radius) override;
 
 protected:
 	int _get_voxel(Vector3i pos) override;
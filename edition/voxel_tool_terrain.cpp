@@ -60,6 +60,27 @@ Ref<VoxelRaycastResult> VoxelToolTerrain::raycast(Vector3 pos, Vector3 dir, floa
 	return res;
 }
 
+void VoxelToolTerrain::do_sphere(Vector3 center, float radius) {
+	ERR_FAIL_COND(_terrain == nullptr);
+
+	Rect3i box = get_sphere_box(center, radius);
+
+	if (!is_area_editable(box)) {
+		print_line("Area not editable");
+		return;
+	}
+
+	if (_channel == VoxelBuffer::CHANNEL_SDF) {
+		SdfSphereOp op = { center, radius, _mode };
+		_map->write_box_f(box, _channel, op);
+	} else {
+		ValueSphereOp op = { center, radius, static_cast<uint64_t>(_mode == MODE_REMOVE ? _eraser_value : _value) };
+		_map->write_box(box, _channel, op);
+	}
+
+	_post_edit(box);
+}
+
 int VoxelToolTerrain::_get_voxel(Vector3i pos) {
 	ERR_FAIL_COND_V(_terrain == nullptr, 0);
 	return _map->get_voxel(pos, _channel);
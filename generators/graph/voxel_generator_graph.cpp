@@ -207,6 +207,10 @@ void VoxelGeneratorGraph::generate_block(VoxelBlockRequest &input) {
 	// Loads of possible optimization from there
 
 	for (rpos.z = rmin.z, gpos.z = gmin.z; rpos.z < rmax.z; ++rpos.z, gpos.z += stride) {
+		if (input.is_cancelled()) {
+			// Nobody needs the result anymore
+			return;
+		}
 		for (rpos.x = rmin.x, gpos.x = gmin.x; rpos.x < rmax.x; ++rpos.x, gpos.x += stride) {
 			for (rpos.y = rmin.y, gpos.y = gmin.y; rpos.y < rmax.y; ++rpos.y, gpos.y += stride) {
 
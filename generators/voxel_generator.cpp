@@ -42,6 +42,16 @@ void VoxelGenerator::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_i
 	generate_block(r);
 }
 
+void VoxelGenerator::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
+	for (int i = 0; i < p_blocks.size(); ++i) {
+		VoxelBlockRequest &r = p_blocks.write[i];
+		if (r.is_cancelled()) {
+			continue;
+		}
+		generate_block(r);
+	}
+}
+
 void VoxelGenerator::_b_generate_block(Ref<VoxelBuffer> out_buffer, Vector3 origin_in_voxels, int lod) {
 	ERR_FAIL_COND(lod < 0);
 	VoxelBlockRequest r = { out_buffer, Vector3i(origin_in_voxels), lod };
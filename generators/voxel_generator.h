@@ -21,6 +21,8 @@ public:
 
 private:
 	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
+	// Passes requests as they are, so generators can see if they get cancelled
+	void emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
 
 protected:
 	static void _bind_methods();
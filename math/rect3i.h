@@ -3,6 +3,7 @@
 
 #include "vector3i.h"
 #include <core/variant.h>
+#include <vector>
 
 // TODO Could be renamed to something more sensical, like Box3i
 class Rect3i {
@@ -228,4 +229,42 @@ inline bool operator!=(const Rect3i &a, const Rect3i &b) {
 	return a.pos != b.pos || a.size != b.size;
 }
 
+inline bool operator==(const Rect3i &a, const Rect3i &b) {
+	return a.pos == b.pos && a.size == b.size;
+}
+
+// Calls `action` once for each cell contained in at least one box of `a`, but in none of the boxes of `b`.
+// Boxes are paired by index, and only cells leaving their paired box are tested,
+// so it is cheap when few boxes changed. Boxes missing from `b` count as empty.
+template <typename A>
+void for_each_cell_in_difference(const std::vector<Rect3i> &a, const std::vector<Rect3i> &b, A action) {
+
+	for (unsigned int i = 0; i < a.size(); ++i) {
+
+		auto test_cell = [&a, &b, i, &action](Vector3i pos) {
+			// Cells found from several pairs are visited from the first one
+			for (unsigned int j = 0; j < i; ++j) {
+				if (a[j].contains(pos) && (j >= b.size() || !b[j].contains(pos))) {
+					return;
+				}
+			}
+			for (unsigned int j = 0; j < b.size(); ++j) {
+				if (b[j].contains(pos)) {
+					return;
+				}
+			}
+			action(pos);
+		};
+
+		if (i >= b.size() || b[i].size.volume() == 0) {
+			a[i].for_each_cell(test_cell);
+
+		} else if (a[i] != b[i]) {
+			a[i].difference(b[i], [&test_cell](Rect3i box) {
+				box.for_each_cell(test_cell);
+			});
+		}
+	}
+}
+
 #endif // RECT3I_H
@@ -389,9 +389,9 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 	// Iterate 3D padded data to extract voxel faces.
 	// This is the most intensive job in this class, so all required data should be as fit as possible.
 
-	// The buffer we receive MUST be dense (i.e not compressed, and channels allocated).
+	// The buffer we receive should be dense (i.e not compressed, and channels allocated).
 	// That means we can use raw pointers to voxel data inside instead of using the higher-level getters,
-	// and then save a lot of time.
+	// and then save a lot of time. Compressed channels get decoded first.
 
 	if (voxels.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM) {
 		// All voxels have the same type.
@@ -401,14 +401,20 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 		// decompress into a backing array to still allow the use of the same algorithm.
 		return;
 
-	} else if (voxels.get_channel_compression(channel) != VoxelBuffer::COMPRESSION_NONE) {
-		// No other form of compression is allowed
-		ERR_PRINT("VoxelMesherBlocky received unsupported voxel compression");
-		return;
 	}
 
-	ArraySlice<uint8_t> raw_channel;
-	if (!voxels.get_channel_raw(channel, raw_channel)) {
+	ArraySlice<const uint8_t> raw_channel;
+
+	if (voxels.get_channel_compression(channel) != VoxelBuffer::COMPRESSION_NONE) {
+		// Padded buffers made by terrains are dense, but a compressed buffer can still be given from script.
+		// In that case, decode it into a temporary array.
+		const uint32_t size_in_bytes =
+				VoxelBuffer::get_size_in_bytes_for_volume(voxels.get_size(), voxels.get_channel_depth(channel));
+		_decompressed_channel.resize(size_in_bytes);
+		voxels.decompress_channel_to(channel, ArraySlice<uint8_t>(_decompressed_channel, 0, size_in_bytes));
+		raw_channel = ArraySlice<const uint8_t>(_decompressed_channel.data(), 0, size_in_bytes);
+
+	} else if (!voxels.get_channel_raw(channel, raw_channel)) {
 		/*       _
 		//      | \
 		//     /\ \\
@@ -435,7 +441,7 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 			break;
 
 		case VoxelBuffer::DEPTH_16_BIT:
-			generate_blocky_mesh(_arrays_per_material, raw_channel.reinterpret_cast_to<uint16_t>(),
+			generate_blocky_mesh(_arrays_per_material, raw_channel.reinterpret_cast_to<const uint16_t>(),
 					block_size, library, _bake_occlusion, baked_occlusion_darkness);
 			break;
 
@@ -46,6 +46,8 @@ protected:
 private:
 	Ref<VoxelLibrary> _library;
 	FixedArray<Arrays, MAX_MATERIALS> _arrays_per_material;
+	// Used when the input buffer is compressed
+	std::vector<uint8_t> _decompressed_channel;
 	float _baked_occlusion_darkness;
 	bool _bake_occlusion;
 };
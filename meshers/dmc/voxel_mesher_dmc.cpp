@@ -1266,9 +1266,12 @@ static const int g_corner_map_bottom[4] = { 3, 2, 1, 0 };
 
 } // namespace MarchingSquares
 
+// Max distance to the isosurface where skirts are generated
+const float SKIRTS_MAX_DISTANCE = 0.2f;
+
 void add_marching_squares_skirts(const Vector3 *corners, const HermiteValue *values, MeshBuilder &mesh_builder, Vector3 min_pos, Vector3 max_pos) {
 
-	float max_distance = 0.2f; // Max distance to the isosurface
+	float max_distance = SKIRTS_MAX_DISTANCE;
 
 	if (corners[0].z == min_pos.z) {
 		polygonize_cell_marching_squares(corners, values, max_distance, mesh_builder, MarchingSquares::g_corner_map_back);
@@ -1490,8 +1493,12 @@ void VoxelMesherDMC::build(VoxelMesher::Output &output, const VoxelMesher::Input
 
 	const VoxelBuffer &voxels = input.voxels;
 
-	if (voxels.is_uniform(VoxelBuffer::CHANNEL_SDF)) {
-		// That won't produce any polygon
+	real_t sdf_min, sdf_max;
+	voxels.get_channel_range_f(VoxelBuffer::CHANNEL_SDF, sdf_min, sdf_max);
+	// Skirts can still be generated a bit inside matter
+	const real_t sdf_inside_limit = _seam_mode == SEAM_MARCHING_SQUARE_SKIRTS ? -dmc::SKIRTS_MAX_DISTANCE : 0.f;
+	if (sdf_min > 0.f || sdf_max < sdf_inside_limit || sdf_min == sdf_max) {
+		// That won't produce any polygon, because the isolevel is never crossed
 		return;
 	}
 
@@ -38,6 +38,21 @@ inline uint8_t get_voxel(const VoxelBuffer &vb, Vector3i pos, int channel) {
 	return get_voxel(vb, pos.x, pos.y, pos.z, channel);
 }
 
+// Surfaces are where samples change sign. This uses the range of the channel, which is often cached,
+// so blocks entirely inside or outside of matter get rejected without looking at every voxel.
+bool can_have_surface(const VoxelBuffer &vb, unsigned int channel) {
+	if (vb.get_channel_depth(channel) != VoxelBuffer::DEPTH_8_BIT) {
+		// Values get truncated to 8 bits by get_voxel(), the range doesn't tell about that
+		return !vb.is_uniform(channel);
+	}
+	uint64_t min_value, max_value;
+	vb.get_channel_range(channel, min_value, max_value);
+	// The main loop computes samples as tos(255 - stored), which is 127 - stored.
+	// tos() gives negative samples for its inputs below 128, so they are negative when stored values are above 127.
+	// A surface needs both signs: at least one stored value up to 127, and at least one from 128.
+	return min_value <= 127 && max_value >= 128;
+}
+
 Vector3 get_border_offset(const Vector3 pos, const int lod_index, const Vector3i block_size) {
 
 	// When transition meshes are inserted between blocks of different LOD, we need to make space for them.
@@ -186,6 +201,11 @@ void VoxelMesherTransvoxel::build(VoxelMesher::Output &output, const VoxelMesher
 	fill_surface_arrays(regular_arrays);
 	output.surfaces.push_back(regular_arrays);
 
+	if (input.is_cancelled()) {
+		// Transition meshes are not worth building
+		return;
+	}
+
 	for (int dir = 0; dir < Cube::SIDE_COUNT; ++dir) {
 
 		clear_output();
@@ -239,8 +259,8 @@ void VoxelMesherTransvoxel::build_internal(const VoxelBuffer &voxels, unsigned i
 		}
 	};
 
-	if (voxels.is_uniform(channel)) {
-		// Nothing to extract, because constant isolevels never cross the threshold and describe no surface
+	if (!can_have_surface(voxels, channel)) {
+		// Nothing to extract, because isolevels never cross the threshold and describe no surface
 		return;
 	}
 
@@ -602,8 +622,8 @@ void VoxelMesherTransvoxel::build_transition(const VoxelBuffer &p_voxels, unsign
 		}
 	};
 
-	if (p_voxels.is_uniform(channel)) {
-		// Nothing to extract, because constant isolevels never cross the threshold and describe no surface
+	if (!can_have_surface(p_voxels, channel)) {
+		// Nothing to extract, because isolevels never cross the threshold and describe no surface
 		return;
 	}
 
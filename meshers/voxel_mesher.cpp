@@ -5,7 +5,7 @@ Ref<Mesh> VoxelMesher::build_mesh(Ref<VoxelBuffer> voxels) {
 	ERR_FAIL_COND_V(voxels.is_null(), Ref<ArrayMesh>());
 
 	Output output;
-	Input input = { **voxels, 0 };
+	Input input = { **voxels, 0, nullptr };
 	build(output, input);
 
 	if (output.surfaces.empty()) {
@@ -2,6 +2,7 @@
 #define VOXEL_MESHER_H
 
 #include "../cube_tables.h"
+#include "../util/cancellation_token.h"
 #include "../util/fixed_array.h"
 #include "../voxel_buffer.h"
 #include <scene/resources/mesh.h>
@@ -12,6 +13,12 @@ public:
 	struct Input {
 		const VoxelBuffer &voxels;
 		int lod; // = 0; // Not initialized because it confused GCC
+		// Can be null. If set and cancelled, meshers may stop early, the output will be thrown away
+		const CancellationToken *cancellation_token;
+
+		inline bool is_cancelled() const {
+			return cancellation_token != nullptr && cancellation_token->is_cancelled();
+		}
 	};
 
 	struct Output {
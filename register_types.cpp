@@ -20,16 +20,22 @@
 #include "terrain/voxel_box_mover.h"
 #include "terrain/voxel_lod_terrain.h"
 #include "terrain/voxel_map.h"
+#include "terrain/voxel_memory_budget.h"
+#include "terrain/voxel_server.h"
 #include "terrain/voxel_terrain.h"
 #include "voxel_buffer.h"
 #include "voxel_memory_pool.h"
 #include "voxel_string_names.h"
 
+#include <core/engine.h>
+
 void register_voxel_types() {
 
 	// Storage
 	ClassDB::register_class<VoxelBuffer>();
 	ClassDB::register_class<VoxelMap>();
+	ClassDB::register_class<VoxelMemoryBudget>();
+	ClassDB::register_class<VoxelServer>();
 
 	// Voxel types
 	ClassDB::register_class<Voxel>();
@@ -69,9 +75,11 @@ void register_voxel_types() {
 	VoxelMemoryPool::create_singleton();
 	VoxelStringNames::create_singleton();
 	VoxelGraphNodeDB::create_singleton();
+	VoxelMemoryBudget::create_singleton();
+	VoxelServer::create_singleton();
 
-	// Reminder: how to create a singleton accessible from scripts:
-	// Engine::get_singleton()->add_singleton(Engine::Singleton("SingletonName",singleton_instance));
+	Engine::get_singleton()->add_singleton(Engine::Singleton("VoxelMemoryBudget", VoxelMemoryBudget::get_singleton()));
+	Engine::get_singleton()->add_singleton(Engine::Singleton("VoxelServer", VoxelServer::get_singleton()));
 
 #ifdef TOOLS_ENABLED
 	VoxelDebug::create_debug_box_mesh();
@@ -82,6 +90,9 @@ void register_voxel_types() {
 
 void unregister_voxel_types() {
 
+	// Threads may still be saving blocks, which uses the memory pool
+	VoxelServer::destroy_singleton();
+
 	unsigned int used_blocks = VoxelMemoryPool::get_singleton()->debug_get_used_blocks();
 	if (used_blocks > 0) {
 		ERR_PRINT(String("VoxelMemoryPool: {0} memory blocks are still used when unregistering the module. Recycling leak?").format(varray(used_blocks)));
@@ -90,6 +101,7 @@ void unregister_voxel_types() {
 	VoxelMemoryPool::destroy_singleton();
 	VoxelStringNames::destroy_singleton();
 	VoxelGraphNodeDB::destroy_singleton();
+	VoxelMemoryBudget::destroy_singleton();
 
 #ifdef TOOLS_ENABLED
 	VoxelDebug::free_debug_box_mesh();
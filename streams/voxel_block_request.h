@@ -2,6 +2,7 @@
 #define VOXEL_BLOCK_REQUEST_H
 
 #include "../math/vector3i.h"
+#include "../util/cancellation_token.h"
 #include "../voxel_buffer.h"
 
 class VoxelBuffer;
@@ -10,6 +11,13 @@ struct VoxelBlockRequest {
 	Ref<VoxelBuffer> voxel_buffer;
 	Vector3i origin_in_voxels;
 	int lod;
+	// Set when the block is requested by a terrain. If it gets cancelled, the result will be thrown away,
+	// so streams and generators may leave the buffer as it is and move on.
+	const CancellationToken *cancellation_token = nullptr;
+
+	inline bool is_cancelled() const {
+		return cancellation_token != nullptr && cancellation_token->is_cancelled();
+	}
 };
 
 #endif // VOXEL_BLOCK_REQUEST_H
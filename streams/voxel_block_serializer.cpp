@@ -9,6 +9,46 @@ namespace {
 // TODO Introduce versionning
 const unsigned int BLOCK_TRAILING_MAGIC = 0x900df00d;
 const int BLOCK_TRAILING_MAGIC_SIZE = 4;
+
+// Flags preceding each brick of bricked channels
+const uint8_t BRICK_UNIFORM = 0;
+const uint8_t BRICK_DENSE = 1;
+
+void store_value(FileAccess *f, uint64_t v, VoxelBuffer::Depth depth) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			f->store_8(v);
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			f->store_16(v);
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			f->store_32(v);
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			f->store_64(v);
+			break;
+		default:
+			CRASH_NOW();
+	}
+}
+
+uint64_t get_value(FileAccess *f, VoxelBuffer::Depth depth) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return f->get_8();
+		case VoxelBuffer::DEPTH_16_BIT:
+			return f->get_16();
+		case VoxelBuffer::DEPTH_32_BIT:
+			return f->get_32();
+		case VoxelBuffer::DEPTH_64_BIT:
+			return f->get_64();
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
 } // namespace
 
 unsigned int VoxelBlockSerializer::get_size_in_bytes(const VoxelBuffer &buffer) {
@@ -19,16 +59,41 @@ unsigned int VoxelBlockSerializer::get_size_in_bytes(const VoxelBuffer &buffer)
 	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
 
 		VoxelBuffer::Compression compression = buffer.get_channel_compression(channel_index);
+		const VoxelBuffer::Depth depth = buffer.get_channel_depth(channel_index);
 		size += 1;
 
 		switch (compression) {
 
 			case VoxelBuffer::COMPRESSION_NONE: {
-				size += size_in_voxels.volume() * sizeof(uint8_t);
+				size += VoxelBuffer::get_size_in_bytes_for_volume(size_in_voxels, depth);
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
-				size += 1;
+				size += VoxelBuffer::get_depth_bit_count(depth) >> 3;
+			} break;
+
+			case VoxelBuffer::COMPRESSION_RLE: {
+				ArraySlice<uint8_t> data;
+				CRASH_COND(!buffer.get_channel_rle_raw(channel_index, data));
+				size += sizeof(uint32_t) + data.size();
+			} break;
+
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				ArraySlice<uint8_t> palette;
+				ArraySlice<uint8_t> indices;
+				uint32_t palette_size;
+				CRASH_COND(!buffer.get_channel_palette_raw(channel_index, palette, indices, palette_size));
+				size += sizeof(uint16_t) + palette.size() + indices.size();
+			} break;
+
+			case VoxelBuffer::COMPRESSION_BRICKS: {
+				const uint32_t brick_count = buffer.get_brick_count();
+				for (uint32_t brick_index = 0; brick_index < brick_count; ++brick_index) {
+					ArraySlice<uint8_t> data;
+					uint64_t value;
+					CRASH_COND(!buffer.get_channel_brick_raw(channel_index, brick_index, data, value));
+					size += 1 + (data.size() != 0 ? data.size() : VoxelBuffer::get_depth_bit_count(depth) >> 3);
+				}
 			} break;
 
 			default:
@@ -56,28 +121,47 @@ const std::vector<uint8_t> &VoxelBlockSerializer::serialize(VoxelBuffer &voxel_b
 		switch (compression) {
 
 			case VoxelBuffer::COMPRESSION_NONE: {
-				ArraySlice<uint8_t> data;
+				ArraySlice<const uint8_t> data;
 				CRASH_COND(!voxel_buffer.get_channel_raw(channel_index, data));
 				f->store_buffer(data.data(), data.size());
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
 				uint64_t v = voxel_buffer.get_voxel(Vector3i(), channel_index);
-				switch (voxel_buffer.get_channel_depth(channel_index)) {
-					case VoxelBuffer::DEPTH_8_BIT:
-						f->store_8(v);
-						break;
-					case VoxelBuffer::DEPTH_16_BIT:
-						f->store_16(v);
-						break;
-					case VoxelBuffer::DEPTH_32_BIT:
-						f->store_32(v);
-						break;
-					case VoxelBuffer::DEPTH_64_BIT:
-						f->store_64(v);
-						break;
-					default:
-						CRASH_NOW();
+				store_value(f, v, voxel_buffer.get_channel_depth(channel_index));
+			} break;
+
+			case VoxelBuffer::COMPRESSION_RLE: {
+				ArraySlice<uint8_t> data;
+				CRASH_COND(!voxel_buffer.get_channel_rle_raw(channel_index, data));
+				f->store_32(data.size());
+				f->store_buffer(data.data(), data.size());
+			} break;
+
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				ArraySlice<uint8_t> palette;
+				ArraySlice<uint8_t> indices;
+				uint32_t palette_size;
+				CRASH_COND(!voxel_buffer.get_channel_palette_raw(channel_index, palette, indices, palette_size));
+				f->store_16(palette_size);
+				f->store_buffer(palette.data(), palette.size());
+				f->store_buffer(indices.data(), indices.size());
+			} break;
+
+			case VoxelBuffer::COMPRESSION_BRICKS: {
+				const VoxelBuffer::Depth depth = voxel_buffer.get_channel_depth(channel_index);
+				const uint32_t brick_count = voxel_buffer.get_brick_count();
+				for (uint32_t brick_index = 0; brick_index < brick_count; ++brick_index) {
+					ArraySlice<uint8_t> data;
+					uint64_t value;
+					CRASH_COND(!voxel_buffer.get_channel_brick_raw(channel_index, brick_index, data, value));
+					if (data.size() == 0) {
+						f->store_8(BRICK_UNIFORM);
+						store_value(f, value, depth);
+					} else {
+						f->store_8(BRICK_DENSE);
+						f->store_buffer(data.data(), data.size());
+					}
 				}
 			} break;
 
@@ -120,26 +204,71 @@ bool VoxelBlockSerializer::deserialize(const std::vector<uint8_t> &p_data, Voxel
 			} break;
 
 			case VoxelBuffer::COMPRESSION_UNIFORM: {
-				uint64_t v;
-				switch (out_voxel_buffer.get_channel_depth(channel_index)) {
-					case VoxelBuffer::DEPTH_8_BIT:
-						v = f->get_8();
-						break;
-					case VoxelBuffer::DEPTH_16_BIT:
-						v = f->get_16();
-						break;
-					case VoxelBuffer::DEPTH_32_BIT:
-						v = f->get_32();
-						break;
-					case VoxelBuffer::DEPTH_64_BIT:
-						v = f->get_64();
-						break;
-					default:
-						CRASH_NOW();
-				}
+				uint64_t v = get_value(f, out_voxel_buffer.get_channel_depth(channel_index));
 				out_voxel_buffer.clear_channel(channel_index, v);
 			} break;
 
+			case VoxelBuffer::COMPRESSION_RLE: {
+				const uint32_t rle_size = f->get_32();
+				const size_t pos = f->get_position();
+				if (pos + rle_size > p_data.size()) {
+					ERR_PRINT("Unexpected end of file");
+					return false;
+				}
+				ERR_FAIL_COND_V_MSG(!out_voxel_buffer.set_channel_rle_raw(channel_index, p_data.data() + pos, rle_size), false,
+						"At offset 0x" + String::num_int64(pos, 16));
+				f->seek(pos + rle_size);
+			} break;
+
+			case VoxelBuffer::COMPRESSION_PALETTE: {
+				const uint32_t palette_size = f->get_16();
+				const uint32_t value_size = VoxelBuffer::get_depth_bit_count(out_voxel_buffer.get_channel_depth(channel_index)) >> 3;
+				const uint32_t palette_size_in_bytes = palette_size * value_size;
+				const uint32_t indices_size_in_bytes =
+						(out_voxel_buffer.get_volume() * VoxelBuffer::get_palette_index_bits(palette_size) + 7) >> 3;
+				const size_t pos = f->get_position();
+				if (pos + palette_size_in_bytes + indices_size_in_bytes > p_data.size()) {
+					ERR_PRINT("Unexpected end of file");
+					return false;
+				}
+				const uint8_t *palette = p_data.data() + pos;
+				ERR_FAIL_COND_V_MSG(!out_voxel_buffer.set_channel_palette_raw(channel_index,
+											palette, palette_size, palette + palette_size_in_bytes, indices_size_in_bytes),
+						false, "At offset 0x" + String::num_int64(pos, 16));
+				f->seek(pos + palette_size_in_bytes + indices_size_in_bytes);
+			} break;
+
+			case VoxelBuffer::COMPRESSION_BRICKS: {
+				const VoxelBuffer::Depth depth = out_voxel_buffer.get_channel_depth(channel_index);
+				const uint32_t brick_count = out_voxel_buffer.get_brick_count();
+				const uint32_t brick_size_in_bytes = VoxelBuffer::BRICK_VOLUME * (VoxelBuffer::get_depth_bit_count(depth) >> 3);
+				ERR_FAIL_COND_V_MSG(brick_count == 0, false, "Bricked channel in a block of incompatible size");
+
+				out_voxel_buffer.clear_channel(channel_index);
+
+				for (uint32_t brick_index = 0; brick_index < brick_count; ++brick_index) {
+					const uint8_t brick_flag = f->get_8();
+
+					if (brick_flag == BRICK_UNIFORM) {
+						const uint64_t v = get_value(f, depth);
+						out_voxel_buffer.set_channel_brick_raw(channel_index, brick_index, nullptr, v);
+
+					} else if (brick_flag == BRICK_DENSE) {
+						const size_t pos = f->get_position();
+						if (pos + brick_size_in_bytes > p_data.size()) {
+							ERR_PRINT("Unexpected end of file");
+							return false;
+						}
+						out_voxel_buffer.set_channel_brick_raw(channel_index, brick_index, p_data.data() + pos, 0);
+						f->seek(pos + brick_size_in_bytes);
+
+					} else {
+						ERR_PRINT("Invalid brick flag at offset 0x" + String::num_int64(f->get_position() - 1, 16));
+						return false;
+					}
+				}
+			} break;
+
 			default:
 				ERR_PRINT("Unhandled compression mode");
 				return false;
@@ -47,6 +47,9 @@ void VoxelStream::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
 	// Default implementation. May matter for some stream types to optimize loading.
 	for (int i = 0; i < p_blocks.size(); ++i) {
 		VoxelBlockRequest &r = p_blocks.write[i];
+		if (r.is_cancelled()) {
+			continue;
+		}
 		emerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
 	}
 }
@@ -6,7 +6,9 @@
 #include <algorithm>
 
 namespace {
-const uint8_t FORMAT_VERSION = 2;
+const uint8_t FORMAT_VERSION = 3;
+// Same layout, but blocks were always packed one after the other
+const uint8_t FORMAT_VERSION_LEGACY_2 = 2;
 const uint8_t FORMAT_VERSION_LEGACY_1 = 1;
 const char *FORMAT_REGION_MAGIC = "VXR_";
 const char *META_FILE_NAME = "meta.vxrm";
@@ -64,6 +66,9 @@ void VoxelStreamRegionFiles::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks)
 
 	for (int i = 0; i < sorted_blocks.size(); ++i) {
 		VoxelBlockRequest &r = sorted_blocks.write[i];
+		if (r.is_cancelled()) {
+			continue;
+		}
 		EmergeResult result = _emerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
 		if (result == EMERGE_OK_FALLBACK) {
 			fallback_requests.push_back(r);
@@ -214,180 +219,175 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	Vector3i block_rpos = block_pos.wrap(region_size);
 	//print_line(String("Immerging block {0} r {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
 
+	const uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+
 	CachedRegion *cache = open_region(region_pos, lod, true);
 	ERR_FAIL_COND(cache == nullptr);
 	FileAccess *f = cache->file_access;
 
+	if (cache->header.version != FORMAT_VERSION) {
+		// Sectors of older versions are always packed, which won't be the case anymore once we write to it.
+		// Upgrade right away so older readers don't get confused by free sectors.
+		f->seek(MAGIC_AND_VERSION_SIZE - 1);
+		f->store_8(FORMAT_VERSION);
+		cache->header.version = FORMAT_VERSION;
+	}
+
 	int lut_index = get_block_index_in_header(block_rpos);
 	BlockInfo &block_info = cache->header.blocks[lut_index];
-	int blocks_begin_offset = get_region_header_size();
 
-	if (block_info.data == 0) {
-		// The block isn't in the file yet, append at the end
+	const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
+	const int written_size = sizeof(int) + data.size();
+	const unsigned int new_sector_count = get_sector_count_from_bytes(written_size);
+	CRASH_COND(new_sector_count < 1);
 
-		int end_offset = blocks_begin_offset + cache->sectors.size() * _meta.sector_size;
-		f->seek(end_offset);
-		int block_offset = f->get_position();
-		// Check position matches the sectors rule
-		CRASH_COND((block_offset - blocks_begin_offset) % _meta.sector_size != 0);
+	unsigned int sector_index;
 
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
-		f->store_32(data.size());
-		int written_size = sizeof(int) + data.size();
-		f->store_buffer(data.data(), data.size());
+	if (block_info.data != 0 && new_sector_count <= block_info.get_sector_count()) {
+		// We can write the block at the same spot
+		sector_index = block_info.get_sector_index();
+		const unsigned int old_sector_count = block_info.get_sector_count();
 
-		int end_pos = f->get_position();
-		CRASH_COND(written_size != (end_pos - block_offset));
-		pad_to_sector_size(f);
-
-		block_info.set_sector_index((block_offset - blocks_begin_offset) / _meta.sector_size);
-		block_info.set_sector_count(get_sector_count_from_bytes(written_size));
-
-		for (unsigned int i = 0; i < block_info.get_sector_count(); ++i) {
-			cache->sectors.push_back(block_rpos);
+		if (new_sector_count < old_sector_count) {
+			// The block now uses less sectors, others can use them
+			free_sectors(cache, sector_index + new_sector_count, old_sector_count - new_sector_count);
+			block_info.set_sector_count(new_sector_count);
+			cache->header_modified = true;
 		}
 
-		cache->header_modified = true;
-
-		//print_line(String("Block saved flen={0}").format(varray(f->get_len())));
-
 	} else {
-		// The block is already in the file
-
-		CRASH_COND(cache->sectors.size() == 0);
-
-		int old_sector_index = block_info.get_sector_index();
-		int old_sector_count = block_info.get_sector_count();
-		CRASH_COND(old_sector_count < 1);
-
-		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**voxel_buffer);
-		int written_size = sizeof(int) + data.size();
-
-		int new_sector_count = get_sector_count_from_bytes(written_size);
-		CRASH_COND(new_sector_count < 1);
-
-		if (new_sector_count <= old_sector_count) {
-			// We can write the block at the same spot
+		// The block isn't in the file yet, or it now uses more sectors.
+		// It goes in the first hole big enough, which may include where it was, or at the end of the file.
+		if (block_info.data != 0) {
+			free_sectors(cache, block_info.get_sector_index(), block_info.get_sector_count());
+		}
 
-			if (new_sector_count < old_sector_count) {
-				// The block now uses less sectors, we can compact others.
-				remove_sectors_from_block(cache, block_rpos, old_sector_count - new_sector_count);
-				cache->header_modified = true;
-			}
+		sector_index = allocate_sectors(cache, new_sector_count);
 
-			int block_offset = blocks_begin_offset + old_sector_index * _meta.sector_size;
-			f->seek(block_offset);
+		block_info.set_sector_index(sector_index);
+		block_info.set_sector_count(new_sector_count);
+		cache->header_modified = true;
+	}
 
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+	const int block_offset = get_region_header_size() + sector_index * _meta.sector_size;
+	f->seek(block_offset);
 
-			int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+	f->store_32(data.size());
+	f->store_buffer(data.data(), data.size());
 
-		} else {
-			// The block now uses more sectors, we have to move others.
-			// Note: we could shift blocks forward, but we can also remove the block entirely and rewrite it at the end.
-			// Need to investigate if it's worth implementing forward shift instead.
+	const int end_pos = f->get_position();
+	CRASH_COND(written_size != (end_pos - block_offset));
 
-			remove_sectors_from_block(cache, block_rpos, old_sector_count);
+	if (sector_index + new_sector_count == cache->sector_count) {
+		// Last block of the file, the file must end at a sector boundary.
+		// Blocks written in holes can leave garbage after their data, it is never read.
+		pad_to_sector_size(f);
+	}
 
-			int block_offset = blocks_begin_offset + cache->sectors.size() * _meta.sector_size;
-			f->seek(block_offset);
+	if (cache->pending_free_sector_count * _meta.sector_size >= (uint32_t)get_region_header_size()) {
+		// Freed sectors wait for the header to be saved before they can be reused.
+		// Rather than waiting for the region to close, save it once they would take more space than it.
+		f->seek(MAGIC_AND_VERSION_SIZE);
+		save_header(cache);
+	}
 
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+	++_save_stats.saved_blocks;
+	_save_stats.saved_bytes += written_size;
+	_save_stats.time_spent_saving += OS::get_singleton()->get_ticks_usec() - time_before;
+}
 
-			int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+unsigned int VoxelStreamRegionFiles::allocate_sectors(CachedRegion *p_region, unsigned int p_sector_count) {
 
-			pad_to_sector_size(f);
+	std::vector<SectorRun> &free_runs = p_region->free_sectors;
 
-			block_info.set_sector_index(cache->sectors.size());
-			for (int i = 0; i < new_sector_count; ++i) {
-				cache->sectors.push_back(block_rpos);
+	// First fit. Regions rarely have many holes, blocks of the same region tend to compress similarly.
+	for (size_t i = 0; i < free_runs.size(); ++i) {
+		SectorRun &run = free_runs[i];
+		if (run.count >= p_sector_count) {
+			const unsigned int sector_index = run.index;
+			if (run.count == p_sector_count) {
+				free_runs.erase(free_runs.begin() + i);
+			} else {
+				run.index += p_sector_count;
+				run.count -= p_sector_count;
 			}
-
-			cache->header_modified = true;
+			_save_stats.reused_sectors += p_sector_count;
+			return sector_index;
 		}
-
-		block_info.set_sector_count(new_sector_count);
 	}
-}
 
-void VoxelStreamRegionFiles::remove_sectors_from_block(CachedRegion *p_region, Vector3i block_rpos, unsigned int p_sector_count) {
-	VOXEL_PROFILE_SCOPE(profile_scope);
+	// Append
+	const unsigned int sector_index = p_region->sector_count;
+	p_region->sector_count += p_sector_count;
+	_save_stats.appended_sectors += p_sector_count;
+	return sector_index;
+}
 
-	// Removes sectors from a block, starting from the last ones.
-	// So if a block has 5 sectors and we remove 2, the first 3 will be preserved.
-	// Then all following sectors are moved earlier in the file to fill the gap.
+// Adds a run to a list ordered by index, merging it with those it touches
+void VoxelStreamRegionFiles::add_sector_run(std::vector<SectorRun> &runs, SectorRun run) {
 
-	//print_line(String("Removing {0} sectors from region {1}").format(varray(p_sector_count, p_region->position.to_vec3())));
+	// Find where the run goes, keeping them ordered
+	size_t i = 0;
+	while (i < runs.size() && runs[i].index < run.index) {
+		++i;
+	}
 
-	FileAccess *f = p_region->file_access;
-	int blocks_begin_offset = get_region_header_size();
-	int old_end_offset = blocks_begin_offset + p_region->sectors.size() * _meta.sector_size;
+	// Merge with neighbor runs
+	if (i > 0 && runs[i - 1].index + runs[i - 1].count == run.index) {
+		--i;
+		run.index = runs[i].index;
+		run.count += runs[i].count;
+		runs.erase(runs.begin() + i);
+	}
+	if (i < runs.size() && run.index + run.count == runs[i].index) {
+		run.count += runs[i].count;
+		runs.erase(runs.begin() + i);
+	}
 
-	unsigned int block_index = get_block_index_in_header(block_rpos);
-	BlockInfo &block_info = p_region->header.blocks[block_index];
+	runs.insert(runs.begin() + i, run);
+}
 
-	int src_offset = blocks_begin_offset + (block_info.get_sector_index() + block_info.get_sector_count()) * _meta.sector_size;
-	int dst_offset = src_offset - p_sector_count * _meta.sector_size;
+void VoxelStreamRegionFiles::free_sectors(CachedRegion *p_region, unsigned int p_sector_index, unsigned int p_sector_count) {
 
-	// Note: removing the last block from a region doesn't make the file invalid, but is not a known use case
-	CRASH_COND(p_region->sectors.size() - p_sector_count <= 0);
-	CRASH_COND(f == nullptr);
-	CRASH_COND(p_sector_count <= 0);
-	CRASH_COND(src_offset - _meta.sector_size < dst_offset);
-	CRASH_COND(block_info.get_sector_index() + p_sector_count > p_region->sectors.size());
-	CRASH_COND(p_sector_count > block_info.get_sector_count());
-	CRASH_COND(dst_offset < blocks_begin_offset);
+	CRASH_COND(p_sector_count == 0);
+	CRASH_COND(p_sector_index + p_sector_count > p_region->sector_count);
 
-	uint8_t *temp = (uint8_t *)memalloc(_meta.sector_size);
+	SectorRun run;
+	run.index = p_sector_index;
+	run.count = p_sector_count;
 
-	// TODO There might be a faster way to shrink a file
-	// Erase sectors from file
-	while (src_offset < old_end_offset) {
+	// Not reusable until the header is saved
+	add_sector_run(p_region->pending_free_sectors, run);
+	p_region->pending_free_sector_count += p_sector_count;
+}
 
-		f->seek(src_offset);
-		int read_bytes = f->get_buffer(temp, _meta.sector_size);
-		CRASH_COND(read_bytes != _meta.sector_size); // Corrupted file
+// Called once the header is saved. Sectors freed since the previous save are no longer used by any block on disk.
+void VoxelStreamRegionFiles::commit_free_sectors(CachedRegion *p_region) {
 
-		f->seek(dst_offset);
-		f->store_buffer(temp, _meta.sector_size);
+	std::vector<SectorRun> &free_runs = p_region->free_sectors;
 
-		src_offset += _meta.sector_size;
-		dst_offset += _meta.sector_size;
+	for (size_t i = 0; i < p_region->pending_free_sectors.size(); ++i) {
+		add_sector_run(free_runs, p_region->pending_free_sectors[i]);
 	}
-
-	memfree(temp);
-	// TODO We need to truncate the end of the file since we effectively shortened it,
-	// but FileAccess doesn't have any function to do that... so can't rely on EOF either
-
-	// Erase sectors from cache
-	p_region->sectors.erase(
-			p_region->sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count() - p_sector_count),
-			p_region->sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count()));
-
-	unsigned int old_sector_index = block_info.get_sector_index();
-
-	// Reduce sectors of current block in header.
-	if (block_info.get_sector_count() > p_sector_count) {
-		block_info.set_sector_count(block_info.get_sector_count() - p_sector_count);
-	} else {
-		// Block removed
-		block_info.data = 0;
+	p_region->pending_free_sectors.clear();
+	p_region->pending_free_sector_count = 0;
+
+	if (free_runs.size() > 0 && free_runs.back().index + free_runs.back().count == p_region->sector_count) {
+		// Free space at the end is not tracked, it will be overwritten by appends.
+		// FileAccess can't truncate files, so the file keeps its length.
+		p_region->sector_count = free_runs.back().index;
+		free_runs.pop_back();
 	}
+}
 
-	// Shift sector index of following blocks
-	if (old_sector_index < p_region->sectors.size()) {
-		RegionHeader &header = p_region->header;
-		for (unsigned int i = 0; i < header.blocks.size(); ++i) {
-			BlockInfo &b = header.blocks[i];
-			if (b.data != 0 && b.get_sector_index() > old_sector_index) {
-				b.set_sector_index(b.get_sector_index() - p_sector_count);
-			}
-		}
-	}
+Dictionary VoxelStreamRegionFiles::get_save_statistics() const {
+	Dictionary d;
+	d["saved_blocks"] = _save_stats.saved_blocks;
+	d["saved_bytes"] = _save_stats.saved_bytes;
+	d["time_spent_saving"] = _save_stats.time_spent_saving;
+	d["appended_sectors"] = _save_stats.appended_sectors;
+	d["reused_sectors"] = _save_stats.reused_sectors;
+	return d;
 }
 
 String VoxelStreamRegionFiles::get_directory() const {
@@ -500,6 +500,11 @@ static void migrate_region_meta_data(Dictionary &data) {
 			depths[i] = VoxelBuffer::DEFAULT_CHANNEL_DEPTH;
 		}
 		data["channel_depths"] = depths;
+		data["version"] = real_t(FORMAT_VERSION_LEGACY_2);
+	}
+
+	if (data["version"] == Variant(real_t(FORMAT_VERSION_LEGACY_2))) {
+		// Only region files changed, they get upgraded when written to, or all at once with convert_files()
 		data["version"] = FORMAT_VERSION;
 	}
 }
@@ -664,6 +669,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		_region_cache.push_back(cache);
 		RegionHeader &header = cache->header;
 
+		header.version = FORMAT_VERSION;
 		header.blocks.resize(region_size.volume());
 
 		save_header(cache);
@@ -676,7 +682,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		const VoxelFileResult check_result = check_magic_and_version(existing_f, FORMAT_VERSION, FORMAT_REGION_MAGIC, version);
 
 		if (check_result == VOXEL_FILE_INVALID_VERSION) {
-			if (version != FORMAT_VERSION_LEGACY_1) {
+			if (version != FORMAT_VERSION_LEGACY_1 && version != FORMAT_VERSION_LEGACY_2) {
 				memdelete(existing_f);
 				ERR_PRINT(String("Could not open file {0}, invalid version {1}").format(varray(fpath, version)));
 				return nullptr;
@@ -688,7 +694,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 			return nullptr;
 		}
 
-		// Versions 1 and 2 are the same
+		// Versions 1 and 2 are the same, and are also valid version 3 files without free sectors
 
 		cache = memnew(CachedRegion);
 		cache->file_exists = true;
@@ -698,14 +704,14 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 		_region_cache.push_back(cache);
 		RegionHeader &header = cache->header;
 
+		header.version = version;
 		header.blocks.resize(region_size.volume());
 
 		// TODO Deal with endianess
 		existing_f->get_buffer((uint8_t *)header.blocks.data(), header.blocks.size() * sizeof(BlockInfo));
 	}
 
-	// Precalculate location of sectors and which block they contain.
-	// This will be useful to know when sectors get moved on insertion and removal
+	// The header tells which sectors are used, so free sectors are found from it instead of being saved
 
 	struct BlockInfoAndIndex {
 		BlockInfo b;
@@ -730,13 +736,22 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(const
 				return a.b.get_sector_index() < b.b.get_sector_index();
 			});
 
+	uint32_t end = 0;
 	for (unsigned int i = 0; i < blocks_sorted_by_offset.size(); ++i) {
-		const BlockInfoAndIndex b = blocks_sorted_by_offset[i];
-		Vector3i bpos = get_block_position_from_index(b.i);
-		for (unsigned int j = 0; j < b.b.get_sector_count(); ++j) {
-			cache->sectors.push_back(bpos);
+		const BlockInfo b = blocks_sorted_by_offset[i].b;
+		if (b.get_sector_index() > end) {
+			SectorRun run;
+			run.index = end;
+			run.count = b.get_sector_index() - end;
+			cache->free_sectors.push_back(run);
+
+		} else if (b.get_sector_index() < end) {
+			ERR_PRINT(String("Block {0} overlaps another in region file {1}")
+							  .format(varray(get_block_position_from_index(blocks_sorted_by_offset[i].i).to_vec3(), fpath)));
 		}
+		end = MAX(end, b.get_sector_index() + b.get_sector_count());
 	}
+	cache->sector_count = end;
 
 	cache->last_opened = OS::get_singleton()->get_ticks_usec();
 
@@ -754,6 +769,8 @@ void VoxelStreamRegionFiles::save_header(CachedRegion *p_region) {
 	// TODO Deal with endianess
 	p_region->file_access->store_buffer((const uint8_t *)header.blocks.data(), header.blocks.size() * sizeof(BlockInfo));
 	p_region->header_modified = false;
+
+	commit_free_sectors(p_region);
 }
 
 void VoxelStreamRegionFiles::close_region(CachedRegion *region) {
@@ -834,6 +851,8 @@ static Vector3i convert_block_coordinates(Vector3i pos, Vector3i old_size, Vecto
 void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	// TODO Converting across different block sizes is untested.
 	// I wrote it because it would be too bad to loose large voxel worlds because of a setting change, so one day we may need it
+	// Files are rewritten in the current version, with blocks packed. So converting with the same settings
+	// migrates files of older versions, and gets rid of free sectors left by edits.
 
 	print_line("Converting region files");
 	// This can be a very long and slow operation. Better run this in a thread.
@@ -1096,7 +1115,7 @@ void VoxelStreamRegionFiles::set_lod_count(int p_lod_count) {
 void VoxelStreamRegionFiles::convert_files(Dictionary d) {
 
 	Meta meta;
-	meta.version = _meta.version;
+	meta.version = FORMAT_VERSION;
 	meta.block_size_po2 = int(d["block_size_po2"]);
 	meta.region_size_po2 = int(d["region_size_po2"]);
 	meta.sector_size = int(d["sector_size"]);
@@ -1141,6 +1160,8 @@ void VoxelStreamRegionFiles::_bind_methods() {
 
 	ClassDB::bind_method(D_METHOD("convert_files", "new_settings"), &VoxelStreamRegionFiles::convert_files);
 
+	ClassDB::bind_method(D_METHOD("get_save_statistics"), &VoxelStreamRegionFiles::get_save_statistics);
+
 	ADD_PROPERTY(PropertyInfo(Variant::STRING, "directory", PROPERTY_HINT_DIR), "set_directory", "get_directory");
 
 	ADD_GROUP("Dimensions", "");
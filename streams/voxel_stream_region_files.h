@@ -45,6 +45,9 @@ public:
 
 	void convert_files(Dictionary d);
 
+	// Counts saves since the stream was created, to measure their throughput
+	Dictionary get_save_statistics() const;
+
 protected:
 	static void _bind_methods();
 
@@ -74,7 +77,9 @@ private:
 	int get_sector_count_from_bytes(int size_in_bytes) const;
 	int get_region_header_size() const;
 	CachedRegion *get_region_from_cache(const Vector3i pos, int lod) const;
-	void remove_sectors_from_block(CachedRegion *p_region, Vector3i block_rpos, unsigned int p_sector_count);
+	unsigned int allocate_sectors(CachedRegion *p_region, unsigned int p_sector_count);
+	void free_sectors(CachedRegion *p_region, unsigned int p_sector_index, unsigned int p_sector_count);
+	void commit_free_sectors(CachedRegion *p_region);
 	int get_sectors_count(const RegionHeader &header) const;
 	void close_oldest_region();
 	void save_header(CachedRegion *p_region);
@@ -134,13 +139,20 @@ private:
 	};
 
 	struct RegionHeader {
-		uint8_t version;
+		uint8_t version = 0;
 		// Location and size of blocks, indexed by flat position.
 		// This table always has the same size,
 		// and the same index always corresponds to the same 3D position.
 		std::vector<BlockInfo> blocks;
 	};
 
+	struct SectorRun {
+		uint32_t index = 0;
+		uint32_t count = 0;
+	};
+
+	static void add_sector_run(std::vector<SectorRun> &runs, SectorRun run);
+
 	struct CachedRegion {
 		Vector3i position;
 		int lod = 0;
@@ -149,10 +161,18 @@ private:
 		RegionHeader header;
 		bool header_modified = false;
 
-		// List of sectors in the order they appear in the file,
-		// and which position their block is. The same block can span multiple sectors.
-		// This is essentially a reverse table of `header->blocks`.
-		std::vector<Vector3i> sectors;
+		// Sectors no block uses, left when blocks shrink or move. Blocks written later are put there if they fit,
+		// so edited blocks don't require moving the rest of the file.
+		// Ordered by index, and never adjacent to each other or to the end.
+		std::vector<SectorRun> free_sectors;
+		// Sectors freed since the header was last saved. The header on disk may still assign them to blocks,
+		// so they are only reused once it is saved again. Otherwise, stopping the program before that
+		// would leave these blocks pointing to data of others. Ordered by index, and never adjacent to each other.
+		std::vector<SectorRun> pending_free_sectors;
+		uint32_t pending_free_sector_count = 0;
+		// Sectors up to the end of the last block, or of the last pending free run.
+		// The file may be longer, following sectors are free.
+		uint32_t sector_count = 0;
 
 		uint64_t last_opened = 0;
 		//uint64_t last_accessed;
@@ -164,6 +184,16 @@ private:
 	bool _meta_saved = false;
 	std::vector<CachedRegion *> _region_cache;
 	unsigned int _max_open_regions = MIN(8, FOPEN_MAX);
+
+	struct SaveStats {
+		uint64_t saved_blocks = 0;
+		uint64_t saved_bytes = 0;
+		uint64_t time_spent_saving = 0;
+		uint64_t appended_sectors = 0;
+		uint64_t reused_sectors = 0;
+	};
+
+	SaveStats _save_stats;
 };
 
 #endif // VOXEL_STREAM_REGION_H
@@ -4,37 +4,71 @@
 #include "../math/rect3i.h"
 #include "../math/vector3i.h"
 #include "../util/array_slice.h"
+#include "../util/cancellation_token.h"
 #include "../util/fixed_array.h"
+#include "../util/latency_histogram.h"
 #include "../util/utility.h"
 #include "../voxel_constants.h"
 
+#include <core/math/camera_matrix.h>
 #include <core/os/os.h>
 #include <core/os/semaphore.h>
 #include <algorithm>
 #include <functional>
 #include <vector>
 
+// Point of view block requests are prioritized from
+struct VoxelPriorityViewer {
+	Vector3i position; // In LOD0 block coordinates
+	// Frustum of the camera the viewer looks through, in LOD0 block coordinates, with normals pointing outwards.
+	// The near plane comes first. Empty if the viewer has no camera, in which case only distance matters.
+	std::vector<Plane> frustum_planes;
+
+	// Takes planes as given by `Camera::get_frustum()`, in voxels.
+	// The far plane is left out, because terrains are limited by their view distance instead.
+	void set_frustum(const Vector<Plane> &camera_frustum, float block_size) {
+		frustum_planes.clear();
+		ERR_FAIL_COND(camera_frustum.size() != 6);
+		const int plane_indexes[] = {
+			CameraMatrix::PLANE_NEAR,
+			CameraMatrix::PLANE_LEFT,
+			CameraMatrix::PLANE_TOP,
+			CameraMatrix::PLANE_RIGHT,
+			CameraMatrix::PLANE_BOTTOM
+		};
+		for (unsigned int i = 0; i < 5; ++i) {
+			const Plane &p = camera_frustum[plane_indexes[i]];
+			frustum_planes.push_back(Plane(p.normal, p.d / block_size));
+		}
+	}
+};
+
 // Base structure for an asynchronous block processing manager using threads.
 // It is the same for block loading and rendering, hence made a generic one.
 // - Push requests and pop requests in batch
-// - One or more threads can be used
+// - One or more threads can be used, taking requests from the same queue. Their count can change at runtime.
 // - Minimizes sync points
-// - Orders blocks to process the closest ones first
+// - Orders blocks to process the closest ones first, without re-sorting the whole queue when the viewer moves.
+//   Blocks in view of the camera come before all others, and those behind it come last.
 // - Merges duplicate requests
-// - Cancels requests that become out of range
-// - Takes some stats
+// - Cancels requests that become out of range, or that volumes no longer need, even while they are processed
+// - Takes some stats, including latency histograms
+// - Can be shared by several volumes, whose requests are prioritized relatively to their own viewers
 template <typename InputBlockData_T, typename OutputBlockData_T>
 class VoxelBlockThreadManager {
 public:
-	static const int MAX_JOBS = 8; // Arbitrary, should be enough
+	static const int MAX_JOBS = 64; // Arbitrary, should be enough
 
 	// Specialization must be copyable
 	struct InputBlock {
 		InputBlockData_T data;
 		Vector3i position; // In LOD-relative block coordinates
 		uint8_t lod = 0;
+		uint32_t volume_id = 0; // Set from the input it was pushed with
 		bool can_be_discarded = true; // If false, will always be processed, even if the thread is told to exit
-		float sort_heuristic = 0;
+		// Cancelled if the volume no longer needs the block while it is being processed.
+		// Processors may poll it to stop early. Results of cancelled blocks are not returned.
+		CancellationToken cancellation_token;
 	};
 
 	// Specialization must be copyable
@@ -42,23 +76,39 @@ public:
 		OutputBlockData_T data;
 		Vector3i position; // In LOD-relative block coordinates
 		uint8_t lod = 0;
+		uint32_t volume_id = 0;
 		// True if the block was actually dropped.
 		// Ideally the requester will agree that it doesn't need that block anymore,
 		// but in cases it still does (bad case), it will have to query it again.
 		bool drop_hint = false;
+		// When the result was made available to the requester, in microseconds
+		uint64_t ready_time = 0;
 	};
 
+	// Identifies a block of the volume an input comes from
+	struct BlockLocation {
+		Vector3i position; // In LOD-relative block coordinates
+		uint8_t lod = 0;
+	};
+
+	typedef VoxelPriorityViewer Viewer;
+
 	struct Input {
 		std::vector<InputBlock> blocks;
-		Vector3i priority_position; // In LOD0 block coordinates
-		Vector3 priority_direction; // Where the viewer is looking at
-		int exclusive_region_extent = 0; // Region beyond which the processor is allowed to discard requests
+		// Previous requests the volume no longer needs. Applied before new requests are added.
+		// Saves and other requests which can't be discarded are not affected.
+		std::vector<BlockLocation> cancelled_blocks;
+		// Volume the blocks belong to. Priority settings below only apply to that volume.
+		uint32_t volume_id = 0;
+		// Requests are prioritized relatively to the nearest viewer
+		std::vector<Viewer> priority_viewers;
+		int exclusive_region_extent = 0; // Region around each viewer beyond which the processor is allowed to discard requests
 		int exclusive_region_max_lod = VoxelConstants::MAX_LOD; // LOD beyond which exclusive region won't be used
 		bool use_exclusive_region = false;
 		int max_lod_index = 0;
 
 		bool is_empty() const {
-			return blocks.empty();
+			return blocks.empty() && cancelled_blocks.empty();
 		}
 	};
 
@@ -67,205 +117,266 @@ public:
 		int time_spent_opening_files = 0;
 	};
 
+	// Microseconds spent by requests in each stage, per LOD
+	struct LatencyStats {
+		// From being pushed to being claimed by a job
+		FixedArray<LatencyHistogram, VoxelConstants::MAX_LOD> queue_wait;
+		// Processing, averaged within each batch
+		FixedArray<LatencyHistogram, VoxelConstants::MAX_LOD> processing;
+		// From the result being available to being popped
+		FixedArray<LatencyHistogram, VoxelConstants::MAX_LOD> pickup;
+	};
+
 	struct Stats {
 		// Generic stats
+		// True until a batch was timed, in which case min and max times are meaningful
 		bool first = true;
 		uint64_t min_time = 0;
 		uint64_t max_time = 0;
 		uint64_t sorting_time = 0;
-		uint32_t remaining_blocks[MAX_JOBS];
+		// Requests of all volumes waiting to be claimed by a job
+		uint32_t remaining_blocks = 0;
 		uint32_t thread_count = 0;
 		uint32_t dropped_count = 0;
+		// Requests cancelled while they were being processed
+		uint32_t cancelled_count = 0;
 		// Processor-specific
 		ProcessorStats processor;
-
-		Stats() {
-			for (int i = 0; i < MAX_JOBS; ++i) {
-				remaining_blocks[i] = 0;
-			}
-		}
+		LatencyStats latency;
 	};
 
 	struct Output {
 		Vector<OutputBlock> blocks;
 		Stats stats;
+		// Stats of the requests of each volume, only filled by the manager.
+		// The manager only sets `remaining_blocks` and `thread_count` in `stats`.
+		HashMap<uint32_t, Stats> volume_stats;
 	};
 
-	typedef std::function<void(ArraySlice<InputBlock>, ArraySlice<OutputBlock>, ProcessorStats &)> BlockProcessingFunc;
-
-	// TODO Make job count dynamic, don't start threads in constructor
+	// Called from all jobs. The index of the calling job is given, so processors that are not thread-safe
+	// can use clones specific to each job. Indexes are below the job count, and never used by two jobs at once.
+	typedef std::function<void(unsigned int, ArraySlice<InputBlock>, ArraySlice<OutputBlock>, ProcessorStats &)> BlockProcessingFunc;
 
 	// Creates and starts jobs.
-	// Processors are given as array because you could decide to either re-use the same one,
-	// or have clones depending on them being stateless or not.
+	// Jobs claim up to `batch_count` requests at once, which are given together to the processor.
 	VoxelBlockThreadManager(
 			unsigned int job_count,
-			unsigned int sync_interval_ms,
-			ArraySlice<BlockProcessingFunc> processors,
+			BlockProcessingFunc processor,
 			bool duplicate_rejection = true,
 			unsigned int batch_count = 1) {
 
-		CRASH_COND(job_count < 1);
-		CRASH_COND(job_count >= MAX_JOBS);
-		_job_count = job_count;
-
 		CRASH_COND(batch_count == 0);
+		_batch_count = batch_count;
+		_duplicate_rejection = duplicate_rejection;
+		_processor = processor;
 
-		for (unsigned int i = 0; i < MAX_JOBS; ++i) {
-			JobData &job = _jobs[i];
-			job.job_index = i;
-			job.duplicate_rejection = duplicate_rejection;
-			job.sync_interval_ms = sync_interval_ms;
-			job.batch_count = batch_count;
-		}
+		_input_mutex = Mutex::create();
 
-		for (unsigned int i = 0; i < _job_count; ++i) {
-
-			JobData &job = _jobs[i];
-			CRASH_COND(job.thread != nullptr);
-
-			job.input_mutex = Mutex::create();
-			job.output_mutex = Mutex::create();
-			job.semaphore = Semaphore::create();
-			job.thread = Thread::create(_thread_func, &job);
-			job.needs_sort = true;
-			job.processor = processors[i];
-		}
+		set_job_count(job_count);
+		CRASH_COND(_jobs.size() < 1);
 	}
 
 	~VoxelBlockThreadManager() {
 
-		for (unsigned int i = 0; i < _job_count; ++i) {
-			JobData &job = _jobs[i];
-			job.thread_exit = true;
-			job.semaphore->post();
+		{
+			MutexLock lock(_input_mutex);
+			_thread_exit = true;
 		}
 
-		for (unsigned int i = 0; i < _job_count; ++i) {
-
-			JobData &job = _jobs[i];
-			CRASH_COND(job.thread == nullptr);
-
-			Thread::wait_to_finish(job.thread);
+		for (unsigned int i = 0; i < _jobs.size(); ++i) {
+			_jobs[i]->semaphore->post();
+		}
+		for (unsigned int i = 0; i < _retiring_jobs.size(); ++i) {
+			_retiring_jobs[i]->semaphore->post();
+		}
 
-			memdelete(job.thread);
-			memdelete(job.semaphore);
-			memdelete(job.input_mutex);
-			memdelete(job.output_mutex);
+		for (unsigned int i = 0; i < _jobs.size(); ++i) {
+			destroy_job(_jobs[i]);
 		}
+		for (unsigned int i = 0; i < _retiring_jobs.size(); ++i) {
+			destroy_job(_retiring_jobs[i]);
+		}
+
+		memdelete(_input_mutex);
 	}
 
-	void push(const Input &input) {
+	// Starts or stops jobs. Queued requests are kept.
+	// Stopped jobs finish what they are processing first, without blocking the caller. Their results come with next pops.
+	void set_job_count(unsigned int job_count) {
 
-		CRASH_COND(_job_count < 1);
+		ERR_FAIL_COND(job_count < 1);
+		ERR_FAIL_COND(job_count > MAX_JOBS);
 
-		unsigned int replaced_blocks = 0;
-		unsigned int highest_pending_count = 0;
-		unsigned int lowest_pending_count = 0;
+		const unsigned int previous_count = _jobs.size();
 
-		// Lock all inputs and gather their pending work counts
-		for (unsigned int job_index = 0; job_index < _job_count; ++job_index) {
+		if (job_count < previous_count) {
+			{
+				MutexLock lock(_input_mutex);
+				for (unsigned int i = job_count; i < previous_count; ++i) {
+					_jobs[i]->exit_requested = true;
+				}
+				_job_count = job_count;
+			}
 
-			JobData &job = _jobs[job_index];
+			for (unsigned int i = job_count; i < previous_count; ++i) {
+				_jobs[i]->semaphore->post();
+				_retiring_jobs.push_back(_jobs[i]);
+			}
+			_jobs.resize(job_count);
+
+		} else if (job_count > previous_count) {
+			// Jobs being stopped may still use indexes about to be given to new jobs.
+			// Processors can have state for each index, so wait for them to be done.
+			for (unsigned int i = 0; i < _retiring_jobs.size(); ++i) {
+				JobData *job = _retiring_jobs[i];
+				if (job->job_index >= previous_count && !job->joined) {
+					Thread::wait_to_finish(job->thread);
+					job->joined = true;
+				}
+			}
 
-			job.input_mutex->lock();
+			{
+				MutexLock lock(_input_mutex);
+				_job_count = job_count;
+			}
 
-			highest_pending_count = MAX(highest_pending_count, job.shared_input.blocks.size());
-			lowest_pending_count = MIN(lowest_pending_count, job.shared_input.blocks.size());
+			for (unsigned int i = previous_count; i < job_count; ++i) {
+				JobData *job = memnew(JobData);
+				job->job_index = i;
+				job->manager = this;
+				job->output_mutex = Mutex::create();
+				job->semaphore = Semaphore::create();
+				job->thread = Thread::create(_thread_func, job);
+				_jobs.push_back(job);
+			}
 		}
+	}
 
-		unsigned int i = 0;
-
-		// We don't use a "weakest team gets it" dispatch for speed,
-		// So prioritize only jobs under median workload count and not just the highest.
-		unsigned int median_pending_count = lowest_pending_count + (highest_pending_count - lowest_pending_count) / 2;
+	unsigned int get_job_count() const {
+		return _jobs.size();
+	}
 
-		// Dispatch to jobs with least pending requests
-		for (unsigned int job_index = 0; job_index < _job_count && i < input.blocks.size(); ++job_index) {
+	void push(const Input &input) {
 
-			JobData &job = _jobs[job_index];
-			unsigned int pending_count = job.shared_input.blocks.size();
+		CRASH_COND(_job_count < 1);
 
-			unsigned int count = MIN(median_pending_count - pending_count, input.blocks.size());
+		unsigned int replaced_blocks = 0;
 
-			if (count > 0) {
-				if (i + count > input.blocks.size()) {
-					count = input.blocks.size() - i;
+		{
+			MutexLock lock(_input_mutex);
+
+			// Settings must be up to date before new requests get their priority
+			update_volume(input);
+			cancel_block_requests(input.cancelled_blocks, input.volume_id);
+			replaced_blocks = push_block_requests(input.blocks, input.volume_id);
+
+			// Busy jobs claim more requests as soon as they are done, so only idle ones are woken up,
+			// and no more than there are requests to take
+			unsigned int wake_count = _queued_count;
+			for (unsigned int job_index = 0; job_index < _jobs.size() && wake_count > 0; ++job_index) {
+				JobData *job = _jobs[job_index];
+				if (job->idle) {
+					job->idle = false;
+					job->semaphore->post();
+					--wake_count;
 				}
-				replaced_blocks += push_block_requests(job, input.blocks, i, count);
-				i += count;
 			}
 		}
 
-		// Dispatch equal count of remaining requests.
-		// Remainder is dispatched too until consumed through the first jobs.
-		unsigned int base_count = (input.blocks.size() - i) / _job_count;
-		unsigned int remainder = (input.blocks.size() - i) % _job_count;
-		for (unsigned int job_index = 0; job_index < _job_count && i < input.blocks.size(); ++job_index) {
+		if (replaced_blocks > 0) {
+			print_line(String("VoxelBlockProcessor: {1} blocks already in queue were replaced").format(varray(replaced_blocks)));
+		}
+	}
+
+	void pop(Output &output) {
 
-			JobData &job = _jobs[job_index];
+		output.stats = Stats();
+		output.stats.thread_count = _jobs.size();
+		output.volume_stats.clear();
 
-			unsigned int count = base_count;
-			if (remainder > 0) {
-				++count;
-				--remainder;
-			}
+		// Harvest results from all jobs
+		for (unsigned int i = 0; i < _jobs.size(); ++i) {
+			harvest_job_output(*_jobs[i], output);
+		}
 
-			if (i + count > input.blocks.size()) {
-				replaced_blocks += push_block_requests(job, input.blocks, i, input.blocks.size() - i);
-			} else {
-				replaced_blocks += push_block_requests(job, input.blocks, i, count);
-				i += count;
+		// Stopped jobs are released once they are done with their last requests
+		for (unsigned int i = 0; i < _retiring_jobs.size(); ++i) {
+			JobData *job = _retiring_jobs[i];
+			if (harvest_job_output(*job, output)) {
+				destroy_job(job);
+				_retiring_jobs[i] = _retiring_jobs.back();
+				_retiring_jobs.pop_back();
+				--i;
 			}
 		}
 
-		// Set remaining data on all jobs, unlock inputs and resume
-		for (unsigned int job_index = 0; job_index < _job_count; ++job_index) {
+		{
+			MutexLock lock(_input_mutex);
+			output.stats.remaining_blocks = _queued_count;
+		}
+
+		const uint64_t now = OS::get_singleton()->get_ticks_usec();
+		for (int i = 0; i < output.blocks.size(); ++i) {
+			const OutputBlock &ob = output.blocks[i];
+			output.volume_stats[ob.volume_id].latency.pickup[ob.lod].add(now - ob.ready_time);
+		}
+	}
 
-			JobData &job = _jobs[job_index];
+	// Cancels requests of a volume which can be discarded, including those being processed,
+	// and forgets its priority settings.
+	void remove_volume(uint32_t volume_id) {
 
-			if (job.shared_input.priority_position != input.priority_position || input.blocks.size() > 0) {
-				job.needs_sort = true;
-			}
+		MutexLock lock(_input_mutex);
 
-			job.shared_input.priority_position = input.priority_position;
+		remove_queued_blocks_if([volume_id](const InputBlock &b) {
+			return b.volume_id == volume_id && b.can_be_discarded;
+		});
 
-			if (input.use_exclusive_region) {
-				job.shared_input.use_exclusive_region = true;
-				job.shared_input.exclusive_region_extent = input.exclusive_region_extent;
-				job.shared_input.exclusive_region_max_lod = input.exclusive_region_max_lod;
+		const BlockKey *key = nullptr;
+		while ((key = _claimed_blocks.next(key))) {
+			if (key->volume_id == volume_id) {
+				_claimed_blocks[*key]->cancel();
 			}
+		}
 
-			bool should_run = !job.shared_input.is_empty();
+		_volumes.erase(volume_id);
+	}
 
-			job.input_mutex->unlock();
+	static void merge_stats(Stats &a, const Stats &b) {
 
-			if (should_run) {
-				job.semaphore->post();
+		if (!b.first) {
+			if (a.first) {
+				a.first = false;
+				a.min_time = b.min_time;
+				a.max_time = b.max_time;
+			} else {
+				a.min_time = MIN(a.min_time, b.min_time);
+				a.max_time = MAX(a.max_time, b.max_time);
 			}
 		}
 
-		if (replaced_blocks > 0) {
-			print_line(String("VoxelBlockProcessor: {1} blocks already in queue were replaced").format(varray(replaced_blocks)));
-		}
-	}
-
-	void pop(Output &output) {
+		a.sorting_time += b.sorting_time;
+		a.dropped_count += b.dropped_count;
+		a.cancelled_count += b.cancelled_count;
 
-		output.stats = Stats();
-		output.stats.thread_count = _job_count;
+		a.processor.file_openings += b.processor.file_openings;
+		a.processor.time_spent_opening_files += b.processor.time_spent_opening_files;
 
-		// Harvest results from all jobs
-		for (unsigned int i = 0; i < _job_count; ++i) {
+		merge_latency(a.latency, b.latency);
+	}
 
-			JobData &job = _jobs[i];
-			{
-				MutexLock lock(job.output_mutex);
+	static void merge_latency(LatencyStats &a, const LatencyStats &b) {
+		for (unsigned int lod = 0; lod < VoxelConstants::MAX_LOD; ++lod) {
+			a.queue_wait[lod].merge(b.queue_wait[lod]);
+			a.processing[lod].merge(b.processing[lod]);
+			a.pickup[lod].merge(b.pickup[lod]);
+		}
+	}
 
-				output.blocks.append_array(job.shared_output.blocks);
-				merge_stats(output.stats, job.shared_output.stats, i);
-				job.shared_output.blocks.clear();
-			}
+	static void merge_volume_stats(HashMap<uint32_t, Stats> &a, const HashMap<uint32_t, Stats> &b) {
+		const uint32_t *volume_id = nullptr;
+		while ((volume_id = b.next(volume_id))) {
+			merge_stats(a[*volume_id], b[*volume_id]);
 		}
 	}
 
@@ -275,346 +386,773 @@ public:
 		d["max_time"] = stats.max_time;
 		d["sorting_time"] = stats.sorting_time;
 		d["dropped_count"] = stats.dropped_count;
-		Array remaining_blocks;
-		remaining_blocks.resize(stats.thread_count);
-		for (unsigned int i = 0; i < stats.thread_count; ++i) {
-			remaining_blocks[i] = stats.remaining_blocks[i];
-		}
-		d["remaining_blocks_per_thread"] = remaining_blocks;
+		d["cancelled_count"] = stats.cancelled_count;
+		d["remaining_blocks"] = stats.remaining_blocks;
+		d["thread_count"] = stats.thread_count;
 		d["file_openings"] = stats.processor.file_openings;
 		d["time_spent_opening_files"] = stats.processor.time_spent_opening_files;
+
+		Dictionary latency;
+		latency["queue_wait"] = to_array(stats.latency.queue_wait);
+		latency["processing"] = to_array(stats.latency.processing);
+		latency["pickup"] = to_array(stats.latency.pickup);
+		d["latency"] = latency;
+
 		return d;
 	}
 
 private:
+	// One dictionary per LOD, up to the last one which has samples
+	static Array to_array(const FixedArray<LatencyHistogram, VoxelConstants::MAX_LOD> &histograms) {
+		unsigned int lod_count = 0;
+		for (unsigned int lod = 0; lod < VoxelConstants::MAX_LOD; ++lod) {
+			if (histograms[lod].get_count() > 0) {
+				lod_count = lod + 1;
+			}
+		}
+		Array a;
+		a.resize(lod_count);
+		for (unsigned int lod = 0; lod < lod_count; ++lod) {
+			a[lod] = histograms[lod].to_dictionary();
+		}
+		return a;
+	}
+
+	// Identifies a request, so duplicates can be found
+	struct BlockKey {
+		Vector3i position;
+		uint32_t volume_id;
+		uint8_t lod;
+
+		inline bool operator==(const BlockKey &other) const {
+			return position == other.position && volume_id == other.volume_id && lod == other.lod;
+		}
+	};
+
+	struct BlockKeyHasher {
+		static inline uint32_t hash(const BlockKey &k) {
+			uint32_t hash = Vector3iHasher::hash(k.position);
+			hash = hash_djb2_one_32(k.volume_id, hash);
+			return hash_djb2_one_32(k.lod, hash);
+		}
+	};
+
+	static inline BlockKey get_block_key(const InputBlock &ib) {
+		BlockKey k;
+		k.position = ib.position;
+		k.volume_id = ib.volume_id;
+		k.lod = ib.lod;
+		return k;
+	}
+
+	// Where requests of a volume are prioritized from
+	struct VolumePriority {
+		std::vector<Viewer> viewers;
+		// Viewers as they were when the queue was last rebuilt. View tiers are computed from their frustums,
+		// so all requests queued until the next rebuild get the same tiers.
+		std::vector<Viewer> viewers_at_rebuild;
+		int exclusive_region_extent = 0;
+		int exclusive_region_max_lod = VoxelConstants::MAX_LOD;
+		bool use_exclusive_region = false;
+		int max_lod_index = 0;
+	};
+
+	// Requests are kept in a binary heap. Their sort key is the priority heuristic plus how far viewers
+	// had travelled in total when it was computed. Viewers moving can only bring a heuristic down by as much
+	// as they travelled, so keys of old entries are lower bounds of their up-to-date key (view tiers aside, see `update_volume`).
+	// When claiming requests, an outdated entry at the top gets its key refreshed and sinks back if needed,
+	// which orders requests exactly as a full sort would, while only touching entries about to be processed.
+	struct QueuedBlock {
+		InputBlock block;
+		double sort_key;
+		// Value of `_travel` when the key was computed
+		double travel;
+		// Identifies the latest request for a given block. Replaced requests remain in the heap until they reach the top.
+		uint32_t sequence;
+		// When the request was pushed, in microseconds
+		uint64_t push_time;
+	};
+
+	// Makes a min-heap, so the most important requests come first
+	struct QueuedBlockComparator {
+		inline bool operator()(const QueuedBlock &a, const QueuedBlock &b) const {
+			return a.sort_key > b.sort_key;
+		}
+	};
+
+	// Latest request of a block present in the queue
+	struct LiveRequest {
+		uint32_t sequence;
+		bool can_be_discarded;
+	};
+
+	// Below this size, the queue is not worth compacting
+	static const unsigned int MIN_REBUILD_SIZE = 1024;
+	// Added to priorities for each view tier a block is away from being in view.
+	// Greater than LOD and distance terms combined, so it sorts first.
+	static const int VIEW_TIER_WEIGHT = 1000000;
+
 	struct JobData {
 
 		// Data accessed from other threads, so they need mutexes
 		//------------------------
-		Input shared_input;
 		Output shared_output;
-		Mutex *input_mutex = nullptr;
 		Mutex *output_mutex = nullptr;
-		// Indexes which blocks are present in shared_input,
-		// so if we push a duplicate request with the same coordinates, we can discard it without a linear search
-		FixedArray<HashMap<Vector3i, int, Vector3iHasher>, VoxelConstants::MAX_LOD> shared_input_block_indexes;
-		bool needs_sort = false;
-		// Only read by the thread
-		bool thread_exit = false;
 		//------------------------
 
-		Input input;
+		// Requests claimed from the shared queue, most important first
+		std::vector<InputBlock> input_blocks;
 		Output output;
 		Semaphore *semaphore = nullptr;
 		Thread *thread = nullptr;
-		uint32_t sync_interval_ms = 100;
 		uint32_t job_index = -1;
-		bool duplicate_rejection = false;
-		int batch_count = 0;
-
-		BlockProcessingFunc processor;
+		VoxelBlockThreadManager *manager = nullptr;
+		// Set under the input mutex when the job count is reduced
+		bool exit_requested = false;
+		// Set under the input mutex when the job found nothing to claim, and is about to wait
+		bool idle = false;
+		// Set under the output mutex when the thread is about to return
+		bool finished = false;
+		bool joined = false;
 	};
 
-	static void merge_stats(Stats &a, const Stats &b, int job_index) {
+	// Returns true if the job has finished
+	static bool harvest_job_output(JobData &job, Output &output) {
+		MutexLock lock(job.output_mutex);
 
-		a.max_time = MAX(a.max_time, b.max_time);
-		a.min_time = MIN(a.min_time, b.min_time);
-		a.remaining_blocks[job_index] = b.remaining_blocks[job_index];
-		a.sorting_time += b.sorting_time;
-		a.dropped_count += b.dropped_count;
+		output.blocks.append_array(job.shared_output.blocks);
+		merge_volume_stats(output.volume_stats, job.shared_output.volume_stats);
+		job.shared_output.blocks.clear();
+		job.shared_output.volume_stats.clear();
 
-		a.processor.file_openings += b.processor.file_openings;
-		a.processor.time_spent_opening_files += b.processor.time_spent_opening_files;
+		return job.finished;
+	}
+
+	// The job must have been told to exit
+	static void destroy_job(JobData *job) {
+		CRASH_COND(job->thread == nullptr);
+
+		if (!job->joined) {
+			Thread::wait_to_finish(job->thread);
+		}
+
+		memdelete(job->thread);
+		memdelete(job->semaphore);
+		memdelete(job->output_mutex);
+		memdelete(job);
+	}
+
+	void update_volume(const Input &input) {
+		// The input mutex must have been locked first!
+
+		VolumePriority *volume = _volumes.getptr(input.volume_id);
+
+		if (volume == nullptr) {
+			// None of its requests are queued yet, so nothing becomes outdated
+			_volumes[input.volume_id] = VolumePriority();
+			volume = _volumes.getptr(input.volume_id);
+			volume->viewers_at_rebuild = input.priority_viewers;
+
+		} else {
+			if (volume->viewers.size() != input.priority_viewers.size() || volume->max_lod_index != input.max_lod_index) {
+				// These don't have a bound on how much they change priorities, but they rarely change
+				_needs_rebuild = true;
+				// All requests get new tiers with the rebuild, and frustums must match viewers meanwhile
+				volume->viewers_at_rebuild = input.priority_viewers;
+
+			} else {
+				for (unsigned int i = 0; i < volume->viewers.size(); ++i) {
+					const Viewer &prev_viewer = volume->viewers[i];
+					const Viewer &viewer = input.priority_viewers[i];
+
+					if (prev_viewer.position != viewer.position) {
+						// Distances to the nearest viewer change by at most the distance the viewers moved
+						_travel += Math::sqrt((double)viewer.position.distance_sq(prev_viewer.position));
+					}
+				}
+
+				// View tiers are not bounded that way, but recomputing them every time the camera turns a little
+				// would cost as much as sorting. Until frustums moved enough, only blocks near their edges are misplaced.
+				if (have_frustums_moved(volume->viewers_at_rebuild, input.priority_viewers)) {
+					_needs_rebuild = true;
+				}
+			}
+		}
+
+		volume->viewers = input.priority_viewers;
+		volume->max_lod_index = input.max_lod_index;
+
+		if (input.use_exclusive_region) {
+			volume->use_exclusive_region = true;
+			volume->exclusive_region_extent = input.exclusive_region_extent;
+			volume->exclusive_region_max_lod = input.exclusive_region_max_lod;
+		}
 	}
 
-	unsigned int push_block_requests(JobData &job, const std::vector<InputBlock> &input_blocks, int begin, int count) {
-		// The job's input mutex must have been locked first!
+	unsigned int push_block_requests(const std::vector<InputBlock> &input_blocks, uint32_t volume_id) {
+		// The input mutex must have been locked first!
+
+		const VolumePriority *volume = _volumes.getptr(volume_id);
+		CRASH_COND(volume == nullptr);
 
 		unsigned int replaced_blocks = 0;
-		unsigned int end = begin + count;
-		CRASH_COND(end > input_blocks.size());
+		const uint64_t now = OS::get_singleton()->get_ticks_usec();
 
-		for (unsigned int i = begin; i < end; ++i) {
+		for (unsigned int i = 0; i < input_blocks.size(); ++i) {
 
-			const InputBlock &block = input_blocks[i];
-			CRASH_COND(block.lod >= VoxelConstants::MAX_LOD);
+			QueuedBlock qb;
+			qb.block = input_blocks[i];
+			qb.block.volume_id = volume_id;
+			CRASH_COND(qb.block.lod >= VoxelConstants::MAX_LOD);
 
-			if (job.duplicate_rejection) {
+			qb.sort_key = get_priority_heuristic(qb.block, *volume) + _travel;
+			qb.travel = _travel;
+			qb.sequence = _next_sequence++;
+			qb.push_time = now;
 
-				int *index = job.shared_input_block_indexes[block.lod].getptr(block.position);
+			if (_duplicate_rejection) {
 
-				// TODO When using more than one thread, duplicate rejection is less effective... is it relevant to keep it at all?
-				if (index) {
-					// The block is already in the update queue, replace it
+				const BlockKey key = get_block_key(qb.block);
+				LiveRequest *live_request = _live_requests.getptr(key);
+
+				if (live_request) {
+					// The block is already in the queue, replace it
 					++replaced_blocks;
-					CRASH_COND(*index < 0 || *index >= (int)job.shared_input.blocks.size());
-					job.shared_input.blocks[*index] = block;
+					++_stale_count;
 
 				} else {
-					// Append new block request
-					unsigned int j = job.shared_input.blocks.size();
-					job.shared_input.blocks.push_back(block);
-					job.shared_input_block_indexes[block.lod][block.position] = j;
+					live_request = &_live_requests[key];
+					++_queued_count;
 				}
 
+				live_request->sequence = qb.sequence;
+				live_request->can_be_discarded = qb.block.can_be_discarded;
+
 			} else {
-				job.shared_input.blocks.push_back(block);
+				++_queued_count;
 			}
+
+			_queue.push_back(qb);
+			std::push_heap(_queue.begin(), _queue.end(), QueuedBlockComparator());
+		}
+
+		if (_queue.size() >= _rebuild_size) {
+			// Replaced or dropped requests may be accumulating
+			_needs_rebuild = true;
 		}
 
 		return replaced_blocks;
 	}
 
-	static void _thread_func(void *p_data) {
-		JobData *data = reinterpret_cast<JobData *>(p_data);
-		CRASH_COND(data == nullptr);
-		thread_func(*data);
+	// False if the request was replaced by a more recent one, or cancelled
+	inline bool is_live(const QueuedBlock &qb) const {
+		if (!_duplicate_rejection) {
+			return true;
+		}
+		const LiveRequest *live_request = _live_requests.getptr(get_block_key(qb.block));
+		return live_request != nullptr && live_request->sequence == qb.sequence;
 	}
 
-	static void thread_func(JobData &data) {
+	void pop_queue() {
+		// The input mutex must have been locked first!
+		std::pop_heap(_queue.begin(), _queue.end(), QueuedBlockComparator());
+		_queue.pop_back();
+	}
 
-		while (!data.thread_exit) {
+	// Removes the top of the queue, which must be live
+	void unqueue_top() {
+		// The input mutex must have been locked first!
+		if (_duplicate_rejection) {
+			_live_requests.erase(get_block_key(_queue.front().block));
+		}
+		pop_queue();
+		--_queued_count;
+	}
 
-			uint32_t sync_time = OS::get_singleton()->get_ticks_msec() + data.sync_interval_ms;
+	void cancel_block_requests(const std::vector<BlockLocation> &locations, uint32_t volume_id) {
+		// The input mutex must have been locked first!
 
-			unsigned int queue_index = 0;
-			Stats stats;
+		for (unsigned int i = 0; i < locations.size(); ++i) {
 
-			thread_sync(data, queue_index, stats, stats.sorting_time, stats.dropped_count);
+			BlockKey key;
+			key.position = locations[i].position;
+			key.volume_id = volume_id;
+			key.lod = locations[i].lod;
 
-			// Continue to run as long as there are queries to process
-			while (!data.input.blocks.empty()) {
+			if (_duplicate_rejection) {
+				// Queued requests become stale, and will be skipped when they reach the top
+				const LiveRequest *live_request = _live_requests.getptr(key);
+				if (live_request != nullptr && live_request->can_be_discarded) {
+					_live_requests.erase(key);
+					--_queued_count;
+					++_stale_count;
+				}
+			}
 
-				if (!data.input.blocks.empty()) {
+			CancellationToken **token = _claimed_blocks.getptr(key);
+			if (token != nullptr) {
+				(*token)->cancel();
+			}
+		}
+	}
 
-					if (data.thread_exit) {
-						// Flush inputs we processed already
-						shift_up(data.input.blocks, queue_index);
-						queue_index = 0;
+	template <typename F>
+	void remove_queued_blocks_if(F predicate) {
+		// The input mutex must have been locked first!
 
-						// Remove all remaining queries except those that can't be discarded.
-						// Since the thread is exiting, we don't care anymore about sorting.
-						unordered_remove_if(data.input.blocks,
-								[](const InputBlock &b) {
-									return b.can_be_discarded;
-								});
+		unordered_remove_if(_queue,
+				[this, &predicate](const QueuedBlock &qb) {
+					if (!is_live(qb)) {
+						return true;
+					}
+					if (predicate(qb.block)) {
+						if (_duplicate_rejection) {
+							_live_requests.erase(get_block_key(qb.block));
+						}
+						return true;
 					}
+					return false;
+				});
 
-					unsigned int input_begin = queue_index;
-					unsigned int batch_count = data.batch_count;
+		std::make_heap(_queue.begin(), _queue.end(), QueuedBlockComparator());
+		_queued_count = _queue.size();
+		_stale_count = 0;
+	}
 
-					if (input_begin + batch_count > data.input.blocks.size()) {
-						batch_count = data.input.blocks.size() - input_begin;
-					}
+	static void _thread_func(void *p_data) {
+		JobData *data = reinterpret_cast<JobData *>(p_data);
+		CRASH_COND(data == nullptr);
+		CRASH_COND(data->manager == nullptr);
+		data->manager->thread_func(*data);
+	}
 
-					if (batch_count > 0) {
+	void thread_func(JobData &data) {
 
-						uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+		HashMap<uint32_t, Stats> volume_stats;
 
-						unsigned int output_begin = data.output.blocks.size();
-						data.output.blocks.resize(data.output.blocks.size() + batch_count);
+		while (true) {
 
-						for (unsigned int i = 0; i < batch_count; ++i) {
-							CRASH_COND(input_begin + i < 0 || input_begin + i >= data.input.blocks.size());
-							InputBlock &ib = data.input.blocks[input_begin + i];
-							OutputBlock &ob = data.output.blocks.write[output_begin + i];
-							ob.position = ib.position;
-							ob.lod = ib.lod;
-						}
+			// Jobs only hold the requests they are about to process, so when one of them is done,
+			// it takes the next most important requests instead of waiting on a queue of its own
+			const bool exiting = claim_blocks(data, volume_stats);
+			const unsigned int claimed_count = data.input_blocks.size();
+
+			if (claimed_count > 0) {
+
+				const unsigned int batch_count = claimed_count;
+
+				unsigned int output_begin = data.output.blocks.size();
+				data.output.blocks.resize(data.output.blocks.size() + batch_count);
+
+				for (unsigned int i = 0; i < batch_count; ++i) {
+					InputBlock &ib = data.input_blocks[i];
+					OutputBlock &ob = data.output.blocks.write[output_begin + i];
+					ob.position = ib.position;
+					ob.lod = ib.lod;
+					ob.volume_id = ib.volume_id;
+				}
+
+				// Requests of a same volume are given to the processor together, so stats can be told apart.
+				// They are sorted by priority, so those of a same volume often follow each other.
+				unsigned int run_begin = 0;
+				while (run_begin < batch_count) {
+
+					const uint32_t volume_id = data.input_blocks[run_begin].volume_id;
+					unsigned int run_end = run_begin + 1;
+					while (run_end < batch_count && data.input_blocks[run_end].volume_id == volume_id) {
+						++run_end;
+					}
+
+					Stats &stats = volume_stats[volume_id];
+					uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+
+					_processor(
+							data.job_index,
+							ArraySlice<InputBlock>(data.input_blocks, run_begin, run_end),
+							ArraySlice<OutputBlock>(&data.output.blocks.write[0], output_begin + run_begin, output_begin + run_end),
+							stats.processor);
 
-						data.processor(
-								ArraySlice<InputBlock>(data.input.blocks, input_begin, input_begin + batch_count),
-								ArraySlice<OutputBlock>(&data.output.blocks.write[0], output_begin, output_begin + batch_count),
-								stats.processor);
+					uint64_t time_taken = (OS::get_singleton()->get_ticks_usec() - time_before) / (run_end - run_begin);
 
-						uint64_t time_taken = (OS::get_singleton()->get_ticks_usec() - time_before) / batch_count;
+					for (unsigned int i = run_begin; i < run_end; ++i) {
+						stats.latency.processing[data.input_blocks[i].lod].add(time_taken);
+					}
 
-						// Do some stats
-						if (stats.first) {
-							stats.first = false;
+					// Do some stats
+					if (stats.first) {
+						stats.first = false;
+						stats.min_time = time_taken;
+						stats.max_time = time_taken;
+					} else {
+						if (time_taken < stats.min_time) {
 							stats.min_time = time_taken;
+						}
+						if (time_taken > stats.max_time) {
 							stats.max_time = time_taken;
-						} else {
-							if (time_taken < stats.min_time) {
-								stats.min_time = time_taken;
-							}
-							if (time_taken > stats.max_time) {
-								stats.max_time = time_taken;
-							}
 						}
 					}
 
-					queue_index += batch_count;
-					if (queue_index >= data.input.blocks.size()) {
-						data.input.blocks.clear();
-					}
+					run_begin = run_end;
 				}
 
-				uint32_t time = OS::get_singleton()->get_ticks_msec();
-				if (time >= sync_time || data.input.blocks.empty()) {
-
-					uint64_t sort_time;
-					unsigned int dropped_count;
-					thread_sync(data, queue_index, stats, sort_time, dropped_count);
-
-					sync_time = OS::get_singleton()->get_ticks_msec() + data.sync_interval_ms;
-					queue_index = 0;
-					stats = Stats();
-					stats.sorting_time = sort_time;
-					stats.dropped_count = dropped_count;
+				// Results of cancelled requests are incomplete, and not needed anyways
+				unsigned int output_end = output_begin;
+				for (unsigned int i = 0; i < batch_count; ++i) {
+					const InputBlock &ib = data.input_blocks[i];
+					if (ib.cancellation_token.is_cancelled()) {
+						++volume_stats[ib.volume_id].cancelled_count;
+					} else {
+						if (output_end != output_begin + i) {
+							data.output.blocks.write[output_end] = data.output.blocks[output_begin + i];
+						}
+						++output_end;
+					}
 				}
+				data.output.blocks.resize(output_end);
 			}
 
-			if (data.thread_exit) {
-				break;
+			if (!data.output.blocks.empty()) {
+				const uint64_t now = OS::get_singleton()->get_ticks_usec();
+				for (int i = 0; i < data.output.blocks.size(); ++i) {
+					data.output.blocks.write[i].ready_time = now;
+				}
+
+				// Copy output to shared
+				MutexLock lock(data.output_mutex);
+				data.shared_output.blocks.append_array(data.output.blocks);
+				merge_volume_stats(data.shared_output.volume_stats, volume_stats);
+				data.output.blocks.clear();
+				volume_stats.clear();
 			}
 
-			// Wait for future wake-up
-			data.semaphore->wait();
+			if (claimed_count == 0) {
+				if (exiting) {
+					break;
+				}
+				// Wait for future wake-up
+				data.semaphore->wait();
+			}
 		}
-	}
 
-	static inline float get_priority_heuristic(const InputBlock &a, const Vector3i &viewer_block_pos, const Vector3 &viewer_direction, int max_lod) {
-		int f = 1 << a.lod;
-		Vector3i p = a.position * f;
-		float d = Math::sqrt(p.distance_sq(viewer_block_pos) + 0.1f);
-		float dp = viewer_direction.dot(viewer_block_pos.to_vec3() / d);
-		// Higher lod indexes come first to allow the octree to subdivide.
-		// Then comes distance, which is modified by how much in view the block is
-		return (max_lod - a.lod) * 10000.f + d + (1.f - dp) * 4.f * f;
+		MutexLock lock(data.output_mutex);
+		data.finished = true;
 	}
 
-	struct BlockUpdateComparator {
-		inline bool operator()(const InputBlock &a, const InputBlock &b) const {
-			return a.sort_heuristic < b.sort_heuristic;
-		}
-	};
+	// Moves the most important requests from the shared queue into the job's input.
+	// Returns true if jobs must exit once the queue is empty.
+	bool claim_blocks(JobData &data, HashMap<uint32_t, Stats> &volume_stats) {
 
-	static void thread_sync(JobData &data, unsigned int queue_index, Stats stats, uint64_t &out_sort_time, unsigned int &out_dropped_count) {
+		MutexLock lock(_input_mutex);
 
-		if (!data.input.blocks.empty()) {
-			// Cleanup input vector
+		uint64_t time_before = OS::get_singleton()->get_ticks_usec();
 
-			if (queue_index >= data.input.blocks.size()) {
-				data.input.blocks.clear();
+		release_claimed_blocks(data);
 
-			} else if (queue_index > 0) {
+		if (data.exit_requested) {
+			// The job count was reduced, remaining requests are left to other jobs
+			return true;
+		}
 
-				// Shift up remaining items since we use a Vector
-				shift_up(data.input.blocks, queue_index);
-			}
+		if (_thread_exit) {
+			// Remove all remaining queries except those that can't be discarded.
+			// Since threads are exiting, we don't care anymore about priorities.
+			remove_queued_blocks_if([](const InputBlock &b) {
+				return b.can_be_discarded;
+			});
+
+		} else if (_needs_rebuild) {
+			rebuild_queue(data.output, volume_stats);
 		}
 
-		stats.remaining_blocks[data.job_index] = data.input.blocks.size();
-		bool needs_sort;
+		// Take a fair share when there are few requests left, so other jobs can process the rest in parallel
+		unsigned int count = (_queued_count + _job_count - 1) / _job_count;
+		count = MIN(count, _batch_count);
 
-		// Get input
-		{
-			MutexLock lock(data.input_mutex);
+		while (data.input_blocks.size() < count && !_queue.empty()) {
 
-			// Copy requests from shared to internal
-			append_array(data.input.blocks, data.shared_input.blocks);
+			QueuedBlock &top = _queue.front();
+
+			if (!is_live(top)) {
+				pop_queue();
+				--_stale_count;
+				continue;
+			}
 
-			data.input.priority_position = data.shared_input.priority_position;
+			if (top.travel != _travel) {
+				// Viewers moved since the key was computed. It can only go up, so see if something else comes first.
+				// The heap must stay valid while it is popped, so the key is refreshed on a copy.
+				QueuedBlock qb = top;
+				pop_queue();
+				refresh_sort_key(qb);
+				_queue.push_back(qb);
+				std::push_heap(_queue.begin(), _queue.end(), QueuedBlockComparator());
+				continue;
+			}
 
-			if (data.shared_input.use_exclusive_region) {
-				data.input.use_exclusive_region = true;
-				data.input.exclusive_region_extent = data.shared_input.exclusive_region_extent;
-				data.input.exclusive_region_max_lod = data.shared_input.exclusive_region_max_lod;
+			if (!_thread_exit && is_outside_exclusive_region(top.block)) {
+				add_drop_hint(data.output, top.block);
+				++volume_stats[top.block.volume_id].dropped_count;
+				unqueue_top();
+				continue;
 			}
 
-			data.shared_input.blocks.clear();
+			volume_stats[top.block.volume_id].latency.queue_wait[top.block.lod].add(time_before - top.push_time);
+			data.input_blocks.push_back(top.block);
+			unqueue_top();
+		}
 
-			if (data.duplicate_rejection) {
-				// We emptied shared input, empty shared_input_block_indexes then
-				for (unsigned int lod_index = 0; lod_index < data.shared_input_block_indexes.size(); ++lod_index) {
-					data.shared_input_block_indexes[lod_index].clear();
-				}
+		// Registered once the vector is filled, so the addresses of tokens won't change
+		for (unsigned int i = 0; i < data.input_blocks.size(); ++i) {
+			InputBlock &ib = data.input_blocks[i];
+			if (ib.can_be_discarded) {
+				// A request for the same block may still be processed by another job.
+				// Only the most recent one is tracked, the old one is most likely outdated.
+				_claimed_blocks[get_block_key(ib)] = &ib.cancellation_token;
 			}
+		}
 
-			needs_sort = data.needs_sort;
-			data.needs_sort = false;
+		if (_queued_count == 0) {
+			// Remaining entries are all stale, there is nothing to keep up to date
+			_queue.clear();
+			_stale_count = 0;
+			_travel = 0;
+		}
+
+		data.idle = data.input_blocks.empty();
+
+		// Time spent on the shared queue is split between the volumes of claimed requests.
+		// If nothing was claimed, it is not attributed to any volume.
+		if (!data.input_blocks.empty()) {
+			const uint64_t sorting_time = (OS::get_singleton()->get_ticks_usec() - time_before) / data.input_blocks.size();
+			for (unsigned int i = 0; i < data.input_blocks.size(); ++i) {
+				volume_stats[data.input_blocks[i].volume_id].sorting_time += sorting_time;
+			}
 		}
 
-		if (!data.output.blocks.empty()) {
+		return _thread_exit;
+	}
 
-			//		print_line(String("VoxelMeshUpdater: posting {0} blocks, {1} remaining ; cost [{2}..{3}] usec")
-			//				   .format(varray(_output.blocks.size(), _input.blocks.size(), stats.min_time, stats.max_time)));
+	// Forgets requests the job was done processing
+	void release_claimed_blocks(JobData &data) {
+		// The input mutex must have been locked first!
 
-			// Copy output to shared
-			MutexLock lock(data.output_mutex);
-			data.shared_output.blocks.append_array(data.output.blocks);
-			data.shared_output.stats = stats;
-			data.output.blocks.clear();
+		for (unsigned int i = 0; i < data.input_blocks.size(); ++i) {
+			const InputBlock &ib = data.input_blocks[i];
+			if (!ib.can_be_discarded) {
+				continue;
+			}
+			const BlockKey key = get_block_key(ib);
+			CancellationToken **token = _claimed_blocks.getptr(key);
+			// Another job may have claimed a newer request for the same block since then
+			if (token != nullptr && *token == &ib.cancellation_token) {
+				_claimed_blocks.erase(key);
+			}
 		}
 
+		data.input_blocks.clear();
+	}
+
+	// Recomputes all sort keys, and removes replaced requests and those outside exclusive regions.
+	// This costs as much as the size of the queue, so it only happens when the queue doubled in size,
+	// or when priority settings changed in ways the lazy refresh can't follow.
+	void rebuild_queue(Output &output, HashMap<uint32_t, Stats> &volume_stats) {
+		// The input mutex must have been locked first!
+
 		// Cancel blocks outside exclusive region.
 		// We do this early because if the player keeps moving forward,
 		// we would keep accumulating requests forever, and that means slower sorting and memory waste
 		int dropped_count = 0;
-		if (data.input.use_exclusive_region) {
-			for (unsigned int i = 0; i < data.input.blocks.size(); ++i) {
-				const InputBlock &ib = data.input.blocks[i];
+		remove_queued_blocks_if([this, &output, &volume_stats, &dropped_count](const InputBlock &ib) {
+			if (is_outside_exclusive_region(ib)) {
+				// Indicate the caller that we dropped that block.
+				// This can help troubleshoot bugs in some situations.
+				add_drop_hint(output, ib);
+				++volume_stats[ib.volume_id].dropped_count;
+				++dropped_count;
+				return true;
+			}
+			return false;
+		});
 
-				if (!ib.can_be_discarded || ib.lod >= data.input.exclusive_region_max_lod) {
-					continue;
-				}
+		const uint32_t *volume_id = nullptr;
+		while ((volume_id = _volumes.next(volume_id))) {
+			VolumePriority &volume = _volumes[*volume_id];
+			volume.viewers_at_rebuild = volume.viewers;
+		}
 
-				Rect3i box = Rect3i::from_center_extents(data.input.priority_position >> ib.lod, Vector3i(data.input.exclusive_region_extent));
+		_travel = 0;
+		for (unsigned int i = 0; i < _queue.size(); ++i) {
+			refresh_sort_key(_queue[i]);
+		}
+		std::make_heap(_queue.begin(), _queue.end(), QueuedBlockComparator());
 
-				if (!box.contains(ib.position)) {
+		_rebuild_size = MAX(MIN_REBUILD_SIZE, 2 * _queue.size());
+		_needs_rebuild = false;
 
-					// Indicate the caller that we dropped that block.
-					// This can help troubleshoot bugs in some situations.
-					OutputBlock ob;
-					ob.position = ib.position;
-					ob.lod = ib.lod;
-					ob.drop_hint = true;
-					data.output.blocks.push_back(ob);
+		if (dropped_count > 0) {
+			print_line(String("Dropped {0} blocks from thread").format(varray(dropped_count)));
+		}
+	}
 
-					// We'll put that block in replacement of the dropped one and pop the last cell,
-					// so we don't need to shift every following blocks
-					const InputBlock &shifted_block = data.input.blocks.back();
+	void refresh_sort_key(QueuedBlock &qb) const {
+		const VolumePriority *volume = _volumes.getptr(qb.block.volume_id);
+		// Volumes are removed with their discardable requests, the remaining ones can use defaults
+		const VolumePriority default_volume;
+		qb.sort_key = get_priority_heuristic(qb.block, volume != nullptr ? *volume : default_volume) + _travel;
+		qb.travel = _travel;
+	}
 
-					// Do this last because it invalidates `ib`
-					data.input.blocks[i] = shifted_block;
-					data.input.blocks.pop_back();
+	bool is_outside_exclusive_region(const InputBlock &ib) const {
 
-					// Move back to redo this index, since we replaced the current block
-					--i;
+		if (!ib.can_be_discarded) {
+			return false;
+		}
 
-					++dropped_count;
-				}
-			}
+		const VolumePriority *volume = _volumes.getptr(ib.volume_id);
+		if (volume == nullptr || !volume->use_exclusive_region || ib.lod >= volume->exclusive_region_max_lod) {
+			return false;
+		}
+		if (volume->viewers.empty()) {
+			return false;
 		}
 
-		if (dropped_count > 0) {
-			print_line(String("Dropped {0} blocks from thread").format(varray(dropped_count)));
-			out_dropped_count = dropped_count;
+		// The region is the union of those around each viewer
+		for (unsigned int i = 0; i < volume->viewers.size(); ++i) {
+			Rect3i box = Rect3i::from_center_extents(volume->viewers[i].position >> ib.lod, Vector3i(volume->exclusive_region_extent));
+			if (box.contains(ib.position)) {
+				return false;
+			}
 		}
+		return true;
+	}
 
-		uint64_t time_before = OS::get_singleton()->get_ticks_usec();
+	static void add_drop_hint(Output &output, const InputBlock &ib) {
+		OutputBlock ob;
+		ob.position = ib.position;
+		ob.lod = ib.lod;
+		ob.volume_id = ib.volume_id;
+		ob.drop_hint = true;
+		output.blocks.push_back(ob);
+	}
+
+	static bool have_frustums_moved(const std::vector<Viewer> &prev_viewers, const std::vector<Viewer> &viewers) {
+		// How much the camera can turn, or move along plane normals in blocks, before tiers are recomputed
+		const float min_cos = 0.996f; // About 5 degrees
+		const float max_distance = 0.5f;
+
+		if (prev_viewers.size() != viewers.size()) {
+			return true;
+		}
+		for (unsigned int i = 0; i < viewers.size(); ++i) {
+			const std::vector<Plane> &prev_planes = prev_viewers[i].frustum_planes;
+			const std::vector<Plane> &planes = viewers[i].frustum_planes;
+			if (prev_planes.size() != planes.size()) {
+				return true;
+			}
+			for (unsigned int j = 0; j < planes.size(); ++j) {
+				if (planes[j].normal.dot(prev_planes[j].normal) < min_cos ||
+						Math::abs(planes[j].d - prev_planes[j].d) > max_distance) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
 
-		if (!data.input.blocks.empty() && needs_sort) {
+	enum ViewTier {
+		VIEW_TIER_IN_VIEW = 0,
+		VIEW_TIER_AROUND,
+		VIEW_TIER_BEHIND
+	};
 
-			for (auto it = data.input.blocks.begin(); it != data.input.blocks.end(); ++it) {
-				InputBlock &ib = *it;
-				// Set or override previous heuristic based on new infos
-				ib.sort_heuristic = get_priority_heuristic(ib,
-						data.input.priority_position,
-						data.input.priority_direction,
-						data.input.max_lod_index);
+	// Where a block is relative to the camera of a viewer
+	static ViewTier get_view_tier(const InputBlock &a, const Viewer &viewer) {
+		if (viewer.frustum_planes.empty()) {
+			return VIEW_TIER_IN_VIEW;
+		}
+		const int f = 1 << a.lod;
+		const Vector3 box_min = (a.position * f).to_vec3();
+		ViewTier tier = VIEW_TIER_IN_VIEW;
+		for (unsigned int i = 0; i < viewer.frustum_planes.size(); ++i) {
+			const Plane &plane = viewer.frustum_planes[i];
+			// Corner of the block the most inside the plane
+			Vector3 corner = box_min;
+			if (plane.normal.x < 0.f) {
+				corner.x += f;
+			}
+			if (plane.normal.y < 0.f) {
+				corner.y += f;
+			}
+			if (plane.normal.z < 0.f) {
+				corner.z += f;
+			}
+			if (plane.is_point_over(corner)) {
+				if (i == 0) {
+					// Fully behind the near plane
+					return VIEW_TIER_BEHIND;
+				}
+				tier = VIEW_TIER_AROUND;
 			}
+		}
+		return tier;
+	}
 
-			// Re-sort priority
-			SortArray<InputBlock, BlockUpdateComparator> sorter;
-			sorter.sort(data.input.blocks.data(), data.input.blocks.size());
+	static inline double get_priority_heuristic(const InputBlock &a, const VolumePriority &volume) {
+		// Higher lod indexes come first to allow the octree to subdivide.
+		double h = (volume.max_lod_index - a.lod) * 10000.0;
+		if (!volume.viewers.empty()) {
+			// Then comes the viewer who needs the block the most.
+			// Distances are from where viewers are now, but tiers use frustums from the last rebuild,
+			// so new requests are not ordered differently from queued ones when the camera drifts a little.
+			CRASH_COND(volume.viewers_at_rebuild.size() != volume.viewers.size());
+			double nearest = get_viewer_heuristic(a, volume.viewers[0].position, volume.viewers_at_rebuild[0]);
+			for (unsigned int i = 1; i < volume.viewers.size(); ++i) {
+				nearest = MIN(nearest, get_viewer_heuristic(a, volume.viewers[i].position, volume.viewers_at_rebuild[i]));
+			}
+			h += nearest;
 		}
+		return h;
+	}
 
-		out_sort_time = OS::get_singleton()->get_ticks_usec() - time_before;
+	static inline double get_viewer_heuristic(const InputBlock &a, Vector3i viewer_position, const Viewer &tier_viewer) {
+		int f = 1 << a.lod;
+		Vector3i p = a.position * f;
+		double d = Math::sqrt(p.distance_sq(viewer_position) + 0.1);
+		// Being in view matters more than anything else, including LOD
+		return get_view_tier(a, tier_viewer) * VIEW_TIER_WEIGHT + d;
 	}
 
-	JobData _jobs[MAX_JOBS];
+	// Requests waiting to be claimed by jobs, shared by all of them
+	std::vector<QueuedBlock> _queue;
+	// Latest request of each block present in the queue, so if we push a duplicate request
+	// with the same coordinates, we can replace or cancel it without a linear search
+	HashMap<BlockKey, LiveRequest, BlockKeyHasher> _live_requests;
+	// Discardable requests being processed by jobs, so they can be cancelled.
+	// Tokens belong to the claimed copies of the requests, in `JobData::input_blocks`.
+	HashMap<BlockKey, CancellationToken *, BlockKeyHasher> _claimed_blocks;
+	uint32_t _next_sequence = 0;
+	// Requests in the queue which were not replaced
+	unsigned int _queued_count = 0;
+	unsigned int _stale_count = 0;
+	// Sum of distances travelled by viewers since the last rebuild, in LOD0 blocks
+	double _travel = 0;
+	unsigned int _rebuild_size = MIN_REBUILD_SIZE;
+	bool _needs_rebuild = false;
+
+	HashMap<uint32_t, VolumePriority> _volumes;
+	Mutex *_input_mutex = nullptr;
+
+	bool _thread_exit = false;
+
+	bool _duplicate_rejection = false;
+	unsigned int _batch_count = 1;
+
+	BlockProcessingFunc _processor;
+	// Jobs are allocated individually, because their threads keep a reference to them
+	std::vector<JobData *> _jobs;
+	// Jobs being stopped after the job count was reduced
+	std::vector<JobData *> _retiring_jobs;
+	// Same as the size of `_jobs`, for use by jobs under the input mutex
 	unsigned int _job_count = 0;
 };
 
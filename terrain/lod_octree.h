@@ -106,11 +106,12 @@ public:
 		bool can_join(Vector3i node_pos, int lod) { return true; }
 	};
 
+	// Nodes split when one of the viewers gets close enough, and join when all are far enough.
 	template <typename UpdateActions_T>
-	void update(Vector3 view_pos, UpdateActions_T &actions) {
+	void update(const std::vector<Vector3> &view_positions, UpdateActions_T &actions) {
 
 		if (_is_root_created || _root.has_children()) {
-			update(ROOT_INDEX, Vector3i(), _max_depth, view_pos, actions);
+			update(ROOT_INDEX, Vector3i(), _max_depth, view_positions, actions);
 
 		} else {
 			// TODO I don't like this much
@@ -180,20 +181,29 @@ private:
 		}
 	}
 
+	static inline float get_distance_to_nearest(Vector3 pos, const std::vector<Vector3> &view_positions) {
+		float distance_sq = Math_INF;
+		for (unsigned int i = 0; i < view_positions.size(); ++i) {
+			distance_sq = MIN(distance_sq, pos.distance_squared_to(view_positions[i]));
+		}
+		return Math::sqrt(distance_sq);
+	}
+
 	template <typename UpdateActions_T>
-	void update(unsigned int node_index, Vector3i node_pos, int lod, Vector3 view_pos, UpdateActions_T &actions) {
+	void update(unsigned int node_index, Vector3i node_pos, int lod, const std::vector<Vector3> &view_positions, UpdateActions_T &actions) {
 		// This function should be called regularly over frames.
 
 		int lod_factor = get_lod_factor(lod);
 		int chunk_size = _base_size * lod_factor;
 		Vector3 world_center = static_cast<real_t>(chunk_size) * (node_pos.to_vec3() + Vector3(0.5, 0.5, 0.5));
 		float split_distance = chunk_size * _split_scale;
+		float view_distance = get_distance_to_nearest(world_center, view_positions);
 		Node *node = get_node(node_index);
 
 		if (!node->has_children()) {
 
 			// If it's not the last LOD, if close enough and custom conditions get fulfilled
-			if (lod > 0 && world_center.distance_to(view_pos) < split_distance && actions.can_split(node_pos, lod - 1)) {
+			if (lod > 0 && view_distance < split_distance && actions.can_split(node_pos, lod - 1)) {
 				// Split
 
 				unsigned int first_child = _pool.allocate_children();
@@ -218,14 +228,14 @@ private:
 
 			for (unsigned int i = 0; i < 8; ++i) {
 				unsigned int child_index = first_child + i;
-				update(child_index, get_child_position(node_pos, i), lod - 1, view_pos, actions);
+				update(child_index, get_child_position(node_pos, i), lod - 1, view_positions, actions);
 				has_split_child |= _pool.get_node(child_index)->has_children();
 			}
 
 			// Get node again because `update` may invalidate the pointer
 			node = get_node(node_index);
 
-			if (!has_split_child && world_center.distance_to(view_pos) > split_distance && actions.can_join(node_pos, lod)) {
+			if (!has_split_child && view_distance > split_distance && actions.can_join(node_pos, lod)) {
 				// Join
 				if (node->has_children()) {
 
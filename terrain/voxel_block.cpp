@@ -1,6 +1,7 @@
 #include "voxel_block.h"
 #include "../util/zprofiling.h"
 #include "../voxel_string_names.h"
+#include <core/os/os.h>
 #include <scene/3d/spatial.h>
 #include <scene/resources/concave_polygon_shape.h>
 
@@ -47,6 +48,7 @@ VoxelBlock *VoxelBlock::create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned
 	block->lod_index = p_lod_index;
 	block->_position_in_voxels = bpos * (size << p_lod_index);
 	block->voxels = buffer;
+	block->_last_viewed_time = OS::get_singleton()->get_ticks_msec();
 
 #ifdef VOXEL_DEBUG_LOD_MATERIALS
 	Ref<SpatialMaterial> debug_material;
@@ -200,6 +202,7 @@ void VoxelBlock::set_visible(bool visible) {
 		return;
 	}
 	_visible = visible;
+	_last_viewed_time = OS::get_singleton()->get_ticks_msec();
 	_set_visible(_visible && _parent_visible);
 }
 
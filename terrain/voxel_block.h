@@ -26,6 +26,11 @@ public:
 	Vector3i position;
 	unsigned int lod_index = 0;
 	bool pending_transition_update = false;
+	// Memory used by voxels when the block was last accounted for by its map
+	uint32_t memory_usage = 0;
+	// Set when voxels share their data with identical blocks of the map, found with this hash
+	bool deduplicated = false;
+	uint64_t content_hash = 0;
 
 	static VoxelBlock *create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int size, unsigned int p_lod_index);
 
@@ -47,6 +52,9 @@ public:
 	void set_visible(bool visible);
 	bool is_visible() const;
 
+	// Time in milliseconds when the block was last visible, or `now` if it is visible
+	inline uint64_t get_last_viewed_time(uint64_t now) const { return _visible ? now : _last_viewed_time; }
+
 	void set_parent_visible(bool parent_visible);
 
 	void set_transition_mask(uint8_t m);
@@ -90,6 +98,7 @@ private:
 #endif
 
 	int _mesh_update_count = 0;
+	uint64_t _last_viewed_time = 0;
 	bool _visible = true;
 	bool _parent_visible = true;
 	MeshState _mesh_state = MESH_NEVER_UPDATED;
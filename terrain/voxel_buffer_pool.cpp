@@ -0,0 +1,84 @@
+#include "voxel_buffer_pool.h"
+
+VoxelBufferPool::VoxelBufferPool() {
+	_mutex = Mutex::create();
+}
+
+VoxelBufferPool::~VoxelBufferPool() {
+	if (_used_buffers != 0) {
+		// Not an error, they will be freed when released
+		WARN_PRINT(String("{0} pooled voxel buffers are still in use").format(varray(_used_buffers)));
+	}
+	clear();
+	memdelete(_mutex);
+}
+
+Ref<VoxelBuffer> VoxelBufferPool::acquire(Vector3i size, unsigned int channels_mask) {
+	{
+		MutexLock lock(_mutex);
+		++_used_buffers;
+		Pool &pool = get_or_create_pool(size, channels_mask);
+		if (!pool.buffers.empty()) {
+			Ref<VoxelBuffer> buffer = pool.buffers.back();
+			pool.buffers.pop_back();
+			++_reuses;
+			return buffer;
+		}
+		++_allocations;
+	}
+	// Allocate outside of the lock
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(size);
+	return buffer;
+}
+
+void VoxelBufferPool::recycle(Ref<VoxelBuffer> buffer, unsigned int channels_mask) {
+	ERR_FAIL_COND(buffer.is_null());
+	MutexLock lock(_mutex);
+	CRASH_COND(_used_buffers == 0);
+	--_used_buffers;
+	Pool &pool = get_or_create_pool(buffer->get_size(), channels_mask);
+	// Bounded by how many threads used buffers at once
+	pool.buffers.push_back(buffer);
+}
+
+void VoxelBufferPool::clear() {
+	MutexLock lock(_mutex);
+	_pools.clear();
+}
+
+VoxelBufferPool::Pool &VoxelBufferPool::get_or_create_pool(Vector3i size, unsigned int channels_mask) {
+	for (size_t i = 0; i < _pools.size(); ++i) {
+		Pool &pool = _pools[i];
+		if (pool.size == size && pool.channels_mask == channels_mask) {
+			return pool;
+		}
+	}
+	Pool pool;
+	pool.size = size;
+	pool.channels_mask = channels_mask;
+	_pools.push_back(pool);
+	return _pools.back();
+}
+
+VoxelBufferPool::Stats VoxelBufferPool::get_stats() const {
+	MutexLock lock(_mutex);
+	Stats stats;
+	stats.allocations = _allocations;
+	stats.reuses = _reuses;
+	stats.used_buffers = _used_buffers;
+	for (size_t i = 0; i < _pools.size(); ++i) {
+		stats.idle_buffers += _pools[i].buffers.size();
+	}
+	return stats;
+}
+
+Dictionary VoxelBufferPool::to_dictionary(const Stats &stats) {
+	Dictionary d;
+	d["allocations"] = stats.allocations;
+	d["reuses"] = stats.reuses;
+	d["used_buffers"] = stats.used_buffers;
+	d["idle_buffers"] = stats.idle_buffers;
+	return d;
+}
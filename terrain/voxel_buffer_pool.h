@@ -0,0 +1,56 @@
+#ifndef VOXEL_BUFFER_POOL_H
+#define VOXEL_BUFFER_POOL_H
+
+#include "../voxel_buffer.h"
+#include <core/dictionary.h>
+#include <core/os/mutex.h>
+
+#include <vector>
+
+// Recycles buffers used temporarily by threads, like voxels padded with neighbors given to meshers.
+// Buffers keep their channels allocated, so once there is one per thread, meshing allocates nothing.
+// Buffers are kept per size and channel mask: channels outside the mask are never written,
+// so they stay at their default values. Thread-safe.
+class VoxelBufferPool {
+public:
+	struct Stats {
+		// Buffers created because none was available
+		uint64_t allocations = 0;
+		// Buffers given again after being recycled
+		uint64_t reuses = 0;
+		uint32_t used_buffers = 0;
+		uint32_t idle_buffers = 0;
+	};
+
+	VoxelBufferPool();
+	~VoxelBufferPool();
+
+	// Channels of the mask may contain voxels of a previous use, so they must be entirely overwritten.
+	Ref<VoxelBuffer> acquire(Vector3i size, unsigned int channels_mask);
+	// The buffer must not be referenced anywhere else
+	void recycle(Ref<VoxelBuffer> buffer, unsigned int channels_mask);
+
+	// Frees idle buffers
+	void clear();
+
+	Stats get_stats() const;
+	static Dictionary to_dictionary(const Stats &stats);
+
+private:
+	struct Pool {
+		Vector3i size;
+		unsigned int channels_mask = 0;
+		std::vector<Ref<VoxelBuffer> > buffers;
+	};
+
+	Pool &get_or_create_pool(Vector3i size, unsigned int channels_mask);
+
+	// There are few of them, one per terrain configuration at most
+	std::vector<Pool> _pools;
+	uint64_t _allocations = 0;
+	uint64_t _reuses = 0;
+	uint32_t _used_buffers = 0;
+	Mutex *_mutex = nullptr;
+};
+
+#endif // VOXEL_BUFFER_POOL_H
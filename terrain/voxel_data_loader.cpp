@@ -1,60 +1,130 @@
 #include "voxel_data_loader.h"
 #include "../streams/voxel_stream.h"
 #include "../util/utility.h"
+#include "voxel_server.h"
 
-VoxelDataLoader::VoxelDataLoader(unsigned int thread_count, Ref<VoxelStream> stream, unsigned int block_size_pow2) {
+#include <core/hash_map.h>
 
-	print_line("Constructing VoxelDataLoader");
-	CRASH_COND(stream.is_null());
+struct VoxelDataLoader::Context {
+	// Stream of the terrain, which jobs use directly or make copies of
+	Ref<VoxelStream> stream;
+	// Stream used by each job of the server, set when the job first needs it
+	FixedArray<Ref<VoxelStream>, Mgr::MAX_JOBS> job_streams;
+	// Locked to make copies of the stream. If the stream is neither thread-safe nor cloneable,
+	// also locked around stream access, so jobs use it one at a time.
+	Mutex *mutex = nullptr;
+	bool serialize_access = false;
+	int block_size_pow2 = 0;
 
-	// TODO I'm not sure it's worth to configure more than one thread for voxel streams
+	~Context() {
+		memdelete(mutex);
+	}
 
-	FixedArray<Mgr::BlockProcessingFunc, Mgr::MAX_JOBS> processors;
+	// A job index is only used by one thread at a time, so its stream can be accessed without locking
+	Ref<VoxelStream> get_job_stream(unsigned int job_index) {
+		Ref<VoxelStream> &job_stream = job_streams[job_index];
+		if (job_stream.is_null()) {
+			if (stream->is_thread_safe() || serialize_access) {
+				job_stream = stream;
+			} else {
+				// Note: more than one thread can make sense for generators,
+				// but won't be as useful for file and network streams
+				MutexLock lock(mutex);
+				job_stream = stream->duplicate();
+			}
+		}
+		return job_stream;
+	}
+};
 
-	processors[0] = [this, stream](ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &stats) {
-		this->process_blocks_thread_func(inputs, outputs, stream, stats);
-	};
+VoxelDataLoader::VoxelDataLoader(Ref<VoxelStream> stream, unsigned int block_size_pow2) {
 
-	if (thread_count > 1) {
-		if (stream->is_thread_safe()) {
+	print_line("Constructing VoxelDataLoader");
+	CRASH_COND(stream.is_null());
 
-			for (unsigned int i = 1; i < thread_count; ++i) {
-				processors[i] = processors[0];
-			}
+	_context = std::make_shared<Context>();
+	_context->stream = stream;
+	_context->mutex = Mutex::create();
+	_context->serialize_access = !stream->is_thread_safe() && !stream->is_cloneable();
+	_context->block_size_pow2 = block_size_pow2;
 
-		} else if (stream->is_cloneable()) {
+	_volume_id = VoxelServer::get_singleton()->add_data_volume();
+}
 
-			// Note: more than one thread can make sense for generators,
-			// but won't be as useful for file and network streams
-			for (unsigned int i = 1; i < thread_count; ++i) {
-				stream = stream->duplicate();
-				processors[i] = [this, stream](ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &stats) {
-					this->process_blocks_thread_func(inputs, outputs, stream, stats);
-				};
-			}
+VoxelDataLoader::~VoxelDataLoader() {
+	print_line("Destroying VoxelDataLoader");
 
-		} else {
-			ERR_PRINT("Thread count set to higher than 1, but the stream is neither thread-safe nor cloneable. Capping back to 1 thread.");
-			thread_count = 1;
+	VoxelServer::get_singleton()->remove_data_volume(_volume_id);
+
+	// Requests which can't be discarded, like saves, are still in the queue and reference the context.
+	// Wait for them, so the stream is no longer in use once the terrain is done with it.
+	while (_context.use_count() > 1) {
+		OS::get_singleton()->delay_usec(1000);
+	}
+}
+
+void VoxelDataLoader::push(Input &input) {
+	for (size_t i = 0; i < input.blocks.size(); ++i) {
+		InputBlockData &data = input.blocks[i].data;
+		data.context = _context;
+		if (data.voxels_to_save.is_null()) {
+			data.mesh_context = _mesh_context;
 		}
 	}
+	VoxelServer::get_singleton()->push_data_requests(_volume_id, input);
+}
 
-	int batch_count = 128;
-	int sync_interval_ms = 500;
+void VoxelDataLoader::pop(Output &output) {
+	const int begin = output.blocks.size();
+	VoxelServer::get_singleton()->pop_data_results(_volume_id, output);
 
-	_block_size_pow2 = block_size_pow2;
-	_mgr = memnew(Mgr(thread_count, sync_interval_ms, processors, true, batch_count));
+	for (int i = begin; i < output.blocks.size(); ++i) {
+		OutputBlockData &data = output.blocks.write[i].data;
+		if (data.has_mesh && data.mesh_context != _mesh_context) {
+			// Meshers changed, the block will be meshed again the usual way
+			data.has_mesh = false;
+			data.mesh = VoxelMeshUpdater::OutputBlockData();
+		}
+		data.mesh_context.reset();
+	}
 }
 
-VoxelDataLoader::~VoxelDataLoader() {
-	print_line("Destroying VoxelDataLoader");
-	if (_mgr) {
-		memdelete(_mgr);
+void VoxelDataLoader::set_mesh_pipeline(const VoxelMeshUpdater *mesh_updater) {
+	// Requests carry the context they were pushed with, so this doesn't affect those already queued
+	if (mesh_updater == nullptr) {
+		_mesh_context.reset();
+	} else {
+		_mesh_context = mesh_updater->get_context();
 	}
 }
 
 // Can run in multiple threads
-void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Ref<VoxelStream> stream, Mgr::ProcessorStats &stats) {
+void VoxelDataLoader::process_blocks(unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &stats) {
+
+	CRASH_COND(inputs.size() != outputs.size());
+
+	// Requests are sorted by priority, so those of a same terrain often follow each other
+	size_t begin = 0;
+	while (begin < inputs.size()) {
+
+		Context *context = inputs[begin].data.context.get();
+		CRASH_COND(context == nullptr);
+
+		size_t end = begin + 1;
+		while (end < inputs.size() && inputs[end].data.context.get() == context) {
+			++end;
+		}
+
+		process_context_blocks(*context, job_index,
+				ArraySlice<InputBlock>(inputs.data(), begin, end),
+				ArraySlice<OutputBlock>(outputs.data(), begin, end),
+				stats);
+
+		begin = end;
+	}
+}
+
+void VoxelDataLoader::process_context_blocks(Context &context, unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &stats) {
 
 	CRASH_COND(inputs.size() != outputs.size());
 
@@ -65,7 +135,7 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 
 		const InputBlock &ib = inputs[i];
 
-		int bs = 1 << _block_size_pow2;
+		int bs = 1 << context.block_size_pow2;
 		Vector3i block_origin_in_voxels = ib.position * (bs << ib.lod);
 
 		if (ib.data.voxels_to_save.is_null()) {
@@ -75,6 +145,7 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 			r.voxel_buffer->create(bs, bs, bs);
 			r.origin_in_voxels = block_origin_in_voxels;
 			r.lod = ib.lod;
+			r.cancellation_token = &ib.cancellation_token;
 			emerge_requests.push_back(r);
 
 		} else {
@@ -87,6 +158,13 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 		}
 	}
 
+	Ref<VoxelStream> stream = context.get_job_stream(job_index);
+	CRASH_COND(stream.is_null());
+
+	if (context.serialize_access) {
+		context.mutex->lock();
+	}
+
 	stream->emerge_blocks(emerge_requests);
 	stream->immerge_blocks(immerge_requests);
 
@@ -94,6 +172,10 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 	stats.file_openings = stream_stats.file_openings;
 	stats.time_spent_opening_files = stream_stats.time_spent_opening_files;
 
+	if (context.serialize_access) {
+		context.mutex->unlock();
+	}
+
 	// Assumes the stream won't change output order
 	int iload = 0;
 	for (size_t i = 0; i < outputs.size(); ++i) {
@@ -112,13 +194,15 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 		}
 	}
 
+	mesh_loaded_blocks(job_index, inputs, outputs, context.block_size_pow2);
+
 	// If unordered responses were allowed
 	//
 	//	size_t j = 0;
 	//	for (size_t i = 0; i < emerge_requests.size(); ++i) {
 	//		VoxelStream::BlockRequest &r = emerge_requests.write[i];
 	//		OutputBlock &ob = outputs[j];
-	//		ob.position = r.origin_in_voxels >> (_block_size_pow2 + r.lod);
+	//		ob.position = r.origin_in_voxels >> (context.block_size_pow2 + r.lod);
 	//		ob.lod = r.lod;
 	//		ob.data.type = TYPE_LOAD;
 	//		ob.data.voxels_loaded = r.voxel_buffer;
@@ -127,9 +211,94 @@ void VoxelDataLoader::process_blocks_thread_func(const ArraySlice<InputBlock> in
 	//	for (size_t i = 0; i < immerge_requests.size(); ++i) {
 	//		VoxelStream::BlockRequest &r = immerge_requests.write[i];
 	//		OutputBlock &ob = outputs[j];
-	//		ob.position = r.origin_in_voxels >> (_block_size_pow2 + r.lod);
+	//		ob.position = r.origin_in_voxels >> (context.block_size_pow2 + r.lod);
 	//		ob.lod = r.lod;
 	//		ob.data.type = TYPE_SAVE;
 	//		++j;
 	//	}
 }
+
+// Meshes blocks of the batch which are surrounded by other blocks of the batch.
+// It's mostly useful when a terrain starts, when batches are full of blocks close to each other.
+void VoxelDataLoader::mesh_loaded_blocks(unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, int block_size_pow2) {
+
+	// Blocks which can be used to mesh, by position
+	HashMap<Vector3i, unsigned int, Vector3iHasher> loaded_indexes;
+	for (unsigned int i = 0; i < inputs.size(); ++i) {
+		const InputBlock &ib = inputs[i];
+		// Cancelled loads may have been left incomplete
+		if (ib.data.mesh_context != nullptr && outputs[i].data.type == TYPE_LOAD && !ib.cancellation_token.is_cancelled()) {
+			loaded_indexes.set(ib.position, i);
+		}
+	}
+	if (loaded_indexes.size() < 27) {
+		// No block can be surrounded
+		return;
+	}
+
+	const int block_size = 1 << block_size_pow2;
+	const unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_TYPE) | (1 << VoxelBuffer::CHANNEL_SDF);
+	VoxelBufferPool &buffer_pool = VoxelServer::get_singleton()->get_meshing_buffer_pool();
+
+	for (unsigned int i = 0; i < inputs.size(); ++i) {
+
+		const InputBlock &ib = inputs[i];
+		if (!loaded_indexes.has(ib.position)) {
+			continue;
+		}
+
+		FixedArray<unsigned int, 27> neighbor_indexes;
+		bool surrounded = true;
+		unsigned int neighbor_count = 0;
+		Vector3i ndir;
+		for (ndir.z = -1; ndir.z < 2 && surrounded; ++ndir.z) {
+			for (ndir.x = -1; ndir.x < 2 && surrounded; ++ndir.x) {
+				for (ndir.y = -1; ndir.y < 2 && surrounded; ++ndir.y) {
+					const unsigned int *ni = loaded_indexes.getptr(ib.position + ndir);
+					// Blocks of other LODs or terrain settings don't fit together
+					if (ni == nullptr || inputs[*ni].lod != ib.lod || inputs[*ni].data.mesh_context != ib.data.mesh_context) {
+						surrounded = false;
+					} else {
+						neighbor_indexes[neighbor_count++] = *ni;
+					}
+				}
+			}
+		}
+		if (!surrounded) {
+			continue;
+		}
+
+		VoxelMeshUpdater::Context &mesh_context = *ib.data.mesh_context;
+		int min_padding;
+		int max_padding;
+		VoxelMeshUpdater::get_padding(mesh_context, min_padding, max_padding);
+
+		// Same as what the mesh updater would build. Neighbors cover it entirely, so a recycled buffer can be used.
+		Ref<VoxelBuffer> padded_voxels = buffer_pool.acquire(Vector3i(block_size + min_padding + max_padding), channels_mask);
+
+		const Vector3i min_pos = ib.position * block_size - Vector3i(min_padding);
+		const Vector3i max_pos = min_pos + padded_voxels->get_size();
+
+		for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+			if (((1 << channel) & channels_mask) == 0) {
+				continue;
+			}
+			for (unsigned int j = 0; j < neighbor_indexes.size(); ++j) {
+				const unsigned int ni = neighbor_indexes[j];
+				const Vector3i offset = inputs[ni].position * block_size;
+				// Note: copy_from takes care of clamping the area if it's on an edge
+				padded_voxels->copy_from(**outputs[ni].data.voxels_loaded,
+						min_pos - offset,
+						max_pos - offset,
+						offset - min_pos,
+						channel);
+			}
+		}
+
+		OutputBlockData &output = outputs[i].data;
+		VoxelMeshUpdater::process_block_from_data_job(mesh_context, job_index, **padded_voxels, ib.lod, &ib.cancellation_token, output.mesh);
+		buffer_pool.recycle(padded_voxels, channels_mask);
+		output.has_mesh = true;
+		output.mesh_context = ib.data.mesh_context;
+	}
+}
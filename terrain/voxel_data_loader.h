@@ -2,14 +2,24 @@
 #define VOXEL_DATA_LOADER_H
 
 #include "block_thread_manager.h"
+#include "voxel_mesh_updater.h"
+
+#include <memory>
 
 class VoxelStream;
 class VoxelBuffer;
 
+// Loads and saves blocks of one terrain, using threads of VoxelServer.
 class VoxelDataLoader {
 public:
+	struct Context;
+
 	struct InputBlockData {
 		Ref<VoxelBuffer> voxels_to_save;
+		// Stream of the terrain the request comes from. Also keeps it alive until pending saves are done.
+		std::shared_ptr<Context> context;
+		// Set for loads to be meshed right away, if their neighbors get loaded in the same batch
+		std::shared_ptr<VoxelMeshUpdater::Context> mesh_context;
 	};
 
 	enum RequestType {
@@ -21,6 +31,11 @@ public:
 	struct OutputBlockData {
 		RequestType type;
 		Ref<VoxelBuffer> voxels_loaded;
+		// Set if the block was meshed with neighbors loaded in the same batch
+		bool has_mesh = false;
+		VoxelMeshUpdater::OutputBlockData mesh;
+		// Meshers it was meshed with, to tell apart results of a mesh updater which was replaced since then
+		std::shared_ptr<VoxelMeshUpdater::Context> mesh_context;
 	};
 
 	typedef VoxelBlockThreadManager<InputBlockData, OutputBlockData> Mgr;
@@ -29,18 +44,29 @@ public:
 	typedef Mgr::Input Input;
 	typedef Mgr::Output Output;
 	typedef Mgr::Stats Stats;
+	typedef Mgr::BlockLocation BlockLocation;
 
-	VoxelDataLoader(unsigned int thread_count, Ref<VoxelStream> stream, unsigned int block_size_pow2);
+	VoxelDataLoader(Ref<VoxelStream> stream, unsigned int block_size_pow2);
 	~VoxelDataLoader();
 
-	void push(const Input &input) { _mgr->push(input); }
-	void pop(Output &output) { _mgr->pop(output); }
+	void push(Input &input);
+	void pop(Output &output);
+
+	// Pipeline mode: loaded blocks whose 26 neighbors were loaded along with them are meshed by the same thread,
+	// saving the main thread a padded copy and a round trip through the mesh updater. Null to turn it off.
+	// Only fits terrains which mesh every loaded block.
+	void set_mesh_pipeline(const VoxelMeshUpdater *mesh_updater);
+
+	// Called from VoxelServer threads. Batches can contain requests from several terrains.
+	static void process_blocks(unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &stats);
 
 private:
-	void process_blocks_thread_func(const ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Ref<VoxelStream> stream, Mgr::ProcessorStats &stats);
+	static void process_context_blocks(Context &context, unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &stats);
+	static void mesh_loaded_blocks(unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, int block_size_pow2);
 
-	Mgr *_mgr = nullptr;
-	int _block_size_pow2 = 0;
+	std::shared_ptr<Context> _context;
+	std::shared_ptr<VoxelMeshUpdater::Context> _mesh_context;
+	uint32_t _volume_id = 0;
 };
 
 #endif // VOXEL_DATA_LOADER_H
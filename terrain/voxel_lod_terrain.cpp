@@ -3,13 +3,14 @@
 #include "../math/rect3i.h"
 #include "../streams/voxel_stream_file.h"
 #include "../util/profiling_clock.h"
+#include "../voxel_memory_pool.h"
 #include "../voxel_string_names.h"
 #include "voxel_map.h"
+#include "voxel_server.h"
 
 #include <core/core_string_names.h>
 #include <core/engine.h>
-
-const uint32_t MAIN_THREAD_MESHING_BUDGET_MS = 8;
+#include <scene/3d/camera.h>
 
 namespace {
 
@@ -70,6 +71,10 @@ VoxelLodTerrain::~VoxelLodTerrain() {
 
 	print_line("Destroy VoxelLodTerrain");
 
+	if (_uses_memory_budget) {
+		VoxelMemoryBudget::get_singleton()->remove_user(this);
+	}
+
 	if (_stream_thread) {
 		// Schedule saving of all modified blocks,
 		// without copy because we are destroying the map anyways
@@ -249,18 +254,49 @@ void VoxelLodTerrain::set_view_distance(int p_distance_in_voxels) {
 	_view_distance_voxels = p_distance_in_voxels;
 }
 
-Spatial *VoxelLodTerrain::get_viewer() const {
-	if (!is_inside_tree()) {
-		return nullptr;
+void VoxelLodTerrain::get_viewers(std::vector<Viewer> &out_viewers) const {
+
+	out_viewers.clear();
+
+	if (Engine::get_singleton()->is_editor_hint()) {
+		// TODO Use editor's camera here
+		out_viewers.push_back(Viewer());
+		return;
 	}
-	if (_viewer_path.is_empty()) {
-		return nullptr;
+
+	// TODO Have option to use viewport camera
+	if (is_inside_tree()) {
+		for (unsigned int i = 0; i < _viewer_paths.size(); ++i) {
+			const Spatial *node = Object::cast_to<Spatial>(get_node(_viewer_paths[i]));
+			if (node == nullptr) {
+				continue;
+			}
+			Viewer viewer;
+			viewer.position = node->get_global_transform().origin;
+			viewer.camera = Object::cast_to<Camera>(node);
+			if (viewer.camera == nullptr) {
+				// The viewer can be a character with the current camera attached to it
+				const Camera *viewport_camera = get_viewport()->get_camera();
+				if (viewport_camera != nullptr && node->is_a_parent_of(viewport_camera)) {
+					viewer.camera = viewport_camera;
+				}
+			}
+			out_viewers.push_back(viewer);
+		}
 	}
-	Node *node = get_node(_viewer_path);
-	if (node == nullptr) {
-		return nullptr;
+
+	if (out_viewers.empty()) {
+		// Keep what was loaded around the last known viewers, or the origin
+		const Lod &lod0 = _lods[0];
+		for (unsigned int i = 0; i < lod0.last_viewer_block_positions.size(); ++i) {
+			Viewer viewer;
+			viewer.position = (lod0.last_viewer_block_positions[i] << lod0.map->get_block_size_pow2()).to_vec3();
+			out_viewers.push_back(viewer);
+		}
+		if (out_viewers.empty()) {
+			out_viewers.push_back(Viewer());
+		}
 	}
-	return Object::cast_to<Spatial>(node);
 }
 
 void VoxelLodTerrain::start_updater() {
@@ -271,7 +307,7 @@ void VoxelLodTerrain::start_updater() {
 	VoxelMeshUpdater::MeshingParams params;
 	params.smooth_surface = true;
 
-	_block_updater = memnew(VoxelMeshUpdater(2, params));
+	_block_updater = memnew(VoxelMeshUpdater(params));
 }
 
 void VoxelLodTerrain::stop_updater() {
@@ -290,6 +326,7 @@ void VoxelLodTerrain::stop_updater() {
 	}
 
 	_blocks_pending_main_thread_update.clear();
+	_meshes_to_cancel.clear();
 
 	for (unsigned int i = 0; i < _lods.size(); ++i) {
 
@@ -308,7 +345,7 @@ void VoxelLodTerrain::start_streamer() {
 	ERR_FAIL_COND(_stream_thread != nullptr);
 	ERR_FAIL_COND(_stream.is_null());
 
-	_stream_thread = memnew(VoxelDataLoader(1, _stream, get_block_size_pow2()));
+	_stream_thread = memnew(VoxelDataLoader(_stream, get_block_size_pow2()));
 }
 
 void VoxelLodTerrain::stop_streamer() {
@@ -322,6 +359,8 @@ void VoxelLodTerrain::stop_streamer() {
 		Lod &lod = _lods[i];
 		lod.blocks_to_load.clear();
 	}
+
+	_loads_to_cancel.clear();
 }
 
 void VoxelLodTerrain::set_lod_split_scale(float p_lod_split_scale) {
@@ -387,6 +426,7 @@ void VoxelLodTerrain::reset_maps() {
 				lod.map.instance();
 			}
 			lod.map->create(get_block_size_pow2(), lod_index);
+			lod.map->set_deduplication_enabled(_deduplicate_blocks);
 
 		} else {
 
@@ -405,6 +445,13 @@ void VoxelLodTerrain::set_generate_collisions(bool enabled) {
 	_generate_collisions = enabled;
 }
 
+void VoxelLodTerrain::set_deduplicate_blocks(bool enabled) {
+	_deduplicate_blocks = enabled;
+	for (int lod_index = 0; lod_index < _lod_count; ++lod_index) {
+		_lods[lod_index].map->set_deduplication_enabled(enabled);
+	}
+}
+
 void VoxelLodTerrain::set_collision_lod_count(int lod_count) {
 	_collision_lod_count = CLAMP(lod_count, -1, get_lod_count());
 }
@@ -414,11 +461,35 @@ int VoxelLodTerrain::get_collision_lod_count() const {
 }
 
 void VoxelLodTerrain::set_viewer_path(NodePath path) {
-	_viewer_path = path;
+	_viewer_paths.clear();
+	if (!path.is_empty()) {
+		_viewer_paths.push_back(path);
+	}
 }
 
 NodePath VoxelLodTerrain::get_viewer_path() const {
-	return _viewer_path;
+	if (_viewer_paths.empty()) {
+		return NodePath();
+	}
+	return _viewer_paths[0];
+}
+
+void VoxelLodTerrain::set_viewer_paths(Array paths) {
+	_viewer_paths.clear();
+	for (int i = 0; i < paths.size(); ++i) {
+		const NodePath path = paths[i];
+		if (!path.is_empty()) {
+			_viewer_paths.push_back(path);
+		}
+	}
+}
+
+Array VoxelLodTerrain::get_viewer_paths() const {
+	Array paths;
+	for (unsigned int i = 0; i < _viewer_paths.size(); ++i) {
+		paths.append(_viewer_paths[i]);
+	}
+	return paths;
 }
 
 int VoxelLodTerrain::get_block_region_extent() const {
@@ -495,32 +566,6 @@ void VoxelLodTerrain::_notification(int p_what) {
 	}
 }
 
-void VoxelLodTerrain::get_viewer_pos_and_direction(Vector3 &out_pos, Vector3 &out_direction) const {
-
-	if (Engine::get_singleton()->is_editor_hint()) {
-
-		// TODO Use editor's camera here
-		out_pos = Vector3();
-		out_direction = Vector3(0, -1, 0);
-
-	} else {
-		// TODO Have option to use viewport camera
-		Spatial *viewer = get_viewer();
-		if (viewer) {
-
-			Transform gt = viewer->get_global_transform();
-			out_pos = gt.origin;
-			out_direction = -gt.basis.get_axis(Vector3::AXIS_Z);
-
-		} else {
-
-			// TODO Just remember last viewer pos
-			out_pos = (_lods[0].last_viewer_block_pos << _lods[0].map->get_block_size_pow2()).to_vec3();
-			out_direction = Vector3(0, -1, 0);
-		}
-	}
-}
-
 void VoxelLodTerrain::try_schedule_loading_with_neighbors(const Vector3i &p_bpos, int lod_index) {
 	Lod &lod = _lods[lod_index];
 
@@ -593,11 +638,7 @@ bool VoxelLodTerrain::check_block_mesh_updated(VoxelBlock *block) {
 void VoxelLodTerrain::send_block_data_requests() {
 
 	VoxelDataLoader::Input input;
-
-	Vector3 viewer_pos;
-	get_viewer_pos_and_direction(viewer_pos, input.priority_direction);
-	input.priority_position = _lods[0].map->voxel_to_block(Vector3i(viewer_pos));
-
+	input.priority_viewers = _priority_viewers;
 	input.use_exclusive_region = true;
 	// The last LOD may spread until end of view distance, it should not be discarded
 	input.exclusive_region_max_lod = get_lod_count() - 1;
@@ -624,6 +665,8 @@ void VoxelLodTerrain::send_block_data_requests() {
 
 	_blocks_to_save.clear();
 
+	input.cancelled_blocks.swap(_loads_to_cancel);
+
 	//print_line(String("Sending {0}").format(varray(input.blocks_to_emerge.size())));
 	_stream_thread->push(input);
 }
@@ -639,17 +682,33 @@ void VoxelLodTerrain::_process() {
 
 	OS &os = *OS::get_singleton();
 
-	// Get viewer location
+	// Get viewer locations
 	// TODO Transform to local (Spatial Transform)
-	Vector3 viewer_pos;
-	Vector3 viewer_direction;
-	get_viewer_pos_and_direction(viewer_pos, viewer_direction);
-	Vector3i viewer_block_pos = _lods[0].map->voxel_to_block(Vector3i(viewer_pos));
+	std::vector<Viewer> viewers;
+	get_viewers(viewers);
+
+	_priority_viewers.resize(viewers.size());
+	for (unsigned int i = 0; i < viewers.size(); ++i) {
+		_priority_viewers[i].position = _lods[0].map->voxel_to_block(Vector3i(viewers[i].position));
+		if (viewers[i].camera != nullptr) {
+			_priority_viewers[i].set_frustum(viewers[i].camera->get_frustum(), _lods[0].map->get_block_size());
+		} else {
+			_priority_viewers[i].frustum_planes.clear();
+		}
+	}
 
 	_stats.dropped_block_loads = 0;
 	_stats.dropped_block_meshs = 0;
+	_stats.skipped_block_meshs = 0;
 	_stats.blocked_lods = 0;
 
+	if (!_uses_memory_budget) {
+		// Registered once there may be blocks to account for, rather than in the constructor,
+		// because Godot creates instances of nodes it doesn't use
+		VoxelMemoryBudget::get_singleton()->add_user(this);
+		_uses_memory_budget = true;
+	}
+
 	// Here we go...
 
 	// Update pending LOD data modifications due to edits.
@@ -679,10 +738,20 @@ void VoxelLodTerrain::_process() {
 			// The player can edit them so changes can be propagated to lower lods.
 
 			unsigned int block_size_po2 = _lods[0].map->get_block_size_pow2() + lod_index;
-			Vector3i viewer_block_pos_within_lod = VoxelMap::voxel_to_block_b(viewer_pos, block_size_po2);
 
-			Rect3i new_box = Rect3i::from_center_extents(viewer_block_pos_within_lod, Vector3i(block_region_extent));
-			Rect3i prev_box = Rect3i::from_center_extents(lod.last_viewer_block_pos, Vector3i(lod.last_view_distance_blocks));
+			// The region is the union of boxes around each viewer
+			std::vector<Vector3i> viewer_block_positions_within_lod;
+			std::vector<Rect3i> new_boxes;
+			for (unsigned int i = 0; i < viewers.size(); ++i) {
+				const Vector3i bpos = VoxelMap::voxel_to_block_b(viewers[i].position, block_size_po2);
+				viewer_block_positions_within_lod.push_back(bpos);
+				new_boxes.push_back(Rect3i::from_center_extents(bpos, Vector3i(block_region_extent)));
+			}
+			std::vector<Rect3i> prev_boxes;
+			for (unsigned int i = 0; i < lod.last_viewer_block_positions.size(); ++i) {
+				prev_boxes.push_back(Rect3i::from_center_extents(
+						lod.last_viewer_block_positions[i], Vector3i(lod.last_view_distance_blocks)));
+			}
 
 			// Eliminate pending blocks that aren't needed
 
@@ -690,22 +759,27 @@ void VoxelLodTerrain::_process() {
 			// Let's assert so it will pop on your face the day that assumption changes
 			CRASH_COND(!lod.blocks_to_load.empty());
 
-			if (prev_box != new_box) {
+			if (prev_boxes != new_boxes) {
 				VOXEL_PROFILE_SCOPE(profile_process_unload_out_of_region_immerge);
-				prev_box.difference(new_box, [this, lod_index](Rect3i out_of_range_box) {
-					out_of_range_box.for_each_cell([=](Vector3i pos) {
-						//print_line(String("Immerge {0}").format(varray(pos.to_vec3())));
-						immerge_block(pos, lod_index);
-					});
+				for_each_cell_in_difference(prev_boxes, new_boxes, [this, lod_index](Vector3i pos) {
+					//print_line(String("Immerge {0}").format(varray(pos.to_vec3())));
+					immerge_block(pos, lod_index);
 				});
 			}
 
 			// Cancel block updates that are not within the padded region (since neighbors are always required to remesh)
-			Rect3i padded_new_box = new_box.padded(-1);
+			std::vector<Rect3i> padded_new_boxes;
+			for (unsigned int i = 0; i < new_boxes.size(); ++i) {
+				padded_new_boxes.push_back(new_boxes[i].padded(-1));
+			}
 			{
 				VOXEL_PROFILE_SCOPE(profile_process_unload_out_of_region_cancel_updates);
-				unordered_remove_if(lod.blocks_pending_update, [&lod, padded_new_box](Vector3i bpos) {
-					if (padded_new_box.contains(bpos)) {
+				unordered_remove_if(lod.blocks_pending_update, [&lod, &padded_new_boxes](Vector3i bpos) {
+					bool inside = false;
+					for (unsigned int i = 0; i < padded_new_boxes.size() && !inside; ++i) {
+						inside = padded_new_boxes[i].contains(bpos);
+					}
+					if (inside) {
 						return false;
 					} else {
 						VoxelBlock *block = lod.map->get_block(bpos);
@@ -717,7 +791,7 @@ void VoxelLodTerrain::_process() {
 				});
 			}
 
-			lod.last_viewer_block_pos = viewer_block_pos_within_lod;
+			lod.last_viewer_block_positions = viewer_block_positions_within_lod;
 			lod.last_view_distance_blocks = block_region_extent;
 		}
 	}
@@ -731,12 +805,14 @@ void VoxelLodTerrain::_process() {
 		const unsigned int octree_size = 1 << octree_size_po2;
 		const unsigned int octree_region_extent = 1 + _view_distance_voxels / (1 << octree_size_po2);
 
-		Vector3i viewer_octree_pos = (Vector3i(viewer_pos) + Vector3i(octree_size / 2)) >> octree_size_po2;
-
-		Rect3i new_box = Rect3i::from_center_extents(viewer_octree_pos, Vector3i(octree_region_extent));
-		Rect3i prev_box = _last_octree_region_box;
+		std::vector<Rect3i> new_boxes;
+		for (unsigned int i = 0; i < viewers.size(); ++i) {
+			Vector3i viewer_octree_pos = (Vector3i(viewers[i].position) + Vector3i(octree_size / 2)) >> octree_size_po2;
+			new_boxes.push_back(Rect3i::from_center_extents(viewer_octree_pos, Vector3i(octree_region_extent)));
+		}
+		const std::vector<Rect3i> &prev_boxes = _last_octree_region_boxes;
 
-		if (new_box != prev_box) {
+		if (new_boxes != prev_boxes) {
 			VOXEL_PROFILE_SCOPE(profile_process_add_remove_octrees_box_diff);
 
 			struct CleanOctreeAction {
@@ -809,16 +885,11 @@ void VoxelLodTerrain::_process() {
 			enter_action.self = this;
 			enter_action.block_size = get_block_size();
 
-			prev_box.difference(new_box, [exit_action](Rect3i out_of_range_box) {
-				out_of_range_box.for_each_cell(exit_action);
-			});
-
-			new_box.difference(prev_box, [enter_action](Rect3i box_to_load) {
-				box_to_load.for_each_cell(enter_action);
-			});
+			for_each_cell_in_difference(prev_boxes, new_boxes, exit_action);
+			for_each_cell_in_difference(new_boxes, prev_boxes, enter_action);
 		}
 
-		_last_octree_region_box = new_box;
+		_last_octree_region_boxes = new_boxes;
 	}
 
 	CRASH_COND(_blocks_pending_transition_update.size() != 0);
@@ -945,8 +1016,19 @@ void VoxelLodTerrain::_process() {
 			octree_actions.self = this;
 			octree_actions.block_offset_lod0 = block_offset_lod0;
 
-			Vector3 relative_viewer_pos = viewer_pos - get_block_size() * block_offset_lod0.to_vec3();
-			item.octree.update(relative_viewer_pos, octree_actions);
+			// Only viewers close enough can make nodes of this octree split
+			const float octree_size = get_block_size() << (get_lod_count() - 1);
+			const Vector3 octree_origin = get_block_size() * block_offset_lod0.to_vec3();
+			const Vector3 octree_center = octree_origin + Vector3(0.5, 0.5, 0.5) * octree_size;
+			const float reach = octree_size * (_lod_split_scale + 0.87f);
+			std::vector<Vector3> relative_viewer_positions;
+			for (unsigned int i = 0; i < viewers.size(); ++i) {
+				if (viewers[i].position.distance_squared_to(octree_center) < reach * reach) {
+					relative_viewer_positions.push_back(viewers[i].position - octree_origin);
+				}
+			}
+
+			item.octree.update(relative_viewer_positions, octree_actions);
 
 			// Ideally, this stat should stabilize to zero.
 			// If not, something in block management prevents LODs from properly show up and should be fixed.
@@ -1070,17 +1152,20 @@ void VoxelLodTerrain::_process() {
 		VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates);
 
 		VoxelMeshUpdater::Input input;
-		input.priority_position = viewer_block_pos;
-		input.priority_direction = viewer_direction;
+		input.priority_viewers = _priority_viewers;
 		input.use_exclusive_region = true;
 		input.exclusive_region_max_lod = get_lod_count() - 1;
 		input.exclusive_region_extent = get_block_region_extent();
+		input.cancelled_blocks.swap(_meshes_to_cancel);
 
 		for (int lod_index = 0; lod_index < get_lod_count(); ++lod_index) {
 
 			VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_lod);
 			Lod &lod = _lods[lod_index];
 
+			// The map is not modified while requests are made, so they can share snapshots of blocks
+			VoxelNeighborhood::SnapshotCache snapshots;
+
 			for (unsigned int i = 0; i < lod.blocks_pending_update.size(); ++i) {
 
 				VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block);
@@ -1091,34 +1176,48 @@ void VoxelLodTerrain::_process() {
 				// All blocks we get here must be in the scheduled state
 				CRASH_COND(block->get_mesh_state() != VoxelBlock::MESH_UPDATE_NOT_SENT);
 
-				// TODO Perhaps we could do a bit of early-rejection before spending time in buffer copy?
-
-				// Create buffer padded with neighbor voxels
-				Ref<VoxelBuffer> nbuffer;
-				nbuffer.instance();
-
-				// TODO Make the buffer re-usable, or pool memory
 				unsigned int min_padding = _block_updater->get_minimum_padding();
 				unsigned int max_padding = _block_updater->get_maximum_padding();
+				unsigned int block_size = lod.map->get_block_size();
+
+				const Rect3i padded_box(
+						lod.map->block_to_voxel(block_pos) - Vector3i(min_padding),
+						Vector3i(block_size + min_padding + max_padding));
+
 				{
-					VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block_alloc);
-					unsigned int block_size = lod.map->get_block_size();
-					nbuffer->create(Vector3i(block_size + min_padding + max_padding));
+					// If the SDF doesn't cross the isolevel in the block and its padding, there is no surface.
+					// That's the case of most blocks in open air or deep underground. Ranges of blocks are cached,
+					// so this rejects them before spending time in buffer copy and meshing.
+					real_t sdf_min, sdf_max;
+					lod.map->get_channel_range_f(padded_box, VoxelBuffer::CHANNEL_SDF, sdf_min, sdf_max);
+					if (sdf_min > 0.f || sdf_max < 0.f) {
+						block->set_mesh(Ref<Mesh>(), this, false, Array(), false);
+						for (int dir = 0; dir < Cube::SIDE_COUNT; ++dir) {
+							block->set_transition_mesh(Ref<Mesh>(), dir);
+						}
+						block->set_mesh_state(VoxelBlock::MESH_UP_TO_DATE);
+						++_stats.skipped_block_meshs;
+						continue;
+					}
 				}
 
+				VoxelMeshUpdater::InputBlock iblock;
+
 				{
-					VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block_copy);
-					unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_SDF);
-					lod.map->get_buffer_copy(lod.map->block_to_voxel(block_pos) - Vector3i(min_padding), **nbuffer, channels_mask);
+					// Reference voxels padded with neighbors, the mesh thread will copy them
+					VOXEL_PROFILE_SCOPE(profile_process_send_mesh_updates_block_neighborhood);
+					iblock.data.voxels.create(**lod.map, padded_box, snapshots);
+					iblock.data.channels_mask = (1 << VoxelBuffer::CHANNEL_SDF);
 				}
 
-				VoxelMeshUpdater::InputBlock iblock;
-				iblock.data.voxels = nbuffer;
 				iblock.position = block_pos;
 				iblock.lod = lod_index;
 				input.blocks.push_back(iblock);
 
 				block->set_mesh_state(VoxelBlock::MESH_UPDATE_SENT);
+
+				// The block is likely to have been edited
+				lod.map->update_block_memory_usage(block);
 			}
 
 			lod.blocks_pending_update.clear();
@@ -1155,14 +1254,14 @@ void VoxelLodTerrain::_process() {
 			}
 		}
 
-		uint32_t timeout = os.get_ticks_msec() + MAIN_THREAD_MESHING_BUDGET_MS; // Allocate milliseconds max to upload meshes
+		_upload_budget.begin_frame();
 		unsigned int queue_index = 0;
 
 		// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
 		// This also proved to be very slow compared to the meshing process itself...
 		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
-		for (; queue_index < _blocks_pending_main_thread_update.size() && os.get_ticks_msec() < timeout; ++queue_index) {
+		for (; queue_index < _blocks_pending_main_thread_update.size(); ++queue_index) {
 
 			VOXEL_PROFILE_SCOPE(profile_process_receive_mesh_updates_block_update);
 
@@ -1191,12 +1290,19 @@ void VoxelLodTerrain::_process() {
 				continue;
 			}
 
+			const VoxelMesher::Output mesh_data = ob.data.smooth_surfaces;
+
+			const uint32_t vertex_count = VoxelUploadBudget::get_vertex_count(mesh_data);
+			if (!_upload_budget.can_upload(vertex_count)) {
+				// Left for next frame
+				break;
+			}
+			const uint64_t time_before = os.get_ticks_usec();
+
 			if (block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT) {
 				block->set_mesh_state(VoxelBlock::MESH_UP_TO_DATE);
 			}
 
-			const VoxelMesher::Output mesh_data = ob.data.smooth_surfaces;
-
 			// TODO Allow multiple collision surfaces
 			Array collidable_surface;
 			Ref<ArrayMesh> mesh = build_mesh(
@@ -1225,6 +1331,8 @@ void VoxelLodTerrain::_process() {
 					block->set_transition_mesh(transition_mesh, dir);
 				}
 			}
+
+			_upload_budget.add_upload(vertex_count, os.get_ticks_usec() - time_before);
 		}
 
 		{
@@ -1234,6 +1342,87 @@ void VoxelLodTerrain::_process() {
 	}
 
 	_stats.time_process_update_responses = profiling_clock.restart();
+
+	// Unload blocks if the memory budget is exceeded, which may also be done by another terrain
+	VoxelMemoryBudget::get_singleton()->process();
+}
+
+uint64_t VoxelLodTerrain::get_block_memory_usage() const {
+	uint64_t usage = 0;
+	for (int lod_index = 0; lod_index < _lod_count; ++lod_index) {
+		usage += _lods[lod_index].map->get_memory_usage();
+	}
+	return usage;
+}
+
+void VoxelLodTerrain::get_eviction_candidates(std::vector<VoxelMemoryBudget::Candidate> &candidates, uint64_t now) {
+	std::vector<Viewer> viewers;
+	get_viewers(viewers);
+
+	const int block_size = get_block_size();
+
+	for (int lod_index = 0; lod_index < _lod_count; ++lod_index) {
+		Lod &lod = _lods[lod_index];
+
+		// Distances are in LOD0 voxels, so they compare with other LODs and terrains
+		const int lod_block_size = block_size << lod_index;
+		const Vector3 half_block_size(lod_block_size / 2, lod_block_size / 2, lod_block_size / 2);
+
+		lod.map->for_all_blocks([this, &candidates, now, &viewers, lod_index, lod_block_size, half_block_size](VoxelBlock *block) {
+			if (block->is_visible()) {
+				// Octrees expect visible blocks to stay loaded, and would not load them back
+				return;
+			}
+			if (has_loaded_children(block->position, lod_index)) {
+				// Blocks are evicted bottom-up, parents go once their children are gone
+				return;
+			}
+			const VoxelBlock::MeshState mesh_state = block->get_mesh_state();
+			if (mesh_state == VoxelBlock::MESH_UPDATE_NOT_SENT || mesh_state == VoxelBlock::MESH_UPDATE_SENT) {
+				// Pending updates expect the block to be there
+				return;
+			}
+			if (block->get_needs_lodding()) {
+				// Edits must reach other LODs first
+				return;
+			}
+			VoxelMemoryBudget::Candidate c;
+			c.position = block->position;
+			c.lod_index = lod_index;
+			c.memory_usage = block->memory_usage;
+			c.last_viewed_time = block->get_last_viewed_time(now);
+			const Vector3 center = (block->position * lod_block_size).to_vec3() + half_block_size;
+			// Blocks matter as much as they do to the nearest viewer
+			c.distance_squared = viewers[0].position.distance_squared_to(center);
+			for (unsigned int i = 1; i < viewers.size(); ++i) {
+				c.distance_squared = MIN(c.distance_squared, viewers[i].position.distance_squared_to(center));
+			}
+			candidates.push_back(c);
+		});
+	}
+}
+
+void VoxelLodTerrain::evict_block(Vector3i bpos, unsigned int lod_index) {
+	// Children would be left without a parent to propagate their edits to
+	ERR_FAIL_COND(has_loaded_children(bpos, lod_index));
+	// Saves the block if it was modified
+	immerge_block(bpos, lod_index);
+}
+
+bool VoxelLodTerrain::has_loaded_children(Vector3i bpos, int lod_index) const {
+	// Blocks of a LOD are only loaded along with their parent: edits propagate to parents
+	// (see flush_pending_lod_edits()), and octrees join children into them.
+	if (lod_index == 0) {
+		return false;
+	}
+	const Lod &child_lod = _lods[lod_index - 1];
+	for (int i = 0; i < 8; ++i) {
+		const Vector3i child_pos = LodOctree::get_child_position(bpos, i);
+		if (child_lod.map->has_block(child_pos) || child_lod.loading_blocks.has(child_pos)) {
+			return true;
+		}
+	}
+	return false;
 }
 
 void VoxelLodTerrain::flush_pending_lod_edits() {
@@ -1308,6 +1497,7 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 			// Update lower LOD
 			// This must always be done after an edit before it gets saved, otherwise LODs won't match and it will look ugly.
 			// TODO Try to narrow to edited region instead of taking whole block
+			// Channels use their default filter, so SDF gets averaged instead of sampled
 			src_block->voxels->downscale_to(**dst_block->voxels, Vector3i(), src_block->voxels->get_size(), rel * half_bs);
 		}
 
@@ -1358,9 +1548,27 @@ void VoxelLodTerrain::immerge_block(Vector3i block_pos, int lod_index) {
 
 	Lod &lod = _lods[lod_index];
 
+	const VoxelBlock *block = lod.map->get_block(block_pos);
+	if (block != nullptr && block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT) {
+		// Stop meshing it, the result would be dropped
+		VoxelMeshUpdater::BlockLocation location;
+		location.position = block_pos;
+		location.lod = lod_index;
+		_meshes_to_cancel.push_back(location);
+	}
+
 	lod.map->remove_block(block_pos, ScheduleSaveAction{ _blocks_to_save, _shader_material_pool, false });
 
-	lod.loading_blocks.erase(block_pos);
+	Set<Vector3i>::Element *E = lod.loading_blocks.find(block_pos);
+	if (E != nullptr) {
+		// Stop loading it, the result would be dropped.
+		// This is what saves most of the work when the viewer teleports.
+		lod.loading_blocks.erase(E);
+		VoxelDataLoader::BlockLocation location;
+		location.position = block_pos;
+		location.lod = lod_index;
+		_loads_to_cancel.push_back(location);
+	}
 
 	// Blocks in the update queue will be cancelled in _process,
 	// because it's too expensive to linear-search all blocks for each block
@@ -1518,6 +1726,8 @@ Dictionary VoxelLodTerrain::get_statistics() const {
 	Dictionary d;
 	d["stream"] = VoxelDataLoader::Mgr::to_dictionary(_stats.stream);
 	d["updater"] = VoxelMeshUpdater::Mgr::to_dictionary(_stats.updater);
+	d["memory_pool"] = VoxelMemoryPool::to_dictionary(VoxelMemoryPool::get_singleton()->get_stats());
+	d["meshing_buffer_pool"] = VoxelBufferPool::to_dictionary(VoxelServer::get_singleton()->get_meshing_buffer_pool().get_stats());
 
 	// Breakdown of time spent in _process
 	d["time_detect_required_blocks"] = _stats.time_detect_required_blocks;
@@ -1529,8 +1739,23 @@ Dictionary VoxelLodTerrain::get_statistics() const {
 	d["remaining_main_thread_blocks"] = (int)_blocks_pending_main_thread_update.size();
 	d["dropped_block_loads"] = _stats.dropped_block_loads;
 	d["dropped_block_meshs"] = _stats.dropped_block_meshs;
+	d["skipped_block_meshs"] = _stats.skipped_block_meshs;
 	d["updated_blocks"] = _stats.updated_blocks;
+	d["mesh_upload"] = _upload_budget.to_dictionary();
 	d["blocked_lods"] = _stats.blocked_lods;
+	d["memory_usage"] = get_block_memory_usage();
+	d["memory_budget"] = VoxelMemoryBudget::get_singleton()->get_statistics();
+
+	VoxelMap::DeduplicationStats deduplication_stats;
+	for (int lod_index = 0; lod_index < _lod_count; ++lod_index) {
+		const VoxelMap::DeduplicationStats lod_stats = _lods[lod_index].map->get_deduplication_stats();
+		deduplication_stats.hits += lod_stats.hits;
+		deduplication_stats.misses += lod_stats.misses;
+		deduplication_stats.collisions += lod_stats.collisions;
+		deduplication_stats.entries += lod_stats.entries;
+		deduplication_stats.saved_bytes += lod_stats.saved_bytes;
+	}
+	d["deduplication"] = VoxelMap::to_dictionary(deduplication_stats);
 
 	return d;
 }
@@ -1654,11 +1879,16 @@ void VoxelLodTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_generate_collisions"), &VoxelLodTerrain::get_generate_collisions);
 	ClassDB::bind_method(D_METHOD("set_generate_collisions", "enabled"), &VoxelLodTerrain::set_generate_collisions);
 
+	ClassDB::bind_method(D_METHOD("get_deduplicate_blocks"), &VoxelLodTerrain::get_deduplicate_blocks);
+	ClassDB::bind_method(D_METHOD("set_deduplicate_blocks", "enabled"), &VoxelLodTerrain::set_deduplicate_blocks);
+
 	ClassDB::bind_method(D_METHOD("get_collision_lod_count"), &VoxelLodTerrain::get_collision_lod_count);
 	ClassDB::bind_method(D_METHOD("set_collision_lod_count", "count"), &VoxelLodTerrain::set_collision_lod_count);
 
 	ClassDB::bind_method(D_METHOD("get_viewer_path"), &VoxelLodTerrain::get_viewer_path);
 	ClassDB::bind_method(D_METHOD("set_viewer_path", "path"), &VoxelLodTerrain::set_viewer_path);
+	ClassDB::bind_method(D_METHOD("get_viewer_paths"), &VoxelLodTerrain::get_viewer_paths);
+	ClassDB::bind_method(D_METHOD("set_viewer_paths", "paths"), &VoxelLodTerrain::set_viewer_paths);
 
 	ClassDB::bind_method(D_METHOD("set_lod_count", "lod_count"), &VoxelLodTerrain::set_lod_count);
 	ClassDB::bind_method(D_METHOD("get_lod_count"), &VoxelLodTerrain::get_lod_count);
@@ -1685,10 +1915,13 @@ void VoxelLodTerrain::_bind_methods() {
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "view_distance"), "set_view_distance", "get_view_distance");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "lod_count"), "set_lod_count", "get_lod_count");
 	ADD_PROPERTY(PropertyInfo(Variant::REAL, "lod_split_scale"), "set_lod_split_scale", "get_lod_split_scale");
-	ADD_PROPERTY(PropertyInfo(Variant::NODE_PATH, "viewer_path"), "set_viewer_path", "get_viewer_path");
+	// Old scenes only have the single path, which is now stored in the list
+	ADD_PROPERTY(PropertyInfo(Variant::NODE_PATH, "viewer_path", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_EDITOR), "set_viewer_path", "get_viewer_path");
+	ADD_PROPERTY(PropertyInfo(Variant::ARRAY, "viewer_paths"), "set_viewer_paths", "get_viewer_paths");
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "material", PROPERTY_HINT_RESOURCE_TYPE, "Material"), "set_material", "get_material");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "generate_collisions"), "set_generate_collisions", "get_generate_collisions");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "collision_lod_count"), "set_collision_lod_count", "get_collision_lod_count");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "deduplicate_blocks"), "set_deduplicate_blocks", "get_deduplicate_blocks");
 }
 
 void VoxelLodTerrain::_b_save_all_modified_blocks() {
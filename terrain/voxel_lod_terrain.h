@@ -3,7 +3,9 @@
 
 #include "lod_octree.h"
 #include "voxel_data_loader.h"
+#include "voxel_memory_budget.h"
 #include "voxel_mesh_updater.h"
+#include "voxel_upload_budget.h"
 #include <core/set.h>
 #include <scene/3d/spatial.h>
 
@@ -11,12 +13,14 @@ class VoxelMap;
 class VoxelTool;
 class VoxelStream;
 class VoxelBlock;
+class Camera;
 
 // Paged terrain made of voxel blocks of variable level of detail.
 // Designed for highest view distances, preferably using smooth voxels.
-// Voxels are polygonized around the viewer by distance in a very large sphere, usually extending beyond far clip.
+// Voxels are polygonized around viewers by distance in very large spheres, usually extending beyond far clip.
+// Blocks seen by several viewers are only loaded and meshed once.
 // Data is streamed using a VoxelStream, which must support LOD.
-class VoxelLodTerrain : public Spatial {
+class VoxelLodTerrain : public Spatial, public VoxelMemoryBudget::User {
 	GDCLASS(VoxelLodTerrain, Spatial)
 public:
 	VoxelLodTerrain();
@@ -42,13 +46,21 @@ public:
 	void set_generate_collisions(bool enabled);
 	bool get_generate_collisions() const { return _generate_collisions; }
 
+	// Identical blocks of the same LOD share their voxels until modified (see VoxelMap::set_deduplication_enabled())
+	void set_deduplicate_blocks(bool enabled);
+	bool get_deduplicate_blocks() const { return _deduplicate_blocks; }
+
 	// Sets up to which amount of LODs collision will generate. -1 means all of them.
 	void set_collision_lod_count(int lod_count);
 	int get_collision_lod_count() const;
 
+	// Shortcut to use a single viewer
 	void set_viewer_path(NodePath path);
 	NodePath get_viewer_path() const;
 
+	void set_viewer_paths(Array paths);
+	Array get_viewer_paths() const;
+
 	int get_block_region_extent() const;
 	Vector3 voxel_to_block_position(Vector3 vpos, int lod_index) const;
 
@@ -61,6 +73,11 @@ public:
 
 	Ref<VoxelTool> get_voxel_tool();
 
+	// VoxelMemoryBudget::User
+	uint64_t get_block_memory_usage() const override;
+	void get_eviction_candidates(std::vector<VoxelMemoryBudget::Candidate> &candidates, uint64_t now) override;
+	void evict_block(Vector3i bpos, unsigned int lod_index) override;
+
 	struct Stats {
 		VoxelMeshUpdater::Stats updater;
 		VoxelDataLoader::Stats stream;
@@ -68,6 +85,7 @@ public:
 		int updated_blocks = 0;
 		int dropped_block_loads = 0;
 		int dropped_block_meshs = 0;
+		int skipped_block_meshs = 0;
 		uint64_t time_detect_required_blocks = 0;
 		uint64_t time_request_blocks_to_load = 0;
 		uint64_t time_process_load_responses = 0;
@@ -88,9 +106,17 @@ protected:
 	void _process();
 
 private:
+	struct Viewer {
+		Vector3 position;
+		// The camera the viewer looks through, if any
+		const Camera *camera = nullptr;
+	};
+
 	unsigned int get_block_size() const;
-	Spatial *get_viewer() const;
+	void get_viewers(std::vector<Viewer> &out_viewers) const;
 	void immerge_block(Vector3i block_pos, int lod_index);
+	// Tells if blocks of the next lower LOD inside the given block are loaded or being loaded
+	bool has_loaded_children(Vector3i bpos, int lod_index) const;
 
 	void start_updater();
 	void stop_updater();
@@ -98,7 +124,6 @@ private:
 	void stop_streamer();
 	void reset_maps();
 
-	void get_viewer_pos_and_direction(Vector3 &out_viewer_pos, Vector3 &out_direction) const;
 	void try_schedule_loading_with_neighbors(const Vector3i &p_bpos, int lod_index);
 	bool check_block_loaded_and_updated(const Vector3i &p_bpos, int lod_index);
 	bool check_block_mesh_updated(VoxelBlock *block);
@@ -127,15 +152,21 @@ private:
 	// Indexed by a grid coordinate whose step is the size of the highest-LOD block
 	// This octree doesn't hold any data... hence bool.
 	Map<Vector3i, OctreeItem> _lod_octrees;
-	Rect3i _last_octree_region_box;
+	// Octrees exist in the union of these boxes, one per viewer
+	std::vector<Rect3i> _last_octree_region_boxes;
 
-	NodePath _viewer_path;
+	std::vector<NodePath> _viewer_paths;
+	// Viewers as of the last update, from which threads prioritize requests
+	std::vector<VoxelPriorityViewer> _priority_viewers;
 
 	Ref<VoxelStream> _stream;
 	VoxelDataLoader *_stream_thread = nullptr;
 	VoxelMeshUpdater *_block_updater = nullptr;
 	std::vector<VoxelMeshUpdater::OutputBlock> _blocks_pending_main_thread_update;
 	std::vector<VoxelDataLoader::InputBlock> _blocks_to_save;
+	// Requests sent for blocks which got unloaded before they came back
+	std::vector<VoxelDataLoader::BlockLocation> _loads_to_cancel;
+	std::vector<VoxelMeshUpdater::BlockLocation> _meshes_to_cancel;
 
 	// Only populated and then cleared inside _process, so lifetime of pointers should be valid
 	std::vector<VoxelBlock *> _blocks_pending_transition_update;
@@ -145,6 +176,8 @@ private:
 
 	bool _generate_collisions = true;
 	int _collision_lod_count = -1;
+	bool _uses_memory_budget = false;
+	bool _deduplicate_blocks = false;
 
 	// Each LOD works in a set of coordinates spanning 2x more voxels the higher their index is
 	struct Lod {
@@ -155,8 +188,8 @@ private:
 		// Blocks that were edited and need their LOD counterparts to be updated
 		std::vector<Vector3i> blocks_pending_lodding;
 
-		// These are relative to this LOD, in block coordinates
-		Vector3i last_viewer_block_pos;
+		// These are relative to this LOD, in block coordinates. One position per viewer.
+		std::vector<Vector3i> last_viewer_block_positions;
 		int last_view_distance_blocks = 0;
 
 		// Members for memory caching
@@ -168,6 +201,8 @@ private:
 	float _lod_split_scale = 0.f;
 	unsigned int _view_distance_voxels = 512;
 
+	VoxelUploadBudget _upload_budget;
+
 	Stats _stats;
 };
 
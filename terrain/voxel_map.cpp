@@ -104,7 +104,7 @@ void VoxelMap::set_default_voxel(int value, unsigned int channel) {
 	_default_voxel[channel] = value;
 }
 
-int VoxelMap::get_default_voxel(unsigned int channel) {
+int VoxelMap::get_default_voxel(unsigned int channel) const {
 	ERR_FAIL_INDEX_V(channel, VoxelBuffer::MAX_CHANNELS, 0);
 	return _default_voxel[channel];
 }
@@ -143,6 +143,12 @@ void VoxelMap::set_block(Vector3i bpos, VoxelBlock *block) {
 		_last_accessed_block = block;
 	}
 	_blocks.set(bpos, block);
+	if (_deduplication_enabled) {
+		deduplicate_content(block);
+	}
+	// Shared data of deduplicated blocks is accounted for once, with their content
+	block->memory_usage = block->voxels->get_memory_usage(!block->deduplicated);
+	_memory_usage += block->memory_usage;
 }
 
 void VoxelMap::remove_block_internal(Vector3i bpos) {
@@ -157,11 +163,127 @@ VoxelBlock *VoxelMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer) {
 		block = VoxelBlock::create(bpos, *buffer, _block_size, _lod_index);
 		set_block(bpos, block);
 	} else {
+		release_deduplicated_content(block);
 		block->voxels = buffer;
+		if (_deduplication_enabled) {
+			deduplicate_content(block);
+		}
+		update_block_memory_usage(block);
 	}
 	return block;
 }
 
+void VoxelMap::update_block_memory_usage(VoxelBlock *block) {
+	CRASH_COND(block == nullptr);
+
+	if (block->deduplicated) {
+		const DeduplicatedContent *content = _deduplicated_content.getptr(block->content_hash);
+		CRASH_COND(content == nullptr);
+		if (!block->voxels->is_sharing_data_with(**content->voxels)) {
+			// The block was modified, its content no longer needs to be kept
+			release_deduplicated_content(block);
+		}
+	}
+
+	_memory_usage -= block->memory_usage;
+	block->memory_usage = block->voxels->get_memory_usage(!block->deduplicated);
+	_memory_usage += block->memory_usage;
+}
+
+void VoxelMap::set_deduplication_enabled(bool enabled) {
+	if (enabled == _deduplication_enabled) {
+		return;
+	}
+	_deduplication_enabled = enabled;
+	if (!enabled) {
+		// Blocks already sharing data keep doing so, but no longer reference a content
+		for_all_blocks([this](VoxelBlock *block) {
+			if (block->deduplicated) {
+				release_deduplicated_content(block);
+				update_block_memory_usage(block);
+			}
+		});
+	}
+}
+
+void VoxelMap::deduplicate_content(VoxelBlock *block) {
+	CRASH_COND(block->deduplicated);
+
+	VoxelBuffer &voxels = **block->voxels;
+	const uint32_t memory_usage = voxels.get_memory_usage();
+	if (memory_usage == 0) {
+		// Uniform, there is nothing to share
+		return;
+	}
+
+	const uint64_t hash = voxels.get_content_hash();
+	DeduplicatedContent *content = _deduplicated_content.getptr(hash);
+
+	if (content == nullptr) {
+		// First time we see this content, other blocks will share data with this one
+		DeduplicatedContent new_content;
+		new_content.voxels = voxels.duplicate();
+		new_content.memory_usage = memory_usage;
+		new_content.users = 1;
+		_deduplicated_content.set(hash, new_content);
+		_memory_usage += memory_usage;
+		++_deduplication_misses;
+
+	} else if (content->voxels->equals(*block->voxels)) {
+		block->voxels = content->voxels->duplicate();
+		++content->users;
+		++_deduplication_hits;
+
+	} else {
+		// Leave the block alone, the content it collides with could be in use for a long time
+		++_deduplication_collisions;
+		return;
+	}
+
+	block->deduplicated = true;
+	block->content_hash = hash;
+}
+
+void VoxelMap::release_deduplicated_content(VoxelBlock *block) {
+	if (!block->deduplicated) {
+		return;
+	}
+	DeduplicatedContent *content = _deduplicated_content.getptr(block->content_hash);
+	CRASH_COND(content == nullptr);
+	CRASH_COND(content->users == 0);
+	--content->users;
+	if (content->users == 0) {
+		_memory_usage -= content->memory_usage;
+		_deduplicated_content.erase(block->content_hash);
+	}
+	block->deduplicated = false;
+}
+
+VoxelMap::DeduplicationStats VoxelMap::get_deduplication_stats() const {
+	DeduplicationStats stats;
+	stats.hits = _deduplication_hits;
+	stats.misses = _deduplication_misses;
+	stats.collisions = _deduplication_collisions;
+	stats.entries = _deduplicated_content.size();
+	const uint64_t *key = nullptr;
+	while ((key = _deduplicated_content.next(key))) {
+		const DeduplicatedContent &content = _deduplicated_content.get(*key);
+		// Approximate, blocks may have stopped sharing some of their channels
+		stats.saved_bytes += (uint64_t)(content.users - 1) * content.memory_usage;
+	}
+	return stats;
+}
+
+Dictionary VoxelMap::to_dictionary(const DeduplicationStats &stats) {
+	Dictionary d;
+	d["hits"] = stats.hits;
+	d["misses"] = stats.misses;
+	d["collisions"] = stats.collisions;
+	d["entries"] = stats.entries;
+	d["saved_bytes"] = stats.saved_bytes;
+	return d;
+}
+
 bool VoxelMap::has_block(Vector3i pos) const {
 	return /*(_last_accessed_block != NULL && _last_accessed_block->pos == pos) ||*/ _blocks.has(pos);
 }
@@ -225,6 +347,34 @@ void VoxelMap::get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsign
 	}
 }
 
+void VoxelMap::get_channel_range_f(const Rect3i &voxel_box, unsigned int channel, real_t &min_value, real_t &max_value) const {
+	ERR_FAIL_INDEX(channel, VoxelBuffer::MAX_CHANNELS);
+
+	// Missing blocks are filled with the default value by get_buffer_copy(), in a buffer of default depth
+	const real_t default_value = VoxelBuffer::raw_voxel_to_real(_default_voxel[channel], VoxelBuffer::DEFAULT_CHANNEL_DEPTH);
+	min_value = default_value;
+	max_value = default_value;
+	bool first = true;
+
+	const Rect3i block_box = voxel_box.downscaled(get_block_size());
+	block_box.for_each_cell([this, channel, default_value, &min_value, &max_value, &first](Vector3i bpos) {
+		real_t block_min = default_value;
+		real_t block_max = default_value;
+		const VoxelBlock *block = get_block(bpos);
+		if (block != nullptr) {
+			block->voxels->get_channel_range_f(channel, block_min, block_max);
+		}
+		if (first) {
+			min_value = block_min;
+			max_value = block_max;
+			first = false;
+		} else {
+			min_value = MIN(min_value, block_min);
+			max_value = MAX(max_value, block_max);
+		}
+	});
+}
+
 void VoxelMap::clear() {
 	const Vector3i *key = NULL;
 	while ((key = _blocks.next(key))) {
@@ -235,7 +385,9 @@ void VoxelMap::clear() {
 		memdelete(block_ptr);
 	}
 	_blocks.clear();
+	_deduplicated_content.clear();
 	_last_accessed_block = NULL;
+	_memory_usage = 0;
 }
 
 int VoxelMap::get_block_count() const {
@@ -265,6 +417,9 @@ void VoxelMap::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("voxel_to_block", "voxel_pos"), &VoxelMap::_b_voxel_to_block);
 	ClassDB::bind_method(D_METHOD("block_to_voxel", "block_pos"), &VoxelMap::_b_block_to_voxel);
 	ClassDB::bind_method(D_METHOD("get_block_size"), &VoxelMap::get_block_size);
+	ClassDB::bind_method(D_METHOD("set_deduplication_enabled", "enabled"), &VoxelMap::set_deduplication_enabled);
+	ClassDB::bind_method(D_METHOD("is_deduplication_enabled"), &VoxelMap::is_deduplication_enabled);
+	ClassDB::bind_method(D_METHOD("get_deduplication_statistics"), &VoxelMap::_b_get_deduplication_statistics);
 }
 
 void VoxelMap::_b_get_buffer_copy(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channel) {
@@ -52,14 +52,89 @@ public:
 	void set_voxel_f(real_t value, Vector3i pos, unsigned int c = VoxelBuffer::CHANNEL_SDF);
 
 	void set_default_voxel(int value, unsigned int channel = 0);
-	int get_default_voxel(unsigned int channel = 0);
+	int get_default_voxel(unsigned int channel = 0) const;
 
 	// Gets a copy of all voxels in the area starting at min_pos having the same size as dst_buffer.
 	void get_buffer_copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int channels_mask = 1);
 
+	// Gets bounds of the values a channel has in blocks intersecting a box of voxels, as seen by get_buffer_copy().
+	// Blocks cache their range, so this is cheap and can be used to reject areas before copying them.
+	void get_channel_range_f(const Rect3i &voxel_box, unsigned int channel, real_t &min_value, real_t &max_value) const;
+
+	// Runs VoxelBuffer::read_write_action() on every block intersecting a box of voxels.
+	// Actions receive positions in voxel space. Voxels inside blocks that are not loaded are skipped.
+	// Actions also implement `bool intersects(Rect3i voxel_box)` and `bool is_unchanged(value)` (see VoxelTool),
+	// so blocks they can't modify are skipped without touching their voxels.
+	template <typename F>
+	void write_box(const Rect3i &voxel_box, unsigned int channel, F action) {
+		const Rect3i block_box = voxel_box.downscaled(get_block_size());
+		block_box.for_each_cell([this, &voxel_box, channel, &action](Vector3i bpos) {
+			VoxelBlock *block = get_block(bpos);
+			if (block == nullptr) {
+				return;
+			}
+			const Vector3i block_origin = block_to_voxel(bpos);
+			if (!action.intersects(Rect3i(block_origin, Vector3i(get_block_size())))) {
+				return;
+			}
+			VoxelBuffer &voxels = **block->voxels;
+			if (voxels.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM &&
+					action.is_unchanged(voxels.get_voxel(0, 0, 0, channel))) {
+				return;
+			}
+			Rect3i local_box(voxel_box.pos - block_origin, voxel_box.size);
+			voxels.read_write_action(local_box, block_origin, channel, action);
+		});
+	}
+
+	// Same as write_box(), using VoxelBuffer::read_write_action_f().
+	template <typename F>
+	void write_box_f(const Rect3i &voxel_box, unsigned int channel, F action) {
+		const Rect3i block_box = voxel_box.downscaled(get_block_size());
+		block_box.for_each_cell([this, &voxel_box, channel, &action](Vector3i bpos) {
+			VoxelBlock *block = get_block(bpos);
+			if (block == nullptr) {
+				return;
+			}
+			const Vector3i block_origin = block_to_voxel(bpos);
+			if (!action.intersects(Rect3i(block_origin, Vector3i(get_block_size())))) {
+				return;
+			}
+			VoxelBuffer &voxels = **block->voxels;
+			if (voxels.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM &&
+					action.is_unchanged(voxels.get_voxel_f(0, 0, 0, channel))) {
+				return;
+			}
+			Rect3i local_box(voxel_box.pos - block_origin, voxel_box.size);
+			voxels.read_write_action_f(local_box, block_origin, channel, action);
+		});
+	}
+
 	// Moves the given buffer into a block of the map. The buffer is referenced, no copy is made.
+	// If deduplication is enabled and an identical block is already in the map, the block gets a copy sharing its data instead.
 	VoxelBlock *set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer);
 
+	// When enabled, blocks with identical voxels share the same memory until one of them gets modified.
+	// Incoming buffers are hashed, so it is worth it when many blocks are the same but not uniform,
+	// like repeated generated patterns.
+	void set_deduplication_enabled(bool enabled);
+	bool is_deduplication_enabled() const { return _deduplication_enabled; }
+
+	struct DeduplicationStats {
+		// Blocks which got their voxels shared with another
+		uint32_t hits = 0;
+		// Blocks which became the reference for identical ones
+		uint32_t misses = 0;
+		// Blocks having the same hash as another without being equal
+		uint32_t collisions = 0;
+		uint32_t entries = 0;
+		// Memory not allocated thanks to sharing
+		uint64_t saved_bytes = 0;
+	};
+
+	DeduplicationStats get_deduplication_stats() const;
+	static Dictionary to_dictionary(const DeduplicationStats &stats);
+
 	struct NoAction {
 		inline void operator()(VoxelBlock *block) {}
 	};
@@ -74,6 +149,8 @@ public:
 			VoxelBlock *block = *pptr;
 			ERR_FAIL_COND(block == NULL);
 			pre_delete(block);
+			_memory_usage -= block->memory_usage;
+			release_deduplicated_content(block);
 			memdelete(block);
 			remove_block_internal(bpos);
 		}
@@ -89,6 +166,11 @@ public:
 
 	int get_block_count() const;
 
+	// Memory used by voxels of all blocks, in bytes.
+	// Blocks are measured when added, so this should be called after modifying them.
+	void update_block_memory_usage(VoxelBlock *block);
+	inline uint64_t get_memory_usage() const { return _memory_usage; }
+
 	template <typename Op_T>
 	void for_all_blocks(Op_T op) {
 		const Vector3i *key = NULL;
@@ -109,6 +191,9 @@ private:
 
 	void set_block_size_pow2(unsigned int p);
 
+	void deduplicate_content(VoxelBlock *block);
+	void release_deduplicated_content(VoxelBlock *block);
+
 	static void _bind_methods();
 
 	int _b_get_voxel(int x, int y, int z, unsigned int c) { return get_voxel(Vector3i(x, y, z), c); }
@@ -121,6 +206,7 @@ private:
 	Vector3 _b_voxel_to_block(Vector3 pos) const { return voxel_to_block(Vector3i(pos)).to_vec3(); }
 	Vector3 _b_block_to_voxel(Vector3 pos) const { return block_to_voxel(Vector3i(pos)).to_vec3(); }
 	bool _b_is_block_surrounded(Vector3 pos) const { return is_block_surrounded(Vector3i(pos)); }
+	Dictionary _b_get_deduplication_statistics() const { return to_dictionary(get_deduplication_stats()); }
 	void _b_get_buffer_copy(Vector3 pos, Ref<VoxelBuffer> dst_buffer_ref, unsigned int channel = 0);
 	void _b_set_block_buffer(Vector3 bpos, Ref<VoxelBuffer> buffer) { set_block_buffer(Vector3i(bpos), buffer); }
 
@@ -141,6 +227,23 @@ private:
 	unsigned int _block_size_mask;
 
 	unsigned int _lod_index = 0;
+
+	uint64_t _memory_usage = 0;
+
+	struct DeduplicatedContent {
+		// Copy sharing the data of the blocks using it. It is never written to,
+		// blocks stop sharing their data when they get modified.
+		Ref<VoxelBuffer> voxels;
+		uint32_t memory_usage = 0;
+		uint32_t users = 0;
+	};
+
+	// Indexed by content hash
+	HashMap<uint64_t, DeduplicatedContent> _deduplicated_content;
+	bool _deduplication_enabled = false;
+	uint32_t _deduplication_hits = 0;
+	uint32_t _deduplication_misses = 0;
+	uint32_t _deduplication_collisions = 0;
 };
 
 #endif // VOXEL_MAP_H
@@ -0,0 +1,144 @@
+#include "voxel_memory_budget.h"
+#include "../util/zprofiling.h"
+
+#include <core/engine.h>
+#include <core/os/os.h>
+#include <algorithm>
+
+namespace {
+VoxelMemoryBudget *g_memory_budget = nullptr;
+
+// Least recently viewed first, then furthest first
+struct CandidateComparator {
+	inline bool operator()(const VoxelMemoryBudget::Candidate &a, const VoxelMemoryBudget::Candidate &b) const {
+		if (a.last_viewed_time != b.last_viewed_time) {
+			return a.last_viewed_time < b.last_viewed_time;
+		}
+		return a.distance_squared > b.distance_squared;
+	}
+};
+
+} // namespace
+
+void VoxelMemoryBudget::create_singleton() {
+	CRASH_COND(g_memory_budget != nullptr);
+	g_memory_budget = memnew(VoxelMemoryBudget);
+}
+
+void VoxelMemoryBudget::destroy_singleton() {
+	CRASH_COND(g_memory_budget == nullptr);
+	VoxelMemoryBudget *budget = g_memory_budget;
+	g_memory_budget = nullptr;
+	memdelete(budget);
+}
+
+VoxelMemoryBudget *VoxelMemoryBudget::get_singleton() {
+	CRASH_COND(g_memory_budget == nullptr);
+	return g_memory_budget;
+}
+
+void VoxelMemoryBudget::set_budget(int64_t budget) {
+	ERR_FAIL_COND(budget < 0);
+	_budget = budget;
+}
+
+int64_t VoxelMemoryBudget::get_budget() const {
+	return _budget;
+}
+
+int64_t VoxelMemoryBudget::get_usage() const {
+	int64_t usage = 0;
+	for (size_t i = 0; i < _users.size(); ++i) {
+		usage += _users[i]->get_block_memory_usage();
+	}
+	return usage;
+}
+
+void VoxelMemoryBudget::add_user(User *user) {
+	CRASH_COND(user == nullptr);
+	ERR_FAIL_COND(std::find(_users.begin(), _users.end(), user) != _users.end());
+	_users.push_back(user);
+}
+
+void VoxelMemoryBudget::remove_user(User *user) {
+	auto it = std::find(_users.begin(), _users.end(), user);
+	ERR_FAIL_COND(it == _users.end());
+	_users.erase(it);
+}
+
+void VoxelMemoryBudget::process() {
+	const uint64_t frame = Engine::get_singleton()->get_idle_frames();
+	if (frame == _last_process_frame) {
+		return;
+	}
+	_last_process_frame = frame;
+	_evicted_block_count = 0;
+
+	if (_budget == 0) {
+		_overrun_bytes = 0;
+		return;
+	}
+
+	int64_t usage = get_usage();
+	if (usage <= _budget) {
+		_overrun_bytes = 0;
+		return;
+	}
+
+	VOXEL_PROFILE_SCOPE(profile_memory_budget_evict);
+
+	// Free a bit more than needed, so it doesn't happen again as soon as another block gets loaded
+	const int64_t target = _budget - _budget / 16;
+
+	// Candidates from all users are sorted together, so the least recently viewed blocks go first
+	// regardless of which terrain they belong to
+	const uint64_t now = OS::get_singleton()->get_ticks_msec();
+	_candidates.clear();
+	for (unsigned int user_index = 0; user_index < _users.size(); ++user_index) {
+		const size_t begin = _candidates.size();
+		_users[user_index]->get_eviction_candidates(_candidates, now);
+		for (size_t i = begin; i < _candidates.size(); ++i) {
+			_candidates[i].user_index = user_index;
+		}
+	}
+
+	std::sort(_candidates.begin(), _candidates.end(), CandidateComparator());
+
+	for (size_t i = 0; i < _candidates.size() && usage > target; ++i) {
+		const Candidate &c = _candidates[i];
+		_users[c.user_index]->evict_block(c.position, c.lod_index);
+		usage -= c.memory_usage;
+		_evicted_bytes += c.memory_usage;
+		++_evicted_block_count;
+	}
+
+	// Blocks viewers need are not candidates, because they would be loaded again right away.
+	// If they alone exceed the budget, it can't be met until viewers need fewer blocks,
+	// which VoxelTerrain does by reducing its view distance.
+	const int64_t overrun_bytes = MAX(usage - _budget, 0);
+	if (overrun_bytes > 0 && _overrun_bytes == 0) {
+		WARN_PRINT(String("Voxel memory budget exceeded by {0} bytes, viewers need more blocks than it allows")
+						   .format(varray(overrun_bytes)));
+	}
+	_overrun_bytes = overrun_bytes;
+}
+
+Dictionary VoxelMemoryBudget::get_statistics() const {
+	Dictionary d;
+	d["budget"] = _budget;
+	d["usage"] = get_usage();
+	d["evicted_blocks"] = _evicted_block_count;
+	d["total_evicted_bytes"] = _evicted_bytes;
+	d["overrun_bytes"] = _overrun_bytes;
+	return d;
+}
+
+void VoxelMemoryBudget::_bind_methods() {
+
+	ClassDB::bind_method(D_METHOD("set_budget", "bytes"), &VoxelMemoryBudget::set_budget);
+	ClassDB::bind_method(D_METHOD("get_budget"), &VoxelMemoryBudget::get_budget);
+	ClassDB::bind_method(D_METHOD("get_usage"), &VoxelMemoryBudget::get_usage);
+	ClassDB::bind_method(D_METHOD("get_statistics"), &VoxelMemoryBudget::get_statistics);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "budget"), "set_budget", "get_budget");
+}
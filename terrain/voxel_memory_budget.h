@@ -0,0 +1,77 @@
+#ifndef VOXEL_MEMORY_BUDGET_H
+#define VOXEL_MEMORY_BUDGET_H
+
+#include "../math/vector3i.h"
+#include <core/object.h>
+
+#include <vector>
+
+// Caps the memory used by voxel blocks of all terrains together.
+// When the budget is exceeded, the least recently viewed blocks are unloaded (and saved if they were modified),
+// blocks viewed at the same time being unloaded furthest from the viewer first.
+// Blocks viewers need are kept. If they alone exceed the budget, the overrun is reported in statistics,
+// and VoxelTerrain loads blocks within a smaller distance until they fit. VoxelLodTerrain has no such fallback,
+// so the budget is only a target for the blocks its octrees don't use.
+// Accessible from scripts as the `VoxelMemoryBudget` singleton.
+class VoxelMemoryBudget : public Object {
+	GDCLASS(VoxelMemoryBudget, Object)
+public:
+	// Block a user can unload
+	struct Candidate {
+		Vector3i position;
+		unsigned int lod_index = 0;
+		uint32_t memory_usage = 0;
+		uint64_t last_viewed_time = 0;
+		// Distance to the viewer, in any unit as long as it's the same for all users
+		float distance_squared = 0.f;
+		unsigned int user_index = 0;
+	};
+
+	// Implemented by terrains. Everything is called from the main thread.
+	class User {
+	public:
+		virtual ~User() {}
+		virtual uint64_t get_block_memory_usage() const = 0;
+		// Adds blocks which can be unloaded safely, and which viewers don't need
+		virtual void get_eviction_candidates(std::vector<Candidate> &candidates, uint64_t now) = 0;
+		virtual void evict_block(Vector3i position, unsigned int lod_index) = 0;
+	};
+
+	static void create_singleton();
+	static void destroy_singleton();
+	static VoxelMemoryBudget *get_singleton();
+
+	VoxelMemoryBudget() {}
+
+	// In bytes. Zero means there is no limit.
+	void set_budget(int64_t budget);
+	int64_t get_budget() const;
+
+	int64_t get_usage() const;
+
+	void add_user(User *user);
+	void remove_user(User *user);
+
+	// Unloads blocks if the budget is exceeded. Users call this every frame, but it only runs once per frame.
+	void process();
+
+	// Blocks unloaded by the last call to process()
+	inline int get_evicted_block_count() const { return _evicted_block_count; }
+	// Bytes still above the budget after the last call to process(), when blocks viewers need don't fit
+	inline int64_t get_overrun_bytes() const { return _overrun_bytes; }
+
+	Dictionary get_statistics() const;
+
+private:
+	static void _bind_methods();
+
+	std::vector<User *> _users;
+	std::vector<Candidate> _candidates;
+	int64_t _budget = 0;
+	uint64_t _last_process_frame = 0;
+	int _evicted_block_count = 0;
+	int64_t _evicted_bytes = 0;
+	int64_t _overrun_bytes = 0;
+};
+
+#endif // VOXEL_MEMORY_BUDGET_H
@@ -2,9 +2,50 @@
 #include "../meshers/transvoxel/voxel_mesher_transvoxel.h"
 #include "../util/utility.h"
 #include "voxel_lod_terrain.h"
+#include "voxel_server.h"
 #include <core/os/os.h>
 
-VoxelMeshUpdater::VoxelMeshUpdater(unsigned int thread_count, MeshingParams params) {
+struct VoxelMeshUpdater::Context {
+	// Configured meshers, which are not used directly
+	Ref<VoxelMesher> blocky_mesher;
+	Ref<VoxelMesher> smooth_mesher;
+	// Meshers used by each job of the server, set when the job first needs them.
+	// Data threads get their own, because job indexes are only unique within a pool.
+	FixedArray<Ref<VoxelMesher>, Mgr::MAX_JOBS> job_blocky_meshers;
+	FixedArray<Ref<VoxelMesher>, Mgr::MAX_JOBS> job_smooth_meshers;
+	FixedArray<Ref<VoxelMesher>, Mgr::MAX_JOBS> data_job_blocky_meshers;
+	FixedArray<Ref<VoxelMesher>, Mgr::MAX_JOBS> data_job_smooth_meshers;
+	// Locked to clone meshers
+	Mutex *mutex = nullptr;
+	int minimum_padding = 0;
+	int maximum_padding = 0;
+
+	~Context() {
+		memdelete(mutex);
+	}
+
+	// A job index is only used by one thread at a time, so its meshers can be accessed without locking
+	void get_job_meshers(bool data_job, unsigned int job_index, Ref<VoxelMesher> &out_blocky_mesher, Ref<VoxelMesher> &out_smooth_mesher) {
+		Ref<VoxelMesher> &job_blocky_mesher = data_job ? data_job_blocky_meshers[job_index] : job_blocky_meshers[job_index];
+		Ref<VoxelMesher> &job_smooth_mesher = data_job ? data_job_smooth_meshers[job_index] : job_smooth_meshers[job_index];
+
+		if (job_blocky_mesher.is_null() && blocky_mesher.is_valid()) {
+			// Need to clone them because they are not thread-safe due to memory pooling.
+			// Also thanks to the wonders of ref_pointer() being private we trigger extra refs/unrefs for no reason
+			MutexLock lock(mutex);
+			job_blocky_mesher = Ref<VoxelMesher>(blocky_mesher->clone());
+		}
+		if (job_smooth_mesher.is_null() && smooth_mesher.is_valid()) {
+			MutexLock lock(mutex);
+			job_smooth_mesher = Ref<VoxelMesher>(smooth_mesher->clone());
+		}
+
+		out_blocky_mesher = job_blocky_mesher;
+		out_smooth_mesher = job_smooth_mesher;
+	}
+};
+
+VoxelMeshUpdater::VoxelMeshUpdater(MeshingParams params) {
 
 	print_line("Constructing VoxelMeshUpdater");
 
@@ -29,59 +70,87 @@ VoxelMeshUpdater::VoxelMeshUpdater(unsigned int thread_count, MeshingParams para
 		_maximum_padding = max(_maximum_padding, smooth_mesher->get_maximum_padding());
 	}
 
-	FixedArray<Mgr::BlockProcessingFunc, VoxelConstants::MAX_LOD> processors;
+	_context = std::make_shared<Context>();
+	_context->blocky_mesher = blocky_mesher;
+	_context->smooth_mesher = smooth_mesher;
+	_context->mutex = Mutex::create();
+	_context->minimum_padding = _minimum_padding;
+	_context->maximum_padding = _maximum_padding;
 
-	for (unsigned int i = 0; i < thread_count; ++i) {
-
-		if (i > 0) {
-			// Need to clone them because they are not thread-safe due to memory pooling.
-			// Also thanks to the wonders of ref_pointer() being private we trigger extra refs/unrefs for no reason
-			if (blocky_mesher.is_valid()) {
-				blocky_mesher = Ref<VoxelMesher>(blocky_mesher->clone());
-			}
-			if (smooth_mesher.is_valid()) {
-				smooth_mesher = Ref<VoxelMesher>(smooth_mesher->clone());
-			}
-		}
-
-		processors[i] = [this, blocky_mesher, smooth_mesher](const ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs, Mgr::ProcessorStats &_) {
-			this->process_blocks_thread_func(inputs, outputs, blocky_mesher, smooth_mesher);
-		};
-	}
-
-	_mgr = memnew(Mgr(thread_count, 50, processors));
+	_volume_id = VoxelServer::get_singleton()->add_mesh_volume();
 }
 
 VoxelMeshUpdater::~VoxelMeshUpdater() {
 	print_line("Destroying VoxelMeshUpdater");
-	if (_mgr) {
-		memdelete(_mgr);
+	// Requests being processed keep the meshers alive, their results will be dropped
+	VoxelServer::get_singleton()->remove_mesh_volume(_volume_id);
+}
+
+void VoxelMeshUpdater::push(Input &input) {
+	for (size_t i = 0; i < input.blocks.size(); ++i) {
+		input.blocks[i].data.context = _context;
 	}
+	VoxelServer::get_singleton()->push_mesh_requests(_volume_id, input);
 }
 
-void VoxelMeshUpdater::process_blocks_thread_func(
-		const ArraySlice<InputBlock> inputs,
-		ArraySlice<OutputBlock> outputs,
-		Ref<VoxelMesher> blocky_mesher,
-		Ref<VoxelMesher> smooth_mesher) {
+void VoxelMeshUpdater::pop(Output &output) {
+	VoxelServer::get_singleton()->pop_mesh_results(_volume_id, output);
+}
+
+// Can run in multiple threads
+void VoxelMeshUpdater::process_blocks(unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs) {
 
 	CRASH_COND(inputs.size() != outputs.size());
 
+	VoxelBufferPool &buffer_pool = VoxelServer::get_singleton()->get_meshing_buffer_pool();
+
 	for (unsigned int i = 0; i < inputs.size(); ++i) {
 
 		const InputBlock &ib = inputs[i];
 		const InputBlockData &block = ib.data;
 		OutputBlockData &output = outputs[i].data;
 
-		CRASH_COND(block.voxels.is_null());
-
-		VoxelMesher::Input input = { **block.voxels, ib.lod };
+		CRASH_COND(block.voxels.is_empty());
+		CRASH_COND(block.context == nullptr);
 
-		if (blocky_mesher.is_valid()) {
-			blocky_mesher->build(output.blocky_surfaces, input);
-		}
-		if (smooth_mesher.is_valid()) {
-			smooth_mesher->build(output.smooth_surfaces, input);
+		if (ib.cancellation_token.is_cancelled()) {
+			continue;
 		}
+
+		// Copying here rather than when the request is made keeps it off the main thread
+		Ref<VoxelBuffer> voxels = buffer_pool.acquire(block.voxels.get_box().size, block.channels_mask);
+		block.voxels.copy_to(**voxels, block.channels_mask);
+
+		build_mesh(*block.context, false, job_index, **voxels, ib.lod, &ib.cancellation_token, output);
+
+		buffer_pool.recycle(voxels, block.channels_mask);
+	}
+}
+
+void VoxelMeshUpdater::get_padding(const Context &context, int &out_minimum_padding, int &out_maximum_padding) {
+	out_minimum_padding = context.minimum_padding;
+	out_maximum_padding = context.maximum_padding;
+}
+
+void VoxelMeshUpdater::process_block_from_data_job(Context &context, unsigned int job_index,
+		const VoxelBuffer &voxels, int lod, const CancellationToken *cancellation_token, OutputBlockData &output) {
+
+	build_mesh(context, true, job_index, voxels, lod, cancellation_token, output);
+}
+
+void VoxelMeshUpdater::build_mesh(Context &context, bool data_job, unsigned int job_index,
+		const VoxelBuffer &voxels, int lod, const CancellationToken *cancellation_token, OutputBlockData &output) {
+
+	Ref<VoxelMesher> blocky_mesher;
+	Ref<VoxelMesher> smooth_mesher;
+	context.get_job_meshers(data_job, job_index, blocky_mesher, smooth_mesher);
+
+	VoxelMesher::Input input = { voxels, lod, cancellation_token };
+
+	if (blocky_mesher.is_valid()) {
+		blocky_mesher->build(output.blocky_surfaces, input);
+	}
+	if (smooth_mesher.is_valid()) {
+		smooth_mesher->build(output.smooth_surfaces, input);
 	}
 }
@@ -9,11 +9,21 @@
 #include "../voxel_buffer.h"
 
 #include "block_thread_manager.h"
+#include "voxel_neighborhood.h"
 
+#include <memory>
+
+// Builds meshes of one terrain, using threads of VoxelServer.
 class VoxelMeshUpdater {
 public:
+	struct Context;
+
 	struct InputBlockData {
-		Ref<VoxelBuffer> voxels;
+		// Voxels of the block padded with those of its neighbors, gathered by the thread building the mesh
+		VoxelNeighborhood voxels;
+		unsigned int channels_mask = 0;
+		// Meshers of the terrain the request comes from
+		std::shared_ptr<Context> context;
 	};
 
 	struct OutputBlockData {
@@ -34,23 +44,34 @@ public:
 	typedef Mgr::Input Input;
 	typedef Mgr::Output Output;
 	typedef Mgr::Stats Stats;
+	typedef Mgr::BlockLocation BlockLocation;
 
-	VoxelMeshUpdater(unsigned int thread_count, MeshingParams params);
+	VoxelMeshUpdater(MeshingParams params);
 	~VoxelMeshUpdater();
 
-	void push(const Input &input) { _mgr->push(input); }
-	void pop(Output &output) { _mgr->pop(output); }
+	void push(Input &input);
+	void pop(Output &output);
 
 	int get_minimum_padding() const { return _minimum_padding; }
 	int get_maximum_padding() const { return _maximum_padding; }
 
+	// Lets data threads mesh blocks they just loaded, see VoxelDataLoader::set_mesh_pipeline()
+	std::shared_ptr<Context> get_context() const { return _context; }
+
+	// Called from VoxelServer threads. Batches can contain requests from several terrains.
+	static void process_blocks(unsigned int job_index, ArraySlice<InputBlock> inputs, ArraySlice<OutputBlock> outputs);
+
+	// Called from data threads of VoxelServer, with voxels padded like those of requests
+	static void get_padding(const Context &context, int &out_minimum_padding, int &out_maximum_padding);
+	static void process_block_from_data_job(Context &context, unsigned int job_index,
+			const VoxelBuffer &voxels, int lod, const CancellationToken *cancellation_token, OutputBlockData &output);
+
 private:
-	void process_blocks_thread_func(const ArraySlice<InputBlock> inputs,
-			ArraySlice<OutputBlock> outputs,
-			Ref<VoxelMesher> blocky_mesher,
-			Ref<VoxelMesher> smooth_mesher);
+	static void build_mesh(Context &context, bool data_job, unsigned int job_index,
+			const VoxelBuffer &voxels, int lod, const CancellationToken *cancellation_token, OutputBlockData &output);
 
-	Mgr *_mgr = nullptr;
+	std::shared_ptr<Context> _context;
+	uint32_t _volume_id = 0;
 	int _minimum_padding = 0;
 	int _maximum_padding = 0;
 };
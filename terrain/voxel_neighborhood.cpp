@@ -0,0 +1,70 @@
+#include "voxel_neighborhood.h"
+#include "voxel_map.h"
+
+void VoxelNeighborhood::create(const VoxelMap &map, Rect3i voxel_box, SnapshotCache &snapshots) {
+
+	_box = voxel_box;
+	_block_size = map.get_block_size();
+	// Not limited to the 27 blocks around one, paddings may be larger than blocks
+	_block_box = voxel_box.downscaled(_block_size);
+
+	_blocks.clear();
+	_blocks.reserve(_block_box.size.volume());
+
+	_block_box.for_each_cell([this, &map, &snapshots](Vector3i bpos) {
+		// Neighboring views need the same blocks
+		const Ref<VoxelBuffer> *snapshot = snapshots.getptr(bpos);
+		if (snapshot != nullptr) {
+			_blocks.push_back(*snapshot);
+			return;
+		}
+		Ref<VoxelBuffer> voxels;
+		const VoxelBlock *block = map.get_block(bpos);
+		if (block != nullptr) {
+			// Shares data instead of copying voxels
+			voxels = block->voxels->duplicate();
+		}
+		snapshots.set(bpos, voxels);
+		_blocks.push_back(voxels);
+	});
+
+	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+		_default_voxel[channel] = map.get_default_voxel(channel);
+	}
+}
+
+void VoxelNeighborhood::clear() {
+	_blocks.clear();
+	_box = Rect3i();
+	_block_box = Rect3i();
+}
+
+void VoxelNeighborhood::copy_to(VoxelBuffer &dst, unsigned int channels_mask) const {
+
+	ERR_FAIL_COND(dst.get_size() != _box.size);
+	ERR_FAIL_COND(_blocks.size() != (size_t)_block_box.size.volume());
+
+	const Vector3i min_pos = _box.pos;
+	const Vector3i max_pos = _box.pos + _box.size;
+	const Vector3i block_size_v(_block_size);
+
+	for (unsigned int channel = 0; channel < VoxelBuffer::MAX_CHANNELS; ++channel) {
+
+		if (((1 << channel) & channels_mask) == 0) {
+			continue;
+		}
+
+		unsigned int i = 0;
+		_block_box.for_each_cell([this, &dst, channel, min_pos, max_pos, block_size_v, &i](Vector3i bpos) {
+			const Ref<VoxelBuffer> &src = _blocks[i++];
+			const Vector3i offset = bpos * _block_size;
+
+			if (src.is_valid()) {
+				// Note: copy_from takes care of clamping the area if it's on an edge
+				dst.copy_from(**src, min_pos - offset, max_pos - offset, offset - min_pos, channel);
+			} else {
+				dst.fill_area(_default_voxel[channel], offset - min_pos, offset - min_pos + block_size_v, channel);
+			}
+		});
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef VOXEL_NEIGHBORHOOD_H
+#define VOXEL_NEIGHBORHOOD_H
+
+#include "../math/rect3i.h"
+#include "../util/fixed_array.h"
+#include "../voxel_buffer.h"
+
+#include <core/hash_map.h>
+#include <vector>
+
+class VoxelMap;
+
+// Read-only view of the voxels of a map within a box, typically a block padded with voxels of its neighbors.
+// Blocks are not copied, the view keeps snapshots of them sharing their data (see VoxelBuffer::duplicate()).
+// If the map gets edited afterwards, modified channels get their own copy, so the view never changes.
+// It is cheap to create on the main thread. Voxels still get copied into a padded buffer by copy_to(),
+// but that can be done by the thread which needs them.
+class VoxelNeighborhood {
+public:
+	// Snapshots of blocks, shared by views created in a row so each block is only duplicated once.
+	// Null where the map has no block. Only valid until the map is modified.
+	typedef HashMap<Vector3i, Ref<VoxelBuffer>, Vector3iHasher> SnapshotCache;
+
+	// Must be called from the thread owning the map.
+	// Blocks missing from the map read as the default voxel values of the map.
+	void create(const VoxelMap &map, Rect3i voxel_box, SnapshotCache &snapshots);
+	void clear();
+
+	inline Rect3i get_box() const { return _box; }
+	inline bool is_empty() const { return _blocks.empty(); }
+
+	// Copies voxels of the box into a buffer of the same size, like VoxelMap::get_buffer_copy() would.
+	void copy_to(VoxelBuffer &dst, unsigned int channels_mask) const;
+
+private:
+	// Null where the map had no block. Ordered like Rect3i::for_each_cell().
+	std::vector<Ref<VoxelBuffer> > _blocks;
+	Rect3i _box;
+	Rect3i _block_box;
+	int _block_size = 0;
+	FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> _default_voxel;
+};
+
+#endif // VOXEL_NEIGHBORHOOD_H
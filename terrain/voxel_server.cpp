@@ -0,0 +1,114 @@
+#include "voxel_server.h"
+
+#include <core/os/os.h>
+
+namespace {
+VoxelServer *g_voxel_server = nullptr;
+}
+
+void VoxelServer::create_singleton() {
+	CRASH_COND(g_voxel_server != nullptr);
+	g_voxel_server = memnew(VoxelServer);
+}
+
+void VoxelServer::destroy_singleton() {
+	CRASH_COND(g_voxel_server == nullptr);
+	VoxelServer *server = g_voxel_server;
+	g_voxel_server = nullptr;
+	memdelete(server);
+}
+
+VoxelServer *VoxelServer::get_singleton() {
+	CRASH_COND(g_voxel_server == nullptr);
+	return g_voxel_server;
+}
+
+VoxelServer::VoxelServer() {
+
+	// One core is left to the main thread. Streams are often bound by I/O, so most threads go to meshing.
+	const int processor_count = OS::get_singleton()->get_processor_count();
+	const int data_thread_count = CLAMP(processor_count / 4, 1, 2);
+	const int mesh_thread_count = CLAMP(processor_count - 1 - data_thread_count, 1, VoxelMeshUpdater::Mgr::MAX_JOBS);
+
+	print_line(String("Constructing VoxelServer with {0} data threads and {1} mesh threads")
+					   .format(varray(data_thread_count, mesh_thread_count)));
+
+	// Streams like region files work better when given many blocks at once
+	_data_pool.mgr = memnew(VoxelDataLoader::Mgr(data_thread_count, VoxelDataLoader::process_blocks, true, 128));
+
+	_mesh_pool.mgr = memnew(VoxelMeshUpdater::Mgr(mesh_thread_count,
+			[](unsigned int job_index,
+					ArraySlice<VoxelMeshUpdater::InputBlock> inputs,
+					ArraySlice<VoxelMeshUpdater::OutputBlock> outputs,
+					VoxelMeshUpdater::Mgr::ProcessorStats &_) {
+				VoxelMeshUpdater::process_blocks(job_index, inputs, outputs);
+			}));
+}
+
+VoxelServer::~VoxelServer() {
+	print_line("Destroying VoxelServer");
+	// Waits for requests which can't be discarded, like saves
+	memdelete(_data_pool.mgr);
+	memdelete(_mesh_pool.mgr);
+}
+
+uint32_t VoxelServer::add_data_volume() {
+	return _data_pool.add_volume();
+}
+
+void VoxelServer::remove_data_volume(uint32_t volume_id) {
+	_data_pool.remove_volume(volume_id);
+}
+
+void VoxelServer::push_data_requests(uint32_t volume_id, VoxelDataLoader::Input &input) {
+	_data_pool.push(volume_id, input);
+}
+
+void VoxelServer::pop_data_results(uint32_t volume_id, VoxelDataLoader::Output &output) {
+	_data_pool.pop(volume_id, output);
+}
+
+uint32_t VoxelServer::add_mesh_volume() {
+	return _mesh_pool.add_volume();
+}
+
+void VoxelServer::remove_mesh_volume(uint32_t volume_id) {
+	_mesh_pool.remove_volume(volume_id);
+}
+
+void VoxelServer::push_mesh_requests(uint32_t volume_id, VoxelMeshUpdater::Input &input) {
+	_mesh_pool.push(volume_id, input);
+}
+
+void VoxelServer::pop_mesh_results(uint32_t volume_id, VoxelMeshUpdater::Output &output) {
+	_mesh_pool.pop(volume_id, output);
+}
+
+void VoxelServer::set_data_thread_count(int count) {
+	ERR_FAIL_COND(count < 1 || count > VoxelDataLoader::Mgr::MAX_JOBS);
+	_data_pool.mgr->set_job_count(count);
+}
+
+int VoxelServer::get_data_thread_count() const {
+	return _data_pool.mgr->get_job_count();
+}
+
+void VoxelServer::set_mesh_thread_count(int count) {
+	ERR_FAIL_COND(count < 1 || count > VoxelMeshUpdater::Mgr::MAX_JOBS);
+	_mesh_pool.mgr->set_job_count(count);
+}
+
+int VoxelServer::get_mesh_thread_count() const {
+	return _mesh_pool.mgr->get_job_count();
+}
+
+void VoxelServer::_bind_methods() {
+
+	ClassDB::bind_method(D_METHOD("set_data_thread_count", "count"), &VoxelServer::set_data_thread_count);
+	ClassDB::bind_method(D_METHOD("get_data_thread_count"), &VoxelServer::get_data_thread_count);
+	ClassDB::bind_method(D_METHOD("set_mesh_thread_count", "count"), &VoxelServer::set_mesh_thread_count);
+	ClassDB::bind_method(D_METHOD("get_mesh_thread_count"), &VoxelServer::get_mesh_thread_count);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "data_thread_count"), "set_data_thread_count", "get_data_thread_count");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "mesh_thread_count"), "set_mesh_thread_count", "get_mesh_thread_count");
+}
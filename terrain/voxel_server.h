@@ -0,0 +1,131 @@
+#ifndef VOXEL_SERVER_H
+#define VOXEL_SERVER_H
+
+#include "voxel_buffer_pool.h"
+#include "voxel_data_loader.h"
+#include "voxel_mesh_updater.h"
+
+#include <core/hash_map.h>
+#include <core/object.h>
+
+// Process-wide pool of threads loading, generating, saving and meshing blocks for all terrains.
+// Terrains used to own threads each, which oversubscribed cores as soon as there were more than one.
+// Requests of all terrains go in the same queues, where they are prioritized relatively to the viewer
+// of the terrain they come from. Results are dispatched back to each terrain, along with stats.
+// Terrains don't use this directly, they go through VoxelDataLoader and VoxelMeshUpdater.
+// Thread counts can be changed at any time, for example to load the world faster before the game starts.
+// Accessible from scripts as the `VoxelServer` singleton. Must be used from the main thread.
+class VoxelServer : public Object {
+	GDCLASS(VoxelServer, Object)
+public:
+	static void create_singleton();
+	static void destroy_singleton();
+	static VoxelServer *get_singleton();
+
+	VoxelServer();
+	~VoxelServer();
+
+	uint32_t add_data_volume();
+	void remove_data_volume(uint32_t volume_id);
+	void push_data_requests(uint32_t volume_id, VoxelDataLoader::Input &input);
+	void pop_data_results(uint32_t volume_id, VoxelDataLoader::Output &output);
+
+	uint32_t add_mesh_volume();
+	void remove_mesh_volume(uint32_t volume_id);
+	void push_mesh_requests(uint32_t volume_id, VoxelMeshUpdater::Input &input);
+	void pop_mesh_results(uint32_t volume_id, VoxelMeshUpdater::Output &output);
+
+	// Threads loading, generating and saving blocks
+	void set_data_thread_count(int count);
+	int get_data_thread_count() const;
+
+	// Threads building meshes
+	void set_mesh_thread_count(int count);
+	int get_mesh_thread_count() const;
+
+	// Padded buffers given to meshers. Can be used from any thread.
+	VoxelBufferPool &get_meshing_buffer_pool() { return _meshing_buffer_pool; }
+
+private:
+	static void _bind_methods();
+
+	// Results waiting for each volume to pick them up
+	template <typename Mgr_T>
+	struct Pool {
+		struct Volume {
+			typename Mgr_T::Output output;
+			// Histograms need many samples to be useful, so they are accumulated since the volume was added
+			typename Mgr_T::LatencyStats latency;
+		};
+
+		Mgr_T *mgr = nullptr;
+		HashMap<uint32_t, Volume> volumes;
+		uint32_t next_volume_id = 1;
+
+		uint32_t add_volume() {
+			// IDs are not reused, so late results of a removed volume can't be mistaken for another's
+			const uint32_t id = next_volume_id++;
+			volumes[id] = Volume();
+			return id;
+		}
+
+		void remove_volume(uint32_t volume_id) {
+			ERR_FAIL_COND(!volumes.has(volume_id));
+			volumes.erase(volume_id);
+			mgr->remove_volume(volume_id);
+		}
+
+		void push(uint32_t volume_id, typename Mgr_T::Input &input) {
+			ERR_FAIL_COND(!volumes.has(volume_id));
+			input.volume_id = volume_id;
+			mgr->push(input);
+		}
+
+		void pop(uint32_t volume_id, typename Mgr_T::Output &output) {
+			ERR_FAIL_COND(!volumes.has(volume_id));
+			dispatch();
+			typename Mgr_T::Output &volume_output = volumes[volume_id].output;
+			output.blocks.append_array(volume_output.blocks);
+			output.stats = volume_output.stats;
+			volume_output.blocks.clear();
+			volume_output.stats = typename Mgr_T::Stats();
+		}
+
+		void dispatch() {
+			typename Mgr_T::Output all;
+			mgr->pop(all);
+
+			for (int i = 0; i < all.blocks.size(); ++i) {
+				const typename Mgr_T::OutputBlock &ob = all.blocks[i];
+				Volume *volume = volumes.getptr(ob.volume_id);
+				// Results of removed volumes are dropped
+				if (volume != nullptr) {
+					volume->output.blocks.push_back(ob);
+				}
+			}
+
+			// Each volume gets stats of its own requests, accumulated until it reads them.
+			// Only the state of threads is shared by all volumes.
+			const uint32_t *key = nullptr;
+			while ((key = volumes.next(key))) {
+				Volume &volume = volumes[*key];
+				typename Mgr_T::Stats &stats = volume.output.stats;
+				const typename Mgr_T::Stats *volume_stats = all.volume_stats.getptr(*key);
+				if (volume_stats != nullptr) {
+					Mgr_T::merge_stats(stats, *volume_stats);
+					Mgr_T::merge_latency(volume.latency, volume_stats->latency);
+				}
+				stats.latency = volume.latency;
+				stats.remaining_blocks = all.stats.remaining_blocks;
+				stats.thread_count = all.stats.thread_count;
+			}
+		}
+	};
+
+	// Declared before pools, so it is destroyed after them. Meshing threads use it until they are stopped.
+	VoxelBufferPool _meshing_buffer_pool;
+	Pool<VoxelDataLoader::Mgr> _data_pool;
+	Pool<VoxelMeshUpdater::Mgr> _mesh_pool;
+};
+
+#endif // VOXEL_SERVER_H
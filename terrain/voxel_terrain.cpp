@@ -3,16 +3,17 @@
 #include "../streams/voxel_stream_file.h"
 #include "../util/profiling_clock.h"
 #include "../util/utility.h"
+#include "../voxel_memory_pool.h"
 #include "voxel_block.h"
 #include "voxel_map.h"
+#include "voxel_server.h"
 
 #include <core/core_string_names.h>
 #include <core/engine.h>
 #include <core/os/os.h>
+#include <scene/3d/camera.h>
 #include <scene/3d/mesh_instance.h>
 
-const uint32_t MAIN_THREAD_MESHING_BUDGET_MS = 8;
-
 VoxelTerrain::VoxelTerrain() {
 	// Note: don't do anything heavy in the constructor.
 	// Godot may create and destroy dozens of instances of all node types on startup,
@@ -21,6 +22,7 @@ VoxelTerrain::VoxelTerrain() {
 	_map.instance();
 
 	_view_distance_blocks = 8;
+	_budget_view_distance_blocks = _view_distance_blocks;
 	_last_view_distance_blocks = 0;
 
 	_stream_thread = nullptr;
@@ -36,6 +38,10 @@ VoxelTerrain::VoxelTerrain() {
 VoxelTerrain::~VoxelTerrain() {
 	print_line("Destroying VoxelTerrain");
 
+	if (_uses_memory_budget) {
+		VoxelMemoryBudget::get_singleton()->remove_user(this);
+	}
+
 	if (_stream_thread) {
 		// Schedule saving of all modified blocks,
 		// without copy because we are destroying the map anyways
@@ -215,6 +221,19 @@ void VoxelTerrain::set_generate_collisions(bool enabled) {
 	_generate_collisions = enabled;
 }
 
+void VoxelTerrain::set_deduplicate_blocks(bool enabled) {
+	_map->set_deduplication_enabled(enabled);
+}
+
+bool VoxelTerrain::get_deduplicate_blocks() const {
+	return _map->is_deduplication_enabled();
+}
+
+void VoxelTerrain::set_pipelined_meshing(bool enabled) {
+	_pipelined_meshing = enabled;
+	update_mesh_pipeline();
+}
+
 int VoxelTerrain::get_view_distance() const {
 	return _view_distance_blocks * _map->get_block_size();
 }
@@ -230,25 +249,35 @@ void VoxelTerrain::set_view_distance(int distance_in_voxels) {
 }
 
 void VoxelTerrain::set_viewer_path(NodePath path) {
-	_viewer_path = path;
+	_viewer_paths.clear();
+	if (!path.is_empty()) {
+		_viewer_paths.push_back(path);
+	}
 }
 
 NodePath VoxelTerrain::get_viewer_path() const {
-	return _viewer_path;
+	if (_viewer_paths.empty()) {
+		return NodePath();
+	}
+	return _viewer_paths[0];
 }
 
-Spatial *VoxelTerrain::get_viewer() const {
-	if (!is_inside_tree()) {
-		return nullptr;
-	}
-	if (_viewer_path.is_empty()) {
-		return nullptr;
+void VoxelTerrain::set_viewer_paths(Array paths) {
+	_viewer_paths.clear();
+	for (int i = 0; i < paths.size(); ++i) {
+		const NodePath path = paths[i];
+		if (!path.is_empty()) {
+			_viewer_paths.push_back(path);
+		}
 	}
-	Node *node = get_node(_viewer_path);
-	if (node == nullptr) {
-		return nullptr;
+}
+
+Array VoxelTerrain::get_viewer_paths() const {
+	Array paths;
+	for (unsigned int i = 0; i < _viewer_paths.size(); ++i) {
+		paths.append(_viewer_paths[i]);
 	}
-	return Object::cast_to<Spatial>(node);
+	return paths;
 }
 
 void VoxelTerrain::set_material(unsigned int id, Ref<Material> material) {
@@ -316,10 +345,25 @@ void VoxelTerrain::immerge_block(Vector3i bpos) {
 
 	ERR_FAIL_COND(_map.is_null());
 
+	const VoxelBlock *block = _map->get_block(bpos);
+	if (block != nullptr && block->get_mesh_state() == VoxelBlock::MESH_UPDATE_SENT) {
+		// Stop meshing it, the result would be dropped
+		VoxelMeshUpdater::BlockLocation location;
+		location.position = bpos;
+		_meshes_to_cancel.push_back(location);
+	}
+
 	// Note: no need to copy the block because it gets removed from the map anyways
 	_map->remove_block(bpos, ScheduleSaveAction{ _blocks_to_save, false });
 
-	_loading_blocks.erase(bpos);
+	Set<Vector3i>::Element *E = _loading_blocks.find(bpos);
+	if (E != nullptr) {
+		// Stop loading it, the result would be dropped
+		_loading_blocks.erase(E);
+		VoxelDataLoader::BlockLocation location;
+		location.position = bpos;
+		_loads_to_cancel.push_back(location);
+	}
 
 	// Blocks in the update queue will be cancelled in _process,
 	// because it's too expensive to linear-search all blocks for each block
@@ -341,6 +385,8 @@ Dictionary VoxelTerrain::get_statistics() const {
 	Dictionary d;
 	d["stream"] = VoxelDataLoader::Mgr::to_dictionary(_stats.stream);
 	d["updater"] = VoxelMeshUpdater::Mgr::to_dictionary(_stats.updater);
+	d["memory_pool"] = VoxelMemoryPool::to_dictionary(VoxelMemoryPool::get_singleton()->get_stats());
+	d["meshing_buffer_pool"] = VoxelBufferPool::to_dictionary(VoxelServer::get_singleton()->get_meshing_buffer_pool().get_stats());
 
 	// Breakdown of time spent in _process
 	d["time_detect_required_blocks"] = _stats.time_detect_required_blocks;
@@ -352,7 +398,14 @@ Dictionary VoxelTerrain::get_statistics() const {
 	d["remaining_main_thread_blocks"] = (int)_blocks_pending_main_thread_update.size();
 	d["dropped_block_loads"] = _stats.dropped_block_loads;
 	d["dropped_block_meshs"] = _stats.dropped_block_meshs;
+	d["skipped_block_meshs"] = _stats.skipped_block_meshs;
+	d["pipelined_block_meshs"] = _stats.pipelined_block_meshs;
 	d["updated_blocks"] = _stats.updated_blocks;
+	d["mesh_upload"] = _upload_budget.to_dictionary();
+	d["memory_usage"] = _map->get_memory_usage();
+	d["deduplication"] = VoxelMap::to_dictionary(_map->get_deduplication_stats());
+	d["memory_budget"] = VoxelMemoryBudget::get_singleton()->get_statistics();
+	d["budget_view_distance"] = _budget_view_distance_blocks * _map->get_block_size();
 
 	return d;
 }
@@ -397,7 +450,8 @@ void VoxelTerrain::start_updater() {
 
 	params.library = _library;
 
-	_block_updater = memnew(VoxelMeshUpdater(1, params));
+	_block_updater = memnew(VoxelMeshUpdater(params));
+	update_mesh_pipeline();
 }
 
 void VoxelTerrain::stop_updater() {
@@ -413,10 +467,12 @@ void VoxelTerrain::stop_updater() {
 	if (_block_updater) {
 		memdelete(_block_updater);
 		_block_updater = NULL;
+		update_mesh_pipeline();
 	}
 
 	_blocks_pending_main_thread_update.clear();
 	_blocks_pending_update.clear();
+	_meshes_to_cancel.clear();
 
 	ResetMeshStateAction a;
 	_map->for_all_blocks(a);
@@ -427,7 +483,8 @@ void VoxelTerrain::start_streamer() {
 	ERR_FAIL_COND(_stream_thread != nullptr);
 	ERR_FAIL_COND(_stream.is_null());
 
-	_stream_thread = memnew(VoxelDataLoader(1, _stream, get_block_size_pow2()));
+	_stream_thread = memnew(VoxelDataLoader(_stream, get_block_size_pow2()));
+	update_mesh_pipeline();
 }
 
 void VoxelTerrain::stop_streamer() {
@@ -439,6 +496,13 @@ void VoxelTerrain::stop_streamer() {
 
 	_loading_blocks.clear();
 	_blocks_pending_load.clear();
+	_loads_to_cancel.clear();
+}
+
+void VoxelTerrain::update_mesh_pipeline() {
+	if (_stream_thread != nullptr) {
+		_stream_thread->set_mesh_pipeline(_pipelined_meshing ? _block_updater : nullptr);
+	}
 }
 
 void VoxelTerrain::reset_map() {
@@ -665,14 +729,18 @@ void VoxelTerrain::_notification(int p_what) {
 	}
 }
 
-static void remove_positions_outside_box(
+static void remove_positions_outside_boxes(
 		Vector<Vector3i> &positions,
-		Rect3i box,
+		const std::vector<Rect3i> &boxes,
 		Set<Vector3i> &loading_set) {
 
 	for (int i = 0; i < positions.size(); ++i) {
 		const Vector3i bpos = positions[i];
-		if (!box.contains(bpos)) {
+		bool inside = false;
+		for (unsigned int j = 0; j < boxes.size() && !inside; ++j) {
+			inside = boxes[j].contains(bpos);
+		}
+		if (!inside) {
 			int last = positions.size() - 1;
 			positions.write[i] = positions[last];
 			positions.resize(last);
@@ -682,28 +750,46 @@ static void remove_positions_outside_box(
 	}
 }
 
-void VoxelTerrain::get_viewer_pos_and_direction(Vector3 &out_pos, Vector3 &out_direction) const {
+void VoxelTerrain::get_viewers(std::vector<Viewer> &out_viewers) const {
 
-	if (Engine::get_singleton()->is_editor_hint()) {
+	out_viewers.clear();
 
+	if (Engine::get_singleton()->is_editor_hint()) {
 		// TODO Use editor's camera here
-		out_pos = Vector3();
-		out_direction = Vector3(0, -1, 0);
-
-	} else {
-		// TODO Have option to use viewport camera
-		Spatial *viewer = get_viewer();
-		if (viewer) {
-
-			Transform gt = viewer->get_global_transform();
-			out_pos = gt.origin;
-			out_direction = -gt.basis.get_axis(Vector3::AXIS_Z);
+		out_viewers.push_back(Viewer());
+		return;
+	}
 
-		} else {
+	// TODO Have option to use viewport camera
+	if (is_inside_tree()) {
+		for (unsigned int i = 0; i < _viewer_paths.size(); ++i) {
+			const Spatial *node = Object::cast_to<Spatial>(get_node(_viewer_paths[i]));
+			if (node == nullptr) {
+				continue;
+			}
+			Viewer viewer;
+			viewer.position = node->get_global_transform().origin;
+			viewer.camera = Object::cast_to<Camera>(node);
+			if (viewer.camera == nullptr) {
+				// The viewer can be a character with the current camera attached to it
+				const Camera *viewport_camera = get_viewport()->get_camera();
+				if (viewport_camera != nullptr && node->is_a_parent_of(viewport_camera)) {
+					viewer.camera = viewport_camera;
+				}
+			}
+			out_viewers.push_back(viewer);
+		}
+	}
 
-			// TODO Just remember last viewer pos
-			out_pos = (_last_viewer_block_pos << _map->get_block_size_pow2()).to_vec3();
-			out_direction = Vector3(0, -1, 0);
+	if (out_viewers.empty()) {
+		// Keep what was loaded around the last known viewers, or the origin
+		for (unsigned int i = 0; i < _last_viewer_block_positions.size(); ++i) {
+			Viewer viewer;
+			viewer.position = (_last_viewer_block_positions[i] << _map->get_block_size_pow2()).to_vec3();
+			out_viewers.push_back(viewer);
+		}
+		if (out_viewers.empty()) {
+			out_viewers.push_back(Viewer());
 		}
 	}
 }
@@ -711,10 +797,7 @@ void VoxelTerrain::get_viewer_pos_and_direction(Vector3 &out_pos, Vector3 &out_d
 void VoxelTerrain::send_block_data_requests() {
 
 	VoxelDataLoader::Input input;
-
-	Vector3 viewer_pos;
-	get_viewer_pos_and_direction(viewer_pos, input.priority_direction);
-	input.priority_position = _map->voxel_to_block(Vector3i(viewer_pos));
+	input.priority_viewers = _priority_viewers;
 
 	for (int i = 0; i < _blocks_pending_load.size(); ++i) {
 		VoxelDataLoader::InputBlock input_block;
@@ -729,6 +812,8 @@ void VoxelTerrain::send_block_data_requests() {
 	}
 
 	//print_line(String("Sending {0} block requests").format(varray(input.blocks_to_emerge.size())));
+	input.cancelled_blocks.swap(_loads_to_cancel);
+
 	_blocks_pending_load.clear();
 	_blocks_to_save.clear();
 
@@ -737,8 +822,9 @@ void VoxelTerrain::send_block_data_requests() {
 
 void VoxelTerrain::_process() {
 
-	// TODO Should be able to run without library, tho!
-	if (_library.is_null()) {
+	// Blocky meshing needs a library, but smooth terrains can run without one
+	const bool smooth = _stream.is_valid() && (_stream->get_used_channels_mask() & (1 << VoxelBuffer::CHANNEL_SDF));
+	if (_library.is_null() && !smooth) {
 		return;
 	}
 
@@ -750,46 +836,69 @@ void VoxelTerrain::_process() {
 
 	_stats.dropped_block_loads = 0;
 	_stats.dropped_block_meshs = 0;
+	_stats.skipped_block_meshs = 0;
+	_stats.pipelined_block_meshs = 0;
+
+	if (!_uses_memory_budget) {
+		// Registered once there may be blocks to account for, rather than in the constructor,
+		// because Godot creates instances of nodes it doesn't use
+		VoxelMemoryBudget::get_singleton()->add_user(this);
+		_uses_memory_budget = true;
+	}
 
-	// Get viewer location
+	// Get viewer locations
 	// TODO Transform to local (Spatial Transform)
-	Vector3 viewer_pos;
-	Vector3 viewer_direction;
-	get_viewer_pos_and_direction(viewer_pos, viewer_direction);
-	Vector3i viewer_block_pos = _map->voxel_to_block(Vector3i(viewer_pos));
+	std::vector<Viewer> viewers;
+	get_viewers(viewers);
+
+	std::vector<Vector3i> viewer_block_positions;
+	_priority_viewers.resize(viewers.size());
+	for (unsigned int i = 0; i < viewers.size(); ++i) {
+		const Vector3i bpos = _map->voxel_to_block(Vector3i(viewers[i].position));
+		viewer_block_positions.push_back(bpos);
+		_priority_viewers[i].position = bpos;
+		if (viewers[i].camera != nullptr) {
+			_priority_viewers[i].set_frustum(viewers[i].camera->get_frustum(), _map->get_block_size());
+		} else {
+			_priority_viewers[i].frustum_planes.clear();
+		}
+	}
 
-	// Find out which blocks need to appear and which need to be unloaded
-	{
-		Rect3i new_box = Rect3i::from_center_extents(viewer_block_pos, Vector3i(_view_distance_blocks));
-		Rect3i prev_box = Rect3i::from_center_extents(_last_viewer_block_pos, Vector3i(_last_view_distance_blocks));
+	update_budget_view_distance(viewers.size());
 
-		if (prev_box != new_box) {
-			//print_line(String("Loaded area changed: from ") + prev_box.to_string() + String(" to ") + new_box.to_string());
+	// Find out which blocks need to appear and which need to be unloaded.
+	// The loaded area is the union of boxes around each viewer.
+	{
+		std::vector<Rect3i> new_boxes;
+		for (unsigned int i = 0; i < viewer_block_positions.size(); ++i) {
+			new_boxes.push_back(Rect3i::from_center_extents(viewer_block_positions[i], Vector3i(_budget_view_distance_blocks)));
+		}
+		std::vector<Rect3i> prev_boxes;
+		for (unsigned int i = 0; i < _last_viewer_block_positions.size(); ++i) {
+			prev_boxes.push_back(Rect3i::from_center_extents(_last_viewer_block_positions[i], Vector3i(_last_view_distance_blocks)));
+		}
 
-			prev_box.difference(new_box, [this](Rect3i out_of_range_box) {
-				out_of_range_box.for_each_cell([=](Vector3i bpos) {
-					// Unload block
-					immerge_block(bpos);
-				});
+		if (prev_boxes != new_boxes) {
+			for_each_cell_in_difference(prev_boxes, new_boxes, [this](Vector3i bpos) {
+				// Unload block
+				immerge_block(bpos);
 			});
 
-			new_box.difference(prev_box, [this](Rect3i box_to_load) {
-				box_to_load.for_each_cell([=](Vector3i bpos) {
-					// Load or update block
-					make_block_dirty(bpos);
-				});
+			for_each_cell_in_difference(new_boxes, prev_boxes, [this](Vector3i bpos) {
+				// Load or update block
+				make_block_dirty(bpos);
 			});
 		}
 
 		// Eliminate pending blocks that aren't needed
-		remove_positions_outside_box(_blocks_pending_load, new_box, _loading_blocks);
-		remove_positions_outside_box(_blocks_pending_update, new_box, _loading_blocks);
+		remove_positions_outside_boxes(_blocks_pending_load, new_boxes, _loading_blocks);
+		remove_positions_outside_boxes(_blocks_pending_update, new_boxes, _loading_blocks);
 	}
 
 	_stats.time_detect_required_blocks = profiling_clock.restart();
 
-	_last_view_distance_blocks = _view_distance_blocks;
-	_last_viewer_block_pos = viewer_block_pos;
+	_last_view_distance_blocks = _budget_view_distance_blocks;
+	_last_viewer_block_positions = viewer_block_positions;
 
 	send_block_data_requests();
 
@@ -804,6 +913,10 @@ void VoxelTerrain::_process() {
 
 		_stats.stream = output.stats;
 
+		// Blocks stored in this pass, and those which also came with a mesh
+		std::vector<Vector3i> stored_positions;
+		std::vector<int> pipelined_output_indexes;
+
 		for (int i = 0; i < output.blocks.size(); ++i) {
 
 			const VoxelDataLoader::OutputBlock &ob = output.blocks[i];
@@ -850,6 +963,11 @@ void VoxelTerrain::_process() {
 			block = _map->set_block_buffer(block_pos, ob.data.voxels_loaded);
 			block->set_world(get_world());
 
+			stored_positions.push_back(block_pos);
+			if (ob.data.has_mesh) {
+				pipelined_output_indexes.push_back(i);
+			}
+
 			// TODO The following code appears to have order-dependency with block loading.
 			// i.e if block loading responses arrive in a different order they were requested in,
 			// some blocks will be stuck in LOAD. For now I made it so no re-ordering happens,
@@ -887,6 +1005,58 @@ void VoxelTerrain::_process() {
 				//OS::get_singleton()->print("Update (%i, %i, %i)\n", block_pos.x, block_pos.y, block_pos.z);
 			}
 		}
+
+		if (!pipelined_output_indexes.empty()) {
+			// Meshes made by data threads are only right if all neighbors they used got stored too,
+			// otherwise the map has different voxels around the block
+			Set<Vector3i> stored_set;
+			for (unsigned int i = 0; i < stored_positions.size(); ++i) {
+				stored_set.insert(stored_positions[i]);
+			}
+
+			Set<Vector3i> pipelined_set;
+			for (unsigned int i = 0; i < pipelined_output_indexes.size(); ++i) {
+				const VoxelDataLoader::OutputBlock &ob = output.blocks[pipelined_output_indexes[i]];
+
+				bool surrounded = true;
+				Vector3i ndir;
+				for (ndir.z = -1; ndir.z < 2 && surrounded; ++ndir.z) {
+					for (ndir.x = -1; ndir.x < 2 && surrounded; ++ndir.x) {
+						for (ndir.y = -1; ndir.y < 2 && surrounded; ++ndir.y) {
+							surrounded = stored_set.has(ob.position + ndir);
+						}
+					}
+				}
+				if (!surrounded) {
+					continue;
+				}
+
+				// The mesh goes with other results of the mesh updater, as if it was sent
+				VoxelBlock *block = _map->get_block(ob.position);
+				CRASH_COND(block == nullptr);
+				block->set_mesh_state(VoxelBlock::MESH_UPDATE_SENT);
+
+				VoxelMeshUpdater::OutputBlock mesh_ob;
+				mesh_ob.position = ob.position;
+				mesh_ob.data = ob.data.mesh;
+				_blocks_pending_main_thread_update.push_back(mesh_ob);
+
+				pipelined_set.insert(ob.position);
+				++_stats.pipelined_block_meshs;
+			}
+
+			if (!pipelined_set.empty()) {
+				// They got scheduled for update when they became surrounded
+				for (int i = 0; i < _blocks_pending_update.size(); ++i) {
+					if (pipelined_set.has(_blocks_pending_update[i])) {
+						int last = _blocks_pending_update.size() - 1;
+						_blocks_pending_update.write[i] = _blocks_pending_update[last];
+						_blocks_pending_update.resize(last);
+						--i;
+					}
+				}
+			}
+		}
 	}
 
 	_stats.time_process_load_responses = profiling_clock.restart();
@@ -894,17 +1064,18 @@ void VoxelTerrain::_process() {
 	// Send mesh updates
 	{
 		VoxelMeshUpdater::Input input;
-		input.priority_position = viewer_block_pos;
-		input.priority_direction = viewer_direction;
+		input.priority_viewers = _priority_viewers;
+		input.cancelled_blocks.swap(_meshes_to_cancel);
+
+		// The map is not modified while requests are made, so they can share snapshots of blocks
+		VoxelNeighborhood::SnapshotCache snapshots;
 
 		for (int i = 0; i < _blocks_pending_update.size(); ++i) {
 			Vector3i block_pos = _blocks_pending_update[i];
 
 			// Check if the block is worth meshing
-			// Smooth meshing works on more neighbors, so checking a single block isn't enough to ignore it,
-			// but that will slow down meshing a lot.
 			// TODO This is one reason to separate terrain systems between blocky and smooth (other reason is LOD)
-			if (! (_stream->get_used_channels_mask() & (1<<VoxelBuffer::CHANNEL_SDF))) {
+			if (!smooth) {
 				VoxelBlock *block = _map->get_block(block_pos);
 				if (block == nullptr) {
 					continue;
@@ -912,10 +1083,12 @@ void VoxelTerrain::_process() {
 					CRASH_COND(block->voxels.is_null());
 
 					uint64_t air_type = 0;
+					// Ranges are usually cached by generators and streams compressing blocks, so this is cheap
+					uint64_t type_min, type_max;
+					block->voxels->get_channel_range(VoxelBuffer::CHANNEL_TYPE, type_min, type_max);
 					if (
-							block->voxels->is_uniform(VoxelBuffer::CHANNEL_TYPE) &&
-							block->voxels->is_uniform(VoxelBuffer::CHANNEL_SDF) &&
-							block->voxels->get_voxel(0, 0, 0, VoxelBuffer::CHANNEL_TYPE) == air_type) {
+							type_min == air_type && type_max == air_type &&
+							block->voxels->is_uniform(VoxelBuffer::CHANNEL_SDF)) {
 
 						// If we got here, it must have been because of scheduling an update
 						CRASH_COND(block->get_mesh_state() != VoxelBlock::MESH_UPDATE_NOT_SENT);
@@ -927,9 +1100,32 @@ void VoxelTerrain::_process() {
 						// Optional, but I guess it might spare some memory
 						block->voxels->clear_channel(VoxelBuffer::CHANNEL_TYPE, air_type);
 
+						++_stats.skipped_block_meshs;
 						continue;
 					}
 				}
+
+			} else if (_library.is_null()) {
+				// Smooth meshing works on neighbors too, so the SDF must not cross the isolevel in the padding either.
+				// Ranges of blocks are cached, so this is cheap compared to meshing.
+				// With a library, blocky voxels could still be there, so the block is meshed anyways.
+				VoxelBlock *block = _map->get_block(block_pos);
+				CRASH_COND(block == nullptr);
+
+				const unsigned int min_padding = _block_updater->get_minimum_padding();
+				const unsigned int max_padding = _block_updater->get_maximum_padding();
+				const Rect3i padded_box(
+						_map->block_to_voxel(block_pos) - Vector3i(min_padding),
+						Vector3i(_map->get_block_size() + min_padding + max_padding));
+				real_t sdf_min, sdf_max;
+				_map->get_channel_range_f(padded_box, VoxelBuffer::CHANNEL_SDF, sdf_min, sdf_max);
+
+				if (sdf_min > 0.f || sdf_max < 0.f) {
+					block->set_mesh(Ref<Mesh>(), this, _generate_collisions, Array(), get_tree()->is_debugging_collisions_hint());
+					block->set_mesh_state(VoxelBlock::MESH_UP_TO_DATE);
+					++_stats.skipped_block_meshs;
+					continue;
+				}
 			}
 
 			VoxelBlock *block = _map->get_block(block_pos);
@@ -938,25 +1134,24 @@ void VoxelTerrain::_process() {
 			CRASH_COND(block == nullptr);
 			CRASH_COND(block->get_mesh_state() != VoxelBlock::MESH_UPDATE_NOT_SENT);
 
-			// Create buffer padded with neighbor voxels
-			Ref<VoxelBuffer> nbuffer;
-			nbuffer.instance();
-
-			// TODO Make the buffer re-usable
+			// Reference voxels padded with neighbors, the mesh thread will copy them
 			unsigned int block_size = _map->get_block_size();
 			unsigned int min_padding = _block_updater->get_minimum_padding();
 			unsigned int max_padding = _block_updater->get_maximum_padding();
-			nbuffer->create(Vector3i(block_size + min_padding + max_padding));
-
-			unsigned int channels_mask = (1 << VoxelBuffer::CHANNEL_TYPE) | (1 << VoxelBuffer::CHANNEL_SDF);
-			_map->get_buffer_copy(_map->block_to_voxel(block_pos) - Vector3i(min_padding), **nbuffer, channels_mask);
+			const Rect3i padded_box(
+					_map->block_to_voxel(block_pos) - Vector3i(min_padding),
+					Vector3i(block_size + min_padding + max_padding));
 
 			VoxelMeshUpdater::InputBlock iblock;
-			iblock.data.voxels = nbuffer;
+			iblock.data.voxels.create(**_map, padded_box, snapshots);
+			iblock.data.channels_mask = (1 << VoxelBuffer::CHANNEL_TYPE) | (1 << VoxelBuffer::CHANNEL_SDF);
 			iblock.position = block_pos;
 			input.blocks.push_back(iblock);
 
 			block->set_mesh_state(VoxelBlock::MESH_UPDATE_SENT);
+
+			// The block is likely to have been edited
+			_map->update_block_memory_usage(block);
 		}
 
 		_block_updater->push(input);
@@ -977,14 +1172,14 @@ void VoxelTerrain::_process() {
 			_blocks_pending_main_thread_update.append_array(output.blocks);
 		}
 
-		uint32_t timeout = os.get_ticks_msec() + MAIN_THREAD_MESHING_BUDGET_MS;
+		_upload_budget.begin_frame();
 		int queue_index = 0;
 
 		// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
 		// This also proved to be very slow compared to the meshing process itself...
 		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
-		for (; queue_index < _blocks_pending_main_thread_update.size() && os.get_ticks_msec() < timeout; ++queue_index) {
+		for (; queue_index < _blocks_pending_main_thread_update.size(); ++queue_index) {
 
 			const VoxelMeshUpdater::OutputBlock &ob = _blocks_pending_main_thread_update[queue_index];
 
@@ -1003,6 +1198,17 @@ void VoxelTerrain::_process() {
 				continue;
 			}
 
+			const VoxelMeshUpdater::OutputBlockData &data = ob.data;
+
+			const uint32_t vertex_count =
+					VoxelUploadBudget::get_vertex_count(data.blocky_surfaces) +
+					VoxelUploadBudget::get_vertex_count(data.smooth_surfaces);
+			if (!_upload_budget.can_upload(vertex_count)) {
+				// Left for next frame
+				break;
+			}
+			const uint64_t time_before = os.get_ticks_usec();
+
 			Ref<ArrayMesh> mesh;
 			mesh.instance();
 
@@ -1010,7 +1216,6 @@ void VoxelTerrain::_process() {
 			Array collidable_surface;
 
 			int surface_index = 0;
-			const VoxelMeshUpdater::OutputBlockData &data = ob.data;
 			for (int i = 0; i < data.blocky_surfaces.surfaces.size(); ++i) {
 
 				Array surface = data.blocky_surfaces.surfaces[i];
@@ -1059,6 +1264,8 @@ void VoxelTerrain::_process() {
 
 			block->set_mesh(mesh, this, _generate_collisions, collidable_surface, get_tree()->is_debugging_collisions_hint());
 			block->set_parent_visible(is_visible());
+
+			_upload_budget.add_upload(vertex_count, os.get_ticks_usec() - time_before);
 		}
 
 		shift_up(_blocks_pending_main_thread_update, queue_index);
@@ -1066,9 +1273,96 @@ void VoxelTerrain::_process() {
 
 	_stats.time_process_update_responses = profiling_clock.restart();
 
+	// Unload blocks if the memory budget is exceeded, which may also be done by another terrain
+	VoxelMemoryBudget::get_singleton()->process();
+
 	//print_line(String("d:") + String::num(_dirty_blocks.size()) + String(", q:") + String::num(_block_update_queue.size()));
 }
 
+void VoxelTerrain::update_budget_view_distance(unsigned int viewer_count) {
+	// The memory budget doesn't unload blocks viewers need, so they would stay over budget.
+	// Instead, the view distance shrinks by one block per frame until they fit.
+	// The budget is shared, so this also happens when other terrains use most of it.
+	const VoxelMemoryBudget *memory_budget = VoxelMemoryBudget::get_singleton();
+	const int64_t budget = memory_budget->get_budget();
+
+	if (budget <= 0 || _budget_view_distance_blocks > _view_distance_blocks) {
+		_budget_view_distance_blocks = _view_distance_blocks;
+		return;
+	}
+
+	if (memory_budget->get_overrun_bytes() > 0) {
+		if (_budget_view_distance_blocks > 1) {
+			--_budget_view_distance_blocks;
+		}
+		return;
+	}
+
+	if (_budget_view_distance_blocks == _view_distance_blocks) {
+		return;
+	}
+
+	// Grow back only if the next shell of blocks is expected to fit with some margin,
+	// otherwise it would be loaded and shrunk again every few frames.
+	// Blocks still loading are not in the budget's usage yet, so they are estimated the same way.
+	const int block_count = _map->get_block_count();
+	const uint64_t average_block_memory = block_count > 0 ? _map->get_memory_usage() / block_count : 0;
+	const int64_t d = _budget_view_distance_blocks;
+	const int64_t shell_block_count = viewer_count * (8 * (d + 1) * (d + 1) * (d + 1) - 8 * d * d * d);
+	const int64_t expected_block_count = shell_block_count + _loading_blocks.size();
+	const int64_t target = budget - budget / 16;
+	if (memory_budget->get_usage() + expected_block_count * static_cast<int64_t>(average_block_memory) <= target) {
+		++_budget_view_distance_blocks;
+	}
+}
+
+uint64_t VoxelTerrain::get_block_memory_usage() const {
+	return _map->get_memory_usage();
+}
+
+void VoxelTerrain::get_eviction_candidates(std::vector<VoxelMemoryBudget::Candidate> &candidates, uint64_t now) {
+	std::vector<Viewer> viewers;
+	get_viewers(viewers);
+
+	const int block_size = _map->get_block_size();
+	const Vector3 half_block_size(block_size / 2, block_size / 2, block_size / 2);
+
+	std::vector<Rect3i> view_boxes;
+	for (unsigned int i = 0; i < _last_viewer_block_positions.size(); ++i) {
+		view_boxes.push_back(Rect3i::from_center_extents(_last_viewer_block_positions[i], Vector3i(_last_view_distance_blocks)));
+	}
+
+	_map->for_all_blocks([&candidates, now, &viewers, &view_boxes, block_size, half_block_size](VoxelBlock *block) {
+		for (unsigned int i = 0; i < view_boxes.size(); ++i) {
+			if (view_boxes[i].contains(block->position)) {
+				// Viewers need it, it would have to be loaded again right away
+				return;
+			}
+		}
+		const VoxelBlock::MeshState mesh_state = block->get_mesh_state();
+		if (mesh_state == VoxelBlock::MESH_UPDATE_NOT_SENT || mesh_state == VoxelBlock::MESH_UPDATE_SENT) {
+			// Pending updates expect the block to be there
+			return;
+		}
+		VoxelMemoryBudget::Candidate c;
+		c.position = block->position;
+		c.memory_usage = block->memory_usage;
+		c.last_viewed_time = block->get_last_viewed_time(now);
+		const Vector3 center = (block->position * block_size).to_vec3() + half_block_size;
+		// Blocks matter as much as they do to the nearest viewer
+		c.distance_squared = viewers[0].position.distance_squared_to(center);
+		for (unsigned int i = 1; i < viewers.size(); ++i) {
+			c.distance_squared = MIN(c.distance_squared, viewers[i].position.distance_squared_to(center));
+		}
+		candidates.push_back(c);
+	});
+}
+
+void VoxelTerrain::evict_block(Vector3i bpos, unsigned int lod_index) {
+	// Saves the block if it was modified
+	immerge_block(bpos);
+}
+
 Ref<VoxelTool> VoxelTerrain::get_voxel_tool() {
 	Ref<VoxelTool> vt = memnew(VoxelToolTerrain(this, _map));
 	if (_stream.is_valid()) {
@@ -1106,8 +1400,16 @@ void VoxelTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_generate_collisions"), &VoxelTerrain::get_generate_collisions);
 	ClassDB::bind_method(D_METHOD("set_generate_collisions", "enabled"), &VoxelTerrain::set_generate_collisions);
 
+	ClassDB::bind_method(D_METHOD("get_deduplicate_blocks"), &VoxelTerrain::get_deduplicate_blocks);
+	ClassDB::bind_method(D_METHOD("set_deduplicate_blocks", "enabled"), &VoxelTerrain::set_deduplicate_blocks);
+
+	ClassDB::bind_method(D_METHOD("get_pipelined_meshing"), &VoxelTerrain::get_pipelined_meshing);
+	ClassDB::bind_method(D_METHOD("set_pipelined_meshing", "enabled"), &VoxelTerrain::set_pipelined_meshing);
+
 	ClassDB::bind_method(D_METHOD("get_viewer_path"), &VoxelTerrain::get_viewer_path);
 	ClassDB::bind_method(D_METHOD("set_viewer_path", "path"), &VoxelTerrain::set_viewer_path);
+	ClassDB::bind_method(D_METHOD("get_viewer_paths"), &VoxelTerrain::get_viewer_paths);
+	ClassDB::bind_method(D_METHOD("set_viewer_paths", "paths"), &VoxelTerrain::set_viewer_paths);
 
 	ClassDB::bind_method(D_METHOD("voxel_to_block", "voxel_pos"), &VoxelTerrain::_b_voxel_to_block);
 	ClassDB::bind_method(D_METHOD("block_to_voxel", "block_pos"), &VoxelTerrain::_b_block_to_voxel);
@@ -1120,6 +1422,10 @@ void VoxelTerrain::_bind_methods() {
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "stream", PROPERTY_HINT_RESOURCE_TYPE, "VoxelStream"), "set_stream", "get_stream");
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "voxel_library", PROPERTY_HINT_RESOURCE_TYPE, "VoxelLibrary"), "set_voxel_library", "get_voxel_library");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "view_distance"), "set_view_distance", "get_view_distance");
-	ADD_PROPERTY(PropertyInfo(Variant::NODE_PATH, "viewer_path"), "set_viewer_path", "get_viewer_path");
+	// Old scenes only have the single path, which is now stored in the list
+	ADD_PROPERTY(PropertyInfo(Variant::NODE_PATH, "viewer_path", PROPERTY_HINT_NONE, "", PROPERTY_USAGE_EDITOR), "set_viewer_path", "get_viewer_path");
+	ADD_PROPERTY(PropertyInfo(Variant::ARRAY, "viewer_paths"), "set_viewer_paths", "get_viewer_paths");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "generate_collisions"), "set_generate_collisions", "get_generate_collisions");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "deduplicate_blocks"), "set_deduplicate_blocks", "get_deduplicate_blocks");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "pipelined_meshing"), "set_pipelined_meshing", "get_pipelined_meshing");
 }
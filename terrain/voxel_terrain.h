@@ -5,7 +5,9 @@
 #include "../math/vector3i.h"
 #include "../util/zprofiling.h"
 #include "voxel_data_loader.h"
+#include "voxel_memory_budget.h"
 #include "voxel_mesh_updater.h"
+#include "voxel_upload_budget.h"
 
 #include <scene/3d/spatial.h>
 
@@ -13,11 +15,13 @@ class VoxelMap;
 class VoxelLibrary;
 class VoxelStream;
 class VoxelTool;
+class Camera;
 
 // Infinite paged terrain made of voxel blocks all with the same level of detail.
-// Voxels are polygonized around the viewer by distance in a large cubic space.
+// Voxels are polygonized around viewers by distance in large cubic spaces.
+// Blocks seen by several viewers are only loaded and meshed once.
 // Data is streamed using a VoxelStream.
-class VoxelTerrain : public Spatial {
+class VoxelTerrain : public Spatial, public VoxelMemoryBudget::User {
 	GDCLASS(VoxelTerrain, Spatial)
 public:
 	VoxelTerrain();
@@ -42,24 +46,45 @@ public:
 	void set_generate_collisions(bool enabled);
 	bool get_generate_collisions() const { return _generate_collisions; }
 
+	// Identical blocks share their voxels until modified (see VoxelMap::set_deduplication_enabled())
+	void set_deduplicate_blocks(bool enabled);
+	bool get_deduplicate_blocks() const;
+
+	// Blocks loaded at the same time as their neighbors are meshed by data threads (see VoxelDataLoader::set_mesh_pipeline())
+	void set_pipelined_meshing(bool enabled);
+	bool get_pipelined_meshing() const { return _pipelined_meshing; }
+
+	// While the memory budget is exceeded by blocks viewers need, blocks are loaded within a smaller distance
+	// until they fit (see VoxelMemoryBudget). The effective distance is reported in statistics.
 	int get_view_distance() const;
 	void set_view_distance(int distance_in_voxels);
 
+	// Shortcut to use a single viewer
 	void set_viewer_path(NodePath path);
 	NodePath get_viewer_path() const;
 
+	void set_viewer_paths(Array paths);
+	Array get_viewer_paths() const;
+
 	void set_material(unsigned int id, Ref<Material> material);
 	Ref<Material> get_material(unsigned int id) const;
 
 	Ref<VoxelMap> get_storage() const { return _map; }
 	Ref<VoxelTool> get_voxel_tool();
 
+	// VoxelMemoryBudget::User
+	uint64_t get_block_memory_usage() const override;
+	void get_eviction_candidates(std::vector<VoxelMemoryBudget::Candidate> &candidates, uint64_t now) override;
+	void evict_block(Vector3i bpos, unsigned int lod_index) override;
+
 	struct Stats {
 		VoxelMeshUpdater::Stats updater;
 		VoxelDataLoader::Stats stream;
 		int updated_blocks = 0;
 		int dropped_block_loads = 0;
 		int dropped_block_meshs = 0;
+		int skipped_block_meshs = 0;
+		int pipelined_block_meshs = 0;
 		uint64_t time_detect_required_blocks = 0;
 		uint64_t time_request_blocks_to_load = 0;
 		uint64_t time_process_load_responses = 0;
@@ -84,13 +109,20 @@ private:
 	void stop_updater();
 	void start_streamer();
 	void stop_streamer();
+	void update_mesh_pipeline();
 	void reset_map();
 
-	Spatial *get_viewer() const;
+	struct Viewer {
+		Vector3 position;
+		// The camera the viewer looks through, if any
+		const Camera *camera = nullptr;
+	};
+
+	void get_viewers(std::vector<Viewer> &out_viewers) const;
+	void update_budget_view_distance(unsigned int viewer_count);
 
 	void immerge_block(Vector3i bpos);
 	void save_all_modified_blocks(bool with_copy);
-	void get_viewer_pos_and_direction(Vector3 &out_pos, Vector3 &out_direction) const;
 	void send_block_data_requests();
 
 	Dictionary get_statistics() const;
@@ -107,6 +139,8 @@ private:
 
 	// How many blocks to load around the viewer
 	int _view_distance_blocks;
+	// View distance actually used, lower while the memory budget is exceeded
+	int _budget_view_distance_blocks;
 
 	// TODO Terrains only need to handle the visible portion of voxels, which reduces the bounds blocks to handle.
 	// Therefore, could a simple grid be better to use than a hashmap?
@@ -117,6 +151,9 @@ private:
 	Vector<VoxelMeshUpdater::OutputBlock> _blocks_pending_main_thread_update;
 
 	std::vector<VoxelDataLoader::InputBlock> _blocks_to_save;
+	// Requests sent for blocks which got unloaded before they came back
+	std::vector<VoxelDataLoader::BlockLocation> _loads_to_cancel;
+	std::vector<VoxelMeshUpdater::BlockLocation> _meshes_to_cancel;
 
 	Ref<VoxelStream> _stream;
 	VoxelDataLoader *_stream_thread;
@@ -124,15 +161,22 @@ private:
 	Ref<VoxelLibrary> _library;
 	VoxelMeshUpdater *_block_updater;
 
-	NodePath _viewer_path;
-	Vector3i _last_viewer_block_pos;
+	std::vector<NodePath> _viewer_paths;
+	// One per viewer
+	std::vector<Vector3i> _last_viewer_block_positions;
 	int _last_view_distance_blocks;
+	// Viewers as of the last update, from which threads prioritize requests
+	std::vector<VoxelPriorityViewer> _priority_viewers;
 
 	bool _generate_collisions = true;
+	bool _pipelined_meshing = false;
 	bool _run_in_editor;
+	bool _uses_memory_budget = false;
 
 	Ref<Material> _materials[VoxelMesherBlocky::MAX_MATERIALS];
 
+	VoxelUploadBudget _upload_budget;
+
 	Stats _stats;
 };
 
@@ -0,0 +1,113 @@
+#include "voxel_upload_budget.h"
+#include <core/engine.h>
+#include <core/os/os.h>
+
+namespace {
+// Used until frame times are known
+const uint64_t INITIAL_BUDGET_USEC = 8000;
+const uint64_t MIN_BUDGET_USEC = 1000;
+// When the engine doesn't cap the frame rate
+const int DEFAULT_TARGET_FPS = 60;
+// Longer frames are hiccups like scene loading or debugger breaks, they say nothing about uploads
+const uint64_t MAX_MEASURED_FRAME_TIME_USEC = 500000;
+// Fixed cost of uploading a block, in vertices
+const uint32_t BLOCK_VERTEX_EQUIVALENT = 256;
+const float INITIAL_USEC_PER_VERTEX = 0.1f;
+const float COST_SMOOTHING = 0.1f;
+} // namespace
+
+VoxelUploadBudget::VoxelUploadBudget() :
+		_budget_usec(INITIAL_BUDGET_USEC),
+		_usec_per_vertex(INITIAL_USEC_PER_VERTEX) {
+}
+
+void VoxelUploadBudget::begin_frame() {
+
+	const uint64_t now = OS::get_singleton()->get_ticks_usec();
+
+	_last_upload_count = _upload_count;
+	_spent_usec = 0;
+	_upload_count = 0;
+
+	if (_last_frame_begin_time == 0) {
+		_last_frame_begin_time = now;
+		return;
+	}
+
+	const uint64_t frame_time = now - _last_frame_begin_time;
+	_last_frame_begin_time = now;
+	_last_frame_time_usec = frame_time;
+
+	if (frame_time > MAX_MEASURED_FRAME_TIME_USEC) {
+		return;
+	}
+
+	const int target_fps = Engine::get_singleton()->get_target_fps();
+	const uint64_t target_frame_time = 1000000 / (target_fps > 0 ? target_fps : DEFAULT_TARGET_FPS);
+	// Leave time to the game and rendering
+	const uint64_t max_budget = target_frame_time * 3 / 4;
+
+	// Frame times jitter a bit even when they are on time
+	if (frame_time <= target_frame_time + target_frame_time / 10) {
+		// Only grow when uploads used time, or it would grow while there is nothing to upload,
+		// and the next burst would make frames late
+		if (_last_upload_count > 0) {
+			_budget_usec = MIN(max_budget, _budget_usec + target_frame_time / 20);
+		}
+	} else {
+		const uint64_t overshoot = frame_time - target_frame_time;
+		_budget_usec = _budget_usec > MIN_BUDGET_USEC + overshoot ? _budget_usec - overshoot : MIN_BUDGET_USEC;
+	}
+}
+
+bool VoxelUploadBudget::can_upload(uint32_t vertex_count) const {
+	return _upload_count == 0 || _spent_usec + estimate_usec(vertex_count) <= _budget_usec;
+}
+
+void VoxelUploadBudget::add_upload(uint32_t vertex_count, uint64_t usec) {
+	_spent_usec += usec;
+	++_upload_count;
+	const float sample = (float)usec / (vertex_count + BLOCK_VERTEX_EQUIVALENT);
+	_usec_per_vertex = Math::lerp(_usec_per_vertex, sample, COST_SMOOTHING);
+}
+
+float VoxelUploadBudget::estimate_usec(uint32_t vertex_count) const {
+	return _usec_per_vertex * (vertex_count + BLOCK_VERTEX_EQUIVALENT);
+}
+
+uint32_t VoxelUploadBudget::get_vertex_count(const VoxelMesher::Output &output) {
+
+	uint32_t count = 0;
+
+	for (int i = 0; i < output.surfaces.size(); ++i) {
+		const Array &surface = output.surfaces[i];
+		if (!surface.empty()) {
+			const PoolVector3Array vertices = surface[Mesh::ARRAY_VERTEX];
+			count += vertices.size();
+		}
+	}
+
+	for (unsigned int dir = 0; dir < output.transition_surfaces.size(); ++dir) {
+		const Vector<Array> &surfaces = output.transition_surfaces[dir];
+		for (int i = 0; i < surfaces.size(); ++i) {
+			const Array &surface = surfaces[i];
+			if (!surface.empty()) {
+				const PoolVector3Array vertices = surface[Mesh::ARRAY_VERTEX];
+				count += vertices.size();
+			}
+		}
+	}
+
+	return count;
+}
+
+Dictionary VoxelUploadBudget::to_dictionary() const {
+	Dictionary d;
+	// Of the last frame
+	d["budget_usec"] = _budget_usec;
+	d["spent_usec"] = _spent_usec;
+	d["upload_count"] = _upload_count;
+	d["frame_time_usec"] = _last_frame_time_usec;
+	d["usec_per_vertex"] = _usec_per_vertex;
+	return d;
+}
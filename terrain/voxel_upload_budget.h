@@ -0,0 +1,42 @@
+#ifndef VOXEL_UPLOAD_BUDGET_H
+#define VOXEL_UPLOAD_BUDGET_H
+
+#include "../meshers/voxel_mesher.h"
+#include <core/dictionary.h>
+
+// Decides how long a terrain can spend turning mesh arrays into meshes and collision shapes on the main thread.
+// The budget grows while frames are on time, and shrinks by how late they are, so the world appears as fast as
+// the frame rate allows. Costs of blocks are estimated from their vertex count and past uploads,
+// so a heavy block is left to the next frame rather than making the current one overrun.
+// Times are in microseconds.
+class VoxelUploadBudget {
+public:
+	VoxelUploadBudget();
+
+	// Call once per frame before uploading
+	void begin_frame();
+
+	// At least one block can be uploaded each frame, so uploads never stall
+	bool can_upload(uint32_t vertex_count) const;
+
+	// Call after uploading a block, with the time it took including collisions
+	void add_upload(uint32_t vertex_count, uint64_t usec);
+
+	static uint32_t get_vertex_count(const VoxelMesher::Output &output);
+
+	Dictionary to_dictionary() const;
+
+private:
+	float estimate_usec(uint32_t vertex_count) const;
+
+	uint64_t _budget_usec;
+	uint64_t _spent_usec = 0;
+	uint64_t _last_frame_begin_time = 0;
+	uint64_t _last_frame_time_usec = 0;
+	uint32_t _upload_count = 0;
+	uint32_t _last_upload_count = 0;
+	// Smoothed cost of a vertex, including a share of the fixed cost of a block
+	float _usec_per_vertex;
+};
+
+#endif // VOXEL_UPLOAD_BUDGET_H
@@ -0,0 +1,32 @@
+#ifndef CANCELLATION_TOKEN_H
+#define CANCELLATION_TOKEN_H
+
+#include <atomic>
+
+// Flag a thread can poll to find out the work it is doing is no longer needed, so it can stop early.
+// Set from another thread. Nothing is cleaned up automatically: whoever polls it decides what stopping means.
+class CancellationToken {
+public:
+	inline CancellationToken() {}
+
+	inline CancellationToken(const CancellationToken &other) :
+			_cancelled(other.is_cancelled()) {}
+
+	inline CancellationToken &operator=(const CancellationToken &other) {
+		_cancelled.store(other.is_cancelled(), std::memory_order_relaxed);
+		return *this;
+	}
+
+	inline void cancel() {
+		_cancelled.store(true, std::memory_order_relaxed);
+	}
+
+	inline bool is_cancelled() const {
+		return _cancelled.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<bool> _cancelled{ false };
+};
+
+#endif // CANCELLATION_TOKEN_H
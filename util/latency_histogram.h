@@ -0,0 +1,71 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include "fixed_array.h"
+#include <core/dictionary.h>
+#include <core/math/math_funcs.h>
+
+// Counts durations in buckets of exponentially growing size, so percentiles can be estimated
+// without keeping every sample. Bucket `i` holds durations in [2^i, 2^(i+1)[ microseconds,
+// except the first which starts at 0 and the last which has no upper bound.
+class LatencyHistogram {
+public:
+	static const unsigned int BUCKET_COUNT = 24; // Up to about 8 seconds
+
+	inline LatencyHistogram() :
+			_buckets(0) {}
+
+	inline void add(uint64_t usec) {
+		unsigned int i = 0;
+		while (usec > 1 && i + 1 < BUCKET_COUNT) {
+			usec >>= 1;
+			++i;
+		}
+		++_buckets[i];
+		++_count;
+	}
+
+	void merge(const LatencyHistogram &other) {
+		for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+			_buckets[i] += other._buckets[i];
+		}
+		_count += other._count;
+	}
+
+	inline uint32_t get_count() const {
+		return _count;
+	}
+
+	// Gets the upper bound of the bucket containing the given percentile, so the estimate errs on the slow side.
+	// Returns 0 if there are no samples.
+	uint64_t get_percentile(float percent) const {
+		if (_count == 0) {
+			return 0;
+		}
+		// Rank of the sample, starting from 1
+		const uint64_t rank = MAX(1, (uint64_t)Math::ceil(percent * 0.01f * _count));
+		uint64_t sum = 0;
+		for (unsigned int i = 0; i < BUCKET_COUNT - 1; ++i) {
+			sum += _buckets[i];
+			if (sum >= rank) {
+				return (uint64_t)1 << (i + 1);
+			}
+		}
+		return (uint64_t)1 << BUCKET_COUNT;
+	}
+
+	Dictionary to_dictionary() const {
+		Dictionary d;
+		d["count"] = _count;
+		d["p50"] = get_percentile(50);
+		d["p90"] = get_percentile(90);
+		d["p99"] = get_percentile(99);
+		return d;
+	}
+
+private:
+	FixedArray<uint32_t, BUCKET_COUNT> _buckets;
+	uint32_t _count = 0;
+};
+
+#endif // LATENCY_HISTOGRAM_H
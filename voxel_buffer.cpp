@@ -7,10 +7,20 @@
 #include "edition/voxel_tool_buffer.h"
 #include "voxel_buffer.h"
 
+#include <core/hashfuncs.h>
 #include <core/io/marshalls.h>
 #include <core/math/math_funcs.h>
 #include <string.h>
 
+// Downscaling uses SIMD when available, with a scalar fallback
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXEL_BUFFER_USE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VOXEL_BUFFER_USE_NEON
+#include <arm_neon.h>
+#endif
+
 namespace {
 
 inline uint8_t *allocate_channel_data(uint32_t size) {
@@ -29,6 +39,14 @@ inline void free_channel_data(uint8_t *data, uint32_t size) {
 #endif
 }
 
+// Every channel holding data gets a counter when the data is allocated, so duplicate() only has to increment it.
+// Creating it lazily there would race when several threads duplicate the same buffer.
+inline SafeRefCount *create_channel_ref_count() {
+	SafeRefCount *ref_count = memnew(SafeRefCount);
+	ref_count->init(1);
+	return ref_count;
+}
+
 uint32_t g_depth_bit_counts[] = {
 	8, 16, 32, 64
 };
@@ -60,186 +78,1245 @@ inline uint64_t clamp_value_for_depth(uint64_t value, VoxelBuffer::Depth d) {
 static_assert(sizeof(uint32_t) == sizeof(float), "uint32_t and float cannot be marshalled back and forth");
 static_assert(sizeof(uint64_t) == sizeof(double), "uint64_t and double cannot be marshalled back and forth");
 
-inline uint64_t real_to_raw_voxel(real_t value, VoxelBuffer::Depth depth) {
+// Run-length encoding of a channel along the Y axis.
+// Every row of voxels sharing the same X and Z is stored as a sequence of runs of the same value.
+// Everything is packed in a single allocation:
+// - Start index of the runs of each row: uint32_t[row_count + 1]. The last item is the total number of runs.
+// - End of each run, exclusive Y coordinate: uint16_t[run_count].
+// - Value of each run: T[run_count], aligned to 8 bytes.
+// Runs are always as long as possible, so two equal channels always have the same encoding.
+
+const uint32_t RLE_MAX_ROW_LENGTH = 0xffff;
+
+inline uint32_t get_rle_run_ends_offset(uint32_t row_count) {
+	return (row_count + 1) * sizeof(uint32_t);
+}
+
+inline uint32_t get_rle_values_offset(uint32_t row_count, uint32_t run_count) {
+	return (get_rle_run_ends_offset(row_count) + run_count * sizeof(uint16_t) + 7) & ~7;
+}
+
+inline uint32_t get_rle_size_in_bytes(uint32_t row_count, uint32_t run_count, uint32_t value_size) {
+	return get_rle_values_offset(row_count, run_count) + run_count * value_size;
+}
+
+template <typename T>
+struct RleView {
+	const uint32_t *row_run_starts;
+	const T *values;
+	const uint16_t *run_ends;
+
+	RleView(const uint8_t *data, uint32_t row_count) {
+		row_run_starts = (const uint32_t *)data;
+		const uint32_t run_count = row_run_starts[row_count];
+		run_ends = (const uint16_t *)(data + get_rle_run_ends_offset(row_count));
+		values = (const T *)(data + get_rle_values_offset(row_count, run_count));
+	}
+
+	// Index of the run containing the given Y coordinate
+	inline uint32_t find_run(uint32_t row, uint32_t y) const {
+		uint32_t begin = row_run_starts[row];
+		uint32_t end = row_run_starts[row + 1] - 1;
+		while (begin < end) {
+			const uint32_t mid = (begin + end) >> 1;
+			if (run_ends[mid] <= y) {
+				begin = mid + 1;
+			} else {
+				end = mid;
+			}
+		}
+		return begin;
+	}
+
+	inline T get(uint32_t row, uint32_t y) const {
+		return values[find_run(row, y)];
+	}
+
+	void decode(uint32_t row, uint32_t y, uint32_t count, T *dst) const {
+		const uint32_t end_y = y + count;
+		for (uint32_t ri = find_run(row, y); y < end_y; ++ri) {
+			const uint32_t run_end = MIN(static_cast<uint32_t>(run_ends[ri]), end_y);
+			const T v = values[ri];
+			for (; y < run_end; ++y) {
+				*dst = v;
+				++dst;
+			}
+		}
+	}
+};
+
+template <typename T>
+void encode_rle(const uint8_t *p_data, uint32_t row_count, uint32_t row_length, uint32_t run_count, uint8_t *rle) {
+	const T *data = (const T *)p_data;
+	uint32_t *row_run_starts = (uint32_t *)rle;
+	uint16_t *run_ends = (uint16_t *)(rle + get_rle_run_ends_offset(row_count));
+	T *values = (T *)(rle + get_rle_values_offset(row_count, run_count));
+
+	uint32_t ri = 0;
+	for (uint32_t row = 0; row < row_count; ++row) {
+		const T *row_data = data + row * row_length;
+		row_run_starts[row] = ri;
+		values[ri] = row_data[0];
+		for (uint32_t y = 1; y < row_length; ++y) {
+			if (row_data[y] != values[ri]) {
+				run_ends[ri] = y;
+				++ri;
+				values[ri] = row_data[y];
+			}
+		}
+		run_ends[ri] = row_length;
+		++ri;
+	}
+	row_run_starts[row_count] = ri;
+	CRASH_COND(ri != run_count);
+}
+
+// Checks that runs are well-formed, used when the encoding comes from an untrusted source.
+bool validate_rle(const uint8_t *rle, uint32_t rle_size, uint32_t row_count, uint32_t row_length, uint32_t value_size) {
+	if (rle_size < get_rle_size_in_bytes(row_count, 0, value_size)) {
+		return false;
+	}
+	const uint32_t *row_run_starts = (const uint32_t *)rle;
+	const uint32_t run_count = row_run_starts[row_count];
+	if (run_count < row_count || run_count > row_count * row_length) {
+		return false;
+	}
+	if (rle_size != get_rle_size_in_bytes(row_count, run_count, value_size)) {
+		return false;
+	}
+	const uint16_t *run_ends = (const uint16_t *)(rle + get_rle_run_ends_offset(row_count));
+
+	if (row_run_starts[0] != 0) {
+		return false;
+	}
+	for (uint32_t row = 0; row < row_count; ++row) {
+		const uint32_t begin = row_run_starts[row];
+		const uint32_t end = row_run_starts[row + 1];
+		if (end <= begin || end > run_count) {
+			return false;
+		}
+		uint32_t prev_end = 0;
+		for (uint32_t ri = begin; ri < end; ++ri) {
+			if (run_ends[ri] <= prev_end) {
+				return false;
+			}
+			prev_end = run_ends[ri];
+		}
+		if (prev_end != row_length) {
+			return false;
+		}
+	}
+	return true;
+}
+
+inline uint64_t get_rle_voxel(const uint8_t *rle, VoxelBuffer::Depth depth, uint32_t row_count, uint32_t row, uint32_t y) {
 	switch (depth) {
 		case VoxelBuffer::DEPTH_8_BIT:
-			return clamp(static_cast<int>(128.f * value + 128.f), 0, 0xff);
+			return RleView<uint8_t>(rle, row_count).get(row, y);
 		case VoxelBuffer::DEPTH_16_BIT:
-			return clamp(static_cast<int>(0x7fff * value + 0x7fff), 0, 0xffff);
-		case VoxelBuffer::DEPTH_32_BIT: {
-			MarshallFloat m;
-			m.f = value;
-			return m.i;
-		}
-		case VoxelBuffer::DEPTH_64_BIT: {
-			MarshallDouble m;
-			m.d = value;
-			return m.l;
-		}
+			return RleView<uint16_t>(rle, row_count).get(row, y);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return RleView<uint32_t>(rle, row_count).get(row, y);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return RleView<uint64_t>(rle, row_count).get(row, y);
 		default:
 			CRASH_NOW();
 			return 0;
 	}
 }
 
-inline real_t raw_voxel_to_real(uint64_t value, VoxelBuffer::Depth depth) {
-	// Depths below 32 are normalized between -1 and 1
+// Decodes part of a row into dense memory of the same depth
+inline void decode_rle_row(const uint8_t *rle, VoxelBuffer::Depth depth, uint32_t row_count,
+		uint32_t row, uint32_t y, uint32_t count, uint8_t *dst) {
 	switch (depth) {
 		case VoxelBuffer::DEPTH_8_BIT:
-			return (static_cast<real_t>(value) - 0x7f) / 0x7f;
+			RleView<uint8_t>(rle, row_count).decode(row, y, count, dst);
+			break;
 		case VoxelBuffer::DEPTH_16_BIT:
-			return (static_cast<real_t>(value) - 0x7fff) / 0x7fff;
-		case VoxelBuffer::DEPTH_32_BIT: {
-			MarshallFloat m;
-			m.i = value;
-			return m.f;
-		}
-		case VoxelBuffer::DEPTH_64_BIT: {
-			MarshallDouble m;
-			m.l = value;
-			return m.d;
-		}
+			RleView<uint16_t>(rle, row_count).decode(row, y, count, (uint16_t *)dst);
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			RleView<uint32_t>(rle, row_count).decode(row, y, count, (uint32_t *)dst);
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			RleView<uint64_t>(rle, row_count).decode(row, y, count, (uint64_t *)dst);
+			break;
 		default:
 			CRASH_NOW();
-			return 0;
+			break;
 	}
 }
 
-} // namespace
+// Palette compression of a channel.
+// Voxels are stored as bit-packed indices into a small table of values, in a single allocation:
+// - Palette: T[1 << index_bits]. Only the first palette_size values are used.
+// - Indices: index_bits per voxel, in the same order as dense data.
+// Index sizes are 1, 2, 4 or 8 bits, so an index never spans two bytes.
 
-const char *VoxelBuffer::CHANNEL_ID_HINT_STRING = "Type,Sdf,Data2,Data3,Data4,Data5,Data6,Data7";
+const uint32_t PALETTE_MAX_SIZE = 256;
 
-VoxelBuffer::VoxelBuffer() {
-	_channels[CHANNEL_SDF].defval = 255;
+inline uint32_t get_palette_indices_offset(uint32_t index_bits, uint32_t value_size) {
+	return (1 << index_bits) * value_size;
 }
 
-VoxelBuffer::~VoxelBuffer() {
-	clear();
+inline uint32_t get_palette_indices_size_in_bytes(uint32_t volume, uint32_t index_bits) {
+	return (volume * index_bits + 7) >> 3;
 }
 
-void VoxelBuffer::create(int sx, int sy, int sz) {
-	if (sx <= 0 || sy <= 0 || sz <= 0) {
-		return;
-	}
-	Vector3i new_size(sx, sy, sz);
-	if (new_size != _size) {
-		for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-			Channel &channel = _channels[i];
-			if (channel.data) {
-				// Channel already contained data
-				delete_channel(i);
-				create_channel(i, new_size, channel.defval);
-			}
-		}
-		_size = new_size;
-	}
+inline uint32_t get_palette_size_in_bytes(uint32_t volume, uint32_t index_bits, uint32_t value_size) {
+	return get_palette_indices_offset(index_bits, value_size) + get_palette_indices_size_in_bytes(volume, index_bits);
 }
 
-void VoxelBuffer::create(Vector3i size) {
-	create(size.x, size.y, size.z);
+inline uint32_t get_palette_index(const uint8_t *indices, uint32_t i, uint32_t index_bits) {
+	const uint32_t bit = i * index_bits;
+	return (indices[bit >> 3] >> (bit & 7)) & ((1 << index_bits) - 1);
 }
 
-void VoxelBuffer::clear() {
-	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		Channel &channel = _channels[i];
-		if (channel.data) {
-			delete_channel(i);
-		}
+inline void set_palette_index(uint8_t *indices, uint32_t i, uint32_t index_bits, uint32_t pi) {
+	const uint32_t bit = i * index_bits;
+	const uint32_t shift = bit & 7;
+	const uint8_t mask = ((1 << index_bits) - 1) << shift;
+	uint8_t &b = indices[bit >> 3];
+	b = (b & ~mask) | ((pi << shift) & mask);
+}
+
+// Accesses values of the given depth in an array. Palettes and bricks store values this way.
+inline uint64_t get_raw_value(const uint8_t *values, uint32_t i, VoxelBuffer::Depth depth) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return values[i];
+		case VoxelBuffer::DEPTH_16_BIT:
+			return ((const uint16_t *)values)[i];
+		case VoxelBuffer::DEPTH_32_BIT:
+			return ((const uint32_t *)values)[i];
+		case VoxelBuffer::DEPTH_64_BIT:
+			return ((const uint64_t *)values)[i];
+		default:
+			CRASH_NOW();
+			return 0;
 	}
 }
 
-void VoxelBuffer::clear_channel(unsigned int channel_index, uint64_t clear_value) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	Channel &channel = _channels[channel_index];
-	if (channel.data) {
-		delete_channel(channel_index);
+inline void set_raw_value(uint8_t *values, uint32_t i, VoxelBuffer::Depth depth, uint64_t value) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			values[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			((uint16_t *)values)[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			((uint32_t *)values)[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			((uint64_t *)values)[i] = value;
+			break;
+		default:
+			CRASH_NOW();
+			break;
 	}
-	channel.defval = clamp_value_for_depth(clear_value, channel.depth);
 }
 
-void VoxelBuffer::clear_channel_f(unsigned int channel_index, real_t clear_value) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	const Channel &channel = _channels[channel_index];
-	clear_channel(channel_index, real_to_raw_voxel(clear_value, channel.depth));
+// Sets `count` consecutive values of the given depth
+inline void fill_raw_values(uint8_t *values, uint32_t count, VoxelBuffer::Depth depth, uint64_t value) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			memset(values, value, count);
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			for (uint32_t i = 0; i < count; ++i) {
+				((uint16_t *)values)[i] = value;
+			}
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			for (uint32_t i = 0; i < count; ++i) {
+				((uint32_t *)values)[i] = value;
+			}
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			for (uint32_t i = 0; i < count; ++i) {
+				((uint64_t *)values)[i] = value;
+			}
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
 }
 
-void VoxelBuffer::set_default_values(FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> values) {
-	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		_channels[i].defval = clamp_value_for_depth(values[i], _channels[i].depth);
+// Gathers distinct values of dense data.
+// Returns how many there are, or PALETTE_MAX_SIZE + 1 if there are too many.
+template <typename T>
+uint32_t find_palette_values(const uint8_t *p_data, uint32_t volume, FixedArray<T, PALETTE_MAX_SIZE> &palette) {
+	const T *data = (const T *)p_data;
+	uint32_t palette_size = 0;
+	uint32_t pi = 0;
+	for (uint32_t i = 0; i < volume; ++i) {
+		const T v = data[i];
+		// Consecutive voxels are often the same
+		if (palette_size != 0 && palette[pi] == v) {
+			continue;
+		}
+		for (pi = 0; pi < palette_size; ++pi) {
+			if (palette[pi] == v) {
+				break;
+			}
+		}
+		if (pi == palette_size) {
+			if (palette_size == PALETTE_MAX_SIZE) {
+				return PALETTE_MAX_SIZE + 1;
+			}
+			palette[palette_size] = v;
+			++palette_size;
+		}
 	}
+	return palette_size;
 }
 
-uint64_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index) const {
-	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+template <typename T>
+void encode_palette(const uint8_t *p_data, uint32_t volume,
+		const FixedArray<T, PALETTE_MAX_SIZE> &palette, uint32_t palette_size, uint32_t index_bits, uint8_t *out) {
 
-	const Channel &channel = _channels[channel_index];
+	const T *data = (const T *)p_data;
+	T *out_palette = (T *)out;
+	for (uint32_t pi = 0; pi < palette_size; ++pi) {
+		out_palette[pi] = palette[pi];
+	}
 
-	if (validate_pos(x, y, z) && channel.data) {
+	uint8_t *indices = out + get_palette_indices_offset(index_bits, sizeof(T));
+	uint32_t pi = 0;
+	for (uint32_t i = 0; i < volume; ++i) {
+		const T v = data[i];
+		if (palette[pi] != v) {
+			for (pi = 0; pi < palette_size; ++pi) {
+				if (palette[pi] == v) {
+					break;
+				}
+			}
+			CRASH_COND(pi == palette_size);
+		}
+		set_palette_index(indices, i, index_bits, pi);
+	}
+}
 
-		uint32_t i = index(x, y, z);
+template <typename T>
+void decode_palette(const uint8_t *data, uint32_t index_bits, uint32_t begin, uint32_t count, T *dst) {
+	const T *palette = (const T *)data;
+	const uint8_t *indices = data + get_palette_indices_offset(index_bits, sizeof(T));
+	const uint32_t end = begin + count;
+	for (uint32_t i = begin; i < end; ++i) {
+		*dst = palette[get_palette_index(indices, i, index_bits)];
+		++dst;
+	}
+}
 
-		switch (channel.depth) {
+// Decodes consecutive voxels into dense memory of the same depth
+inline void decode_palette_span(const uint8_t *data, VoxelBuffer::Depth depth, uint32_t index_bits,
+		uint32_t begin, uint32_t count, uint8_t *dst) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			decode_palette(data, index_bits, begin, count, dst);
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			decode_palette(data, index_bits, begin, count, (uint16_t *)dst);
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			decode_palette(data, index_bits, begin, count, (uint32_t *)dst);
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			decode_palette(data, index_bits, begin, count, (uint64_t *)dst);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
 
-			case DEPTH_8_BIT:
-				return channel.data[i];
+// Bricked channels split the volume into cubes of BRICK_SIZE voxels, which requires all dimensions to be multiples of it.
+// The data then is an array of bricks, ordered like voxels ([z][x][y]).
+// Each brick is either uniform, storing only its value, or has its own dense allocation from the memory pool,
+// with voxels also in order [z][x][y].
+// This saves memory on blocks that are only partially uniform, like blocks with a bit of surface or a small cave,
+// and unlike the other encodings, voxels can be written without decompressing the whole channel.
+
+struct VoxelBrick {
+	// Dense values, or null if the brick is uniform
+	uint8_t *data;
+	uint64_t value;
+};
 
-			case DEPTH_16_BIT:
-				return ((uint16_t *)channel.data)[i];
+// Tells if a box is not empty and entirely inside a buffer of the given size
+inline bool is_box_inside(const Rect3i &box, Vector3i size) {
+	return box.pos.x >= 0 && box.pos.y >= 0 && box.pos.z >= 0 &&
+		   box.size.x > 0 && box.size.y > 0 && box.size.z > 0 &&
+		   box.pos.x + box.size.x <= size.x && box.pos.y + box.size.y <= size.y && box.pos.z + box.size.z <= size.z;
+}
 
-			case DEPTH_32_BIT:
-				return ((uint32_t *)channel.data)[i];
+const uint32_t BRICK_SIZE_MASK = VoxelBuffer::BRICK_SIZE - 1;
 
-			case DEPTH_64_BIT:
-				return ((uint64_t *)channel.data)[i];
+inline bool can_use_bricks(Vector3i size) {
+	return (size.x & BRICK_SIZE_MASK) == 0 && (size.y & BRICK_SIZE_MASK) == 0 && (size.z & BRICK_SIZE_MASK) == 0;
+}
 
-			default:
-				CRASH_NOW();
-				return 0;
-		}
+inline Vector3i get_brick_grid_size(Vector3i size) {
+	return size >> VoxelBuffer::BRICK_SIZE_PO2;
+}
 
-		return channel.data[index(x, y, z)];
+inline uint32_t get_brick_size_in_bytes(VoxelBuffer::Depth depth) {
+	return VoxelBuffer::BRICK_VOLUME * (get_depth_bit_count(depth) >> 3);
+}
 
-	} else {
-		return channel.defval;
+// Index of the brick containing a voxel
+inline uint32_t get_brick_index(Vector3i grid_size, int x, int y, int z) {
+	const int po2 = VoxelBuffer::BRICK_SIZE_PO2;
+	return (y >> po2) + grid_size.y * ((x >> po2) + grid_size.x * (z >> po2));
+}
+
+// Index of a voxel within its brick
+inline uint32_t get_index_in_brick(int x, int y, int z) {
+	const int bs = VoxelBuffer::BRICK_SIZE;
+	return (y & BRICK_SIZE_MASK) + bs * ((x & BRICK_SIZE_MASK) + bs * (z & BRICK_SIZE_MASK));
+}
+
+inline uint64_t get_brick_voxel(const VoxelBrick *bricks, Vector3i grid_size, VoxelBuffer::Depth depth, int x, int y, int z) {
+	const VoxelBrick &brick = bricks[get_brick_index(grid_size, x, y, z)];
+	if (brick.data == nullptr) {
+		return brick.value;
 	}
+	return get_raw_value(brick.data, get_index_in_brick(x, y, z), depth);
 }
 
-void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	ERR_FAIL_COND(!validate_pos(x, y, z));
+// Decodes voxels of a row along Y into dense memory of the same depth
+void decode_brick_row(const VoxelBrick *bricks, Vector3i grid_size, VoxelBuffer::Depth depth,
+		int x, int y, int z, uint32_t count, uint8_t *dst) {
 
-	Channel &channel = _channels[channel_index];
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
 
-	value = clamp_value_for_depth(value, channel.depth);
-	bool do_set = true;
+	while (count > 0) {
+		const VoxelBrick &brick = bricks[get_brick_index(grid_size, x, y, z)];
+		const uint32_t len = MIN(VoxelBuffer::BRICK_SIZE - (y & BRICK_SIZE_MASK), count);
 
-	if (channel.data == NULL) {
-		if (channel.defval != value) {
-			// Allocate channel with same initial values as defval
-			create_channel(channel_index, _size, channel.defval);
+		if (brick.data == nullptr) {
+			fill_raw_values(dst, len, depth, brick.value);
 		} else {
-			do_set = false;
+			memcpy(dst, brick.data + get_index_in_brick(x, y, z) * value_size, len * value_size);
 		}
+
+		dst += len * value_size;
+		y += len;
+		count -= len;
 	}
+}
 
-	if (do_set) {
-		uint32_t i = index(x, y, z);
+// Checks if the voxels of dense data covered by the brick at `origin` all have the same value
+template <typename T>
+bool is_dense_brick_uniform(const uint8_t *p_data, Vector3i size, Vector3i origin) {
+	const T *data = (const T *)p_data;
+	const T v0 = data[origin.y + size.y * (origin.x + size.x * origin.z)];
+	for (int z = origin.z; z < origin.z + VoxelBuffer::BRICK_SIZE; ++z) {
+		for (int x = origin.x; x < origin.x + VoxelBuffer::BRICK_SIZE; ++x) {
+			const T *row = data + origin.y + size.y * (x + size.x * z);
+			for (int y = 0; y < VoxelBuffer::BRICK_SIZE; ++y) {
+				if (row[y] != v0) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
 
-		switch (channel.depth) {
+inline bool is_dense_brick_uniform(const uint8_t *data, VoxelBuffer::Depth depth, Vector3i size, Vector3i origin) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return is_dense_brick_uniform<uint8_t>(data, size, origin);
+		case VoxelBuffer::DEPTH_16_BIT:
+			return is_dense_brick_uniform<uint16_t>(data, size, origin);
+		case VoxelBuffer::DEPTH_32_BIT:
+			return is_dense_brick_uniform<uint32_t>(data, size, origin);
+		case VoxelBuffer::DEPTH_64_BIT:
+			return is_dense_brick_uniform<uint64_t>(data, size, origin);
+		default:
+			CRASH_NOW();
+			return false;
+	}
+}
 
-			case DEPTH_8_BIT:
-				channel.data[i] = value;
-				break;
+// Counts how many bricks of dense data are not uniform
+uint32_t count_dense_bricks(const uint8_t *data, VoxelBuffer::Depth depth, Vector3i size) {
+	const Vector3i grid_size = get_brick_grid_size(size);
+	uint32_t count = 0;
+	Vector3i bpos;
+	for (bpos.z = 0; bpos.z < grid_size.z; ++bpos.z) {
+		for (bpos.x = 0; bpos.x < grid_size.x; ++bpos.x) {
+			for (bpos.y = 0; bpos.y < grid_size.y; ++bpos.y) {
+				if (!is_dense_brick_uniform(data, depth, size, bpos << VoxelBuffer::BRICK_SIZE_PO2)) {
+					++count;
+				}
+			}
+		}
+	}
+	return count;
+}
 
-			case DEPTH_16_BIT:
-				((uint16_t *)channel.data)[i] = value;
-				break;
+inline uint32_t get_bricks_size_in_bytes(Vector3i size, VoxelBuffer::Depth depth, uint32_t dense_brick_count) {
+	return get_brick_grid_size(size).volume() * sizeof(VoxelBrick) + dense_brick_count * get_brick_size_in_bytes(depth);
+}
 
-			case DEPTH_32_BIT:
-				((uint32_t *)channel.data)[i] = value;
-				break;
+// Splits dense data into bricks. Non-uniform bricks get allocated.
+void encode_bricks(const uint8_t *data, VoxelBuffer::Depth depth, Vector3i size, VoxelBrick *bricks) {
+	const Vector3i grid_size = get_brick_grid_size(size);
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
+	const uint32_t row_size_in_bytes = VoxelBuffer::BRICK_SIZE * value_size;
+	const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(depth);
+
+	Vector3i bpos;
+	for (bpos.z = 0; bpos.z < grid_size.z; ++bpos.z) {
+		for (bpos.x = 0; bpos.x < grid_size.x; ++bpos.x) {
+			for (bpos.y = 0; bpos.y < grid_size.y; ++bpos.y) {
+
+				const Vector3i origin = bpos << VoxelBuffer::BRICK_SIZE_PO2;
+				VoxelBrick &brick = bricks[bpos.y + grid_size.y * (bpos.x + grid_size.x * bpos.z)];
+
+				if (is_dense_brick_uniform(data, depth, size, origin)) {
+					brick.data = nullptr;
+					brick.value = get_raw_value(data, origin.y + size.y * (origin.x + size.x * origin.z), depth);
+					continue;
+				}
 
-			case DEPTH_64_BIT:
+				brick.data = allocate_channel_data(brick_size_in_bytes);
+				brick.value = 0;
+
+				// Copy row by row
+				uint8_t *dst = brick.data;
+				for (int z = origin.z; z < origin.z + VoxelBuffer::BRICK_SIZE; ++z) {
+					for (int x = origin.x; x < origin.x + VoxelBuffer::BRICK_SIZE; ++x) {
+						memcpy(dst, data + (origin.y + size.y * (x + size.x * z)) * value_size, row_size_in_bytes);
+						dst += row_size_in_bytes;
+					}
+				}
+			}
+		}
+	}
+}
+
+void free_bricks(VoxelBrick *bricks, uint32_t brick_count, VoxelBuffer::Depth depth) {
+	const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(depth);
+	for (uint32_t i = 0; i < brick_count; ++i) {
+		if (bricks[i].data != nullptr) {
+			free_channel_data(bricks[i].data, brick_size_in_bytes);
+		}
+	}
+	memfree(bricks);
+}
+
+// Downscaling kernels.
+// They reduce 2x2x2 voxels into one, for a row of `count` destination voxels along Y.
+// `p_rows` are the 4 source rows of `2 * count` voxels, at (x, z), (x + 1, z), (x, z + 1) and (x + 1, z + 1).
+
+typedef void (*DownscaleRowFunc)(const uint8_t *const *p_rows, uint8_t *p_dst, uint32_t count);
+
+template <typename T>
+inline void get_typed_rows(const uint8_t *const *p_rows, const T **rows) {
+	for (unsigned int r = 0; r < 4; ++r) {
+		rows[r] = reinterpret_cast<const T *>(p_rows[r]);
+	}
+}
+
+template <typename T>
+void downscale_row_nearest(const uint8_t *const *p_rows, uint8_t *p_dst, uint32_t count) {
+	const T *src = reinterpret_cast<const T *>(p_rows[0]);
+	T *dst = reinterpret_cast<T *>(p_dst);
+	for (uint32_t i = 0; i < count; ++i) {
+		dst[i] = src[i << 1];
+	}
+}
+
+#ifdef VOXEL_BUFFER_USE_SSE2
+// Adds adjacent values together, into lanes of twice their size
+inline __m128i add_pairs_u8(__m128i v) {
+	return _mm_add_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), _mm_srli_epi16(v, 8));
+}
+inline __m128i add_pairs_u16(__m128i v) {
+	return _mm_add_epi32(_mm_and_si128(v, _mm_set1_epi32(0x0000ffff)), _mm_srli_epi32(v, 16));
+}
+#endif
+
+void downscale_row_average_u8(const uint8_t *const *rows, uint8_t *dst, uint32_t count) {
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	for (; i + 8 <= count; i += 8) {
+		const uint32_t j = i << 1;
+		__m128i sum = _mm_set1_epi16(4);
+		for (unsigned int r = 0; r < 4; ++r) {
+			sum = _mm_add_epi16(sum, add_pairs_u8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[r] + j))));
+		}
+		sum = _mm_srli_epi16(sum, 3);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(sum, sum));
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	for (; i + 8 <= count; i += 8) {
+		const uint32_t j = i << 1;
+		uint16x8_t sum = vpaddlq_u8(vld1q_u8(rows[0] + j));
+		sum = vpadalq_u8(sum, vld1q_u8(rows[1] + j));
+		sum = vpadalq_u8(sum, vld1q_u8(rows[2] + j));
+		sum = vpadalq_u8(sum, vld1q_u8(rows[3] + j));
+		vst1_u8(dst + i, vrshrn_n_u16(sum, 3));
+	}
+#endif
+	for (; i < count; ++i) {
+		const uint32_t j = i << 1;
+		uint32_t sum = 4;
+		for (unsigned int r = 0; r < 4; ++r) {
+			sum += rows[r][j] + rows[r][j + 1];
+		}
+		dst[i] = sum >> 3;
+	}
+}
+
+void downscale_row_average_u16(const uint8_t *const *p_rows, uint8_t *p_dst, uint32_t count) {
+	const uint16_t *rows[4];
+	get_typed_rows(p_rows, rows);
+	uint16_t *dst = reinterpret_cast<uint16_t *>(p_dst);
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	for (; i + 4 <= count; i += 4) {
+		const uint32_t j = i << 1;
+		__m128i sum = _mm_set1_epi32(4);
+		for (unsigned int r = 0; r < 4; ++r) {
+			sum = _mm_add_epi32(sum, add_pairs_u16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[r] + j))));
+		}
+		sum = _mm_srli_epi32(sum, 3);
+		// SSE2 can only pack to signed 16-bit, so values are offset into that range and back
+		sum = _mm_packs_epi32(_mm_sub_epi32(sum, _mm_set1_epi32(0x8000)), _mm_setzero_si128());
+		sum = _mm_add_epi16(sum, _mm_set1_epi16(-0x8000));
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), sum);
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	for (; i + 4 <= count; i += 4) {
+		const uint32_t j = i << 1;
+		uint32x4_t sum = vpaddlq_u16(vld1q_u16(rows[0] + j));
+		sum = vpadalq_u16(sum, vld1q_u16(rows[1] + j));
+		sum = vpadalq_u16(sum, vld1q_u16(rows[2] + j));
+		sum = vpadalq_u16(sum, vld1q_u16(rows[3] + j));
+		vst1_u16(dst + i, vrshrn_n_u32(sum, 3));
+	}
+#endif
+	for (; i < count; ++i) {
+		const uint32_t j = i << 1;
+		uint32_t sum = 4;
+		for (unsigned int r = 0; r < 4; ++r) {
+			sum += rows[r][j] + rows[r][j + 1];
+		}
+		dst[i] = sum >> 3;
+	}
+}
+
+// 32-bit values are floats, like in raw_voxel_to_real()
+void downscale_row_average_f32(const uint8_t *const *p_rows, uint8_t *p_dst, uint32_t count) {
+	const float *rows[4];
+	get_typed_rows(p_rows, rows);
+	float *dst = reinterpret_cast<float *>(p_dst);
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	for (; i + 4 <= count; i += 4) {
+		const uint32_t j = i << 1;
+		__m128 a = _mm_loadu_ps(rows[0] + j);
+		__m128 b = _mm_loadu_ps(rows[0] + j + 4);
+		for (unsigned int r = 1; r < 4; ++r) {
+			a = _mm_add_ps(a, _mm_loadu_ps(rows[r] + j));
+			b = _mm_add_ps(b, _mm_loadu_ps(rows[r] + j + 4));
+		}
+		const __m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(even, odd), _mm_set1_ps(0.125f)));
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	for (; i + 4 <= count; i += 4) {
+		const uint32_t j = i << 1;
+		float32x4_t sum = vdupq_n_f32(0.f);
+		for (unsigned int r = 0; r < 4; ++r) {
+			// Loads even and odd values separately
+			const float32x4x2_t v = vld2q_f32(rows[r] + j);
+			sum = vaddq_f32(sum, vaddq_f32(v.val[0], v.val[1]));
+		}
+		vst1q_f32(dst + i, vmulq_n_f32(sum, 0.125f));
+	}
+#endif
+	for (; i < count; ++i) {
+		const uint32_t j = i << 1;
+		float sum = 0.f;
+		for (unsigned int r = 0; r < 4; ++r) {
+			sum += rows[r][j] + rows[r][j + 1];
+		}
+		dst[i] = sum * 0.125f;
+	}
+}
+
+void downscale_row_average_f64(const uint8_t *const *p_rows, uint8_t *p_dst, uint32_t count) {
+	const double *rows[4];
+	get_typed_rows(p_rows, rows);
+	double *dst = reinterpret_cast<double *>(p_dst);
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t j = i << 1;
+		double sum = 0.0;
+		for (unsigned int r = 0; r < 4; ++r) {
+			sum += rows[r][j] + rows[r][j + 1];
+		}
+		dst[i] = sum * 0.125;
+	}
+}
+
+template <typename T>
+void downscale_row_max_occupancy(const uint8_t *const *p_rows, uint8_t *p_dst, uint32_t count) {
+	const T *rows[4];
+	get_typed_rows(p_rows, rows);
+	T *dst = reinterpret_cast<T *>(p_dst);
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t j = i << 1;
+		const T values[8] = {
+			rows[0][j], rows[0][j + 1], rows[1][j], rows[1][j + 1],
+			rows[2][j], rows[2][j + 1], rows[3][j], rows[3][j + 1]
+		};
+		T best = values[0];
+		unsigned int best_count = 0;
+		for (unsigned int a = 0; a < 8 && best_count <= 4; ++a) {
+			unsigned int n = 0;
+			for (unsigned int b = 0; b < 8; ++b) {
+				n += values[a] == values[b];
+			}
+			// Empty voxels lose ties, so thin features don't vanish in lower LODs
+			if (n > best_count || (n == best_count && best == 0)) {
+				best = values[a];
+				best_count = n;
+			}
+		}
+		dst[i] = best;
+	}
+}
+
+const DownscaleRowFunc g_downscale_row_funcs[VoxelBuffer::DOWNSCALE_FILTER_COUNT][VoxelBuffer::DEPTH_COUNT] = {
+	{ downscale_row_nearest<uint8_t>,
+			downscale_row_nearest<uint16_t>,
+			downscale_row_nearest<uint32_t>,
+			downscale_row_nearest<uint64_t> },
+	{ downscale_row_average_u8,
+			downscale_row_average_u16,
+			downscale_row_average_f32,
+			downscale_row_average_f64 },
+	{ downscale_row_max_occupancy<uint8_t>,
+			downscale_row_max_occupancy<uint16_t>,
+			downscale_row_max_occupancy<uint32_t>,
+			downscale_row_max_occupancy<uint64_t> }
+};
+
+// Ranges of raw values.
+// 32-bit and 64-bit values are compared as floats, because that's how get_voxel_f() reads them.
+// Found bounds are always values present in the data.
+
+inline bool is_raw_value_less(uint64_t a, uint64_t b, VoxelBuffer::Depth depth) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_32_BIT: {
+			MarshallFloat ma, mb;
+			ma.i = a;
+			mb.i = b;
+			return ma.f < mb.f;
+		}
+		case VoxelBuffer::DEPTH_64_BIT: {
+			MarshallDouble ma, mb;
+			ma.l = a;
+			mb.l = b;
+			return ma.d < mb.d;
+		}
+		default:
+			return a < b;
+	}
+}
+
+inline void merge_raw_range(uint64_t min_value, uint64_t max_value, VoxelBuffer::Depth depth,
+		uint64_t &dst_min, uint64_t &dst_max) {
+	if (is_raw_value_less(min_value, dst_min, depth)) {
+		dst_min = min_value;
+	}
+	if (is_raw_value_less(dst_max, max_value, depth)) {
+		dst_max = max_value;
+	}
+}
+
+template <typename T>
+inline void merge_range(const T *values, uint32_t count, T &min_value, T &max_value) {
+	for (uint32_t i = 0; i < count; ++i) {
+		const T v = values[i];
+		if (v < min_value) {
+			min_value = v;
+		}
+		if (v > max_value) {
+			max_value = v;
+		}
+	}
+}
+
+void get_range_u8(const uint8_t *data, uint32_t count, uint8_t &min_value, uint8_t &max_value) {
+	min_value = data[0];
+	max_value = data[0];
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	if (count >= 16) {
+		__m128i vmin = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+		__m128i vmax = vmin;
+		for (i = 16; i + 16 <= count; i += 16) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+			vmin = _mm_min_epu8(vmin, v);
+			vmax = _mm_max_epu8(vmax, v);
+		}
+		uint8_t lanes[16];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), vmin);
+		merge_range(lanes, 16, min_value, max_value);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), vmax);
+		merge_range(lanes, 16, min_value, max_value);
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	if (count >= 16) {
+		uint8x16_t vmin = vld1q_u8(data);
+		uint8x16_t vmax = vmin;
+		for (i = 16; i + 16 <= count; i += 16) {
+			const uint8x16_t v = vld1q_u8(data + i);
+			vmin = vminq_u8(vmin, v);
+			vmax = vmaxq_u8(vmax, v);
+		}
+		uint8_t lanes[16];
+		vst1q_u8(lanes, vmin);
+		merge_range(lanes, 16, min_value, max_value);
+		vst1q_u8(lanes, vmax);
+		merge_range(lanes, 16, min_value, max_value);
+	}
+#endif
+	merge_range(data + i, count - i, min_value, max_value);
+}
+
+void get_range_u16(const uint16_t *data, uint32_t count, uint16_t &min_value, uint16_t &max_value) {
+	min_value = data[0];
+	max_value = data[0];
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	if (count >= 8) {
+		// SSE2 only compares signed 16-bit values, so values are offset into that range and back
+		const __m128i bias = _mm_set1_epi16(-0x8000);
+		__m128i vmin = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), bias);
+		__m128i vmax = vmin;
+		for (i = 8; i + 8 <= count; i += 8) {
+			const __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), bias);
+			vmin = _mm_min_epi16(vmin, v);
+			vmax = _mm_max_epi16(vmax, v);
+		}
+		uint16_t lanes[8];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_xor_si128(vmin, bias));
+		merge_range(lanes, 8, min_value, max_value);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_xor_si128(vmax, bias));
+		merge_range(lanes, 8, min_value, max_value);
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	if (count >= 8) {
+		uint16x8_t vmin = vld1q_u16(data);
+		uint16x8_t vmax = vmin;
+		for (i = 8; i + 8 <= count; i += 8) {
+			const uint16x8_t v = vld1q_u16(data + i);
+			vmin = vminq_u16(vmin, v);
+			vmax = vmaxq_u16(vmax, v);
+		}
+		uint16_t lanes[8];
+		vst1q_u16(lanes, vmin);
+		merge_range(lanes, 8, min_value, max_value);
+		vst1q_u16(lanes, vmax);
+		merge_range(lanes, 8, min_value, max_value);
+	}
+#endif
+	merge_range(data + i, count - i, min_value, max_value);
+}
+
+void get_range_f32(const float *data, uint32_t count, float &min_value, float &max_value) {
+	min_value = data[0];
+	max_value = data[0];
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	if (count >= 4) {
+		__m128 vmin = _mm_loadu_ps(data);
+		__m128 vmax = vmin;
+		for (i = 4; i + 4 <= count; i += 4) {
+			const __m128 v = _mm_loadu_ps(data + i);
+			vmin = _mm_min_ps(vmin, v);
+			vmax = _mm_max_ps(vmax, v);
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, vmin);
+		merge_range(lanes, 4, min_value, max_value);
+		_mm_storeu_ps(lanes, vmax);
+		merge_range(lanes, 4, min_value, max_value);
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	if (count >= 4) {
+		float32x4_t vmin = vld1q_f32(data);
+		float32x4_t vmax = vmin;
+		for (i = 4; i + 4 <= count; i += 4) {
+			const float32x4_t v = vld1q_f32(data + i);
+			vmin = vminq_f32(vmin, v);
+			vmax = vmaxq_f32(vmax, v);
+		}
+		float lanes[4];
+		vst1q_f32(lanes, vmin);
+		merge_range(lanes, 4, min_value, max_value);
+		vst1q_f32(lanes, vmax);
+		merge_range(lanes, 4, min_value, max_value);
+	}
+#endif
+	merge_range(data + i, count - i, min_value, max_value);
+}
+
+// Counts the runs an RLE encoding would have, and finds the range of values at the same time.
+// Runs are told apart by raw bits like encode_rle() does, while values are compared as V.
+// Only the first value of each run needs to be compared, so this costs little more than counting.
+template <typename T, typename V>
+uint32_t count_rle_runs_and_range(const uint8_t *p_data, uint32_t row_count, uint32_t row_length, V &min_value, V &max_value) {
+	const T *data = (const T *)p_data;
+	const V *values = (const V *)p_data;
+	min_value = values[0];
+	max_value = values[0];
+	uint32_t run_count = 0;
+	for (uint32_t row = 0; row < row_count; ++row) {
+		const uint32_t row_begin = row * row_length;
+		const T *row_data = data + row_begin;
+		++run_count;
+		merge_range(values + row_begin, 1, min_value, max_value);
+		for (uint32_t y = 1; y < row_length; ++y) {
+			if (row_data[y] != row_data[y - 1]) {
+				++run_count;
+				merge_range(values + row_begin + y, 1, min_value, max_value);
+			}
+		}
+	}
+	return run_count;
+}
+
+uint32_t count_rle_runs_and_range(const uint8_t *data, VoxelBuffer::Depth depth, uint32_t row_count, uint32_t row_length,
+		uint64_t &min_value, uint64_t &max_value) {
+	CRASH_COND(row_count == 0 || row_length == 0);
+	uint32_t run_count = 0;
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT: {
+			uint8_t a, b;
+			run_count = count_rle_runs_and_range<uint8_t, uint8_t>(data, row_count, row_length, a, b);
+			min_value = a;
+			max_value = b;
+		} break;
+
+		case VoxelBuffer::DEPTH_16_BIT: {
+			uint16_t a, b;
+			run_count = count_rle_runs_and_range<uint16_t, uint16_t>(data, row_count, row_length, a, b);
+			min_value = a;
+			max_value = b;
+		} break;
+
+		case VoxelBuffer::DEPTH_32_BIT: {
+			MarshallFloat a, b;
+			run_count = count_rle_runs_and_range<uint32_t, float>(data, row_count, row_length, a.f, b.f);
+			min_value = a.i;
+			max_value = b.i;
+		} break;
+
+		case VoxelBuffer::DEPTH_64_BIT: {
+			MarshallDouble a, b;
+			run_count = count_rle_runs_and_range<uint64_t, double>(data, row_count, row_length, a.d, b.d);
+			min_value = a.l;
+			max_value = b.l;
+		} break;
+
+		default:
+			CRASH_NOW();
+			break;
+	}
+	return run_count;
+}
+
+void get_raw_range(const uint8_t *data, uint32_t count, VoxelBuffer::Depth depth, uint64_t &min_value, uint64_t &max_value) {
+	CRASH_COND(count == 0);
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT: {
+			uint8_t a, b;
+			get_range_u8(data, count, a, b);
+			min_value = a;
+			max_value = b;
+		} break;
+
+		case VoxelBuffer::DEPTH_16_BIT: {
+			uint16_t a, b;
+			get_range_u16(reinterpret_cast<const uint16_t *>(data), count, a, b);
+			min_value = a;
+			max_value = b;
+		} break;
+
+		case VoxelBuffer::DEPTH_32_BIT: {
+			MarshallFloat a, b;
+			get_range_f32(reinterpret_cast<const float *>(data), count, a.f, b.f);
+			min_value = a.i;
+			max_value = b.i;
+		} break;
+
+		case VoxelBuffer::DEPTH_64_BIT: {
+			const double *values = reinterpret_cast<const double *>(data);
+			MarshallDouble a, b;
+			a.d = values[0];
+			b.d = values[0];
+			merge_range(values + 1, count - 1, a.d, b.d);
+			min_value = a.l;
+			max_value = b.l;
+		} break;
+
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+// Compares whole words with the first value repeated, instead of one voxel at a time
+bool is_uniform(const uint8_t *data, uint32_t size, VoxelBuffer::Depth depth) {
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
+	const uint32_t size_in_bytes = size * value_size;
+
+	uint8_t pattern[8];
+	for (uint32_t i = 0; i < 8; i += value_size) {
+		memcpy(pattern + i, data, value_size);
+	}
+	uint64_t pattern_word;
+	memcpy(&pattern_word, pattern, 8);
+
+	uint32_t i = 0;
+#if defined(VOXEL_BUFFER_USE_SSE2)
+	const __m128i pattern_vec = _mm_unpacklo_epi64(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i *>(pattern)),
+			_mm_loadl_epi64(reinterpret_cast<const __m128i *>(pattern)));
+	for (; i + 64 <= size_in_bytes; i += 64) {
+		// Accumulate differences over 64 bytes and test them once
+		__m128i diff = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), pattern_vec);
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 16)), pattern_vec));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 32)), pattern_vec));
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 48)), pattern_vec));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff) {
+			return false;
+		}
+	}
+#elif defined(VOXEL_BUFFER_USE_NEON)
+	const uint8x16_t pattern_vec = vcombine_u8(vld1_u8(pattern), vld1_u8(pattern));
+	for (; i + 64 <= size_in_bytes; i += 64) {
+		// Accumulate differences over 64 bytes and test them once
+		uint8x16_t diff = veorq_u8(vld1q_u8(data + i), pattern_vec);
+		diff = vorrq_u8(diff, veorq_u8(vld1q_u8(data + i + 16), pattern_vec));
+		diff = vorrq_u8(diff, veorq_u8(vld1q_u8(data + i + 32), pattern_vec));
+		diff = vorrq_u8(diff, veorq_u8(vld1q_u8(data + i + 48), pattern_vec));
+		const uint64x2_t diff64 = vreinterpretq_u64_u8(diff);
+		if ((vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) != 0) {
+			return false;
+		}
+	}
+#endif
+	for (; i + 8 <= size_in_bytes; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		if (word != pattern_word) {
+			return false;
+		}
+	}
+	// Value sizes divide 8, so the pattern repeats every 8 bytes
+	for (; i < size_in_bytes; ++i) {
+		if (data[i] != pattern[i & 7]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Hashes memory a word at a time, bytes left at the end are hashed one by one
+inline uint64_t hash_bytes(const uint8_t *data, uint32_t size_in_bytes, uint64_t hash) {
+	uint32_t i = 0;
+	for (; i + 8 <= size_in_bytes; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = hash_djb2_one_64(word, hash);
+	}
+	for (; i < size_in_bytes; ++i) {
+		hash = hash_djb2_one_64(data[i], hash);
+	}
+	return hash;
+}
+
+} // namespace
+
+const char *VoxelBuffer::CHANNEL_ID_HINT_STRING = "Type,Sdf,Data2,Data3,Data4,Data5,Data6,Data7";
+
+VoxelBuffer::VoxelBuffer() {
+	_channels[CHANNEL_SDF].defval = 255;
+}
+
+VoxelBuffer::~VoxelBuffer() {
+	clear();
+}
+
+void VoxelBuffer::create(int sx, int sy, int sz) {
+	if (sx <= 0 || sy <= 0 || sz <= 0) {
+		return;
+	}
+	Vector3i new_size(sx, sy, sz);
+	if (new_size != _size) {
+		for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+			Channel &channel = _channels[i];
+			if (channel.data) {
+				// Channel already contained data
+				delete_channel(i);
+				create_channel(i, new_size, channel.defval);
+			}
+		}
+		_size = new_size;
+	}
+}
+
+void VoxelBuffer::create(Vector3i size) {
+	create(size.x, size.y, size.z);
+}
+
+void VoxelBuffer::clear() {
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		Channel &channel = _channels[i];
+		if (channel.data) {
+			delete_channel(i);
+		}
+	}
+}
+
+void VoxelBuffer::clear_channel(unsigned int channel_index, uint64_t clear_value) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	Channel &channel = _channels[channel_index];
+	if (channel.data) {
+		delete_channel(channel_index);
+	}
+	channel.defval = clamp_value_for_depth(clear_value, channel.depth);
+}
+
+void VoxelBuffer::clear_channel_f(unsigned int channel_index, real_t clear_value) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+	clear_channel(channel_index, real_to_raw_voxel(clear_value, channel.depth));
+}
+
+void VoxelBuffer::set_default_values(FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> values) {
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		_channels[i].defval = clamp_value_for_depth(values[i], _channels[i].depth);
+	}
+}
+
+uint64_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+
+	const Channel &channel = _channels[channel_index];
+
+	if (validate_pos(x, y, z) && channel.data) {
+
+		if (channel.compression == COMPRESSION_RLE) {
+			return get_rle_voxel(channel.data, channel.depth, _size.x * _size.z, x + _size.x * z, y);
+		}
+
+		if (channel.compression == COMPRESSION_BRICKS) {
+			return get_brick_voxel((const VoxelBrick *)channel.data, get_brick_grid_size(_size), channel.depth, x, y, z);
+		}
+
+		uint32_t i = index(x, y, z);
+
+		if (channel.compression == COMPRESSION_PALETTE) {
+			const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+			const uint8_t *indices = channel.data + get_palette_indices_offset(channel.palette_index_bits, value_size);
+			return get_raw_value(channel.data, get_palette_index(indices, i, channel.palette_index_bits), channel.depth);
+		}
+
+		switch (channel.depth) {
+
+			case DEPTH_8_BIT:
+				return channel.data[i];
+
+			case DEPTH_16_BIT:
+				return ((uint16_t *)channel.data)[i];
+
+			case DEPTH_32_BIT:
+				return ((uint32_t *)channel.data)[i];
+
+			case DEPTH_64_BIT:
+				return ((uint64_t *)channel.data)[i];
+
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+
+		return channel.data[index(x, y, z)];
+
+	} else {
+		return channel.defval;
+	}
+}
+
+void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_COND(!validate_pos(x, y, z));
+
+	Channel &channel = _channels[channel_index];
+
+	value = clamp_value_for_depth(value, channel.depth);
+	bool do_set = true;
+	channel.range_valid = false;
+
+	if (channel.compression == COMPRESSION_RLE) {
+		if (get_voxel(x, y, z, channel_index) == value) {
+			return;
+		}
+		decompress_channel(channel_index);
+
+	} else if (channel.compression == COMPRESSION_PALETTE) {
+		if (set_palette_voxel(channel_index, index(x, y, z), value)) {
+			return;
+		}
+		// Too many different values
+		decompress_channel(channel_index);
+
+	} else if (channel.compression == COMPRESSION_BRICKS) {
+		set_brick_voxel(channel_index, x, y, z, value);
+		return;
+	}
+
+	if (channel.data == NULL) {
+		if (channel.defval != value) {
+			// Allocate channel with same initial values as defval
+			create_channel(channel_index, _size, channel.defval);
+		} else {
+			do_set = false;
+		}
+	}
+
+	if (do_set) {
+		unshare_channel(channel_index);
+		uint32_t i = index(x, y, z);
+
+		switch (channel.depth) {
+
+			case DEPTH_8_BIT:
+				channel.data[i] = value;
+				break;
+
+			case DEPTH_16_BIT:
+				((uint16_t *)channel.data)[i] = value;
+				break;
+
+			case DEPTH_32_BIT:
+				((uint32_t *)channel.data)[i] = value;
+				break;
+
+			case DEPTH_64_BIT:
 				((uint64_t *)channel.data)[i] = value;
 				break;
 
@@ -248,212 +1325,790 @@ void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int ch
 				break;
 		}
 	}
-}
+}
+
+real_t VoxelBuffer::get_voxel_f(int x, int y, int z, unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+	return raw_voxel_to_real(get_voxel(x, y, z, channel_index), _channels[channel_index].depth);
+}
+
+void VoxelBuffer::set_voxel_f(real_t value, int x, int y, int z, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	set_voxel(real_to_raw_voxel(value, _channels[channel_index].depth), x, y, z, channel_index);
+}
+
+// This version does not cause errors if out of bounds. Use only if it's okay to be outside.
+void VoxelBuffer::try_set_voxel(int x, int y, int z, int value, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	if (!validate_pos(x, y, z)) {
+		return;
+	}
+	set_voxel(x, y, z, value, channel_index);
+}
+
+void VoxelBuffer::fill(uint64_t defval, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+	Channel &channel = _channels[channel_index];
+
+	defval = clamp_value_for_depth(defval, channel.depth);
+
+	if (channel.data == NULL) {
+		// Channel is already optimized and uniform
+		if (channel.defval == defval) {
+			// No change
+			return;
+		} else {
+			// Just change default value
+			channel.defval = defval;
+			return;
+		}
+	}
+
+	if (channel.compression != COMPRESSION_NONE || channel.ref_count->get() > 1) {
+		// The whole channel gets the same value, no need to keep the encoding or shared data
+		clear_channel(channel_index, defval);
+		return;
+	}
+
+	unsigned int volume = get_volume();
+
+	switch (channel.depth) {
+
+		case DEPTH_8_BIT:
+			memset(channel.data, defval, channel.size_in_bytes);
+			break;
+
+		case DEPTH_16_BIT:
+			for (uint32_t i = 0; i < volume; ++i) {
+				((uint16_t *)channel.data)[i] = defval;
+			}
+			break;
+
+		case DEPTH_32_BIT:
+			for (uint32_t i = 0; i < volume; ++i) {
+				((uint32_t *)channel.data)[i] = defval;
+			}
+			break;
+
+		case DEPTH_64_BIT:
+			for (uint32_t i = 0; i < volume; ++i) {
+				((uint64_t *)channel.data)[i] = defval;
+			}
+			break;
+
+		default:
+			CRASH_NOW();
+			break;
+	}
+
+	channel.range_valid = false;
+}
+
+void VoxelBuffer::fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+	Vector3i::sort_min_max(min, max);
+
+	min.clamp_to(Vector3i(0, 0, 0), _size + Vector3i(1, 1, 1));
+	max.clamp_to(Vector3i(0, 0, 0), _size + Vector3i(1, 1, 1));
+	Vector3i area_size = max - min;
+
+	if (area_size.x == 0 || area_size.y == 0 || area_size.z == 0) {
+		return;
+	}
+
+	Channel &channel = _channels[channel_index];
+	defval = clamp_value_for_depth(defval, channel.depth);
+
+	if (channel.data == NULL && channel.defval == defval) {
+		return;
+	}
+
+	if (channel.depth == DEPTH_8_BIT) {
+		decompress_channel(channel_index);
+		// Fill row by row
+		Vector3i pos;
+		for (pos.z = min.z; pos.z < max.z; ++pos.z) {
+			for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+				unsigned int dst_ri = index(pos.x, min.y, pos.z);
+				memset(&channel.data[dst_ri], defval, area_size.y * sizeof(uint8_t));
+			}
+		}
+
+	} else {
+		read_write_action(Rect3i(min, area_size), Vector3i(), channel_index, [defval](Vector3i pos, uint64_t v) {
+			return defval;
+		});
+	}
+}
+
+void VoxelBuffer::fill_f(real_t value, unsigned int channel) {
+	ERR_FAIL_INDEX(channel, MAX_CHANNELS);
+	fill(real_to_raw_voxel(value, _channels[channel].depth), channel);
+}
+
+bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, true);
+
+	const Channel &channel = _channels[channel_index];
+	if (channel.data == nullptr) {
+		// Channel has been optimized
+		return true;
+	}
+
+	if (channel.range_valid && (channel.range_min != channel.range_max || channel.depth <= DEPTH_16_BIT)) {
+		// Bounds are values of the channel, so if they differ it can't be uniform.
+		// Equal float bounds can't tell about other values comparing equal, like -0 and +0.
+		return channel.range_min == channel.range_max;
+	}
+
+	const uint8_t *values = channel.data;
+	unsigned int volume = get_volume();
+
+	if (channel.compression == COMPRESSION_PALETTE) {
+		// Unused values can remain in the palette, so compare indices
+		const uint32_t index_bits = channel.palette_index_bits;
+		const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+		const uint8_t *indices = channel.data + get_palette_indices_offset(index_bits, value_size);
+		const uint32_t pi = get_palette_index(indices, 0, index_bits);
+		// Compare whole bytes first, then the remaining indices
+		uint8_t pattern = 0;
+		for (uint32_t i = 0; i < 8; i += index_bits) {
+			pattern |= pi << i;
+		}
+		const uint32_t full_bytes = (volume * index_bits) >> 3;
+		for (uint32_t i = 0; i < full_bytes; ++i) {
+			if (indices[i] != pattern) {
+				return false;
+			}
+		}
+		for (uint32_t i = (full_bytes << 3) / index_bits; i < volume; ++i) {
+			if (get_palette_index(indices, i, index_bits) != pi) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	if (channel.compression == COMPRESSION_RLE) {
+		// Only the values of runs need to be compared
+		const uint32_t row_count = _size.x * _size.z;
+		volume = ((const uint32_t *)channel.data)[row_count];
+		values = channel.data + get_rle_values_offset(row_count, volume);
+	}
+
+	if (channel.compression == COMPRESSION_BRICKS) {
+		// Uniform bricks only need their value to be compared
+		const VoxelBrick *bricks = (const VoxelBrick *)channel.data;
+		const uint32_t brick_count = get_brick_count();
+		const uint64_t v0 = get_voxel(0, 0, 0, channel_index);
+		for (uint32_t i = 0; i < brick_count; ++i) {
+			const VoxelBrick &brick = bricks[i];
+			if (brick.data == nullptr) {
+				if (brick.value != v0) {
+					return false;
+				}
+			} else if (get_raw_value(brick.data, 0, channel.depth) != v0 ||
+					   !::is_uniform(brick.data, BRICK_VOLUME, channel.depth)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Channel isn't optimized, so must look at each voxel
+	if (!::is_uniform(values, volume, channel.depth)) {
+		return false;
+	}
+	// Remember it, this is cheap to know now
+	channel.range_min = get_raw_value(values, 0, channel.depth);
+	channel.range_max = channel.range_min;
+	channel.range_valid = true;
+	return true;
+}
+
+void VoxelBuffer::get_channel_range(unsigned int channel_index, uint64_t &min_value, uint64_t &max_value) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+
+	if (channel.data == nullptr) {
+		min_value = channel.defval;
+		max_value = channel.defval;
+		return;
+	}
+
+	if (!channel.range_valid) {
+		switch (channel.compression) {
+			case COMPRESSION_NONE:
+				get_raw_range(channel.data, get_volume(), channel.depth, channel.range_min, channel.range_max);
+				break;
+
+			case COMPRESSION_RLE: {
+				// Only values of runs need to be looked at
+				const uint32_t row_count = _size.x * _size.z;
+				const uint32_t run_count = ((const uint32_t *)channel.data)[row_count];
+				get_raw_range(channel.data + get_rle_values_offset(row_count, run_count), run_count, channel.depth,
+						channel.range_min, channel.range_max);
+			} break;
+
+			case COMPRESSION_PALETTE: {
+				// Unused values can remain in the palette, so only look at referenced ones
+				const uint32_t index_bits = channel.palette_index_bits;
+				const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+				const uint8_t *indices = channel.data + get_palette_indices_offset(index_bits, value_size);
+				FixedArray<bool, PALETTE_MAX_SIZE> used;
+				used.fill(false);
+				const uint32_t volume = get_volume();
+				for (uint32_t i = 0; i < volume; ++i) {
+					used[get_palette_index(indices, i, index_bits)] = true;
+				}
+				bool first = true;
+				for (uint32_t pi = 0; pi < channel.palette_size; ++pi) {
+					if (!used[pi]) {
+						continue;
+					}
+					const uint64_t v = get_raw_value(channel.data, pi, channel.depth);
+					if (first) {
+						channel.range_min = v;
+						channel.range_max = v;
+						first = false;
+					} else {
+						merge_raw_range(v, v, channel.depth, channel.range_min, channel.range_max);
+					}
+				}
+			} break;
+
+			case COMPRESSION_BRICKS: {
+				// Uniform bricks only need their value to be looked at
+				const VoxelBrick *bricks = (const VoxelBrick *)channel.data;
+				const uint32_t brick_count = get_brick_count();
+				for (uint32_t i = 0; i < brick_count; ++i) {
+					const VoxelBrick &brick = bricks[i];
+					uint64_t brick_min = brick.value;
+					uint64_t brick_max = brick.value;
+					if (brick.data != nullptr) {
+						get_raw_range(brick.data, BRICK_VOLUME, channel.depth, brick_min, brick_max);
+					}
+					if (i == 0) {
+						channel.range_min = brick_min;
+						channel.range_max = brick_max;
+					} else {
+						merge_raw_range(brick_min, brick_max, channel.depth, channel.range_min, channel.range_max);
+					}
+				}
+			} break;
+
+			default:
+				CRASH_NOW();
+				break;
+		}
+		channel.range_valid = true;
+	}
 
-real_t VoxelBuffer::get_voxel_f(int x, int y, int z, unsigned int channel_index) const {
-	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
-	return raw_voxel_to_real(get_voxel(x, y, z, channel_index), _channels[channel_index].depth);
+	min_value = channel.range_min;
+	max_value = channel.range_max;
 }
 
-void VoxelBuffer::set_voxel_f(real_t value, int x, int y, int z, unsigned int channel_index) {
+void VoxelBuffer::get_channel_range_f(unsigned int channel_index, real_t &min_value, real_t &max_value) const {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	set_voxel(real_to_raw_voxel(value, _channels[channel_index].depth), x, y, z, channel_index);
+	uint64_t raw_min, raw_max;
+	get_channel_range(channel_index, raw_min, raw_max);
+	const Depth depth = _channels[channel_index].depth;
+	// Conversion preserves order
+	min_value = raw_voxel_to_real(raw_min, depth);
+	max_value = raw_voxel_to_real(raw_max, depth);
 }
 
-// This version does not cause errors if out of bounds. Use only if it's okay to be outside.
-void VoxelBuffer::try_set_voxel(int x, int y, int z, int value, unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	if (!validate_pos(x, y, z)) {
-		return;
+void VoxelBuffer::compress_uniform_channels() {
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		Channel &channel = _channels[i];
+		if (channel.data == nullptr) {
+			continue;
+		}
+
+		if (channel.compression != COMPRESSION_NONE) {
+			// Uniformity of encoded channels is found without decoding them, and stops at the first difference
+			if (is_uniform(i)) {
+				clear_channel(i, get_voxel(0, 0, 0, i));
+				continue;
+			}
+			if (channel.compression == COMPRESSION_RLE) {
+				// Runs are already as compact as they get. Keep the range for meshers, it only looks at run values.
+				uint64_t min_value, max_value;
+				get_channel_range(i, min_value, max_value);
+				continue;
+			}
+			// Values may have been added by edits and then overwritten, rebuild a compact encoding
+			decompress_channel(i);
+		}
+
+		// A single pass counts runs and finds the range, which tells about uniformity too.
+		// The range is kept after compressing, so meshers can use it without looking at voxels again.
+		const uint32_t row_count = _size.x * _size.z;
+		uint64_t min_value, max_value;
+		const uint32_t run_count = count_rle_runs_and_range(channel.data, channel.depth, row_count, _size.y, min_value, max_value);
+
+		// Equal float bounds can't tell about other values comparing equal, like -0 and +0
+		if (min_value == max_value &&
+				(channel.depth <= DEPTH_16_BIT || ::is_uniform(channel.data, get_volume(), channel.depth))) {
+			clear_channel(i, min_value);
+			continue;
+		}
+
+		if (i == CHANNEL_TYPE) {
+			// Types tend to have few different values and often get edited,
+			// which palettes support without decompressing
+			compress_channel_palette(i);
+		}
+		if (channel.compression == COMPRESSION_NONE) {
+			// Pick whichever encoding takes less memory.
+			// Bricks win ties because they can be written to without decompressing.
+			const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+			uint32_t bricks_size = channel.size_in_bytes;
+			if (can_use_bricks(_size)) {
+				bricks_size = get_bricks_size_in_bytes(_size, channel.depth, count_dense_bricks(channel.data, channel.depth, _size));
+			}
+			uint32_t rle_size = channel.size_in_bytes;
+			if (_size.y <= RLE_MAX_ROW_LENGTH) {
+				rle_size = get_rle_size_in_bytes(row_count, run_count, value_size);
+			}
+			if (bricks_size < channel.size_in_bytes && bricks_size <= rle_size) {
+				compress_channel_bricks(i);
+			} else if (rle_size < channel.size_in_bytes) {
+				compress_channel_rle(i, run_count);
+			}
+		}
+		// Encodings don't change values
+		channel.range_min = min_value;
+		channel.range_max = max_value;
+		channel.range_valid = true;
 	}
-	set_voxel(x, y, z, value, channel_index);
 }
 
-void VoxelBuffer::fill(uint64_t defval, unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+uint32_t VoxelBuffer::get_palette_index_bits(uint32_t palette_size) {
+	if (palette_size <= 2) {
+		return 1;
+	}
+	if (palette_size <= 4) {
+		return 2;
+	}
+	if (palette_size <= 16) {
+		return 4;
+	}
+	return 8;
+}
 
+void VoxelBuffer::allocate_channel_palette(unsigned int channel_index, uint32_t index_bits) {
 	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data != nullptr);
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+	const uint32_t size_in_bytes = get_palette_size_in_bytes(get_volume(), index_bits, value_size);
+	// Encodings have variable size, so they don't go through the memory pool.
+	// Zeroed so unused palette entries and padding bits don't make equal channels differ.
+	channel.data = (uint8_t *)memalloc(size_in_bytes);
+	memset(channel.data, 0, size_in_bytes);
+	if (channel.ref_count == nullptr) {
+		// Growing a palette keeps the counter of the data it replaces
+		channel.ref_count = create_channel_ref_count();
+	}
+	channel.size_in_bytes = size_in_bytes;
+	channel.compression = COMPRESSION_PALETTE;
+	channel.palette_index_bits = index_bits;
+	channel.palette_size = 0;
+}
 
-	defval = clamp_value_for_depth(defval, channel.depth);
+void VoxelBuffer::compress_channel_palette(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
 
-	if (channel.data == NULL) {
-		// Channel is already optimized and uniform
-		if (channel.defval == defval) {
-			// No change
-			return;
-		} else {
-			// Just change default value
-			channel.defval = defval;
+	const uint32_t volume = get_volume();
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+
+	FixedArray<uint8_t, PALETTE_MAX_SIZE> palette_8;
+	FixedArray<uint16_t, PALETTE_MAX_SIZE> palette_16;
+	FixedArray<uint32_t, PALETTE_MAX_SIZE> palette_32;
+	FixedArray<uint64_t, PALETTE_MAX_SIZE> palette_64;
+
+	uint32_t palette_size;
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			palette_size = find_palette_values(channel.data, volume, palette_8);
+			break;
+		case DEPTH_16_BIT:
+			palette_size = find_palette_values(channel.data, volume, palette_16);
+			break;
+		case DEPTH_32_BIT:
+			palette_size = find_palette_values(channel.data, volume, palette_32);
+			break;
+		case DEPTH_64_BIT:
+			palette_size = find_palette_values(channel.data, volume, palette_64);
+			break;
+		default:
+			CRASH_NOW();
 			return;
-		}
 	}
 
-	unsigned int volume = get_volume();
+	if (palette_size > PALETTE_MAX_SIZE) {
+		return;
+	}
 
-	switch (channel.depth) {
+	const uint32_t index_bits = get_palette_index_bits(palette_size);
+	if (get_palette_size_in_bytes(volume, index_bits, value_size) >= channel.size_in_bytes) {
+		// Not worth it
+		return;
+	}
+
+	// Encode first, dense data may be shared with other buffers so it gets released with delete_channel()
+	const uint32_t size_in_bytes = get_palette_size_in_bytes(volume, index_bits, value_size);
+	uint8_t *palette_data = (uint8_t *)memalloc(size_in_bytes);
+	memset(palette_data, 0, size_in_bytes);
 
+	switch (channel.depth) {
 		case DEPTH_8_BIT:
-			memset(channel.data, defval, channel.size_in_bytes);
+			encode_palette(channel.data, volume, palette_8, palette_size, index_bits, palette_data);
 			break;
-
 		case DEPTH_16_BIT:
-			for (uint32_t i = 0; i < volume; ++i) {
-				((uint16_t *)channel.data)[i] = defval;
-			}
+			encode_palette(channel.data, volume, palette_16, palette_size, index_bits, palette_data);
 			break;
-
 		case DEPTH_32_BIT:
-			for (uint32_t i = 0; i < volume; ++i) {
-				((uint32_t *)channel.data)[i] = defval;
-			}
+			encode_palette(channel.data, volume, palette_32, palette_size, index_bits, palette_data);
 			break;
-
 		case DEPTH_64_BIT:
-			for (uint32_t i = 0; i < volume; ++i) {
-				((uint64_t *)channel.data)[i] = defval;
-			}
+			encode_palette(channel.data, volume, palette_64, palette_size, index_bits, palette_data);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+
+	delete_channel(channel_index);
+	channel.data = palette_data;
+	channel.ref_count = create_channel_ref_count();
+	channel.size_in_bytes = size_in_bytes;
+	channel.compression = COMPRESSION_PALETTE;
+	channel.palette_index_bits = index_bits;
+	channel.palette_size = palette_size;
+}
+
+// Returns false if the palette cannot hold the value
+bool VoxelBuffer::set_palette_voxel(unsigned int channel_index, uint32_t i, uint64_t value) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_PALETTE);
+	unshare_channel(channel_index);
+
+	uint32_t pi = 0;
+	for (; pi < channel.palette_size; ++pi) {
+		if (get_raw_value(channel.data, pi, channel.depth) == value) {
 			break;
+		}
+	}
+
+	if (pi == channel.palette_size) {
+		// New value
+		if (channel.palette_size == PALETTE_MAX_SIZE) {
+			return false;
+		}
+
+		if (channel.palette_size == (1u << channel.palette_index_bits)) {
+			// Grow indices
+			uint8_t *old_data = channel.data;
+			const uint32_t old_index_bits = channel.palette_index_bits;
+			const uint32_t palette_size = channel.palette_size;
+			const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+
+			channel.data = nullptr;
+			allocate_channel_palette(channel_index, old_index_bits * 2);
+			channel.palette_size = palette_size;
+
+			memcpy(channel.data, old_data, palette_size * value_size);
+
+			const uint8_t *old_indices = old_data + get_palette_indices_offset(old_index_bits, value_size);
+			uint8_t *indices = channel.data + get_palette_indices_offset(channel.palette_index_bits, value_size);
+			const uint32_t volume = get_volume();
+			for (uint32_t j = 0; j < volume; ++j) {
+				set_palette_index(indices, j, channel.palette_index_bits, get_palette_index(old_indices, j, old_index_bits));
+			}
+
+			memfree(old_data);
+		}
+
+		set_raw_value(channel.data, pi, channel.depth, value);
+		++channel.palette_size;
+	}
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+	uint8_t *indices = channel.data + get_palette_indices_offset(channel.palette_index_bits, value_size);
+	set_palette_index(indices, i, channel.palette_index_bits, pi);
+	return true;
+}
 
+void VoxelBuffer::compress_channel_rle(unsigned int channel_index, uint32_t run_count) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
+
+	if (_size.y > RLE_MAX_ROW_LENGTH) {
+		return;
+	}
+
+	const uint32_t row_count = _size.x * _size.z;
+	const uint32_t row_length = _size.y;
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+
+	const uint32_t rle_size = get_rle_size_in_bytes(row_count, run_count, value_size);
+	if (rle_size >= channel.size_in_bytes) {
+		// Not worth it
+		return;
+	}
+
+	// Encodings have variable size, so they don't go through the memory pool
+	uint8_t *rle = (uint8_t *)memalloc(rle_size);
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			encode_rle<uint8_t>(channel.data, row_count, row_length, run_count, rle);
+			break;
+		case DEPTH_16_BIT:
+			encode_rle<uint16_t>(channel.data, row_count, row_length, run_count, rle);
+			break;
+		case DEPTH_32_BIT:
+			encode_rle<uint32_t>(channel.data, row_count, row_length, run_count, rle);
+			break;
+		case DEPTH_64_BIT:
+			encode_rle<uint64_t>(channel.data, row_count, row_length, run_count, rle);
+			break;
 		default:
 			CRASH_NOW();
 			break;
 	}
+
+	delete_channel(channel_index);
+	channel.data = rle;
+	channel.ref_count = create_channel_ref_count();
+	channel.size_in_bytes = rle_size;
+	channel.compression = COMPRESSION_RLE;
 }
 
-void VoxelBuffer::fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigned int channel_index) {
-	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+void VoxelBuffer::compress_channel_bricks(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_NONE);
+	CRASH_COND(!can_use_bricks(_size));
 
-	Vector3i::sort_min_max(min, max);
+	// The brick array doesn't go through the memory pool, but bricks themselves do
+	const uint32_t size_in_bytes = get_brick_count() * sizeof(VoxelBrick);
+	VoxelBrick *bricks = (VoxelBrick *)memalloc(size_in_bytes);
+	encode_bricks(channel.data, channel.depth, _size, bricks);
 
-	min.clamp_to(Vector3i(0, 0, 0), _size + Vector3i(1, 1, 1));
-	max.clamp_to(Vector3i(0, 0, 0), _size + Vector3i(1, 1, 1));
-	Vector3i area_size = max - min;
+	delete_channel(channel_index);
+	channel.data = (uint8_t *)bricks;
+	channel.ref_count = create_channel_ref_count();
+	channel.size_in_bytes = size_in_bytes;
+	channel.compression = COMPRESSION_BRICKS;
+}
 
-	if (area_size.x == 0 || area_size.y == 0 || area_size.z == 0) {
+void VoxelBuffer::set_brick_voxel(unsigned int channel_index, int x, int y, int z, uint64_t value) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.compression != COMPRESSION_BRICKS);
+
+	const uint32_t brick_index = get_brick_index(get_brick_grid_size(_size), x, y, z);
+	const VoxelBrick &shared_brick = ((const VoxelBrick *)channel.data)[brick_index];
+	if (shared_brick.data == nullptr && shared_brick.value == value) {
 		return;
 	}
 
+	unshare_channel(channel_index);
+	VoxelBrick &brick = ((VoxelBrick *)channel.data)[brick_index];
+
+	if (brick.data == nullptr) {
+		// Allocate brick with same initial values as its uniform value
+		brick.data = allocate_channel_data(get_brick_size_in_bytes(channel.depth));
+		fill_raw_values(brick.data, BRICK_VOLUME, channel.depth, brick.value);
+	}
+
+	set_raw_value(brick.data, get_index_in_brick(x, y, z), channel.depth, value);
+}
+
+void VoxelBuffer::decompress_channel(unsigned int channel_index) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	Channel &channel = _channels[channel_index];
-	defval = clamp_value_for_depth(defval, channel.depth);
 
-	if (channel.data == NULL) {
-		if (channel.defval == defval) {
-			return;
-		} else {
-			create_channel(channel_index, _size, channel.defval);
-		}
+	if (channel.data == nullptr) {
+		create_channel(channel_index, _size, channel.defval);
+
+	} else if (channel.compression == COMPRESSION_NONE) {
+		unshare_channel(channel_index);
+
+	} else {
+		const uint32_t dense_size_in_bytes = get_size_in_bytes_for_volume(_size, channel.depth);
+		uint8_t *dense_data = allocate_channel_data(dense_size_in_bytes);
+		decompress_channel_to(channel_index, ArraySlice<uint8_t>(dense_data, 0, dense_size_in_bytes));
+
+		delete_channel(channel_index);
+		channel.data = dense_data;
+		channel.ref_count = create_channel_ref_count();
+		channel.size_in_bytes = dense_size_in_bytes;
+		channel.compression = COMPRESSION_NONE;
 	}
 
-	Vector3i pos;
-	unsigned int volume = get_volume();
-	for (pos.z = min.z; pos.z < max.z; ++pos.z) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+	// Data is about to be written to
+	channel.range_valid = false;
+}
 
-			unsigned int dst_ri = index(pos.x, pos.y + min.y, pos.z);
-			CRASH_COND(dst_ri >= volume);
+void VoxelBuffer::decompress_channel_to(unsigned int channel_index, ArraySlice<uint8_t> dst) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+	const uint32_t size_in_bytes = get_size_in_bytes_for_volume(_size, channel.depth);
+	ERR_FAIL_COND(dst.size() != size_in_bytes);
 
-			switch (channel.depth) {
+	switch (channel.compression) {
+
+		case COMPRESSION_NONE:
+			memcpy(dst.data(), channel.data, size_in_bytes);
+			break;
 
+		case COMPRESSION_UNIFORM: {
+			const uint32_t volume = get_volume();
+			switch (channel.depth) {
 				case DEPTH_8_BIT:
-					// Fill row by row
-					memset(&channel.data[dst_ri], defval, area_size.y * sizeof(uint8_t));
+					memset(dst.data(), channel.defval, size_in_bytes);
 					break;
-
 				case DEPTH_16_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint16_t *)channel.data)[dst_ri + i] = defval;
+					for (uint32_t i = 0; i < volume; ++i) {
+						((uint16_t *)dst.data())[i] = channel.defval;
 					}
 					break;
-
 				case DEPTH_32_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint32_t *)channel.data)[dst_ri + i] = defval;
+					for (uint32_t i = 0; i < volume; ++i) {
+						((uint32_t *)dst.data())[i] = channel.defval;
 					}
 					break;
-
 				case DEPTH_64_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint64_t *)channel.data)[dst_ri + i] = defval;
+					for (uint32_t i = 0; i < volume; ++i) {
+						((uint64_t *)dst.data())[i] = channel.defval;
 					}
 					break;
-
 				default:
 					CRASH_NOW();
 					break;
 			}
-		}
-	}
-}
-
-void VoxelBuffer::fill_f(real_t value, unsigned int channel) {
-	ERR_FAIL_INDEX(channel, MAX_CHANNELS);
-	fill(real_to_raw_voxel(value, _channels[channel].depth), channel);
-}
-
-template <typename T>
-inline bool is_uniform(const uint8_t *p_data, uint32_t size) {
-	const T *data = (const T *)p_data;
-	T v0 = data[0];
-	for (unsigned int i = 1; i < size; ++i) {
-		if (data[i] != v0) {
-			return false;
-		}
-	}
-	return true;
-}
+		} break;
 
-bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
-	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, true);
+		case COMPRESSION_RLE: {
+			const uint32_t row_count = _size.x * _size.z;
+			const uint32_t row_size_in_bytes = _size.y * (::get_depth_bit_count(channel.depth) >> 3);
+			for (uint32_t row = 0; row < row_count; ++row) {
+				decode_rle_row(channel.data, channel.depth, row_count, row, 0, _size.y, dst.data() + row * row_size_in_bytes);
+			}
+		} break;
 
-	const Channel &channel = _channels[channel_index];
-	if (channel.data == nullptr) {
-		// Channel has been optimized
-		return true;
-	}
+		case COMPRESSION_PALETTE:
+			decode_palette_span(channel.data, channel.depth, channel.palette_index_bits, 0, get_volume(), dst.data());
+			break;
 
-	unsigned int volume = get_volume();
+		case COMPRESSION_BRICKS: {
+			const VoxelBrick *bricks = (const VoxelBrick *)channel.data;
+			const Vector3i grid_size = get_brick_grid_size(_size);
+			const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+			for (int z = 0; z < _size.z; ++z) {
+				for (int x = 0; x < _size.x; ++x) {
+					decode_brick_row(bricks, grid_size, channel.depth, x, 0, z, _size.y, dst.data() + index(x, 0, z) * value_size);
+				}
+			}
+		} break;
 
-	// Channel isn't optimized, so must look at each voxel
-	switch (channel.depth) {
-		case DEPTH_8_BIT:
-			return ::is_uniform<uint8_t>(channel.data, volume);
-		case DEPTH_16_BIT:
-			return ::is_uniform<uint16_t>(channel.data, volume);
-		case DEPTH_32_BIT:
-			return ::is_uniform<uint32_t>(channel.data, volume);
-		case DEPTH_64_BIT:
-			return ::is_uniform<uint64_t>(channel.data, volume);
 		default:
 			CRASH_NOW();
 			break;
 	}
-
-	return true;
 }
 
-void VoxelBuffer::compress_uniform_channels() {
-	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
-		if (_channels[i].data && is_uniform(i)) {
-			clear_channel(i, _channels[i].data[0]);
+void VoxelBuffer::copy_to_raw(Rect3i box, unsigned int channel_index, ArraySlice<uint8_t> dst) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+
+	ERR_FAIL_COND(!is_box_inside(box, _size));
+	ERR_FAIL_COND(dst.size() != get_size_in_bytes_for_volume(box.size, channel.depth));
+
+	if (box.size == _size) {
+		decompress_channel_to(channel_index, dst);
+		return;
+	}
+
+	// Rows are decoded straight into the destination, or copied if the channel is dense
+	const uint32_t row_size_in_bytes = box.size.y * (::get_depth_bit_count(channel.depth) >> 3);
+	uint8_t *dst_row = dst.data();
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < box.pos.z + box.size.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < box.pos.x + box.size.x; ++pos.x) {
+			const uint8_t *src_row = get_row(channel_index, pos.x, box.pos.y, pos.z, box.size.y, dst_row);
+			if (src_row != dst_row) {
+				memcpy(dst_row, src_row, row_size_in_bytes);
+			}
+			dst_row += row_size_in_bytes;
 		}
 	}
 }
 
-void VoxelBuffer::decompress_channel(unsigned int channel_index) {
+void VoxelBuffer::copy_from_raw(Rect3i box, unsigned int channel_index, ArraySlice<const uint8_t> src) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	Channel &channel = _channels[channel_index];
-	if (channel.data == nullptr) {
-		create_channel(channel_index, _size, channel.defval);
+
+	ERR_FAIL_COND(!is_box_inside(box, _size));
+	ERR_FAIL_COND(src.size() != get_size_in_bytes_for_volume(box.size, channel.depth));
+
+	if (box.size == _size) {
+		// Previous data is entirely overwritten, no need to decompress it
+		if (channel.data != nullptr) {
+			delete_channel(channel_index);
+		}
+		create_channel_noinit(channel_index, _size);
+		memcpy(channel.data, src.data(), channel.size_in_bytes);
+		return;
+	}
+
+	decompress_channel(channel_index);
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+	const uint32_t row_size_in_bytes = box.size.y * value_size;
+	const uint8_t *src_row = src.data();
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < box.pos.z + box.size.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < box.pos.x + box.size.x; ++pos.x) {
+			memcpy(channel.data + index(pos.x, box.pos.y, pos.z) * value_size, src_row, row_size_in_bytes);
+			src_row += row_size_in_bytes;
+		}
 	}
 }
 
 VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int channel_index) const {
-	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, VoxelBuffer::COMPRESSION_NONE);
-	const Channel &channel = _channels[channel_index];
-	if (channel.data == nullptr) {
-		return COMPRESSION_UNIFORM;
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, VoxelBuffer::COMPRESSION_NONE);
+	return _channels[channel_index].compression;
+}
+
+uint32_t VoxelBuffer::get_memory_usage(bool include_shared) const {
+	uint32_t usage = 0;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data == nullptr) {
+			continue;
+		}
+		if (!include_shared && channel.ref_count->get() > 1) {
+			continue;
+		}
+		usage += channel.size_in_bytes;
+		if (channel.compression == COMPRESSION_BRICKS) {
+			// Dense bricks are allocated separately
+			const VoxelBrick *bricks = (const VoxelBrick *)channel.data;
+			const uint32_t brick_count = get_brick_count();
+			const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(channel.depth);
+			for (uint32_t bi = 0; bi < brick_count; ++bi) {
+				if (bricks[bi].data != nullptr) {
+					usage += brick_size_in_bytes;
+				}
+			}
+		}
 	}
-	return COMPRESSION_NONE;
+	return usage;
 }
 
 void VoxelBuffer::copy_from(const VoxelBuffer &other) {
@@ -466,23 +2121,30 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other) {
 void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	ERR_FAIL_COND(other._size != _size);
+	ERR_FAIL_COND(&other == this);
 
 	Channel &channel = _channels[channel_index];
 	const Channel &other_channel = other._channels[channel_index];
 
 	ERR_FAIL_COND(other_channel.depth != channel.depth);
 
-	if (other_channel.data) {
-		if (channel.data == NULL) {
-			create_channel_noinit(channel_index, _size);
-		}
-		CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
-		memcpy(channel.data, other_channel.data, channel.size_in_bytes);
-
-	} else if (channel.data) {
+	if (channel.data) {
 		delete_channel(channel_index);
 	}
 
+	if (other_channel.data) {
+		// Keep the same encoding
+		channel.data = other.clone_channel_data(channel_index);
+		channel.ref_count = create_channel_ref_count();
+		channel.size_in_bytes = other_channel.size_in_bytes;
+		channel.compression = other_channel.compression;
+		channel.palette_size = other_channel.palette_size;
+		channel.palette_index_bits = other_channel.palette_index_bits;
+		channel.range_min = other_channel.range_min;
+		channel.range_max = other_channel.range_max;
+		channel.range_valid = other_channel.range_valid;
+	}
+
 	channel.defval = other_channel.defval;
 	channel.depth = other_channel.depth;
 }
@@ -517,40 +2179,69 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 	} else {
 		if (other_channel.data) {
 
-			if (channel.data == NULL) {
-				create_channel(channel_index, _size, channel.defval);
-			}
+			decompress_channel(channel_index);
 
-			if (channel.depth == DEPTH_8_BIT) {
-				// Native format
-				// Copy row by row
+			if (other_channel.compression == COMPRESSION_PALETTE) {
+				// Decode row by row
+				const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
 				Vector3i pos;
 				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
 					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-						// Row direction is Y
-						unsigned int src_ri = other.index(pos.x + src_min.x, pos.y + src_min.y, pos.z + src_min.z);
-						unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
-						memcpy(&channel.data[dst_ri], &other_channel.data[src_ri], area_size.y * sizeof(uint8_t));
+						unsigned int src_ri = other.index(pos.x + src_min.x, src_min.y, pos.z + src_min.z);
+						unsigned int dst_ri = index(pos.x + dst_min.x, dst_min.y, pos.z + dst_min.z);
+						decode_palette_span(other_channel.data, channel.depth, other_channel.palette_index_bits,
+								src_ri, area_size.y, channel.data + dst_ri * value_size);
+					}
+				}
+
+			} else if (other_channel.compression == COMPRESSION_RLE) {
+				// Decode row by row
+				const uint32_t src_row_count = other._size.x * other._size.z;
+				const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+				Vector3i pos;
+				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+						const uint32_t src_row = (pos.x + src_min.x) + other._size.x * (pos.z + src_min.z);
+						unsigned int dst_ri = index(pos.x + dst_min.x, dst_min.y, pos.z + dst_min.z);
+						decode_rle_row(other_channel.data, channel.depth, src_row_count,
+								src_row, src_min.y, area_size.y, channel.data + dst_ri * value_size);
+					}
+				}
+
+			} else if (other_channel.compression == COMPRESSION_BRICKS) {
+				// Decode row by row
+				const VoxelBrick *src_bricks = (const VoxelBrick *)other_channel.data;
+				const Vector3i src_grid_size = get_brick_grid_size(other._size);
+				const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+				Vector3i pos;
+				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+						unsigned int dst_ri = index(pos.x + dst_min.x, dst_min.y, pos.z + dst_min.z);
+						decode_brick_row(src_bricks, src_grid_size, channel.depth,
+								pos.x + src_min.x, src_min.y, pos.z + src_min.z, area_size.y, channel.data + dst_ri * value_size);
 					}
 				}
 
 			} else {
-				// TODO Optimized versions
+				// Native format
+				// Copy row by row
+				const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
 				Vector3i pos;
 				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
 					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-						for (pos.y = 0; pos.y < area_size.y; ++pos.y) {
-							uint64_t v = other.get_voxel(src_min + pos, channel_index);
-							set_voxel(v, dst_min + pos, channel_index);
-						}
+						// Row direction is Y
+						unsigned int src_ri = other.index(pos.x + src_min.x, src_min.y, pos.z + src_min.z);
+						unsigned int dst_ri = index(pos.x + dst_min.x, dst_min.y, pos.z + dst_min.z);
+						memcpy(channel.data + dst_ri * value_size,
+								other_channel.data + src_ri * value_size,
+								area_size.y * value_size);
 					}
 				}
 			}
 
-		} else if (channel.defval != other_channel.defval) {
-			if (channel.data == NULL) {
-				create_channel(channel_index, _size, channel.defval);
-			}
+		} else {
+			// Data of the destination may differ from its default value, so the area gets filled anyways.
+			// fill_area() does nothing if the channel is uniform with the same value.
 			fill_area(other_channel.defval, dst_min, dst_min + area_size, channel_index);
 		}
 	}
@@ -559,13 +2250,46 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 Ref<VoxelBuffer> VoxelBuffer::duplicate() const {
 	VoxelBuffer *d = memnew(VoxelBuffer);
 	d->create(_size);
-	d->copy_from(*this);
+	for (unsigned int i = 0; i < _channels.size(); ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data != nullptr) {
+			// Share data instead of copying it. The counter is atomic, so several threads can do this at once.
+			channel.ref_count->ref();
+		}
+		d->_channels[i] = channel;
+	}
 	return Ref<VoxelBuffer>(d);
 }
 
-bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const {
+bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<const uint8_t> &slice) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
 	const Channel &channel = _channels[channel_index];
-	if (channel.data != nullptr) {
+	if (channel.compression == COMPRESSION_NONE) {
+		slice = ArraySlice<const uint8_t>(channel.data, 0, channel.size_in_bytes);
+		return true;
+	}
+	slice = ArraySlice<const uint8_t>();
+	return false;
+}
+
+bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	Channel &channel = _channels[channel_index];
+	if (channel.compression == COMPRESSION_NONE) {
+		// The slice may be written to
+		unshare_channel(channel_index);
+		channel.range_valid = false;
+		slice = ArraySlice<uint8_t>(channel.data, 0, channel.size_in_bytes);
+		return true;
+	}
+	slice = ArraySlice<uint8_t>();
+	return false;
+}
+
+bool VoxelBuffer::get_channel_rle_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	const Channel &channel = _channels[channel_index];
+	if (channel.compression == COMPRESSION_RLE) {
 		slice = ArraySlice<uint8_t>(channel.data, 0, channel.size_in_bytes);
 		return true;
 	}
@@ -573,6 +2297,157 @@ bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t
 	return false;
 }
 
+bool VoxelBuffer::set_channel_rle_raw(unsigned int channel_index, const uint8_t *p_data, uint32_t p_size) {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	ERR_FAIL_COND_V(p_data == nullptr, false);
+	ERR_FAIL_COND_V(_size.y > RLE_MAX_ROW_LENGTH, false);
+
+	Channel &channel = _channels[channel_index];
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+
+	// Copy first, so the encoding gets validated in aligned memory
+	uint8_t *rle = (uint8_t *)memalloc(p_size);
+	memcpy(rle, p_data, p_size);
+
+	if (!validate_rle(rle, p_size, _size.x * _size.z, _size.y, value_size)) {
+		memfree(rle);
+		ERR_PRINT("Invalid run-length encoding");
+		return false;
+	}
+
+	if (channel.data) {
+		delete_channel(channel_index);
+	}
+	channel.data = rle;
+	channel.ref_count = create_channel_ref_count();
+	channel.size_in_bytes = p_size;
+	channel.compression = COMPRESSION_RLE;
+	return true;
+}
+
+bool VoxelBuffer::get_channel_palette_raw(unsigned int channel_index,
+		ArraySlice<uint8_t> &palette, ArraySlice<uint8_t> &indices, uint32_t &palette_size) const {
+
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	const Channel &channel = _channels[channel_index];
+	if (channel.compression != COMPRESSION_PALETTE) {
+		return false;
+	}
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+	const uint32_t indices_offset = get_palette_indices_offset(channel.palette_index_bits, value_size);
+	palette = ArraySlice<uint8_t>(channel.data, 0, channel.palette_size * value_size);
+	indices = ArraySlice<uint8_t>(channel.data, indices_offset, channel.size_in_bytes);
+	palette_size = channel.palette_size;
+	return true;
+}
+
+bool VoxelBuffer::set_channel_palette_raw(unsigned int channel_index,
+		const uint8_t *p_palette, uint32_t palette_size, const uint8_t *p_indices, uint32_t p_indices_size) {
+
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	ERR_FAIL_COND_V(p_palette == nullptr || p_indices == nullptr, false);
+	ERR_FAIL_COND_V(palette_size == 0 || palette_size > PALETTE_MAX_SIZE, false);
+
+	const uint32_t volume = get_volume();
+	const uint32_t index_bits = get_palette_index_bits(palette_size);
+	ERR_FAIL_COND_V(p_indices_size != get_palette_indices_size_in_bytes(volume, index_bits), false);
+
+	for (uint32_t i = 0; i < volume; ++i) {
+		ERR_FAIL_COND_V_MSG(get_palette_index(p_indices, i, index_bits) >= palette_size, false,
+				"Invalid palette index");
+	}
+
+	Channel &channel = _channels[channel_index];
+	if (channel.data) {
+		delete_channel(channel_index);
+	}
+	allocate_channel_palette(channel_index, index_bits);
+	channel.palette_size = palette_size;
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+	memcpy(channel.data, p_palette, palette_size * value_size);
+	memcpy(channel.data + get_palette_indices_offset(index_bits, value_size), p_indices, p_indices_size);
+	return true;
+}
+
+uint32_t VoxelBuffer::get_brick_count() const {
+	if (!can_use_bricks(_size)) {
+		return 0;
+	}
+	return get_brick_grid_size(_size).volume();
+}
+
+bool VoxelBuffer::get_channel_brick_raw(unsigned int channel_index, uint32_t brick_index,
+		ArraySlice<uint8_t> &data, uint64_t &value) const {
+
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	const Channel &channel = _channels[channel_index];
+	if (channel.compression != COMPRESSION_BRICKS) {
+		return false;
+	}
+	ERR_FAIL_INDEX_V(brick_index, get_brick_count(), false);
+
+	const VoxelBrick &brick = ((const VoxelBrick *)channel.data)[brick_index];
+	if (brick.data == nullptr) {
+		data = ArraySlice<uint8_t>();
+	} else {
+		data = ArraySlice<uint8_t>(brick.data, 0, get_brick_size_in_bytes(channel.depth));
+	}
+	value = brick.value;
+	return true;
+}
+
+bool VoxelBuffer::set_channel_brick_raw(unsigned int channel_index, uint32_t brick_index,
+		const uint8_t *p_data, uint64_t value) {
+
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	const uint32_t brick_count = get_brick_count();
+	ERR_FAIL_INDEX_V(brick_index, brick_count, false);
+
+	Channel &channel = _channels[channel_index];
+
+	if (channel.compression != COMPRESSION_BRICKS) {
+		if (channel.data == nullptr) {
+			// All bricks start with the uniform value
+			const uint32_t size_in_bytes = brick_count * sizeof(VoxelBrick);
+			VoxelBrick *bricks = (VoxelBrick *)memalloc(size_in_bytes);
+			for (uint32_t i = 0; i < brick_count; ++i) {
+				bricks[i].data = nullptr;
+				bricks[i].value = channel.defval;
+			}
+			channel.data = (uint8_t *)bricks;
+			channel.ref_count = create_channel_ref_count();
+			channel.size_in_bytes = size_in_bytes;
+			channel.compression = COMPRESSION_BRICKS;
+		} else {
+			decompress_channel(channel_index);
+			compress_channel_bricks(channel_index);
+		}
+	}
+
+	unshare_channel(channel_index);
+	channel.range_valid = false;
+	VoxelBrick &brick = ((VoxelBrick *)channel.data)[brick_index];
+	const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(channel.depth);
+
+	if (p_data == nullptr) {
+		if (brick.data != nullptr) {
+			free_channel_data(brick.data, brick_size_in_bytes);
+			brick.data = nullptr;
+		}
+		brick.value = clamp_value_for_depth(value, channel.depth);
+
+	} else {
+		if (brick.data == nullptr) {
+			brick.data = allocate_channel_data(brick_size_in_bytes);
+		}
+		memcpy(brick.data, p_data, brick_size_in_bytes);
+		brick.value = 0;
+	}
+
+	return true;
+}
+
 void VoxelBuffer::create_channel(int i, Vector3i size, uint64_t defval) {
 	create_channel_noinit(i, size);
 	fill(defval, i);
@@ -591,18 +2466,96 @@ void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 	uint32_t size_in_bytes = get_size_in_bytes_for_volume(size, channel.depth);
 	CRASH_COND(channel.data != nullptr);
 	channel.data = allocate_channel_data(size_in_bytes);
+	channel.ref_count = create_channel_ref_count();
 	channel.size_in_bytes = size_in_bytes;
+	channel.compression = COMPRESSION_NONE;
+	channel.range_valid = false;
+}
+
+// Allocates a copy of the data of a channel, in the same encoding
+uint8_t *VoxelBuffer::clone_channel_data(unsigned int channel_index) const {
+	const Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data == nullptr);
+
+	uint8_t *data;
+	if (channel.compression == COMPRESSION_NONE) {
+		data = allocate_channel_data(channel.size_in_bytes);
+	} else {
+		data = (uint8_t *)memalloc(channel.size_in_bytes);
+	}
+	memcpy(data, channel.data, channel.size_in_bytes);
+
+	if (channel.compression == COMPRESSION_BRICKS) {
+		// Dense bricks are separate allocations
+		VoxelBrick *bricks = (VoxelBrick *)data;
+		const uint32_t brick_count = get_brick_count();
+		const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(channel.depth);
+		for (uint32_t i = 0; i < brick_count; ++i) {
+			VoxelBrick &brick = bricks[i];
+			if (brick.data != nullptr) {
+				const uint8_t *src = brick.data;
+				brick.data = allocate_channel_data(brick_size_in_bytes);
+				memcpy(brick.data, src, brick_size_in_bytes);
+			}
+		}
+	}
+
+	return data;
+}
+
+// Must be called before modifying data of a channel in place
+void VoxelBuffer::unshare_channel(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (channel.ref_count->get() == 1) {
+		// Not shared, or other buffers released the data already
+		return;
+	}
+
+	const Channel shared_channel = channel;
+	uint8_t *data = clone_channel_data(channel_index);
+	// Releases our reference, the data gets freed if other buffers released it meanwhile
+	delete_channel(channel_index);
+	channel = shared_channel;
+	channel.data = data;
+	channel.ref_count = create_channel_ref_count();
 }
 
 void VoxelBuffer::delete_channel(int i) {
 	Channel &channel = _channels[i];
 	ERR_FAIL_COND(channel.data == nullptr);
-	free_channel_data(channel.data, channel.size_in_bytes);
+	// Shared data is freed by the last buffer releasing it
+	CRASH_COND(channel.ref_count == nullptr);
+	if (channel.ref_count->unref()) {
+		memdelete(channel.ref_count);
+		if (channel.compression == COMPRESSION_NONE) {
+			free_channel_data(channel.data, channel.size_in_bytes);
+		} else if (channel.compression == COMPRESSION_BRICKS) {
+			free_bricks((VoxelBrick *)channel.data, get_brick_count(), channel.depth);
+		} else {
+			memfree(channel.data);
+		}
+	}
+	channel.ref_count = nullptr;
 	channel.data = nullptr;
 	channel.size_in_bytes = 0;
+	channel.compression = COMPRESSION_UNIFORM;
+	channel.palette_size = 0;
+	channel.palette_index_bits = 0;
+	channel.range_valid = false;
 }
 
 void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const {
+	for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+		downscale_to(dst, src_min, src_max, dst_min, channel_index, get_default_downscale_filter(channel_index));
+	}
+}
+
+void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min,
+		unsigned int channel_index, DownscaleFilter filter) const {
+
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_INDEX(filter, DOWNSCALE_FILTER_COUNT);
+	ERR_FAIL_COND(&dst == this);
 
 	// TODO Align input to multiple of two
 
@@ -614,41 +2567,97 @@ void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_
 	dst_min.clamp_to(Vector3i(), dst._size);
 	dst_max.clamp_to(Vector3i(), dst._size + Vector3i(1));
 
-	for (int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
-
-		const Channel &src_channel = _channels[channel_index];
-		const Channel &dst_channel = dst._channels[channel_index];
+	const Vector3i area_size = dst_max - dst_min;
+	if (area_size.x <= 0 || area_size.y <= 0 || area_size.z <= 0) {
+		return;
+	}
 
-		if (src_channel.data == nullptr && dst_channel.data == nullptr && src_channel.defval == dst_channel.defval) {
-			// No action needed
-			continue;
-		}
+	const Channel &src_channel = _channels[channel_index];
+	Channel &dst_channel = dst._channels[channel_index];
 
-		// Nearest-neighbor downscaling
+	if (src_channel.compression == COMPRESSION_UNIFORM) {
+		// Every filter gives the same value
+		dst.fill_area(src_channel.defval, dst_min, dst_max, channel_index);
+		return;
+	}
 
-		Vector3i pos;
-		for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
-			for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
-				for (pos.y = dst_min.y; pos.y < dst_max.y; ++pos.y) {
+	ERR_FAIL_COND(src_channel.depth != dst_channel.depth);
 
-					const Vector3i src_pos = src_min + ((pos - dst_min) << 1);
+	dst.decompress_channel(channel_index);
 
-					// TODO Remove check once it works
-					CRASH_COND(!validate_pos(src_pos.x, src_pos.y, src_pos.z));
+	const uint32_t value_size = ::get_depth_bit_count(src_channel.depth) >> 3;
+	const uint32_t src_row_length = area_size.y << 1;
+	const DownscaleRowFunc downscale_row = g_downscale_row_funcs[filter][src_channel.depth];
 
-					uint64_t v;
-					if (src_channel.data) {
-						// TODO Optimized version?
-						v = get_voxel(src_pos, channel_index);
-					} else {
-						v = src_channel.defval;
-					}
+	// Rows of compressed channels are decoded in there
+	uint8_t *tmp = nullptr;
+	if (src_channel.compression != COMPRESSION_NONE) {
+		tmp = (uint8_t *)memalloc(4 * src_row_length * value_size);
+	}
 
-					dst.set_voxel(v, pos, channel_index);
-				}
+	const uint8_t *src_rows[4];
+	Vector3i pos;
+	for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+			const Vector3i src_pos = src_min + (pos << 1);
+			for (unsigned int r = 0; r < 4; ++r) {
+				// Dense rows are read in place and don't need temporary memory
+				uint8_t *row_tmp = tmp != nullptr ? tmp + r * src_row_length * value_size : nullptr;
+				src_rows[r] = get_row(channel_index, src_pos.x + (r & 1), src_pos.y, src_pos.z + (r >> 1), src_row_length,
+						row_tmp);
 			}
+			const unsigned int dst_ri = dst.index(dst_min.x + pos.x, dst_min.y, dst_min.z + pos.z);
+			downscale_row(src_rows, dst_channel.data + dst_ri * value_size, area_size.y);
 		}
 	}
+
+	if (tmp != nullptr) {
+		memfree(tmp);
+	}
+}
+
+VoxelBuffer::DownscaleFilter VoxelBuffer::get_default_downscale_filter(unsigned int channel_index) {
+	switch (channel_index) {
+		case CHANNEL_TYPE:
+			return DOWNSCALE_MAX_OCCUPANCY;
+		case CHANNEL_SDF:
+			return DOWNSCALE_AVERAGE;
+		default:
+			return DOWNSCALE_NEAREST;
+	}
+}
+
+// Gets `count` voxels of a row along Y. Points to the data of the channel if it is not compressed,
+// otherwise voxels are decoded into `tmp`.
+const uint8_t *VoxelBuffer::get_row(unsigned int channel_index, int x, int y, int z, uint32_t count, uint8_t *tmp) const {
+	const Channel &channel = _channels[channel_index];
+
+	switch (channel.compression) {
+		case COMPRESSION_NONE:
+			return channel.data + index(x, y, z) * (::get_depth_bit_count(channel.depth) >> 3);
+
+		case COMPRESSION_UNIFORM:
+			fill_raw_values(tmp, count, channel.depth, channel.defval);
+			break;
+
+		case COMPRESSION_RLE:
+			decode_rle_row(channel.data, channel.depth, _size.x * _size.z, x + _size.x * z, y, count, tmp);
+			break;
+
+		case COMPRESSION_PALETTE:
+			decode_palette_span(channel.data, channel.depth, channel.palette_index_bits, index(x, y, z), count, tmp);
+			break;
+
+		case COMPRESSION_BRICKS:
+			decode_brick_row((const VoxelBrick *)channel.data, get_brick_grid_size(_size), channel.depth, x, y, z, count, tmp);
+			break;
+
+		default:
+			CRASH_NOW();
+			break;
+	}
+
+	return tmp;
 }
 
 Ref<VoxelTool> VoxelBuffer::get_voxel_tool() {
@@ -679,13 +2688,49 @@ bool VoxelBuffer::equals(const VoxelBuffer *p_other) const {
 			return false;
 		}
 
+		if (channel.compression != other_channel.compression) {
+			return false;
+		}
+
+		if (channel.compression == COMPRESSION_PALETTE && channel.palette_size != other_channel.palette_size) {
+			return false;
+		}
+
 		if (channel.data == nullptr) {
 			if (channel.defval != other_channel.defval) {
 				return false;
 			}
 
+		} else if (channel.data == other_channel.data) {
+			// Shared data
+			continue;
+
+		} else if (channel.compression == COMPRESSION_BRICKS) {
+			// Bricks point to their own allocations, so compare what they contain
+			const VoxelBrick *bricks = (const VoxelBrick *)channel.data;
+			const VoxelBrick *other_bricks = (const VoxelBrick *)other_channel.data;
+			const uint32_t brick_count = get_brick_count();
+			const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(channel.depth);
+			for (uint32_t i = 0; i < brick_count; ++i) {
+				const VoxelBrick &brick = bricks[i];
+				const VoxelBrick &other_brick = other_bricks[i];
+				if ((brick.data == nullptr) != (other_brick.data == nullptr)) {
+					return false;
+				}
+				if (brick.data == nullptr) {
+					if (brick.value != other_brick.value) {
+						return false;
+					}
+				} else if (memcmp(brick.data, other_brick.data, brick_size_in_bytes) != 0) {
+					return false;
+				}
+			}
+
 		} else {
-			CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
+			if (channel.size_in_bytes != other_channel.size_in_bytes) {
+				// Can happen with run-length or palette encoding
+				return false;
+			}
 			for (unsigned int i = 0; i < channel.size_in_bytes; ++i) {
 				if (channel.data[i] != other_channel.data[i]) {
 					return false;
@@ -697,6 +2742,56 @@ bool VoxelBuffer::equals(const VoxelBuffer *p_other) const {
 	return true;
 }
 
+bool VoxelBuffer::is_sharing_data_with(const VoxelBuffer &other) const {
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const uint8_t *data = _channels[i].data;
+		if (data != nullptr && data == other._channels[i].data) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t VoxelBuffer::get_content_hash() const {
+	// Must hash the same things equals() compares
+	uint64_t hash = hash_djb2_one_64(_size.x);
+	hash = hash_djb2_one_64(_size.y, hash);
+	hash = hash_djb2_one_64(_size.z, hash);
+
+	for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+		const Channel &channel = _channels[channel_index];
+
+		hash = hash_djb2_one_64(channel.depth, hash);
+		hash = hash_djb2_one_64(channel.compression, hash);
+
+		if (channel.data == nullptr) {
+			hash = hash_djb2_one_64(channel.defval, hash);
+
+		} else if (channel.compression == COMPRESSION_BRICKS) {
+			const VoxelBrick *bricks = (const VoxelBrick *)channel.data;
+			const uint32_t brick_count = get_brick_count();
+			const uint32_t brick_size_in_bytes = get_brick_size_in_bytes(channel.depth);
+			for (uint32_t i = 0; i < brick_count; ++i) {
+				const VoxelBrick &brick = bricks[i];
+				if (brick.data == nullptr) {
+					hash = hash_djb2_one_64(brick.value, hash);
+				} else {
+					hash = hash_bytes(brick.data, brick_size_in_bytes, hash);
+				}
+			}
+
+		} else {
+			if (channel.compression == COMPRESSION_PALETTE) {
+				hash = hash_djb2_one_64(channel.palette_size, hash);
+			}
+			hash = hash_djb2_one_64(channel.size_in_bytes, hash);
+			hash = hash_bytes(channel.data, channel.size_in_bytes, hash);
+		}
+	}
+
+	return hash;
+}
+
 void VoxelBuffer::set_channel_depth(unsigned int channel_index, Depth new_depth) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	ERR_FAIL_INDEX(new_depth, DEPTH_COUNT);
@@ -709,6 +2804,7 @@ void VoxelBuffer::set_channel_depth(unsigned int channel_index, Depth new_depth)
 		WARN_PRINT("Changing VoxelBuffer depth with present data, this will reset the channel");
 		delete_channel(channel_index);
 	}
+	channel.depth = new_depth;
 	channel.defval = clamp_value_for_depth(channel.defval, new_depth);
 }
 
@@ -721,6 +2817,10 @@ uint32_t VoxelBuffer::get_depth_bit_count(Depth d) {
 	return ::get_depth_bit_count(d);
 }
 
+uint64_t VoxelBuffer::get_depth_max_value(Depth d) {
+	return ::get_max_value_for_depth(d);
+}
+
 Ref<Image> VoxelBuffer::debug_print_sdf_to_image_top_down() {
 	Image *im = memnew(Image);
 	im->create(_size.x, _size.z, false, Image::FORMAT_RGB8);
@@ -769,9 +2869,19 @@ void VoxelBuffer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("copy_channel_from", "other", "channel"), &VoxelBuffer::_b_copy_channel_from);
 	ClassDB::bind_method(D_METHOD("copy_channel_from_area", "other", "src_min", "src_max", "dst_min", "channel"), &VoxelBuffer::_b_copy_channel_from_area);
 	ClassDB::bind_method(D_METHOD("downscale_to", "dst", "src_min", "src_max", "dst_min"), &VoxelBuffer::_b_downscale_to);
+	ClassDB::bind_method(D_METHOD("downscale_channel_to", "dst", "src_min", "src_max", "dst_min", "channel", "filter"),
+			&VoxelBuffer::_b_downscale_channel_to);
+
+	ClassDB::bind_method(D_METHOD("get_channel_data", "channel"), &VoxelBuffer::_b_get_channel_data);
+	ClassDB::bind_method(D_METHOD("set_channel_data", "data", "channel"), &VoxelBuffer::_b_set_channel_data);
+	ClassDB::bind_method(D_METHOD("get_area_data", "min", "max", "channel"), &VoxelBuffer::_b_get_area_data);
+	ClassDB::bind_method(D_METHOD("set_area_data", "data", "min", "max", "channel"), &VoxelBuffer::_b_set_area_data);
+	ClassDB::bind_method(D_METHOD("get_area_data_f", "min", "max", "channel"), &VoxelBuffer::_b_get_area_data_f);
+	ClassDB::bind_method(D_METHOD("set_area_data_f", "data", "min", "max", "channel"), &VoxelBuffer::_b_set_area_data_f);
 
 	ClassDB::bind_method(D_METHOD("is_uniform", "channel"), &VoxelBuffer::is_uniform);
 	ClassDB::bind_method(D_METHOD("optimize"), &VoxelBuffer::compress_uniform_channels);
+	ClassDB::bind_method(D_METHOD("get_channel_compression", "channel"), &VoxelBuffer::get_channel_compression);
 
 	BIND_ENUM_CONSTANT(CHANNEL_TYPE);
 	BIND_ENUM_CONSTANT(CHANNEL_SDF);
@@ -788,6 +2898,18 @@ void VoxelBuffer::_bind_methods() {
 	BIND_ENUM_CONSTANT(DEPTH_32_BIT);
 	BIND_ENUM_CONSTANT(DEPTH_64_BIT);
 	BIND_ENUM_CONSTANT(DEPTH_COUNT);
+
+	BIND_ENUM_CONSTANT(COMPRESSION_NONE);
+	BIND_ENUM_CONSTANT(COMPRESSION_UNIFORM);
+	BIND_ENUM_CONSTANT(COMPRESSION_RLE);
+	BIND_ENUM_CONSTANT(COMPRESSION_PALETTE);
+	BIND_ENUM_CONSTANT(COMPRESSION_BRICKS);
+	BIND_ENUM_CONSTANT(COMPRESSION_COUNT);
+
+	BIND_ENUM_CONSTANT(DOWNSCALE_NEAREST);
+	BIND_ENUM_CONSTANT(DOWNSCALE_AVERAGE);
+	BIND_ENUM_CONSTANT(DOWNSCALE_MAX_OCCUPANCY);
+	BIND_ENUM_CONSTANT(DOWNSCALE_FILTER_COUNT);
 }
 
 void VoxelBuffer::_b_copy_channel_from(Ref<VoxelBuffer> other, unsigned int channel) {
@@ -804,3 +2926,105 @@ void VoxelBuffer::_b_downscale_to(Ref<VoxelBuffer> dst, Vector3 src_min, Vector3
 	ERR_FAIL_COND(dst.is_null());
 	downscale_to(**dst, Vector3i(src_min), Vector3i(src_max), Vector3i(dst_min));
 }
+
+void VoxelBuffer::_b_downscale_channel_to(Ref<VoxelBuffer> dst, Vector3 src_min, Vector3 src_max, Vector3 dst_min,
+		unsigned int channel, DownscaleFilter filter) const {
+	ERR_FAIL_COND(dst.is_null());
+	downscale_to(**dst, Vector3i(src_min), Vector3i(src_max), Vector3i(dst_min), channel, filter);
+}
+
+PoolByteArray VoxelBuffer::_b_get_channel_data(unsigned int channel) const {
+	return _b_get_area_data(Vector3(), _size.to_vec3(), channel);
+}
+
+void VoxelBuffer::_b_set_channel_data(PoolByteArray data, unsigned int channel) {
+	_b_set_area_data(data, Vector3(), _size.to_vec3(), channel);
+}
+
+PoolByteArray VoxelBuffer::_b_get_area_data(Vector3 min, Vector3 max, unsigned int channel) const {
+	PoolByteArray data;
+	ERR_FAIL_INDEX_V(channel, MAX_CHANNELS, data);
+	Vector3i min_pos(min);
+	Vector3i max_pos(max);
+	Vector3i::sort_min_max(min_pos, max_pos);
+	const Rect3i box = Rect3i::from_min_max(min_pos, max_pos);
+	ERR_FAIL_COND_V(!is_box_inside(box, _size), data);
+
+	const uint32_t size_in_bytes = get_size_in_bytes_for_volume(box.size, _channels[channel].depth);
+	data.resize(size_in_bytes);
+	{
+		PoolByteArray::Write w = data.write();
+		copy_to_raw(box, channel, ArraySlice<uint8_t>(w.ptr(), 0, size_in_bytes));
+	}
+	return data;
+}
+
+void VoxelBuffer::_b_set_area_data(PoolByteArray data, Vector3 min, Vector3 max, unsigned int channel) {
+	ERR_FAIL_INDEX(channel, MAX_CHANNELS);
+	Vector3i min_pos(min);
+	Vector3i max_pos(max);
+	Vector3i::sort_min_max(min_pos, max_pos);
+	const Rect3i box = Rect3i::from_min_max(min_pos, max_pos);
+	ERR_FAIL_COND(!is_box_inside(box, _size));
+
+	const uint32_t size_in_bytes = get_size_in_bytes_for_volume(box.size, _channels[channel].depth);
+	ERR_FAIL_COND_MSG(data.size() != (int)size_in_bytes, "Data size doesn't match the area and channel depth");
+
+	PoolByteArray::Read r = data.read();
+	copy_from_raw(box, channel, ArraySlice<const uint8_t>(r.ptr(), 0, size_in_bytes));
+}
+
+PoolRealArray VoxelBuffer::_b_get_area_data_f(Vector3 min, Vector3 max, unsigned int channel) const {
+	PoolRealArray data;
+	ERR_FAIL_INDEX_V(channel, MAX_CHANNELS, data);
+	Vector3i min_pos(min);
+	Vector3i max_pos(max);
+	Vector3i::sort_min_max(min_pos, max_pos);
+	const Rect3i box = Rect3i::from_min_max(min_pos, max_pos);
+	ERR_FAIL_COND_V(!is_box_inside(box, _size), data);
+
+	const Depth depth = _channels[channel].depth;
+	data.resize(box.size.volume());
+	PoolRealArray::Write w = data.write();
+	real_t *dst = w.ptr();
+
+	// Rows are decoded as raw values, then converted
+	uint8_t *tmp = (uint8_t *)memalloc(box.size.y * (::get_depth_bit_count(depth) >> 3));
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < box.pos.z + box.size.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < box.pos.x + box.size.x; ++pos.x) {
+			const uint8_t *row = get_row(channel, pos.x, box.pos.y, pos.z, box.size.y, tmp);
+			for (int y = 0; y < box.size.y; ++y) {
+				*dst++ = raw_voxel_to_real(get_raw_value(row, y, depth), depth);
+			}
+		}
+	}
+	memfree(tmp);
+
+	return data;
+}
+
+void VoxelBuffer::_b_set_area_data_f(PoolRealArray data, Vector3 min, Vector3 max, unsigned int channel) {
+	ERR_FAIL_INDEX(channel, MAX_CHANNELS);
+	Vector3i min_pos(min);
+	Vector3i max_pos(max);
+	Vector3i::sort_min_max(min_pos, max_pos);
+	const Rect3i box = Rect3i::from_min_max(min_pos, max_pos);
+	ERR_FAIL_COND(!is_box_inside(box, _size));
+	ERR_FAIL_COND_MSG(data.size() != box.size.volume(), "Data size doesn't match the area");
+
+	decompress_channel(channel);
+
+	Channel &ch = _channels[channel];
+	PoolRealArray::Read r = data.read();
+	const real_t *src = r.ptr();
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < box.pos.z + box.size.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < box.pos.x + box.size.x; ++pos.x) {
+			const uint32_t ri = index(pos.x, box.pos.y, pos.z);
+			for (int y = 0; y < box.size.y; ++y) {
+				set_raw_value(ch.data, ri + y, ch.depth, real_to_raw_voxel(*src++, ch.depth));
+			}
+		}
+	}
+}
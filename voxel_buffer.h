@@ -4,14 +4,20 @@
 #include "math/rect3i.h"
 #include "util/array_slice.h"
 #include "util/fixed_array.h"
+#include <core/io/marshalls.h>
 #include <core/reference.h>
+#include <core/safe_refcount.h>
 #include <core/vector.h>
 
+#include <limits>
+
 class VoxelTool;
 
 // Dense voxels data storage.
 // Organized in channels of configurable bit depth.
 // Values can be interpreted either as unsigned integers or normalized floats.
+// Channels can be compressed to save memory, either as a single value, as runs along the Y axis,
+// as indices into a small palette of values, or as bricks which are each either uniform or dense.
 class VoxelBuffer : public Reference {
 	GDCLASS(VoxelBuffer, Reference)
 
@@ -35,7 +41,9 @@ public:
 	enum Compression {
 		COMPRESSION_NONE = 0,
 		COMPRESSION_UNIFORM,
-		//COMPRESSION_RLE,
+		COMPRESSION_RLE,
+		COMPRESSION_PALETTE,
+		COMPRESSION_BRICKS,
 		COMPRESSION_COUNT
 	};
 
@@ -49,6 +57,22 @@ public:
 
 	static const Depth DEFAULT_CHANNEL_DEPTH = DEPTH_8_BIT;
 
+	// How 2x2x2 voxels are reduced into one when downscaling
+	enum DownscaleFilter {
+		// Takes the voxel with the lowest coordinates
+		DOWNSCALE_NEAREST = 0,
+		// Takes the mean of the 8 voxels. Suited to SDF. 32-bit and 64-bit values are treated as floats.
+		DOWNSCALE_AVERAGE,
+		// Takes the most frequent of the 8 voxels, non-zero values winning ties. Suited to types.
+		DOWNSCALE_MAX_OCCUPANCY,
+		DOWNSCALE_FILTER_COUNT
+	};
+
+	// Size of the cubes bricked channels are made of
+	static const unsigned int BRICK_SIZE_PO2 = 3;
+	static const unsigned int BRICK_SIZE = 1 << BRICK_SIZE_PO2;
+	static const unsigned int BRICK_VOLUME = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
 	VoxelBuffer();
 	~VoxelBuffer();
 
@@ -79,16 +103,44 @@ public:
 
 	bool is_uniform(unsigned int channel_index) const;
 
+	// Gets the lowest and highest raw values of a channel. 32-bit and 64-bit values are compared as floats.
+	// The result is cached until the channel is modified, and compress_uniform_channels() computes it,
+	// so meshers can reject blocks cheaply.
+	void get_channel_range(unsigned int channel_index, uint64_t &min_value, uint64_t &max_value) const;
+	void get_channel_range_f(unsigned int channel_index, real_t &min_value, real_t &max_value) const;
+
+	// Turns channels into their most compact form: uniform if all voxels are the same,
+	// otherwise run-length encoded or split into bricks, whichever takes less memory than dense storage.
+	// CHANNEL_TYPE uses a palette instead when possible. Palettes and bricks can be written to without decompressing.
 	void compress_uniform_channels();
+	// Makes the channel dense and owned by this buffer only, so its raw data can be written to.
+	// This also forgets the cached range of the channel.
 	void decompress_channel(unsigned int channel_index);
 	Compression get_channel_compression(unsigned int channel_index) const;
 
+	// Writes voxels of a channel into dense memory, whatever its compression.
+	// The destination must be get_size_in_bytes_for_volume() bytes large.
+	void decompress_channel_to(unsigned int channel_index, ArraySlice<uint8_t> dst) const;
+
+	// Bulk access to raw values of a box of voxels, which must be inside the buffer.
+	// Values are laid out like in a dense buffer of the size of the box, in native byte order,
+	// so the memory must be get_size_in_bytes_for_volume() bytes large.
+	// Rows are decoded directly from compressed channels, and writing the whole buffer doesn't decompress first.
+	void copy_to_raw(Rect3i box, unsigned int channel_index, ArraySlice<uint8_t> dst) const;
+	void copy_from_raw(Rect3i box, unsigned int channel_index, ArraySlice<const uint8_t> src);
+
 	static uint32_t get_size_in_bytes_for_volume(Vector3i size, Depth depth);
 
+	// Memory used by voxel data, in bytes. Data shared with copies of the buffer is counted in each of them,
+	// unless `include_shared` is false.
+	uint32_t get_memory_usage(bool include_shared = true) const;
+
 	void copy_from(const VoxelBuffer &other);
 	void copy_from(const VoxelBuffer &other, unsigned int channel_index);
 	void copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index);
 
+	// Channels of the copy share their data with this buffer until either of them is written to,
+	// so this is cheap and can be used to take snapshots.
 	Ref<VoxelBuffer> duplicate() const;
 
 	_FORCE_INLINE_ bool validate_pos(unsigned int x, unsigned int y, unsigned int z) const {
@@ -108,38 +160,163 @@ public:
 	}
 
 	// TODO Have a template version based on channel depth
-	bool get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const;
-
+	// Gives the memory of a dense channel. Data may be shared with copies of the buffer, so it is read-only.
+	bool get_channel_raw(unsigned int channel_index, ArraySlice<const uint8_t> &slice) const;
+	// Same, for writing: the channel gets its own copy of shared data first, and forgets its cached range.
+	bool get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice);
+
+	// Access to the encoded memory of run-length compressed channels, mostly useful to serializers.
+	// The setter validates the data and returns false if it is not a valid encoding for the current size and depth.
+	bool get_channel_rle_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const;
+	bool set_channel_rle_raw(unsigned int channel_index, const uint8_t *p_data, uint32_t p_size);
+
+	// Same for palette compressed channels. The palette is given as raw values of the channel depth,
+	// and indices are bit-packed using get_palette_index_bits() bits per voxel.
+	bool get_channel_palette_raw(unsigned int channel_index,
+			ArraySlice<uint8_t> &palette, ArraySlice<uint8_t> &indices, uint32_t &palette_size) const;
+	bool set_channel_palette_raw(unsigned int channel_index,
+			const uint8_t *p_palette, uint32_t palette_size, const uint8_t *p_indices, uint32_t p_indices_size);
+	static uint32_t get_palette_index_bits(uint32_t palette_size);
+
+	// Same for bricked channels. Bricks are cubes of BRICK_SIZE voxels, ordered like voxels.
+	// They can only be used if all dimensions of the buffer are multiples of BRICK_SIZE, otherwise there are none.
+	// A brick is either uniform, with an empty slice and its value, or has BRICK_VOLUME raw values.
+	// The setter turns the channel into bricks if it isn't already. Pass null data to make a brick uniform.
+	uint32_t get_brick_count() const;
+	bool get_channel_brick_raw(unsigned int channel_index, uint32_t brick_index, ArraySlice<uint8_t> &data, uint64_t &value) const;
+	bool set_channel_brick_raw(unsigned int channel_index, uint32_t brick_index, const uint8_t *p_data, uint64_t value);
+
+	// Downscales an area by a factor of 2, each destination voxel coming from 2x2x2 source voxels.
+	// The first version uses the default filter of each channel.
 	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const;
+	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min,
+			unsigned int channel_index, DownscaleFilter filter) const;
+	static DownscaleFilter get_default_downscale_filter(unsigned int channel_index);
 	Ref<VoxelTool> get_voxel_tool();
 
 	bool equals(const VoxelBuffer *p_other) const;
+	// Tells if at least one channel shares its data with the other buffer (see duplicate())
+	bool is_sharing_data_with(const VoxelBuffer &other) const;
+	// Hash of what equals() compares, so equal buffers have the same hash
+	uint64_t get_content_hash() const;
 
 	void set_channel_depth(unsigned int channel_index, Depth new_depth);
 	Depth get_channel_depth(unsigned int channel_index) const;
 	static uint32_t get_depth_bit_count(Depth d);
+	static uint64_t get_depth_max_value(Depth d);
+
+	// Runs an action on every voxel of a box, which returns the new value of the voxel.
+	// The action is called as `uint64_t action_func(Vector3i pos, uint64_t value)`, where `pos` is the position
+	// of the voxel plus `offset`. Returned values are clamped to the depth of the channel.
+	// The box is clipped to the buffer. Actions may be called more than once on the same voxel,
+	// so they must only depend on their arguments.
+	// Storage is only touched where values change: uniform and run-length encoded channels are decompressed
+	// once the action changes a voxel, palettes and bricks are written in place, and shared data is copied on first write.
+	// Dense channels are iterated through raw pointers along Y, with depth dispatched once per call,
+	// so this is much faster than many calls to get_voxel/set_voxel.
+	template <typename F>
+	void read_write_action(Rect3i box, Vector3i offset, unsigned int channel_index, F action_func) {
+		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+
+		box.clip(Rect3i(Vector3i(), _size));
+		if (box.size.x <= 0 || box.size.y <= 0 || box.size.z <= 0) {
+			return;
+		}
+
+		Channel &channel = _channels[channel_index];
+
+		switch (channel.compression) {
+			case COMPRESSION_UNIFORM:
+			case COMPRESSION_RLE:
+				if (!is_changed_by_action(box, offset, channel_index, action_func)) {
+					return;
+				}
+				decompress_channel(channel_index);
+				break;
+
+			case COMPRESSION_PALETTE:
+			case COMPRESSION_BRICKS:
+				read_write_action_per_voxel(box, offset, channel_index, action_func);
+				return;
+
+			default:
+				break;
+		}
+
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				read_write_action_t<uint8_t>(channel_index, box, offset, action_func);
+				break;
+			case DEPTH_16_BIT:
+				read_write_action_t<uint16_t>(channel_index, box, offset, action_func);
+				break;
+			case DEPTH_32_BIT:
+				read_write_action_t<uint32_t>(channel_index, box, offset, action_func);
+				break;
+			case DEPTH_64_BIT:
+				read_write_action_t<uint64_t>(channel_index, box, offset, action_func);
+				break;
+			default:
+				CRASH_NOW();
+				break;
+		}
+	}
 
-	// TODO Make this work, would be awesome for perf
-	//
-	//	template <typename F>
-	//	void read_write_action(Rect3i box, Vector3i offset, unsigned int channel_index, F f) {
-	//		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	//		box.clip(Rect3i(Vector3i(), _size));
-	//		Vector3i min_pos = box.pos;
-	//		Vector3i max_pos = box.pos + box.size;
-	//		Vector3i pos;
-	//		for (pos.z = min_pos.z; pos.z < max_pos.z; ++pos.z) {
-	//			for (pos.x = min_pos.x; pos.x < max_pos.x; ++pos.x) {
-	//				for (pos.y = min_pos.y; pos.y < max_pos.y; ++pos.y) {
-	//					int v0 = get_voxel(pos, channel_index);
-	//					int v1 = f(pos + offset, v0);
-	//					if (v0 != v1) {
-	//						set_voxel(v1, pos, channel_index);
-	//					}
-	//				}
-	//			}
-	//		}
-	//	}
+	// Same as read_write_action(), with values converted like get_voxel_f/set_voxel_f.
+	// The action is called as `real_t action_func(Vector3i pos, real_t value)`.
+	template <typename F>
+	void read_write_action_f(Rect3i box, Vector3i offset, unsigned int channel_index, F action_func) {
+		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+		const Depth depth = _channels[channel_index].depth;
+		read_write_action(box, offset, channel_index, [depth, &action_func](Vector3i pos, uint64_t v) {
+			return real_to_raw_voxel(action_func(pos, raw_voxel_to_real(v, depth)), depth);
+		});
+	}
+
+	// Conversions used by the `_f` accessors. Depths below 32 bits are normalized between -1 and 1.
+	static inline uint64_t real_to_raw_voxel(real_t value, Depth depth) {
+		switch (depth) {
+			case DEPTH_8_BIT:
+				return CLAMP(static_cast<int>(128.f * value + 128.f), 0, 0xff);
+			case DEPTH_16_BIT:
+				return CLAMP(static_cast<int>(0x7fff * value + 0x7fff), 0, 0xffff);
+			case DEPTH_32_BIT: {
+				MarshallFloat m;
+				m.f = value;
+				return m.i;
+			}
+			case DEPTH_64_BIT: {
+				MarshallDouble m;
+				m.d = value;
+				return m.l;
+			}
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
+
+	static inline real_t raw_voxel_to_real(uint64_t value, Depth depth) {
+		switch (depth) {
+			case DEPTH_8_BIT:
+				return (static_cast<real_t>(value) - 0x7f) / 0x7f;
+			case DEPTH_16_BIT:
+				return (static_cast<real_t>(value) - 0x7fff) / 0x7fff;
+			case DEPTH_32_BIT: {
+				MarshallFloat m;
+				m.i = value;
+				return m.f;
+			}
+			case DEPTH_64_BIT: {
+				MarshallDouble m;
+				m.l = value;
+				return m.d;
+			}
+			default:
+				CRASH_NOW();
+				return 0;
+		}
+	}
 
 	// Debugging
 	Ref<Image> debug_print_sdf_to_image_top_down();
@@ -148,6 +325,91 @@ private:
 	void create_channel_noinit(int i, Vector3i size);
 	void create_channel(int i, Vector3i size, uint64_t defval);
 	void delete_channel(int i);
+	// Takes the number of runs, as counted by compress_uniform_channels()
+	void compress_channel_rle(unsigned int channel_index, uint32_t run_count);
+	void compress_channel_palette(unsigned int channel_index);
+	bool set_palette_voxel(unsigned int channel_index, uint32_t i, uint64_t value);
+	void allocate_channel_palette(unsigned int channel_index, uint32_t index_bits);
+	void compress_channel_bricks(unsigned int channel_index);
+	void set_brick_voxel(unsigned int channel_index, int x, int y, int z, uint64_t value);
+	uint8_t *clone_channel_data(unsigned int channel_index) const;
+	void unshare_channel(unsigned int channel_index);
+	const uint8_t *get_row(unsigned int channel_index, int x, int y, int z, uint32_t count, uint8_t *tmp) const;
+
+	// Inner loop of read_write_action() on dense channels, for one channel depth. The box must be inside the buffer.
+	template <typename T, typename F>
+	void read_write_action_t(unsigned int channel_index, const Rect3i &box, Vector3i offset, F &action_func) {
+		Channel &channel = _channels[channel_index];
+		const uint64_t max_value = std::numeric_limits<T>::max();
+		const Vector3i max_pos = box.pos + box.size;
+		bool modified = false;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max_pos.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max_pos.x; ++pos.x) {
+				T *row = reinterpret_cast<T *>(channel.data) + index(pos.x, 0, pos.z);
+				Vector3i dst_pos(pos.x + offset.x, box.pos.y + offset.y, pos.z + offset.z);
+				for (int y = box.pos.y; y < max_pos.y; ++y, ++dst_pos.y) {
+					const uint64_t v = action_func(dst_pos, static_cast<uint64_t>(row[y]));
+					const T new_v = static_cast<T>(v < max_value ? v : max_value);
+					if (new_v != row[y]) {
+						if (!modified) {
+							// Data shared with other buffers gets copied only if something changes
+							unshare_channel(channel_index);
+							row = reinterpret_cast<T *>(channel.data) + index(pos.x, 0, pos.z);
+							modified = true;
+						}
+						row[y] = new_v;
+					}
+				}
+			}
+		}
+		if (modified) {
+			channel.range_valid = false;
+		}
+	}
+
+	// Runs an action on a compressed channel without writing to it, and tells if it would change any voxel.
+	template <typename F>
+	bool is_changed_by_action(const Rect3i &box, Vector3i offset, unsigned int channel_index, F &action_func) const {
+		const uint64_t max_value = get_depth_max_value(_channels[channel_index].depth);
+		const Vector3i max_pos = box.pos + box.size;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max_pos.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max_pos.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < max_pos.y; ++pos.y) {
+					const uint64_t v = get_voxel(pos.x, pos.y, pos.z, channel_index);
+					const uint64_t new_v = action_func(pos + offset, v);
+					if ((new_v < max_value ? new_v : max_value) != v) {
+						return true;
+					}
+				}
+			}
+		}
+		return false;
+	}
+
+	// Variant of read_write_action() going through set_voxel(), for channels which can be modified in place.
+	// Only voxels whose value changes are written.
+	template <typename F>
+	void read_write_action_per_voxel(const Rect3i &box, Vector3i offset, unsigned int channel_index, F &action_func) {
+		const uint64_t max_value = get_depth_max_value(_channels[channel_index].depth);
+		const Vector3i max_pos = box.pos + box.size;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max_pos.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max_pos.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < max_pos.y; ++pos.y) {
+					const uint64_t v = get_voxel(pos.x, pos.y, pos.z, channel_index);
+					uint64_t new_v = action_func(pos + offset, v);
+					if (new_v > max_value) {
+						new_v = max_value;
+					}
+					if (new_v != v) {
+						set_voxel(new_v, pos.x, pos.y, pos.z, channel_index);
+					}
+				}
+			}
+		}
+	}
 
 protected:
 	static void _bind_methods();
@@ -167,11 +429,20 @@ protected:
 	void _b_set_voxel_f(real_t value, int x, int y, int z, unsigned int channel) { set_voxel_f(value, x, y, z, channel); }
 	void _b_set_voxel_v(uint64_t value, Vector3 pos, unsigned int channel_index = 0) { set_voxel(value, pos.x, pos.y, pos.z, channel_index); }
 	void _b_downscale_to(Ref<VoxelBuffer> dst, Vector3 src_min, Vector3 src_max, Vector3 dst_min) const;
+	void _b_downscale_channel_to(Ref<VoxelBuffer> dst, Vector3 src_min, Vector3 src_max, Vector3 dst_min,
+			unsigned int channel, DownscaleFilter filter) const;
+	PoolByteArray _b_get_channel_data(unsigned int channel) const;
+	void _b_set_channel_data(PoolByteArray data, unsigned int channel);
+	PoolByteArray _b_get_area_data(Vector3 min, Vector3 max, unsigned int channel) const;
+	void _b_set_area_data(PoolByteArray data, Vector3 min, Vector3 max, unsigned int channel);
+	PoolRealArray _b_get_area_data_f(Vector3 min, Vector3 max, unsigned int channel) const;
+	void _b_set_area_data_f(PoolRealArray data, Vector3 min, Vector3 max, unsigned int channel);
 
 private:
 	struct Channel {
 		// Allocated when the channel is populated.
 		// Flat array, in order [z][x][y] because it allows faster vertical-wise access (the engine is Y-up).
+		// If the channel is compressed with runs, a palette or bricks, contains the encoding instead (see voxel_buffer.cpp).
 		uint8_t *data = nullptr;
 
 		// Default value when data is null
@@ -180,6 +451,23 @@ private:
 		Depth depth = DEFAULT_CHANNEL_DEPTH;
 
 		uint32_t size_in_bytes = 0;
+
+		// Uniform when data is null
+		Compression compression = COMPRESSION_UNIFORM;
+
+		// Used values in the palette, and how many bits are used to store each index
+		uint16_t palette_size = 0;
+		uint8_t palette_index_bits = 0;
+
+		// How many buffers use the data, set whenever data is. It can be shared with copies of the buffer (see duplicate()).
+		// Shared data is never modified, the channel gets its own copy first.
+		SafeRefCount *ref_count = nullptr;
+
+		// Lowest and highest raw values, cached until the channel gets modified (see get_channel_range()).
+		// Mutable because they are computed on demand.
+		mutable uint64_t range_min = 0;
+		mutable uint64_t range_max = 0;
+		mutable bool range_valid = false;
 	};
 
 	// Each channel can store arbitary data.
@@ -192,5 +480,7 @@ private:
 
 VARIANT_ENUM_CAST(VoxelBuffer::ChannelId)
 VARIANT_ENUM_CAST(VoxelBuffer::Depth)
+VARIANT_ENUM_CAST(VoxelBuffer::Compression)
+VARIANT_ENUM_CAST(VoxelBuffer::DownscaleFilter)
 
 #endif // VOXEL_BUFFER_H
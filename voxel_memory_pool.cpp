@@ -1,11 +1,70 @@
 #include "voxel_memory_pool.h"
+#include "core/os/os.h"
 #include "core/print_string.h"
+#include "core/safe_refcount.h"
 #include "core/variant.h"
 
 namespace {
 VoxelMemoryPool *g_memory_pool = nullptr;
 } // namespace
 
+// Blocks a thread keeps for itself. Only its thread uses it, so it needs no lock,
+// except when moving blocks from or to shared pools.
+struct VoxelMemoryPool::ThreadCache {
+	struct Entry {
+		Pool *pool = nullptr;
+		uint32_t count = 0;
+		uint8_t *blocks[THREAD_CACHE_BLOCKS];
+
+		// Moves blocks to the shared pool. Must be called with the shared lock held.
+		void give_back(uint32_t block_count, uint64_t &idle_bytes) {
+			CRASH_COND(block_count > count);
+			for (uint32_t i = 0; i < block_count; ++i) {
+				pool->blocks.push_back(blocks[--count]);
+			}
+			idle_bytes += block_count * pool->block_size;
+		}
+	};
+
+	// Pool the blocks belong to. Null if the cache is not registered in any pool.
+	VoxelMemoryPool *owner = nullptr;
+	Entry entries[THREAD_CACHE_POOLS];
+	unsigned int next_entry = 0;
+
+	~ThreadCache() {
+		// Thread is exiting, blocks go back to shared pools
+		if (owner != nullptr) {
+			owner->flush_thread_cache(*this);
+		}
+	}
+
+	inline Entry *find(uint32_t size) {
+		for (unsigned int i = 0; i < THREAD_CACHE_POOLS; ++i) {
+			Entry &entry = entries[i];
+			if (entry.pool != nullptr && entry.pool->block_size == size) {
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	// Gets the entry for blocks of a pool, replacing the least recently claimed one if there is none.
+	// Must be called with the shared lock held.
+	Entry &claim(Pool *pool, uint64_t &idle_bytes) {
+		Entry *entry = find(pool->block_size);
+		if (entry != nullptr) {
+			return *entry;
+		}
+		Entry &e = entries[next_entry];
+		next_entry = (next_entry + 1) % THREAD_CACHE_POOLS;
+		if (e.pool != nullptr) {
+			e.give_back(e.count, idle_bytes);
+		}
+		e.pool = pool;
+		return e;
+	}
+};
+
 void VoxelMemoryPool::create_singleton() {
 	CRASH_COND(g_memory_pool != nullptr);
 	g_memory_pool = memnew(VoxelMemoryPool);
@@ -35,30 +94,176 @@ VoxelMemoryPool::~VoxelMemoryPool() {
 	memdelete(_mutex);
 }
 
+VoxelMemoryPool::ThreadCache &VoxelMemoryPool::get_thread_cache() {
+	static thread_local ThreadCache cache;
+	return cache;
+}
+
 uint8_t *VoxelMemoryPool::allocate(uint32_t size) {
-	MutexLock lock(_mutex);
+	ThreadCache &cache = get_thread_cache();
+
+	if (cache.owner == this) {
+		ThreadCache::Entry *entry = cache.find(size);
+		if (entry != nullptr && entry->count > 0) {
+			atomic_increment(&entry->pool->used_blocks);
+			atomic_increment(&entry->pool->allocations);
+			return entry->blocks[--entry->count];
+		}
+	}
+
+	const bool contended = lock_shared();
+
+	if (cache.owner != this) {
+		attach_thread_cache(cache);
+	}
+
 	Pool *pool = get_or_create_pool(size);
+	if (contended) {
+		++pool->contentions;
+	}
+
 	uint8_t *block;
 	if (pool->blocks.size() > 0) {
 		block = pool->blocks.back();
 		pool->blocks.pop_back();
+		_idle_bytes -= size;
 	} else {
 		block = (uint8_t *)memalloc(size * sizeof(uint8_t));
+		++pool->total_blocks;
+	}
+
+	// Take a few more idle blocks, so next allocations of this size don't have to lock
+	ThreadCache::Entry &entry = cache.claim(pool, _idle_bytes);
+	while (entry.count < THREAD_CACHE_BLOCKS / 2 && pool->blocks.size() > 0) {
+		entry.blocks[entry.count++] = pool->blocks.back();
+		pool->blocks.pop_back();
+		_idle_bytes -= size;
 	}
-	++_used_blocks;
+
+	atomic_increment(&pool->used_blocks);
+	atomic_increment(&pool->allocations);
+
+	_mutex->unlock();
 	return block;
 }
 
 void VoxelMemoryPool::recycle(uint8_t *block, uint32_t size) {
-	MutexLock lock(_mutex);
-	Pool *pool = _pools[size]; // If not found, entry will be created! It would be an error
+	ThreadCache &cache = get_thread_cache();
+
+	if (cache.owner == this) {
+		ThreadCache::Entry *entry = cache.find(size);
+		if (entry != nullptr && entry->count < THREAD_CACHE_BLOCKS) {
+			atomic_decrement(&entry->pool->used_blocks);
+			entry->blocks[entry->count++] = block;
+			return;
+		}
+	}
+
+	const bool contended = lock_shared();
+
+	if (cache.owner != this) {
+		attach_thread_cache(cache);
+	}
+
+	Pool **ppool = _pools.getptr(size);
 	// Check recycling before having allocated
-	CRASH_COND(pool == nullptr);
-	pool->blocks.push_back(block);
-	--_used_blocks;
+	CRASH_COND(ppool == nullptr);
+	Pool *pool = *ppool;
+	if (contended) {
+		++pool->contentions;
+	}
+
+	// Keep the block in the cache of the thread, which gives half of its blocks to the shared pool if it is full
+	ThreadCache::Entry &entry = cache.claim(pool, _idle_bytes);
+	if (entry.count == THREAD_CACHE_BLOCKS) {
+		entry.give_back(THREAD_CACHE_BLOCKS / 2, _idle_bytes);
+	}
+	entry.blocks[entry.count++] = block;
+
+	atomic_decrement(&pool->used_blocks);
+
+	if (_idle_bytes > _max_idle_bytes) {
+		// Trim more than needed, so it doesn't happen again on the next recycle
+		trim_locked(_max_idle_bytes / 2);
+	}
+
+	_mutex->unlock();
+}
+
+void VoxelMemoryPool::set_max_idle_bytes(uint64_t max_idle_bytes) {
+	MutexLock lock(_mutex);
+	_max_idle_bytes = max_idle_bytes;
+	if (_idle_bytes > _max_idle_bytes) {
+		trim_locked(_max_idle_bytes);
+	}
+}
+
+uint64_t VoxelMemoryPool::get_max_idle_bytes() const {
+	MutexLock lock(_mutex);
+	return _max_idle_bytes;
+}
+
+void VoxelMemoryPool::trim(uint64_t max_idle_bytes) {
+	MutexLock lock(_mutex);
+	trim_locked(max_idle_bytes);
+}
+
+// Locks shared pools, and tells if another thread was holding the lock
+bool VoxelMemoryPool::lock_shared() {
+	if (_mutex->try_lock() == OK) {
+		return false;
+	}
+	_mutex->lock();
+	++_contentions;
+	return true;
+}
+
+void VoxelMemoryPool::trim_locked(uint64_t max_idle_bytes) {
+	const uint32_t *key = NULL;
+	while (_idle_bytes > max_idle_bytes && (key = _pools.next(key))) {
+		Pool *pool = _pools.get(*key);
+		while (_idle_bytes > max_idle_bytes && pool->blocks.size() > 0) {
+			memfree(pool->blocks.back());
+			pool->blocks.pop_back();
+			--pool->total_blocks;
+			_idle_bytes -= pool->block_size;
+			_trimmed_bytes += pool->block_size;
+		}
+	}
+}
+
+void VoxelMemoryPool::attach_thread_cache(ThreadCache &cache) {
+	CRASH_COND(cache.owner != nullptr);
+	cache.owner = this;
+	_thread_caches.push_back(&cache);
+}
+
+void VoxelMemoryPool::flush_thread_cache(ThreadCache &cache) {
+	MutexLock lock(_mutex);
+	for (unsigned int i = 0; i < THREAD_CACHE_POOLS; ++i) {
+		ThreadCache::Entry &entry = cache.entries[i];
+		if (entry.pool != nullptr) {
+			entry.give_back(entry.count, _idle_bytes);
+			entry.pool = nullptr;
+		}
+	}
+	for (size_t i = 0; i < _thread_caches.size(); ++i) {
+		if (_thread_caches[i] == &cache) {
+			_thread_caches[i] = _thread_caches.back();
+			_thread_caches.pop_back();
+			break;
+		}
+	}
+	cache.owner = nullptr;
 }
 
 void VoxelMemoryPool::clear() {
+	// Threads are expected to be done with the pool at this point.
+	// Their caches get emptied and detached, in case they are still alive.
+	while (!_thread_caches.empty()) {
+		flush_thread_cache(*_thread_caches.back());
+	}
+
 	MutexLock lock(_mutex);
 	const uint32_t *key = NULL;
 	while ((key = _pools.next(key))) {
@@ -69,8 +274,68 @@ void VoxelMemoryPool::clear() {
 			CRASH_COND(ptr == nullptr);
 			memfree(ptr);
 		}
+		memdelete(pool);
 	}
 	_pools.clear();
+	_idle_bytes = 0;
+}
+
+VoxelMemoryPool::Stats VoxelMemoryPool::get_stats() {
+	MutexLock lock(_mutex);
+
+	const uint64_t now = OS::get_singleton()->get_ticks_usec();
+	const float elapsed_seconds = _last_stats_time_usec == 0 ? 0.f : (now - _last_stats_time_usec) / 1000000.f;
+	_last_stats_time_usec = now;
+
+	Stats stats;
+	stats.idle_bytes = _idle_bytes;
+	stats.trimmed_bytes = _trimmed_bytes;
+	stats.contentions = _contentions;
+
+	const uint32_t *key = NULL;
+	while ((key = _pools.next(key))) {
+		Pool *pool = _pools.get(*key);
+		PoolStats ps;
+		ps.block_size = pool->block_size;
+		ps.allocations = pool->allocations;
+		if (elapsed_seconds > 0.f) {
+			ps.allocations_per_second = (ps.allocations - pool->allocations_at_last_stats) / elapsed_seconds;
+		}
+		pool->allocations_at_last_stats = ps.allocations;
+		ps.used_blocks = pool->used_blocks;
+		ps.idle_blocks = pool->blocks.size();
+		ps.total_blocks = pool->total_blocks;
+		ps.contentions = pool->contentions;
+		stats.held_bytes += (uint64_t)pool->total_blocks * pool->block_size;
+		stats.pools.push_back(ps);
+	}
+
+	return stats;
+}
+
+Dictionary VoxelMemoryPool::to_dictionary(const Stats &stats) {
+	Dictionary d;
+	d["held_bytes"] = stats.held_bytes;
+	d["idle_bytes"] = stats.idle_bytes;
+	d["trimmed_bytes"] = stats.trimmed_bytes;
+	d["contentions"] = stats.contentions;
+	Array pools;
+	pools.resize(stats.pools.size());
+	for (size_t i = 0; i < stats.pools.size(); ++i) {
+		const PoolStats &ps = stats.pools[i];
+		Dictionary pd;
+		pd["block_size"] = ps.block_size;
+		pd["allocations"] = ps.allocations;
+		pd["allocations_per_second"] = ps.allocations_per_second;
+		pd["used_blocks"] = ps.used_blocks;
+		pd["idle_blocks"] = ps.idle_blocks;
+		pd["total_blocks"] = ps.total_blocks;
+		pd["held_bytes"] = (uint64_t)ps.total_blocks * ps.block_size;
+		pd["contentions"] = ps.contentions;
+		pools[i] = pd;
+	}
+	d["pools"] = pools;
+	return d;
 }
 
 void VoxelMemoryPool::debug_print() {
@@ -80,14 +345,21 @@ void VoxelMemoryPool::debug_print() {
 	int i = 0;
 	while ((key = _pools.next(key))) {
 		Pool *pool = _pools.get(*key);
-		print_line(String("Pool {0} for size {1}: {2} blocks").format(varray(i, *key, pool->blocks.size())));
+		print_line(String("Pool {0} for size {1}: {2} idle blocks, {3} total, {4} contentions")
+						   .format(varray(i, *key, (int)pool->blocks.size(), pool->total_blocks, pool->contentions)));
 		++i;
 	}
+	print_line(String("Trimmed {0} bytes, {1} contentions").format(varray(_trimmed_bytes, _contentions)));
 }
 
 unsigned int VoxelMemoryPool::debug_get_used_blocks() const {
 	MutexLock lock(_mutex);
-	return _used_blocks;
+	unsigned int used_blocks = 0;
+	const uint32_t *key = NULL;
+	while ((key = _pools.next(key))) {
+		used_blocks += _pools.get(*key)->used_blocks;
+	}
+	return used_blocks;
 }
 
 VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
@@ -96,6 +368,7 @@ VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
 	if (ppool == nullptr) {
 		pool = memnew(Pool);
 		CRASH_COND(pool == nullptr);
+		pool->block_size = size;
 		_pools.set(size, pool);
 	} else {
 		pool = *ppool;
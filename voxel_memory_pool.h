@@ -1,6 +1,7 @@
 #ifndef VOXEL_MEMORY_POOL_H
 #define VOXEL_MEMORY_POOL_H
 
+#include "core/dictionary.h"
 #include "core/hash_map.h"
 #include "core/os/mutex.h"
 
@@ -8,13 +9,52 @@
 
 // Pool based on a scenario where allocated blocks are often the same size.
 // A pool of blocks is assigned for each size.
+// Each thread also keeps a few blocks of the sizes it recently used, so most allocations and recycles
+// don't need to lock the shared pools. When shared pools hold more idle memory than a threshold,
+// they get trimmed, so memory is given back after a burst of allocations (like when the viewer teleports).
 class VoxelMemoryPool {
 private:
 	struct Pool {
 		std::vector<uint8_t *> blocks;
+		uint32_t block_size = 0;
+		// Blocks allocated from the system and not freed yet, wherever they are
+		uint32_t total_blocks = 0;
+		uint32_t contentions = 0;
+		// Updated atomically, because threads can take blocks from their cache
+		volatile uint32_t used_blocks = 0;
+		volatile uint64_t allocations = 0;
+		// To measure allocations per second
+		uint64_t allocations_at_last_stats = 0;
 	};
 
+	struct ThreadCache;
+
 public:
+	// Blocks of each size each thread can keep for itself
+	static const unsigned int THREAD_CACHE_BLOCKS = 16;
+	// How many different sizes each thread can keep blocks of
+	static const unsigned int THREAD_CACHE_POOLS = 4;
+	static const uint64_t DEFAULT_MAX_IDLE_BYTES = 128 * 1024 * 1024;
+
+	struct PoolStats {
+		uint32_t block_size = 0;
+		uint64_t allocations = 0;
+		float allocations_per_second = 0.f;
+		uint32_t used_blocks = 0;
+		// Blocks in the shared pool. Blocks in caches of threads are the remainder.
+		uint32_t idle_blocks = 0;
+		uint32_t total_blocks = 0;
+		uint32_t contentions = 0;
+	};
+
+	struct Stats {
+		std::vector<PoolStats> pools;
+		uint64_t held_bytes = 0;
+		uint64_t idle_bytes = 0;
+		uint64_t trimmed_bytes = 0;
+		uint32_t contentions = 0;
+	};
+
 	static void create_singleton();
 	static void destroy_singleton();
 	static VoxelMemoryPool *get_singleton();
@@ -25,15 +65,36 @@ public:
 	uint8_t *allocate(uint32_t size);
 	void recycle(uint8_t *block, uint32_t size);
 
+	// Shared pools are trimmed down to half of this amount when idle memory goes above it.
+	void set_max_idle_bytes(uint64_t max_idle_bytes);
+	uint64_t get_max_idle_bytes() const;
+	// Frees idle blocks of shared pools until they hold at most the given amount
+	void trim(uint64_t max_idle_bytes = 0);
+
+	// Allocation rates are measured since the last call
+	Stats get_stats();
+	static Dictionary to_dictionary(const Stats &stats);
+
 	void debug_print();
 	unsigned int debug_get_used_blocks() const;
 
 private:
 	Pool *get_or_create_pool(uint32_t size);
+	bool lock_shared();
+	void trim_locked(uint64_t max_idle_bytes);
+	void attach_thread_cache(ThreadCache &cache);
+	void flush_thread_cache(ThreadCache &cache);
 	void clear();
 
+	static ThreadCache &get_thread_cache();
+
 	HashMap<uint32_t, Pool *> _pools;
-	unsigned int _used_blocks = 0;
+	std::vector<ThreadCache *> _thread_caches;
+	uint64_t _idle_bytes = 0;
+	uint64_t _max_idle_bytes = DEFAULT_MAX_IDLE_BYTES;
+	uint64_t _trimmed_bytes = 0;
+	uint32_t _contentions = 0;
+	uint64_t _last_stats_time_usec = 0;
 	Mutex *_mutex = nullptr;
 };
 